@@ -261,12 +261,17 @@ static void basic_help()
 
 static void usage()
 {
-    fprintf( stderr, "Usage: dfu-programmer target[:usb-bus,usb-addr] command [options] "
-                     "[global-options] [file|data]\n\n" );
+    fprintf( stderr, "Usage: dfu-programmer target[:usb-bus,usb-addr[:usb-bus,usb-addr...]] "
+                     "command [options] [global-options] [file|data]\n\n" );
+
+    fprintf( stderr, "       dfu-programmer --daemon socket-path [--debug level]\n\n" );
 
     fprintf( stderr, "global-options:\n"
                      "        --quiet\n"
                      "        --debug level    (level is an integer specifying level of detail)\n"
+                     "        --all            (use every connected device matching the target)\n"
+                     "        --wait[=seconds] (wait for the device to be connected first)\n"
+                     "        --port path      (use the device on the USB port path, e.g. 1-2.3)\n"
                      "        Global options can be used with any command and must come\n"
                      "        after the command and before any file or data value\n\n" );
     fprintf( stderr, "commands:\n" );
@@ -312,6 +317,45 @@ static int32_t assign_option( int32_t *arg,
     return -1;
 }
 
+/*
+ *  Used to parse a port path of the form bus-port[.port...], as sysfs
+ *  names devices; e.g. 1-2.3 is port 3 of the hub on port 2 of bus 1.
+ *
+ *  returns 0 on success, -1 if the path is malformed
+ */
+static int32_t assign_port( dfu_port_t *port, const char *path )
+{
+    unsigned int bus, number;
+    int consumed;
+
+    port->depth = 0;
+
+    if( 2 != sscanf(path, "%u-%u%n", &bus, &number, &consumed) ) {
+        return -1;
+    }
+    if( (0 == bus) || (255 < bus) ) {
+        return -1;
+    }
+    port->bus_number = bus;
+
+    for( ;; ) {
+        if( (0 == number) || (255 < number) || (DFU_PORT_MAX_DEPTH == port->depth) ) {
+            port->depth = 0;
+            return -1;
+        }
+        port->numbers[port->depth++] = number;
+
+        path += consumed;
+        if( '\0' == *path ) {
+            return 0;
+        }
+        if( 1 != sscanf(path, ".%u%n", &number, &consumed) ) {
+            port->depth = 0;
+            return -1;
+        }
+    }
+}
+
 static int32_t assign_target( struct programmer_arguments *args,
                               char *value,
                               struct target_mapping_structure *map )
@@ -326,21 +370,35 @@ static int32_t assign_target( struct programmer_arguments *args,
             args->vendor_id = map->vendor_id;
             args->bus_id = 0;
             args->device_address = 0;
+            args->location_count = 0;
             if (value[name_len] == ':') {
               /* The target name includes USB bus and address info.
                * This is used to differentiate between multiple dfu
                * devices with the same vendor/chip ID numbers. By
                * specifying the bus and address, mltiple units can
-               * be programmed at one time.
+               * be programmed at one time. Several bus,address pairs
+               * may be given, separated by ':', to program a list of
+               * units from a single process.
                */
-              int bus = 0;
-              int address = 0;
-              if( 2 != sscanf(&value[name_len+1], "%i,%i", &bus, &address) )
-                return -1;
-              if (bus <= 0) return -1;
-              if (address <= 0) return -1;
-              args->bus_id = bus;
-              args->device_address = address;
+              char *location = &value[name_len];
+              while( ':' == *location ) {
+                int bus = 0;
+                int address = 0;
+                int consumed = 0;
+                if( DEVICE_LOCATION_MAX_COUNT == args->location_count )
+                  return -1;
+                if( 2 != sscanf(&location[1], "%i,%i%n", &bus, &address, &consumed) )
+                  return -1;
+                if (bus <= 0) return -1;
+                if (address <= 0) return -1;
+                args->locations[args->location_count].bus_number = bus;
+                args->locations[args->location_count].device_address = address;
+                args->location_count++;
+                location += 1 + consumed;
+              }
+              if ('\0' != *location) return -1;
+              args->bus_id = args->locations[0].bus_number;
+              args->device_address = args->locations[0].device_address;
             }
             args->device_type = map->device_type;
             args->eeprom_memory_size = map->eeprom_memory_size;
@@ -413,6 +471,55 @@ static int32_t assign_global_options( struct programmer_arguments *args,
         }
     }
 
+    /* Find '--all' if it is here */
+    for( i = 0; i < argc; i++ ) {
+        if( 0 == strcmp("--all", argv[i]) ) {
+            *argv[i] = '\0';
+            args->all_devices = true;
+            break;
+        }
+    }
+
+    /* Find '--wait[=seconds]' if it is here */
+    for( i = 0; i < argc; i++ ) {
+        if( 0 == strncmp("--wait", argv[i], 6) ) {
+            if( 0 == strncmp("--wait=", argv[i], 7) ) {
+                if( 1 != sscanf(argv[i], "--wait=%u", &args->wait_timeout) )
+                    return -2;
+                /* It is passed on in ms as an int32_t. */
+                if( (INT32_MAX / 1000) < args->wait_timeout )
+                    return -2;
+            } else if( '\0' != argv[i][6] ) {
+                continue;
+            }
+            *argv[i] = '\0';
+            args->wait = true;
+            break;
+        }
+    }
+
+    /* Find '--port' if it is here */
+    for( i = 0; i < argc; i++ ) {
+        if( 0 == strncmp("--port", argv[i], 6) ) {
+            if( 0 == strncmp("--port=", argv[i], 7) ) {
+                if( 0 != assign_port(&args->port, &argv[i][7]) )
+                    return -2;
+            } else if( '\0' == argv[i][6] ) {
+                if( (i+1) >= argc )
+                    return -3;
+
+                if( 0 != assign_port(&args->port, argv[i+1]) )
+                    return -4;
+
+                *argv[i+1] = '\0';
+            } else {
+                continue;
+            }
+            *argv[i] = '\0';
+            break;
+        }
+    }
+
     /* Find '--suppress-bootloader-mem' if it is here */
     for( i = 0; i < argc; i++ ) {
         if( 0 == strcmp("--suppress-bootloader-mem", argv[i]) ) {
@@ -767,8 +874,13 @@ int32_t parse_arguments( struct programmer_arguments *args,
     /* initialize the argument block to empty, known values */
     args->target  = tar_none;
     args->command = com_none;
+    args->daemon_socket = NULL;
     args->quiet   = 0;
     args->suppressbootloader = 0;
+    args->all_devices = false;
+    args->wait = false;
+    args->wait_timeout = 0;
+    args->port.depth = 0;
 
     /* Special case - check for the help commands which do not require a device type */
     if( argc == 2 ) {
@@ -786,6 +898,22 @@ int32_t parse_arguments( struct programmer_arguments *args,
         }
     }
 
+    /* Special case - the daemon takes its jobs from a socket.  Its debug
+     * level is set here, since it is shared by every job. */
+    if( (argc >= 3) && (0 == strcasecmp(argv[1], "--daemon")) ) {
+        if(    ((argc == 4) && (1 == sscanf(argv[3], "--debug=%i", &debug)))
+            || ((argc == 5) && (0 == strcmp(argv[3], "--debug"))
+                            && (1 == sscanf(argv[4], "%i", &debug)))
+            || (argc == 3) )
+        {
+            args->command = com_daemon;
+            args->daemon_socket = argv[2];
+            return 0;
+        }
+        usage();
+        return -1;
+    }
+
     /* Make sure there are the minimum arguments */
     if( argc < 3 ) {
         basic_help();
@@ -837,6 +965,29 @@ int32_t parse_arguments( struct programmer_arguments *args,
         args->com_flash_data.file[0] = args->com_flash_data.original_first_char;
     }
 
+    /* Commands which write their results to stdout only make sense for
+     * a single device. */
+    if( (true == args->all_devices) || (1 < args->location_count) ) {
+        switch( args->command ) {
+            case com_get:
+            case com_getfuse:
+            case com_dump:
+            case com_edump:
+            case com_udump:
+                fprintf( stderr, "This command can only be used with a single device.\n" );
+                status = -9;
+                goto done;
+            default:
+                break;
+        }
+
+        if( 0 != args->port.depth ) {
+            fprintf( stderr, "--port selects a single device.\n" );
+            status = -9;
+            goto done;
+        }
+    }
+
 done:
     if( 1 < debug ) {
         print_args( args );
@@ -26,6 +26,7 @@
 #include "atmel.h"
 
 #define DEVICE_TYPE_STRING_MAX_LENGTH   6
+#define DEVICE_LOCATION_MAX_COUNT       32
 /*
  *  atmel_programmer target command
  *
@@ -118,7 +119,7 @@ enum targets_enum { tar_at89c51snd1c,
 enum commands_enum { com_none, com_erase, com_flash, com_user, com_eflash,
                      com_configure, com_get, com_getfuse, com_dump, com_edump,
                      com_udump, com_setfuse, com_setsecure,
-                     com_start_app, com_version, com_reset };
+                     com_start_app, com_version, com_reset, com_daemon };
 
 enum configure_enum { conf_BSB = ATMEL_SET_CONFIG_BSB,
                       conf_SBV = ATMEL_SET_CONFIG_SBV,
@@ -145,6 +146,13 @@ struct programmer_arguments {
     uint16_t chip_id;
     uint16_t bus_id;            /* if non-zero, use bus_id and device_address */
     uint16_t device_address;        /* to identify the specific target device. */
+    dfu_bool all_devices;       /* if true, program every matching device */
+    dfu_bool wait;              /* if true, wait for the device to appear */
+    uint32_t wait_timeout;      /* seconds to wait for it, 0 for forever */
+    dfu_port_t port;            /* if port.depth is non-zero, the port */
+                                /* the target device is attached to. */
+    size_t location_count;      /* the number of bus/address pairs given */
+    dfu_location_t locations[DEVICE_LOCATION_MAX_COUNT];
     atmel_device_class_t device_type;
     char device_type_string[DEVICE_TYPE_STRING_MAX_LENGTH];
     uint32_t memory_address_top;        /* the maximum memory address */
@@ -162,6 +170,7 @@ struct programmer_arguments {
 
     /* command-specific state */
     enum commands_enum command;
+    char *daemon_socket;        /* the socket to listen on for com_daemon */
     char quiet;
     char suppressbootloader;
 
@@ -22,6 +22,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "dfu-bool.h"
 #include "config.h"
@@ -37,10 +38,10 @@
                                COMMAND_DEBUG_THRESHOLD, __VA_ARGS__ )
 
 
-static int security_bit_state;
-
-static void security_check( dfu_device_t *device )
+static int32_t security_check( dfu_device_t *device )
 {
+    int32_t security_bit_state;
+
     if( ADC_AVR32 == device->type ) {
         // Get security bit state for AVR32.
         security_bit_state = atmel_getsecure( device );
@@ -49,9 +50,11 @@ static void security_check( dfu_device_t *device )
         // Security bit not present or not testable.
         security_bit_state = ATMEL_SECURE_OFF;
     }
+
+    return security_bit_state;
 }
 
-static void security_message()
+static void security_message( const int32_t security_bit_state )
 {
     if( security_bit_state > ATMEL_SECURE_OFF ) {
         fprintf( stderr, "The security bit %s set.\n"
@@ -120,23 +123,84 @@ static int32_t serialize_memory_image(int16_t *hex_data,
     return 0;
 }
 
+/*
+ *  Used to read the memory image for one of the flash commands and get it
+ *  ready to be written.  The image only depends on the arguments, so it
+ *  can be shared by every device being programmed.
+ *
+ *  args       - the parsed command line
+ *  size[out]  - the number of entries in the returned image
+ *  usage[out] - the number of bytes of the image which are used
+ *
+ *  returns the memory image, or NULL on an error
+ */
+static int16_t *load_memory_image( struct programmer_arguments *args,
+                                   size_t *size, int32_t *usage )
+{
+    int16_t *hex_data = NULL;
+    uint32_t i;
+
+    switch( args->command ) {
+        case com_eflash:
+            if( 0 == args->eeprom_memory_size ) {
+                fprintf( stderr, "This device has no eeprom.\n" );
+                return NULL;
+            }
+            *size = args->eeprom_memory_size;
+            break;
+        case com_user:
+            *size = args->flash_page_size;
+            break;
+        default:
+            *size = args->memory_address_top + 1;
+            break;
+    }
+
+    hex_data = intel_hex_to_buffer( args->com_flash_data.file, *size, usage );
+    if( NULL == hex_data ) {
+        DEBUG( "Something went wrong with creating the memory image.\n" );
+        fprintf( stderr,
+                 "Something went wrong with creating the memory image.\n" );
+        return NULL;
+    }
+
+    if (0 != serialize_memory_image(hex_data,args))
+      goto error;
+
+    if( com_flash == args->command ) {
+        for( i = args->bootloader_bottom; i <= args->bootloader_top; i++) {
+            if( -1 != hex_data[i] ) {
+                if( true == args->suppressbootloader ) {
+                    //If we're ignoring the bootloader, don't write to it
+                    hex_data[i] = -1;
+                } else {
+                    fprintf( stderr, "Bootloader and code overlap.\n" );
+                    fprintf( stderr, "Use --suppress-bootloader-mem to ignore\n" );
+                    goto error;
+                }
+            }
+        }
+    }
+
+    return hex_data;
+
+error:
+    free( hex_data );
+    return NULL;
+}
+
 static int32_t execute_flash_eeprom( dfu_device_t *device,
-                                     struct programmer_arguments *args )
+                                     struct programmer_arguments *args,
+                                     int16_t *hex_data,
+                                     const int32_t usage )
 {
     int32_t result;
     int32_t i;
     int32_t retval;
-    int32_t usage;
     uint8_t *buffer = NULL;
-    int16_t *hex_data = NULL;
 
     retval = -1;
 
-    if( 0 == args->eeprom_memory_size ) {
-        fprintf( stderr, "This device has no eeprom.\n" );
-        return -1;
-    }
-
     buffer = (uint8_t *) malloc( args->eeprom_memory_size );
     if( NULL == buffer ) {
         fprintf( stderr, "Request for %lu bytes of memory failed.\n",
@@ -145,18 +209,6 @@ static int32_t execute_flash_eeprom( dfu_device_t *device,
     }
     memset( buffer, 0, args->eeprom_memory_size );
 
-    hex_data = intel_hex_to_buffer( args->com_flash_data.file,
-                                    args->eeprom_memory_size, &usage );
-    if( NULL == hex_data ) {
-        DEBUG( "Something went wrong with creating the memory image.\n" );
-        fprintf( stderr,
-                 "Something went wrong with creating the memory image.\n" );
-        goto error;
-    }
-
-    if (0 != serialize_memory_image(hex_data,args))
-      goto error;
-
     result = atmel_flash( device, hex_data, 0, args->eeprom_memory_size,
                           args->eeprom_page_size, true );
 
@@ -206,23 +258,18 @@ error:
         buffer = NULL;
     }
 
-    if( NULL != hex_data ) {
-        free( hex_data );
-        hex_data = NULL;
-    }
-
     return retval;
 }
 
 static int32_t execute_flash_user_page( dfu_device_t *device,
-                                        struct programmer_arguments *args )
+                                        struct programmer_arguments *args,
+                                        int16_t *hex_data,
+                                        const int32_t usage )
 {
     int32_t result;
     int32_t i;
     int32_t retval;
-    int32_t usage;
     uint8_t *buffer = NULL;
-    int16_t *hex_data = NULL;
 
     retval = -1;
 
@@ -234,18 +281,6 @@ static int32_t execute_flash_user_page( dfu_device_t *device,
     }
     memset( buffer, 0, args->flash_page_size );
 
-    hex_data = intel_hex_to_buffer( args->com_flash_data.file,
-                                    args->flash_page_size, &usage );
-    if( NULL == hex_data ) {
-        DEBUG( "Something went wrong with creating the memory image.\n" );
-        fprintf( stderr,
-                 "Something went wrong with creating the memory image.\n" );
-        goto error;
-    }
-
-    if (0 != serialize_memory_image(hex_data,args))
-      goto error;
-
     result = atmel_user( device, hex_data, args->flash_page_size );
 
     if( result < 0 ) {
@@ -294,19 +329,14 @@ error:
         buffer = NULL;
     }
 
-    if( NULL != hex_data ) {
-        free( hex_data );
-        hex_data = NULL;
-    }
-
     return retval;
 }
 
 static int32_t execute_flash_normal( dfu_device_t *device,
-                                     struct programmer_arguments *args )
+                                     struct programmer_arguments *args,
+                                     int16_t *hex_data,
+                                     const int32_t usage )
 {
-    int16_t *hex_data = NULL;
-    int32_t  usage = 0;
     int32_t  retval = -1;
     int32_t  result = 0;
     uint8_t *buffer = NULL;
@@ -331,31 +361,6 @@ static int32_t execute_flash_normal( dfu_device_t *device,
 
     memset( buffer, 0, memory_size );
 
-    hex_data = intel_hex_to_buffer( args->com_flash_data.file,
-                                    args->memory_address_top + 1, &usage );
-    if( NULL == hex_data ) {
-        DEBUG( "Something went wrong with creating the memory image.\n" );
-        fprintf( stderr,
-                 "Something went wrong with creating the memory image.\n" );
-        goto error;
-    }
-
-    if (0 != serialize_memory_image(hex_data,args))
-      goto error;
-
-    for( i = args->bootloader_bottom; i <= args->bootloader_top; i++) {
-        if( -1 != hex_data[i] ) {
-            if( true == args->suppressbootloader ) {
-                //If we're ignoring the bootloader, don't write to it
-                hex_data[i] = -1;
-            } else {
-                fprintf( stderr, "Bootloader and code overlap.\n" );
-                fprintf( stderr, "Use --suppress-bootloader-mem to ignore\n" );
-                goto error;
-            }
-        }
-    }
-
     DEBUG( "write %d/%d bytes\n", usage, memory_size );
 
     result = atmel_flash( device, hex_data, args->flash_address_bottom,
@@ -409,14 +414,7 @@ error:
         buffer = NULL;
     }
 
-    if( NULL != hex_data ) {
-        free( hex_data );
-        hex_data = NULL;
-    }
-
     return retval;
-
-    return 0;
 }
 
 static int32_t execute_getfuse( dfu_device_t *device,
@@ -426,9 +424,10 @@ static int32_t execute_getfuse( dfu_device_t *device,
     char *message = NULL;
     int32_t value = 0;
     int32_t status;
+    int32_t security_bit_state;
 
     /* Check AVR32 security bit in order to provide a better error message. */
-    security_check( device );
+    security_bit_state = security_check( device );
 
     status = atmel_read_fuses( device, &info );
 
@@ -437,7 +436,7 @@ static int32_t execute_getfuse( dfu_device_t *device,
                args->device_type_string );
         fprintf( stderr, "Error reading %s config information.\n",
                          args->device_type_string );
-        security_message();
+        security_message( security_bit_state );
         return status;
     }
 
@@ -494,9 +493,10 @@ static int32_t execute_get( dfu_device_t *device,
     int16_t value = 0;
     int32_t status;
     int32_t controller_error = 0;
+    int32_t security_bit_state;
 
     /* Check AVR32 security bit in order to provide a better error message. */
-    security_check( device );
+    security_bit_state = security_check( device );
 
     status = atmel_read_config( device, &info );
 
@@ -505,7 +505,7 @@ static int32_t execute_get( dfu_device_t *device,
                args->device_type_string );
         fprintf( stderr, "Error reading %s config information.\n",
                          args->device_type_string );
-        security_message();
+        security_message( security_bit_state );
         return status;
     }
 
@@ -601,6 +601,7 @@ static int32_t execute_dump_normal( dfu_device_t *device,
     uint8_t *buffer = NULL;
     size_t memory_size;
     size_t adjusted_flash_top_address;
+    int32_t security_bit_state;
 
     /* Why +1? Because the flash_address_top location is inclusive, as
      * apposed to most times when sizes are specified by length, etc.
@@ -616,7 +617,7 @@ static int32_t execute_dump_normal( dfu_device_t *device,
     }
 
     /* Check AVR32 security bit in order to provide a better error message. */
-    security_check( device );
+    security_bit_state = security_check( device );
 
     DEBUG( "dump %d bytes\n", memory_size );
 
@@ -626,7 +627,7 @@ static int32_t execute_dump_normal( dfu_device_t *device,
     {
         fprintf( stderr, "Failed to read %lu bytes from device.\n",
                  (unsigned long) memory_size );
-        security_message();
+        security_message( security_bit_state );
         return -1;
     }
 
@@ -656,6 +657,7 @@ static int32_t execute_dump_eeprom( dfu_device_t *device,
     int32_t i = 0;
     uint8_t *buffer = NULL;
     size_t memory_size;
+    int32_t security_bit_state;
 
     if( 0 == args->eeprom_memory_size ) {
         fprintf( stderr, "This device has no eeprom.\n" );
@@ -672,7 +674,7 @@ static int32_t execute_dump_eeprom( dfu_device_t *device,
     }
 
     /* Check AVR32 security bit in order to provide a better error message. */
-    security_check( device );
+    security_bit_state = security_check( device );
 
     DEBUG( "dump %d bytes\n", memory_size );
 
@@ -682,7 +684,7 @@ static int32_t execute_dump_eeprom( dfu_device_t *device,
     {
         fprintf( stderr, "Failed to read %lu bytes from device.\n",
                  (unsigned long) memory_size );
-        security_message();
+        security_message( security_bit_state );
         return -1;
     }
 
@@ -707,6 +709,7 @@ static int32_t execute_dump_user_page( dfu_device_t *device,
     int32_t i = 0;
     uint8_t *buffer = NULL;
     size_t page_size = args->flash_page_size;
+    int32_t security_bit_state;
 
     buffer = (uint8_t *) malloc( page_size );
     if( NULL == buffer ) {
@@ -716,7 +719,7 @@ static int32_t execute_dump_user_page( dfu_device_t *device,
     }
 
     /* Check AVR32 security bit in order to provide a better error message. */
-    security_check( device );
+    security_bit_state = security_check( device );
 
     DEBUG( "dump %d bytes\n", page_size );
 
@@ -726,7 +729,7 @@ static int32_t execute_dump_user_page( dfu_device_t *device,
     {
         fprintf( stderr, "Failed to read %lu bytes from device.\n",
                  (unsigned long) page_size );
-        security_message();
+        security_message( security_bit_state );
         return -1;
     }
 
@@ -750,6 +753,7 @@ static int32_t execute_setfuse( dfu_device_t *device,
 {
     int32_t value = args->com_setfuse_data.value;
     int32_t name = args->com_setfuse_data.name;
+    int32_t security_bit_state;
 
     if( GRP_AVR & args->device_type ) {
         DEBUG( "target doesn't support fuse set operation.\n" );
@@ -758,13 +762,13 @@ static int32_t execute_setfuse( dfu_device_t *device,
     }
 
     /* Check AVR32 security bit in order to provide a better error message. */
-    security_check( device );
+    security_bit_state = security_check( device );
 
     if( 0 != atmel_set_fuse(device, name, value) )
     {
         DEBUG( "Fuse set failed.\n" );
         fprintf( stderr, "Fuse set failed.\n" );
-        security_message();
+        security_message( security_bit_state );
         return -1;
     }
 
@@ -799,19 +803,21 @@ static int32_t execute_configure( dfu_device_t *device,
     return 0;
 }
 
-int32_t execute_command( dfu_device_t *device,
-                         struct programmer_arguments *args )
+static int32_t dispatch_command( dfu_device_t *device,
+                                 struct programmer_arguments *args,
+                                 int16_t *hex_data,
+                                 const int32_t usage )
 {
     device->type = args->device_type;
     switch( args->command ) {
         case com_erase:
             return execute_erase( device, args );
         case com_flash:
-            return execute_flash_normal( device, args );
+            return execute_flash_normal( device, args, hex_data, usage );
         case com_eflash:
-            return execute_flash_eeprom( device, args );
+            return execute_flash_eeprom( device, args, hex_data, usage );
         case com_user:
-            return execute_flash_user_page( device, args );
+            return execute_flash_user_page( device, args, hex_data, usage );
         case com_reset:
             return atmel_reset( device );
         case com_start_app:
@@ -838,3 +844,183 @@ int32_t execute_command( dfu_device_t *device,
 
     return -1;
 }
+
+static dfu_bool needs_memory_image( struct programmer_arguments *args )
+{
+    return (com_flash == args->command) || (com_eflash == args->command)
+           || (com_user == args->command);
+}
+
+int32_t execute_command( dfu_device_t *device,
+                         struct programmer_arguments *args )
+{
+    int16_t *hex_data = NULL;
+    int32_t usage = 0;
+    size_t size;
+    int32_t result;
+
+    if( true == needs_memory_image(args) ) {
+        hex_data = load_memory_image( args, &size, &usage );
+        if( NULL == hex_data ) {
+            return -1;
+        }
+    }
+
+    result = dispatch_command( device, args, hex_data, usage );
+
+    if( NULL != hex_data ) {
+        free( hex_data );
+    }
+
+    return result;
+}
+
+int32_t read_memory_image( struct programmer_arguments *args,
+                           memory_image_t *image )
+{
+    image->hex_data = NULL;
+    image->size = 0;
+    image->usage = 0;
+
+    if( false == needs_memory_image(args) ) {
+        return 0;
+    }
+
+    image->hex_data = load_memory_image( args, &image->size, &image->usage );
+    if( NULL == image->hex_data ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int32_t execute_command_image( dfu_device_t *device,
+                               struct programmer_arguments *args,
+                               const memory_image_t *image )
+{
+    int16_t *hex_data = image->hex_data;
+    int32_t result;
+
+    /* The 8051 flash path fills in unused bytes of partially used pages,
+     * so it must not be given a shared image. */
+    if( (NULL != hex_data) && (ADC_8051 == args->device_type) ) {
+        hex_data = (int16_t *) malloc( image->size * sizeof(int16_t) );
+        if( NULL == hex_data ) {
+            fprintf( stderr, "Request for %lu bytes of memory failed.\n",
+                     (unsigned long) (image->size * sizeof(int16_t)) );
+            return -1;
+        }
+        memcpy( hex_data, image->hex_data, image->size * sizeof(int16_t) );
+    }
+
+    result = dispatch_command( device, args, hex_data, image->usage );
+
+    if( hex_data != image->hex_data ) {
+        free( hex_data );
+    }
+
+    return result;
+}
+
+struct command_worker {
+    pthread_t thread;
+    dfu_device_t *device;
+    struct programmer_arguments *args;
+    int16_t *hex_data;
+    int32_t usage;
+    int32_t result;
+};
+
+static void *command_worker_run( void *data )
+{
+    struct command_worker *worker = (struct command_worker *) data;
+
+    worker->result = dispatch_command( worker->device, worker->args,
+                                       worker->hex_data, worker->usage );
+
+    return NULL;
+}
+
+int32_t execute_command_all( dfu_device_t *devices,
+                             const size_t count,
+                             struct programmer_arguments *args,
+                             int32_t *results )
+{
+    struct programmer_arguments worker_args;
+    struct command_worker *workers = NULL;
+    int16_t *hex_data = NULL;
+    int32_t usage = 0;
+    size_t size = 0;
+    size_t i;
+    int32_t failed = 0;
+
+    /* Per-device progress messages would interleave, so the workers run
+     * quietly and the caller reports a summary instead. */
+    worker_args = *args;
+    worker_args.quiet = 1;
+
+    workers = (struct command_worker *) calloc( count, sizeof(struct command_worker) );
+    if( NULL == workers ) {
+        fprintf( stderr, "Request for %lu workers failed.\n",
+                 (unsigned long) count );
+        return -1;
+    }
+
+    if( true == needs_memory_image(args) ) {
+        hex_data = load_memory_image( args, &size, &usage );
+        if( NULL == hex_data ) {
+            free( workers );
+            return -1;
+        }
+    }
+
+    for( i = 0; i < count; i++ ) {
+        workers[i].device = &devices[i];
+        workers[i].args = &worker_args;
+        workers[i].hex_data = hex_data;
+        workers[i].usage = usage;
+        workers[i].result = -1;
+
+        /* The 8051 flash path fills in unused bytes of partially used pages,
+         * so those devices each need a private copy of the image. */
+        if( (NULL != hex_data) && (ADC_8051 == args->device_type) ) {
+            workers[i].hex_data = (int16_t *) malloc( size * sizeof(int16_t) );
+            if( NULL == workers[i].hex_data ) {
+                fprintf( stderr, "Request for %lu bytes of memory failed.\n",
+                         (unsigned long) (size * sizeof(int16_t)) );
+                workers[i].device = NULL;
+                continue;
+            }
+            memcpy( workers[i].hex_data, hex_data, size * sizeof(int16_t) );
+        }
+
+        if( 0 != pthread_create(&workers[i].thread, NULL,
+                                command_worker_run, &workers[i]) )
+        {
+            DEBUG( "Failed to start a worker for USB:%d,%d\n",
+                   devices[i].bus_number, devices[i].device_address );
+            workers[i].device = NULL;
+        }
+    }
+
+    for( i = 0; i < count; i++ ) {
+        if( NULL != workers[i].device ) {
+            pthread_join( workers[i].thread, NULL );
+        }
+        if( hex_data != workers[i].hex_data ) {
+            free( workers[i].hex_data );
+        }
+
+        results[i] = workers[i].result;
+        if( 0 != results[i] ) {
+            failed++;
+        }
+    }
+
+    if( NULL != hex_data ) {
+        free( hex_data );
+    }
+    free( workers );
+
+    return failed;
+}
@@ -22,9 +22,57 @@
 #define __COMMANDS_H__
 
 #include <stdint.h>
+#include <stddef.h>
 #include "arguments.h"
 #include "dfu-device.h"
 
 int32_t execute_command( dfu_device_t *device,
                          struct programmer_arguments *args );
+
+/*
+ *  A memory image read for one of the flash commands.  The image only
+ *  depends on the arguments, so it may be kept and used for later commands.
+ */
+typedef struct {
+    int16_t *hex_data;  /* NULL if the command does not need an image */
+    size_t size;        /* the number of entries in hex_data */
+    int32_t usage;      /* the number of bytes of the image which are used */
+} memory_image_t;
+
+/*
+ *  Reads the memory image needed by the command, if there is one.
+ *
+ *  args       - the parsed command line
+ *  image[out] - the image, which the caller frees with free(hex_data)
+ *
+ *  returns 0 on success, < 0 on an error
+ */
+int32_t read_memory_image( struct programmer_arguments *args,
+                           memory_image_t *image );
+
+/*
+ *  Runs the command using a memory image from read_memory_image.  The image
+ *  is not modified, so one image may be used by several commands at once.
+ *
+ *  returns 0 on success, < 0 on an error
+ */
+int32_t execute_command_image( dfu_device_t *device,
+                               struct programmer_arguments *args,
+                               const memory_image_t *image );
+
+/*
+ *  Runs the command on every device at once, one worker thread per device.
+ *  Memory images are read only once and shared by all of the workers.
+ *
+ *  devices     - the claimed dfu devices
+ *  count       - the number of entries in devices
+ *  args        - the parsed command line
+ *  results[out] - the result of the command for each device
+ *
+ *  returns the number of devices the command failed on, or < 0 on an error
+ */
+int32_t execute_command_all( dfu_device_t *devices,
+                             const size_t count,
+                             struct programmer_arguments *args,
+                             int32_t *results );
 #endif
@@ -0,0 +1,972 @@
+/*
+ * dfu-programmer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef HAVE_LIBUSB_1_0
+#include <libusb.h>
+#else
+#include <usb.h>
+#endif
+
+#include "dfu-bool.h"
+#include "dfu-device.h"
+#include "dfu.h"
+#include "arguments.h"
+#include "commands.h"
+#include "daemon.h"
+#include "util.h"
+
+#define DAEMON_DEBUG_THRESHOLD 40
+
+#define DEBUG(...)  dfu_debug( __FILE__, __FUNCTION__, __LINE__, \
+                               DAEMON_DEBUG_THRESHOLD, __VA_ARGS__ )
+
+/* The longest job line accepted from a client. */
+#define DAEMON_MAX_LINE         4096
+
+/* The most words in a job line, including the target and command. */
+#define DAEMON_MAX_WORDS        32
+
+/* The number of memory images kept between jobs. */
+#define DAEMON_IMAGE_CACHE_SIZE 8
+
+struct daemon_client {
+    int fd;
+    pthread_mutex_t lock;       /* guards writes to fd and jobs */
+    pthread_cond_t idle;        /* signalled when jobs drops to 0 */
+    uint32_t jobs;              /* the number of jobs still running */
+};
+
+struct daemon_image {
+    char *file;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    time_t ctime;
+    off_t file_size;
+    enum commands_enum command;
+    uint32_t memory_address_top;
+    uint32_t bootloader_bottom;
+    uint32_t bootloader_top;
+    size_t flash_page_size;
+    size_t eeprom_memory_size;
+    char suppressbootloader;
+    memory_image_t image;
+    uint32_t users;             /* the number of jobs using the image */
+    uint32_t last_used;
+    dfu_bool cached;            /* false once dropped from the cache */
+};
+
+struct daemon_job {
+    struct daemon_client *client;
+    uint32_t id;
+    char *line;                 /* argv and args point into this */
+    char name[sizeof(PACKAGE)];
+    char command[16];
+    char *argv[DAEMON_MAX_WORDS + 1];
+    size_t argc;
+    struct programmer_arguments args;
+};
+
+static pthread_mutex_t daemon_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct daemon_image *image_cache[DAEMON_IMAGE_CACHE_SIZE];
+static uint32_t image_clock = 0;
+static uint32_t job_count = 0;
+
+/* Device selection is serialized so that two jobs never race for the
+ * same device, and because libusb-0.1 rescans the bus in place. */
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef HAVE_LIBUSB_1_0
+/* A device attached according to the hotplug watch.  The port holds the
+ * bus number as well as the port path. */
+struct daemon_present {
+    uint16_t vendor;
+    uint16_t product;
+    uint8_t address;
+    dfu_port_t port;
+};
+
+/* The devices attached, kept up to date by one hotplug callback for the
+ * life of the daemon, so that jobs can wait for their device, or find it
+ * missing, without scanning the bus. */
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watch_changed = PTHREAD_COND_INITIALIZER;
+static struct daemon_present *watch_devices = NULL;
+static size_t watch_count = 0;
+static size_t watch_size = 0;
+static dfu_bool watch_running = false;
+#endif
+
+static int64_t daemon_time_ms( void )
+{
+    struct timeval now;
+
+    gettimeofday( &now, NULL );
+
+    return ((int64_t) now.tv_sec) * 1000 + (now.tv_usec / 1000);
+}
+
+/*
+ *  Writes one line of JSON to the client.  Errors are ignored, since a
+ *  client which has gone away still lets its jobs run to completion.
+ */
+static void daemon_send( struct daemon_client *client, const char *format, ... )
+{
+    char buffer[512];
+    va_list va_arg;
+    size_t length, sent;
+    ssize_t rv;
+
+    va_start( va_arg, format );
+    vsnprintf( buffer, sizeof(buffer) - 1, format, va_arg );
+    va_end( va_arg );
+
+    length = strlen( buffer );
+    buffer[length++] = '\n';
+
+    pthread_mutex_lock( &client->lock );
+    for( sent = 0; sent < length; sent += rv ) {
+        rv = write( client->fd, &buffer[sent], length - sent );
+        if( rv <= 0 ) {
+            if( (rv < 0) && (EINTR == errno) ) {
+                rv = 0;
+                continue;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock( &client->lock );
+}
+
+static void daemon_image_free( struct daemon_image *entry )
+{
+    free( entry->image.hex_data );
+    free( entry->file );
+    free( entry );
+}
+
+/*
+ *  Used to check whether a cached image is still the one the job asks for.
+ *  A file replaced by a rename has a new inode, and one rewritten in place
+ *  has a later mtime and ctime, since files changed within the second
+ *  they were read in are never cached (see daemon_image_get).
+ *
+ *  returns true if the entry can be used for the job
+ */
+static dfu_bool daemon_image_match( const struct daemon_image *entry,
+                                    const struct programmer_arguments *args,
+                                    const struct stat *info )
+{
+    return    (0 == strcmp(entry->file, args->com_flash_data.file))
+           && (entry->dev == info->st_dev)
+           && (entry->ino == info->st_ino)
+           && (entry->mtime == info->st_mtime)
+           && (entry->ctime == info->st_ctime)
+           && (entry->file_size == info->st_size)
+           && (entry->command == args->command)
+           && (entry->memory_address_top == args->memory_address_top)
+           && (entry->bootloader_bottom == args->bootloader_bottom)
+           && (entry->bootloader_top == args->bootloader_top)
+           && (entry->flash_page_size == args->flash_page_size)
+           && (entry->eeprom_memory_size == args->eeprom_memory_size)
+           && (entry->suppressbootloader == args->suppressbootloader);
+}
+
+/*
+ *  Used to get the memory image for a job, from the cache if the file has
+ *  not changed since it was last read.  Images with serial data written
+ *  into them are never cached, and neither are files changed within the
+ *  current second, which could change again without a new timestamp.
+ *
+ *  cached[out] - true if the image came from the cache
+ *
+ *  returns the image, or NULL on an error
+ */
+static struct daemon_image *daemon_image_get( struct programmer_arguments *args,
+                                              dfu_bool *cached )
+{
+    struct daemon_image *entry = NULL;
+    struct stat info;
+    time_t now;
+    dfu_bool cacheable;
+    size_t i, slot;
+
+    *cached = false;
+
+    if( 0 != stat(args->com_flash_data.file, &info) ) {
+        fprintf( stderr, "Unable to open file '%s'.\n", args->com_flash_data.file );
+        return NULL;
+    }
+    now = time( NULL );
+    cacheable =    (NULL == args->com_flash_data.serial_data)
+                && (info.st_mtime < now) && (info.st_ctime < now);
+
+    pthread_mutex_lock( &daemon_lock );
+    for( i = 0; (true == cacheable) && (i < DAEMON_IMAGE_CACHE_SIZE); i++ ) {
+        if(    (NULL != image_cache[i])
+            && (true == daemon_image_match(image_cache[i], args, &info)) )
+        {
+            entry = image_cache[i];
+            entry->users++;
+            entry->last_used = ++image_clock;
+            pthread_mutex_unlock( &daemon_lock );
+            *cached = true;
+            return entry;
+        }
+    }
+    pthread_mutex_unlock( &daemon_lock );
+
+    /* Read the file without holding the lock; if two jobs race to read the
+     * same image both copies are cached and the unused one ages out. */
+    entry = (struct daemon_image *) calloc( 1, sizeof(struct daemon_image) );
+    if( NULL == entry ) {
+        return NULL;
+    }
+    entry->file = strdup( args->com_flash_data.file );
+    if(    (NULL == entry->file)
+        || (0 != read_memory_image(args, &entry->image)) )
+    {
+        daemon_image_free( entry );
+        return NULL;
+    }
+    entry->dev = info.st_dev;
+    entry->ino = info.st_ino;
+    entry->mtime = info.st_mtime;
+    entry->ctime = info.st_ctime;
+    entry->file_size = info.st_size;
+    entry->command = args->command;
+    entry->memory_address_top = args->memory_address_top;
+    entry->bootloader_bottom = args->bootloader_bottom;
+    entry->bootloader_top = args->bootloader_top;
+    entry->flash_page_size = args->flash_page_size;
+    entry->eeprom_memory_size = args->eeprom_memory_size;
+    entry->suppressbootloader = args->suppressbootloader;
+    entry->users = 1;
+
+    if( false == cacheable ) {
+        return entry;
+    }
+
+    pthread_mutex_lock( &daemon_lock );
+    entry->last_used = ++image_clock;
+
+    /* Use a free slot, or replace the least recently used idle image. */
+    slot = DAEMON_IMAGE_CACHE_SIZE;
+    for( i = 0; i < DAEMON_IMAGE_CACHE_SIZE; i++ ) {
+        if( NULL == image_cache[i] ) {
+            slot = i;
+            break;
+        }
+        if( (0 == image_cache[i]->users)
+            && ((DAEMON_IMAGE_CACHE_SIZE == slot)
+                || (image_cache[i]->last_used < image_cache[slot]->last_used)) )
+        {
+            slot = i;
+        }
+    }
+
+    if( DAEMON_IMAGE_CACHE_SIZE != slot ) {
+        if( NULL != image_cache[slot] ) {
+            daemon_image_free( image_cache[slot] );
+        }
+        image_cache[slot] = entry;
+        entry->cached = true;
+    }
+    pthread_mutex_unlock( &daemon_lock );
+
+    return entry;
+}
+
+static void daemon_image_put( struct daemon_image *entry )
+{
+    dfu_bool release;
+
+    pthread_mutex_lock( &daemon_lock );
+    entry->users--;
+    release = (0 == entry->users) && (false == entry->cached);
+    pthread_mutex_unlock( &daemon_lock );
+
+    if( true == release ) {
+        daemon_image_free( entry );
+    }
+}
+
+#ifdef HAVE_LIBUSB_1_0
+/*
+ *  Hotplug callback of the watch.  It may be called with libusb's device
+ *  list locked, so it must not call back into libusb for anything which
+ *  takes that lock.
+ *
+ *  returns 0 to stay registered
+ */
+static int LIBUSB_CALL daemon_watch_event( libusb_context *context,
+                                           libusb_device *device,
+                                           libusb_hotplug_event event,
+                                           void *user_data )
+{
+    struct libusb_device_descriptor descriptor;
+    struct daemon_present present;
+    int depth;
+    size_t i;
+
+    memset( &present, 0, sizeof(present) );
+    present.address = libusb_get_device_address( device );
+    present.port.bus_number = libusb_get_bus_number( device );
+
+    pthread_mutex_lock( &watch_lock );
+    for( i = 0; i < watch_count; i++ ) {
+        if(    (watch_devices[i].port.bus_number == present.port.bus_number)
+            && (watch_devices[i].address == present.address) )
+        {
+            /* Either it left, or it is back at the same address. */
+            watch_devices[i] = watch_devices[--watch_count];
+            break;
+        }
+    }
+
+    if(    (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED == event)
+        && (0 == libusb_get_device_descriptor(device, &descriptor)) )
+    {
+        present.vendor = descriptor.idVendor;
+        present.product = descriptor.idProduct;
+        depth = libusb_get_port_numbers( device, present.port.numbers,
+                                         sizeof(present.port.numbers) );
+        present.port.depth = (0 < depth) ? depth : 0;
+
+        if( watch_count == watch_size ) {
+            size_t size = (0 == watch_size) ? 16 : (2 * watch_size);
+            struct daemon_present *devices;
+
+            devices = (struct daemon_present *)
+                          realloc( watch_devices, size * sizeof(*devices) );
+            if( NULL != devices ) {
+                watch_devices = devices;
+                watch_size = size;
+            }
+        }
+        if( watch_count < watch_size ) {
+            watch_devices[watch_count++] = present;
+        }
+    }
+    pthread_cond_broadcast( &watch_changed );
+    pthread_mutex_unlock( &watch_lock );
+
+    return 0;
+}
+
+/*
+ *  Runs the usb events for the hotplug watch.  Jobs handle events of their
+ *  own while they transfer data; libusb lets only one thread at a time do
+ *  so, and wakes the others when their transfers complete.
+ */
+static void *daemon_watch_run( void *data )
+{
+    extern libusb_context *usbcontext;
+
+    for( ;; ) {
+        if( 0 != libusb_handle_events(usbcontext) ) {
+            DEBUG( "Failed while handling usb events\n" );
+            usleep( 100000 );
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ *  Used to start the hotplug watch, where libusb supports hotplug.  Without
+ *  it, jobs scan the bus for their devices instead.
+ */
+static void daemon_watch_start( void )
+{
+    extern libusb_context *usbcontext;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int result;
+
+    if( 0 == libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) ) {
+        DEBUG( "hotplug not supported, jobs scan the bus\n" );
+        return;
+    }
+
+    result = libusb_hotplug_register_callback( usbcontext,
+                    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                    LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE,
+                    LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                    LIBUSB_HOTPLUG_MATCH_ANY, daemon_watch_event, NULL, NULL );
+    if( LIBUSB_SUCCESS != result ) {
+        DEBUG( "Failed to register the hotplug callback: %d\n", result );
+        return;
+    }
+
+    pthread_attr_init( &attr );
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    if( 0 != pthread_create(&thread, &attr, daemon_watch_run, NULL) ) {
+        DEBUG( "Failed to start the hotplug watch\n" );
+    } else {
+        watch_running = true;
+    }
+    pthread_attr_destroy( &attr );
+}
+
+/*
+ *  Used to check the watch for a device matching the job's target.  The
+ *  caller holds watch_lock.
+ *
+ *  returns true if such a device is attached
+ */
+static dfu_bool daemon_watch_find( const struct programmer_arguments *args )
+{
+    const dfu_port_t *port = &args->port;
+    size_t i;
+
+    for( i = 0; i < watch_count; i++ ) {
+        const struct daemon_present *present = &watch_devices[i];
+
+        if(    (present->vendor == args->vendor_id)
+            && (present->product == args->chip_id)
+            && (    (0 == args->bus_id)
+                 || (    (present->port.bus_number == args->bus_id)
+                      && (present->address == args->device_address)))
+            && (    (0 == port->depth)
+                 || (    (present->port.bus_number == port->bus_number)
+                      && (present->port.depth == port->depth)
+                      && (0 == memcmp(present->port.numbers, port->numbers,
+                                      port->depth)))) )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+#endif
+
+/*
+ *  Used to check whether the job's device is attached before the bus is
+ *  scanned for it.  Without the hotplug watch there is no telling.
+ *
+ *  returns false if the device is known to be missing
+ */
+static dfu_bool daemon_device_present( const struct programmer_arguments *args )
+{
+    dfu_bool present = true;
+
+#ifdef HAVE_LIBUSB_1_0
+    if( true == watch_running ) {
+        pthread_mutex_lock( &watch_lock );
+        present = daemon_watch_find( args );
+        pthread_mutex_unlock( &watch_lock );
+    }
+#endif
+
+    return present;
+}
+
+/*
+ *  Used to wait for the job's device, with the hotplug watch if it is
+ *  running, or else like dfu_device_wait.
+ *
+ *  returns 0 once the device is present, 1 on timeout, or < 0 on error
+ */
+static int32_t daemon_device_wait( struct programmer_arguments *args )
+{
+#ifdef HAVE_LIBUSB_1_0
+    struct timespec deadline;
+    struct timeval now;
+    int32_t result = 0;
+
+    if( true == watch_running ) {
+        gettimeofday( &now, NULL );
+        deadline.tv_sec = now.tv_sec + args->wait_timeout;
+        deadline.tv_nsec = now.tv_usec * 1000;
+
+        pthread_mutex_lock( &watch_lock );
+        while( (0 == result) && (false == daemon_watch_find(args)) ) {
+            if( 0 == args->wait_timeout ) {
+                pthread_cond_wait( &watch_changed, &watch_lock );
+            } else if( ETIMEDOUT == pthread_cond_timedwait(&watch_changed,
+                                                           &watch_lock,
+                                                           &deadline) )
+            {
+                result = (true == daemon_watch_find(args)) ? 0 : 1;
+                break;
+            }
+        }
+        pthread_mutex_unlock( &watch_lock );
+
+        return result;
+    }
+#endif
+
+    return dfu_device_wait( args->vendor_id, args->chip_id, args->bus_id,
+                            args->device_address, &args->port,
+                            args->wait_timeout * 1000, true );
+}
+
+static void daemon_release( dfu_device_t *device )
+{
+    if( NULL == device->handle ) {
+        return;
+    }
+
+#ifdef HAVE_LIBUSB_1_0
+    libusb_release_interface( device->handle, device->interface );
+    libusb_close( device->handle );
+#else
+    usb_release_interface( device->handle, device->interface );
+    usb_close( device->handle );
+#endif
+    device->handle = NULL;
+}
+
+/*
+ *  Used to split a job line into words, in place.  Words are separated by
+ *  white space, and may be enclosed in double quotes to include spaces.
+ *
+ *  returns the number of words, or -1 if there are too many
+ */
+static int32_t daemon_split( char *line, char **argv, const size_t max )
+{
+    size_t argc = 0;
+
+    while( '\0' != *line ) {
+        if( (' ' == *line) || ('\t' == *line) || ('\r' == *line) ) {
+            line++;
+            continue;
+        }
+
+        if( argc == max ) {
+            return -1;
+        }
+
+        argv[argc++] = line;
+        if( '"' == *line ) {
+            argv[argc - 1] = ++line;
+            while( ('\0' != *line) && ('"' != *line) ) {
+                line++;
+            }
+        } else {
+            while(    ('\0' != *line) && (' ' != *line)
+                   && ('\t' != *line) && ('\r' != *line) )
+            {
+                line++;
+            }
+        }
+
+        if( '\0' != *line ) {
+            *line++ = '\0';
+        }
+    }
+
+    return argc;
+}
+
+static void daemon_job_finish( struct daemon_job *job, const int32_t result,
+                               const char *error, const int64_t start )
+{
+    struct daemon_client *client = job->client;
+
+    if( NULL != error ) {
+        daemon_send( client, "{\"job\":%u,\"event\":\"done\",\"status\":\"failed\","
+                             "\"result\":%d,\"error\":\"%s\",\"ms\":%ld}",
+                     job->id, result, error, (long) (daemon_time_ms() - start) );
+    } else {
+        daemon_send( client, "{\"job\":%u,\"event\":\"done\",\"status\":\"%s\","
+                             "\"result\":%d,\"ms\":%ld}",
+                     job->id, ((0 == result) ? "ok" : "failed"), result,
+                     (long) (daemon_time_ms() - start) );
+    }
+
+    if( NULL != job->args.com_flash_data.serial_data ) {
+        switch( job->args.command ) {
+            case com_flash:
+            case com_eflash:
+            case com_user:
+                free( job->args.com_flash_data.serial_data );
+                break;
+            default:
+                break;
+        }
+    }
+    free( job->line );
+    free( job );
+
+    pthread_mutex_lock( &client->lock );
+    if( 0 == --client->jobs ) {
+        pthread_cond_signal( &client->idle );
+    }
+    pthread_mutex_unlock( &client->lock );
+}
+
+static void *daemon_job_run( void *data )
+{
+    struct daemon_job *job = (struct daemon_job *) data;
+    struct programmer_arguments *args = &job->args;
+    struct daemon_image *entry = NULL;
+    static const memory_image_t no_image = { NULL, 0, 0 };
+    dfu_device_t device;
+    int64_t start = daemon_time_ms();
+    dfu_bool cached;
+    int32_t result;
+
+    daemon_send( job->client, "{\"job\":%u,\"event\":\"started\",\"command\":\"%s\"}",
+                 job->id, job->command );
+
+    if(    (com_flash == args->command) || (com_eflash == args->command)
+        || (com_user == args->command) )
+    {
+        entry = daemon_image_get( args, &cached );
+        if( NULL == entry ) {
+            daemon_job_finish( job, -1, "unable to read the memory image", start );
+            return NULL;
+        }
+        daemon_send( job->client, "{\"job\":%u,\"event\":\"image\",\"cached\":%s,"
+                                  "\"bytes\":%d}", job->id,
+                     ((true == cached) ? "true" : "false"), entry->image.usage );
+    }
+
+    if( true == args->wait ) {
+        result = daemon_device_wait( args );
+        if( 0 != result ) {
+            if( NULL != entry ) {
+                daemon_image_put( entry );
+            }
+            daemon_job_finish( job, -1, ((1 == result)
+                                         ? "timed out waiting for the device"
+                                         : "error waiting for the device"), start );
+            return NULL;
+        }
+    }
+
+    if( false == daemon_device_present(args) ) {
+        if( NULL != entry ) {
+            daemon_image_put( entry );
+        }
+        daemon_job_finish( job, -1, "no device present", start );
+        return NULL;
+    }
+
+    memset( &device, 0, sizeof(device) );
+    pthread_mutex_lock( &device_lock );
+    if( NULL == dfu_device_init(args->vendor_id, args->chip_id,
+                                args->bus_id, args->device_address,
+                                &args->port, &device, args->initial_abort,
+                                args->honor_interfaceclass) )
+    {
+        pthread_mutex_unlock( &device_lock );
+        if( NULL != entry ) {
+            daemon_image_put( entry );
+        }
+        daemon_job_finish( job, -1, "no device present", start );
+        return NULL;
+    }
+    pthread_mutex_unlock( &device_lock );
+
+    daemon_send( job->client, "{\"job\":%u,\"event\":\"device\",\"bus\":%d,"
+                              "\"address\":%d}", job->id,
+                 device.bus_number, device.device_address );
+
+    result = execute_command_image( &device, args,
+                                    ((NULL != entry) ? &entry->image : &no_image) );
+
+    daemon_release( &device );
+    if( NULL != entry ) {
+        daemon_image_put( entry );
+    }
+    daemon_job_finish( job, result, NULL, start );
+
+    return NULL;
+}
+
+/*
+ *  Used to check whether a job tries to set the debug level, which is
+ *  global and so can't change under the other jobs.  It is set when the
+ *  daemon is started instead.
+ */
+static dfu_bool daemon_sets_debug( const struct daemon_job *job )
+{
+    size_t i;
+
+    for( i = 1; i < job->argc; i++ ) {
+        if( 0 == strncmp("--debug", job->argv[i], 7) ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ *  Used to parse one job line and start a thread to run it.
+ */
+static void daemon_job_start( struct daemon_client *client, const char *line )
+{
+    struct daemon_job *job;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int32_t words;
+    const char *error = NULL;
+
+    job = (struct daemon_job *) calloc( 1, sizeof(struct daemon_job) );
+    if( NULL == job ) {
+        return;
+    }
+    job->client = client;
+    job->line = strdup( line );
+    strcpy( job->name, PACKAGE );
+
+    pthread_mutex_lock( &daemon_lock );
+    job->id = ++job_count;
+    pthread_mutex_unlock( &daemon_lock );
+
+    if( NULL == job->line ) {
+        free( job );
+        return;
+    }
+
+    job->argv[0] = job->name;
+    words = daemon_split( job->line, &job->argv[1], DAEMON_MAX_WORDS );
+    if( 0 == words ) {
+        free( job->line );
+        free( job );
+        return;
+    }
+
+    if( 0 < words ) {
+        job->argc = words + 1;
+        if( 2 <= words ) {
+            snprintf( job->command, sizeof(job->command), "%s", job->argv[2] );
+        }
+    }
+
+    if( words < 0 ) {
+        error = "too many arguments";
+    } else if( true == daemon_sets_debug(job) ) {
+        error = "--debug is only supported when starting the daemon";
+    } else if( 0 != parse_arguments(&job->args, job->argc, job->argv) ) {
+        error = "invalid arguments";
+    } else {
+        switch( job->args.command ) {
+            case com_get:
+            case com_getfuse:
+            case com_dump:
+            case com_edump:
+            case com_udump:
+                error = "command not supported by the daemon";
+                break;
+            case com_flash:
+            case com_eflash:
+            case com_user:
+                if( 0 == strcmp("STDIN", job->args.com_flash_data.file) ) {
+                    error = "STDIN is not supported by the daemon";
+                }
+                break;
+            default:
+                break;
+        }
+
+        if( (true == job->args.all_devices) || (1 < job->args.location_count) ) {
+            error = "use one job per device";
+        }
+    }
+
+    /* The job only counts as running once it is accepted. */
+    pthread_mutex_lock( &client->lock );
+    client->jobs++;
+    pthread_mutex_unlock( &client->lock );
+
+    if( NULL != error ) {
+        daemon_job_finish( job, -1, error, daemon_time_ms() );
+        return;
+    }
+
+    /* Progress bars from concurrent jobs would interleave. */
+    job->args.quiet = 1;
+
+    pthread_attr_init( &attr );
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    if( 0 != pthread_create(&thread, &attr, daemon_job_run, job) ) {
+        daemon_job_finish( job, -1, "unable to start the job", daemon_time_ms() );
+    }
+    pthread_attr_destroy( &attr );
+}
+
+static void *daemon_client_run( void *data )
+{
+    struct daemon_client *client = (struct daemon_client *) data;
+    char buffer[DAEMON_MAX_LINE];
+    size_t length = 0;
+    dfu_bool overflow = false;
+    ssize_t rv;
+
+    for( ;; ) {
+        char *start, *end;
+
+        rv = read( client->fd, &buffer[length], sizeof(buffer) - 1 - length );
+        if( rv < 0 ) {
+            if( EINTR == errno ) {
+                continue;
+            }
+            break;
+        }
+        if( 0 == rv ) {
+            break;
+        }
+        length += rv;
+        buffer[length] = '\0';
+
+        start = buffer;
+        while( NULL != (end = strchr(start, '\n')) ) {
+            *end = '\0';
+            if( true == overflow ) {
+                overflow = false;
+            } else {
+                daemon_job_start( client, start );
+            }
+            start = end + 1;
+        }
+
+        length -= start - buffer;
+        memmove( buffer, start, length );
+
+        /* Throw away the rest of a line which is too long to be a job. */
+        if( (sizeof(buffer) - 1) == length ) {
+            if( false == overflow ) {
+                daemon_send( client, "{\"event\":\"error\",\"error\":\"line too long\"}" );
+            }
+            overflow = true;
+            length = 0;
+        }
+    }
+
+    DEBUG( "client %d disconnected\n", client->fd );
+
+    /* Let any jobs still running finish before the client goes away. */
+    pthread_mutex_lock( &client->lock );
+    while( 0 != client->jobs ) {
+        pthread_cond_wait( &client->idle, &client->lock );
+    }
+    pthread_mutex_unlock( &client->lock );
+
+    close( client->fd );
+    pthread_cond_destroy( &client->idle );
+    pthread_mutex_destroy( &client->lock );
+    free( client );
+
+    return NULL;
+}
+
+int32_t daemon_run( const char *path )
+{
+    struct sockaddr_un address;
+    pthread_attr_t attr;
+    int listener;
+
+    if( strlen(path) >= sizeof(address.sun_path) ) {
+        fprintf( stderr, "Socket path '%s' is too long.\n", path );
+        return 1;
+    }
+
+    /* A client going away must not take the daemon with it. */
+    signal( SIGPIPE, SIG_IGN );
+
+    listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( listener < 0 ) {
+        perror( "socket" );
+        return 1;
+    }
+
+    memset( &address, 0, sizeof(address) );
+    address.sun_family = AF_UNIX;
+    strcpy( address.sun_path, path );
+    unlink( path );
+
+    if(    (0 != bind(listener, (struct sockaddr *) &address, sizeof(address)))
+        || (0 != listen(listener, 16)) )
+    {
+        fprintf( stderr, "Unable to listen on '%s': %s\n", path, strerror(errno) );
+        close( listener );
+        return 1;
+    }
+
+    DEBUG( "listening on %s\n", path );
+
+#ifdef HAVE_LIBUSB_1_0
+    daemon_watch_start();
+#endif
+
+    pthread_attr_init( &attr );
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+
+    for( ;; ) {
+        struct daemon_client *client;
+        pthread_t thread;
+        int fd;
+
+        fd = accept( listener, NULL, NULL );
+        if( fd < 0 ) {
+            if( (EINTR == errno) || (ECONNABORTED == errno) ) {
+                continue;
+            }
+            perror( "accept" );
+            break;
+        }
+
+        client = (struct daemon_client *) calloc( 1, sizeof(struct daemon_client) );
+        if( NULL == client ) {
+            close( fd );
+            continue;
+        }
+        client->fd = fd;
+        pthread_mutex_init( &client->lock, NULL );
+        pthread_cond_init( &client->idle, NULL );
+
+        if( 0 != pthread_create(&thread, &attr, daemon_client_run, client) ) {
+            DEBUG( "Failed to start a thread for client %d\n", fd );
+            pthread_cond_destroy( &client->idle );
+            pthread_mutex_destroy( &client->lock );
+            close( fd );
+            free( client );
+        }
+    }
+
+    pthread_attr_destroy( &attr );
+    close( listener );
+    unlink( path );
+
+    return 1;
+}
@@ -0,0 +1,42 @@
+/*
+ * dfu-programmer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include <stdint.h>
+
+/*
+ *  Runs dfu-programmer as a daemon, taking jobs from clients connected to
+ *  a unix domain socket.  Each job is one line holding the arguments of a
+ *  normal dfu-programmer command line, for example
+ *
+ *      at90usb1287:2,7 flash --suppress-bootloader-mem /srv/fw/app.hex
+ *
+ *  and its progress and result are written back to the client as lines of
+ *  JSON tagged with the job number.  Jobs run concurrently, each on the
+ *  first free device which matches, and memory images are kept between
+ *  jobs until the file changes.
+ *
+ *  path - the socket to listen on, which is replaced if it exists
+ *
+ *  returns only on an error, with a non-zero value
+ */
+int32_t daemon_run( const char *path );
+
+#endif
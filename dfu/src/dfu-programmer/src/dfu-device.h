@@ -32,6 +32,26 @@ typedef struct {
 #endif
     int32_t interface;
     atmel_device_class_t type;
+    uint16_t transaction;       /* wValue for the next DNLOAD/UPLOAD request */
+    uint8_t bus_number;         /* USB location of the claimed device, */
+    uint8_t device_address;     /* used to report per-device results.  */
 } dfu_device_t;
 
+typedef struct {
+    uint16_t bus_number;
+    uint16_t device_address;
+} dfu_location_t;
+
+/* The most ports in a port path; the USB 3.0 specification limits the
+ * depth of the hub tree to 7. */
+#define DFU_PORT_MAX_DEPTH 7
+
+/* A physical port, which unlike the device address stays the same when
+ * the device resets.  A depth of 0 means any port. */
+typedef struct {
+    uint8_t bus_number;
+    uint8_t depth;
+    uint8_t numbers[DFU_PORT_MAX_DEPTH];
+} dfu_port_t;
+
 #endif
@@ -26,12 +26,15 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
 #ifdef HAVE_LIBUSB_1_0
 #include <libusb.h>
 #else
 #include <usb.h>
 #endif
 #include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include "dfu.h"
 #include "util.h"
 #include "dfu-bool.h"
@@ -57,6 +60,14 @@
  * before the giving up going into dfu mode. */
 #define DFU_DETACH_TIMEOUT 1000
 
+/* Time (in ms) to wait for a device which reset while being brought into
+ * dfuIDLE to enumerate again before scanning the bus for it. */
+#define DFU_REENUMERATE_TIMEOUT 2000
+
+/* Time (in ms) between bus scans while waiting for a device when hotplug
+ * notification is not available. */
+#define DFU_WAIT_POLL_INTERVAL 100
+
 #define DFU_DEBUG_THRESHOLD         100
 #define DFU_TRACE_THRESHOLD         200
 #define DFU_MESSAGE_DEBUG_THRESHOLD 300
@@ -68,8 +79,6 @@
 #define MSG_DEBUG(...)  dfu_debug( __FILE__, __FUNCTION__, __LINE__, \
                                DFU_MESSAGE_DEBUG_THRESHOLD, __VA_ARGS__ )
 
-static uint16_t transaction = 0;
-
 #ifdef HAVE_LIBUSB_1_0
 static int32_t dfu_find_interface( struct libusb_device *device,
                                    const dfu_bool honor_interfaceclass,
@@ -79,6 +88,9 @@ static int32_t dfu_find_interface( const struct usb_device *device,
                                    const dfu_bool honor_interfaceclass );
 #endif
 static int32_t dfu_make_idle( dfu_device_t *device, const dfu_bool initial_abort );
+static void dfu_device_reenumerate_wait( const uint32_t vendor,
+                                         const uint32_t product,
+                                         const dfu_port_t *port );
 
 static int32_t dfu_transfer_out( dfu_device_t *device,
                                  uint8_t request,
@@ -174,7 +186,7 @@ int32_t dfu_download( dfu_device_t *device, const size_t length, uint8_t* data )
         }
     }
 
-    result = dfu_transfer_out( device, DFU_DNLOAD, transaction++, data, length );
+    result = dfu_transfer_out( device, DFU_DNLOAD, device->transaction++, data, length );
 
     dfu_msg_response_output( __FUNCTION__, result );
 
@@ -209,7 +221,7 @@ int32_t dfu_upload( dfu_device_t *device, const size_t length, uint8_t* data )
         return -2;
     }
 
-    result = dfu_transfer_in( device, DFU_UPLOAD, transaction++, data, length );
+    result = dfu_transfer_in( device, DFU_UPLOAD, device->transaction++, data, length );
 
     dfu_msg_response_output( __FUNCTION__, result );
 
@@ -361,6 +373,277 @@ int32_t dfu_abort( dfu_device_t *device )
 }
 
 
+/*
+ *  Used to check whether a device at the given USB location is one of
+ *  the locations requested by the user.
+ *
+ *  locations      - the bus/address pairs to accept, or NULL for any
+ *  location_count - the number of entries in locations
+ *  bus_number     - the bus the device is attached to
+ *  device_address - the address of the device on that bus
+ *
+ *  returns true if the device should be used, false otherwise
+ */
+static dfu_bool dfu_location_match( const dfu_location_t *locations,
+                                    const size_t location_count,
+                                    const uint32_t bus_number,
+                                    const uint32_t device_address )
+{
+    size_t i;
+
+    if( (NULL == locations) || (0 == location_count) ) {
+        return true;
+    }
+
+    for( i = 0; i < location_count; i++ ) {
+        if(    (locations[i].bus_number == bus_number)
+            && (locations[i].device_address == device_address) )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ *  Used to check whether a device is attached at the port path given.
+ *
+ *  port - the port path, or NULL (or a depth of 0) for any port
+ *
+ *  returns true if the device should be used, false otherwise
+ */
+#ifdef HAVE_LIBUSB_1_0
+static dfu_bool dfu_port_match( const dfu_port_t *port,
+                                libusb_device *device )
+{
+    uint8_t numbers[DFU_PORT_MAX_DEPTH];
+    int depth;
+
+    if( (NULL == port) || (0 == port->depth) ) {
+        return true;
+    }
+
+    if( libusb_get_bus_number(device) != port->bus_number ) {
+        return false;
+    }
+
+    depth = libusb_get_port_numbers( device, numbers, sizeof(numbers) );
+
+    return (depth == port->depth)
+           && (0 == memcmp(numbers, port->numbers, depth));
+}
+#else
+#ifdef __linux__
+/*
+ *  Used to find the device attached at a port path through sysfs, which
+ *  names each device after its path.  libusb-0.1 knows nothing of ports,
+ *  so this is the only way to match one there.
+ *
+ *  returns 0 and the location of the device, or -1 if there is none
+ */
+static int32_t dfu_port_locate( const dfu_port_t *port,
+                                uint32_t *bus_number,
+                                uint32_t *device_address )
+{
+    char path[64];
+    size_t length;
+    uint8_t i;
+    FILE *fp;
+    int32_t result = -1;
+
+    length = snprintf( path, sizeof(path), "/sys/bus/usb/devices/%u-%u",
+                       port->bus_number, port->numbers[0] );
+    for( i = 1; i < port->depth; i++ ) {
+        length += snprintf( &path[length], sizeof(path) - length, ".%u",
+                            port->numbers[i] );
+    }
+    snprintf( &path[length], sizeof(path) - length, "/devnum" );
+
+    fp = fopen( path, "r" );
+    if( NULL == fp ) {
+        return -1;
+    }
+    if( 1 == fscanf(fp, "%u", device_address) ) {
+        *bus_number = port->bus_number;
+        result = 0;
+    }
+    fclose( fp );
+
+    return result;
+}
+#endif
+
+static dfu_bool dfu_port_match( const dfu_port_t *port,
+                                const uint32_t bus_number,
+                                const uint32_t device_address )
+{
+#ifdef __linux__
+    uint32_t port_bus, port_address;
+
+    if( (NULL == port) || (0 == port->depth) ) {
+        return true;
+    }
+
+    if( 0 != dfu_port_locate(port, &port_bus, &port_address) ) {
+        return false;
+    }
+
+    return (port_bus == bus_number) && (port_address == device_address);
+#else
+    return (NULL == port) || (0 == port->depth);
+#endif
+}
+#endif
+
+/*
+ *  Used to check whether a device at the given USB location has already
+ *  been claimed by an earlier enumeration pass.
+ *
+ *  returns true if the device is in the claimed list, false otherwise
+ */
+static dfu_bool dfu_device_claimed( const dfu_device_t *devices,
+                                    const size_t count,
+                                    const uint32_t bus_number,
+                                    const uint32_t device_address )
+{
+    size_t i;
+
+    for( i = 0; i < count; i++ ) {
+        if(    (devices[i].bus_number == bus_number)
+            && (devices[i].device_address == device_address) )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ *  dfu_device_claim finds the DFU interface of a matching usb device,
+ *  opens the device, claims the interface and gets it into dfuIDLE.
+ *
+ *  device  - the usb device to claim
+ *  [out] dfu_device - the dfu device to commmunicate with
+ *
+ *  returns 0 on success, 1 if the device was reset, < 0 otherwise;
+ *  dfu_device->handle is only left open on success
+ */
+#ifdef HAVE_LIBUSB_1_0
+static int32_t dfu_device_claim( struct libusb_device *device,
+                                 const uint8_t bNumConfigurations,
+                                 dfu_device_t *dfu_device,
+                                 const dfu_bool initial_abort,
+                                 const dfu_bool honor_interfaceclass )
+{
+    int32_t tmp;
+    int32_t result = -1;
+
+    /* We found a device that looks like it matches...
+     * let's try to find the DFU interface, open the device
+     * and claim it. */
+    tmp = dfu_find_interface( device, honor_interfaceclass,
+                              bNumConfigurations );
+
+    if( 0 <= tmp ) {    /* The interface is valid. */
+        dfu_device->interface = tmp;
+
+        if( 0 == libusb_open(device, &dfu_device->handle) ) {
+            DEBUG( "opened interface %d...\n", tmp );
+            if( 0 == libusb_set_configuration(dfu_device->handle, 1) ) {
+                DEBUG( "set configuration %d...\n", 1 );
+                if( 0 == libusb_claim_interface(dfu_device->handle, dfu_device->interface) )
+                {
+                    DEBUG( "claimed interface %d...\n", dfu_device->interface );
+
+                    result = dfu_make_idle( dfu_device, initial_abort );
+                    if( 0 == result ) {
+                        dfu_device->bus_number = libusb_get_bus_number( device );
+                        dfu_device->device_address = libusb_get_device_address( device );
+                        return 0;
+                    }
+
+                    if( 1 != result ) {
+                        DEBUG( "Failed to put the device in dfuIDLE mode.\n" );
+                        libusb_release_interface( dfu_device->handle, dfu_device->interface );
+                        result = -1;
+                    }
+                } else {
+                    DEBUG( "Failed to claim the DFU interface.\n" );
+                }
+            } else {
+                DEBUG( "Failed to set configuration.\n" );
+            }
+
+            libusb_close(dfu_device->handle);
+        } else {
+            DEBUG( "Failed to open device.\n" );
+        }
+    } else {
+        DEBUG( "Failed to find the DFU interface.\n" );
+    }
+
+    dfu_device->handle = NULL;
+    dfu_device->interface = 0;
+
+    return result;
+}
+#else
+static int32_t dfu_device_claim( struct usb_device *device,
+                                 dfu_device_t *dfu_device,
+                                 const dfu_bool initial_abort,
+                                 const dfu_bool honor_interfaceclass )
+{
+    int32_t tmp;
+    int32_t result = -1;
+
+    /* We found a device that looks like it matches...
+     * let's try to find the DFU interface, open the device
+     * and claim it. */
+    tmp = dfu_find_interface( device, honor_interfaceclass );
+    if( 0 <= tmp ) {
+        /* The interface is valid. */
+        dfu_device->interface = tmp;
+        dfu_device->handle = usb_open( device );
+        if( NULL != dfu_device->handle ) {
+            if( 0 == usb_set_configuration(dfu_device->handle, 1) ) {
+                if( 0 == usb_claim_interface(dfu_device->handle, dfu_device->interface) ) {
+                    result = dfu_make_idle( dfu_device, initial_abort );
+                    if( 0 == result ) {
+                        dfu_device->bus_number = device->bus->location >> 24;
+                        dfu_device->device_address = device->devnum;
+                        return 0;
+                    }
+
+                    if( 1 != result ) {
+                        DEBUG( "Failed to put the device in dfuIDLE mode.\n" );
+                        usb_release_interface( dfu_device->handle, dfu_device->interface );
+                        result = -1;
+                    }
+                } else {
+                    DEBUG( "Failed to claim the DFU interface.\n" );
+                }
+            } else {
+                DEBUG( "Failed to set configuration.\n");
+            }
+
+            usb_close( dfu_device->handle );
+        } else {
+            DEBUG( "Failed to open device.\n" );
+        }
+    } else {
+        DEBUG( "Failed to find the DFU interface.\n" );
+    }
+
+    dfu_device->handle = NULL;
+    dfu_device->interface = 0;
+
+    return result;
+}
+#endif
+
+
 /*
  *  dfu_device_init is designed to find one of the usb devices which match
  *  the vendor and product parameters passed in.
@@ -376,6 +659,7 @@ struct libusb_device *dfu_device_init( const uint32_t vendor,
                                        const uint32_t product,
                                        const uint32_t bus_number,
                                        const uint32_t device_address,
+                                       const dfu_port_t *port,
                                        dfu_device_t *dfu_device,
                                        const dfu_bool initial_abort,
                                        const dfu_bool honor_interfaceclass )
@@ -398,6 +682,13 @@ retry:
         libusb_device *device = list[i];
         struct libusb_device_descriptor descriptor;
 
+        /* The port path only needs the bus number and the port numbers
+         * libusb already has, so devices on other ports are passed over
+         * before anything else is read from them. */
+        if( false == dfu_port_match(port, device) ) {
+            continue;
+        }
+
         if( libusb_get_device_descriptor(device, &descriptor) ) {
              DEBUG( "Failed in libusb_get_device_descriptor\n" );
              break;
@@ -412,49 +703,23 @@ retry:
              || ((libusb_get_bus_number(device) == bus_number) &&
                  (libusb_get_device_address(device) == device_address))) )
         {
-            int32_t tmp;
             DEBUG( "found device at USB:%d,%d\n", libusb_get_bus_number(device), libusb_get_device_address(device) );
-            /* We found a device that looks like it matches...
-             * let's try to find the DFU interface, open the device
-             * and claim it. */
-            tmp = dfu_find_interface( device, honor_interfaceclass,
-                                      descriptor.bNumConfigurations );
-
-            if( 0 <= tmp ) {    /* The interface is valid. */
-                dfu_device->interface = tmp;
-
-                if( 0 == libusb_open(device, &dfu_device->handle) ) {
-                    DEBUG( "opened interface %d...\n", tmp );
-                    if( 0 == libusb_set_configuration(dfu_device->handle, 1) ) {
-                        DEBUG( "set configuration %d...\n", 1 );
-                        if( 0 == libusb_claim_interface(dfu_device->handle, dfu_device->interface) )
-                        {
-                            DEBUG( "claimed interface %d...\n", dfu_device->interface );
-
-                            switch( dfu_make_idle(dfu_device, initial_abort) )
-                            {
-                                case 0:
-                                    libusb_free_device_list( list, 1 );
-                                    return device;
-
-                                case 1:
-                                    retries--;
-                                    libusb_free_device_list( list, 1 );
-                                    goto retry;
-                            }
-
-                            DEBUG( "Failed to put the device in dfuIDLE mode.\n" );
-                            libusb_release_interface( dfu_device->handle, dfu_device->interface );
-                            retries = 4;
-                        } else {
-                            DEBUG( "Failed to claim the DFU interface.\n" );
-                        }
-                    } else {
-                        DEBUG( "Failed to set configuration.\n" );
-                    }
 
-                    libusb_close(dfu_device->handle);
-                }
+            switch( dfu_device_claim(device, descriptor.bNumConfigurations,
+                                     dfu_device, initial_abort,
+                                     honor_interfaceclass) )
+            {
+                case 0:
+                    libusb_free_device_list( list, 1 );
+                    return device;
+
+                case 1:
+                    libusb_free_device_list( list, 1 );
+                    if( 0 < --retries ) {
+                        dfu_device_reenumerate_wait( vendor, product, port );
+                        goto retry;
+                    }
+                    return NULL;
             }
         }
     }
@@ -470,6 +735,7 @@ struct usb_device *dfu_device_init( const uint32_t vendor,
                                     const uint32_t product,
                                     const uint32_t bus_number,
                                     const uint32_t device_address,
+                                    const dfu_port_t *port,
                                     dfu_device_t *dfu_device,
                                     const dfu_bool initial_abort,
                                     const dfu_bool honor_interfaceclass )
@@ -495,48 +761,21 @@ retry:
                     && (product == device->descriptor.idProduct)
                     && ((bus_number == 0)
                         || (device->devnum == device_address
-                            && (usb_bus->location >> 24) == bus_number)))
+                            && (usb_bus->location >> 24) == bus_number))
+                    && (true == dfu_port_match(port, usb_bus->location >> 24,
+                                               device->devnum)) )
                 {
-                    int32_t tmp;
                     DEBUG( "found device at USB:%d,%d\n", device->devnum, (usb_bus->location >> 24) );
-                    /* We found a device that looks like it matches...
-                     * let's try to find the DFU interface, open the device
-                     * and claim it. */
-                    tmp = dfu_find_interface( device, honor_interfaceclass );
-                    if( 0 <= tmp ) {
-                        /* The interface is valid. */
-                        dfu_device->interface = tmp;
-                        dfu_device->handle = usb_open( device );
-                        if( NULL != dfu_device->handle ) {
-                            if( 0 == usb_set_configuration(dfu_device->handle, 1) ) {
-                                if( 0 == usb_claim_interface(dfu_device->handle, dfu_device->interface) ) {
-                                    switch( dfu_make_idle(dfu_device, initial_abort) )
-                                    {
-                                        case 0:
-                                            return device;
-                                        case 1:
-                                            retries--;
-                                            goto retry;
-                                    }
-
-                                    DEBUG( "Failed to put the device in dfuIDLE mode.\n" );
-                                    usb_release_interface( dfu_device->handle, dfu_device->interface );
-                                    usb_close( dfu_device->handle );
-                                    retries = 4;
-                                } else {
-                                    DEBUG( "Failed to claim the DFU interface.\n" );
-                                    usb_close( dfu_device->handle );
-                                }
-                            } else {
-                                DEBUG( "Failed to set configuration.\n");
-
-                                usb_close( dfu_device->handle );
-                            }
-                        } else {
-                            DEBUG( "Failed to open device.\n" );
-                        }
-                    } else {
-                        DEBUG( "Failed to find the DFU interface.\n" );
+
+                    switch( dfu_device_claim(device, dfu_device, initial_abort,
+                                             honor_interfaceclass) )
+                    {
+                        case 0:
+                            return device;
+                        case 1:
+                            retries--;
+                            dfu_device_reenumerate_wait( vendor, product, port );
+                            goto retry;
                     }
                 }
             }
@@ -551,6 +790,448 @@ retry:
 #endif
 
 
+/*
+ *  dfu_device_init_all is designed to find every usb device which matches
+ *  the vendor and product parameters passed in, using a single enumeration
+ *  pass, and to claim each of them.  Devices which reset while being
+ *  brought into dfuIDLE are picked up by a further pass.
+ *
+ *  vendor         - the vender number of the devices to look for
+ *  product        - the product number of the devices to look for
+ *  locations      - the bus/address pairs to restrict the search to,
+ *                   or NULL to accept every matching device
+ *  location_count - the number of entries in locations
+ *  [out] devices  - the dfu devices to commmunicate with
+ *  max_devices    - the number of entries available in devices
+ *
+ *  returns the number of devices claimed
+ */
+#ifdef HAVE_LIBUSB_1_0
+size_t dfu_device_init_all( const uint32_t vendor,
+                            const uint32_t product,
+                            const dfu_location_t *locations,
+                            const size_t location_count,
+                            dfu_device_t *devices,
+                            const size_t max_devices,
+                            const dfu_bool initial_abort,
+                            const dfu_bool honor_interfaceclass )
+{
+    libusb_device **list;
+    size_t i, devicecount;
+    size_t found = 0;
+    extern libusb_context *usbcontext;
+    int32_t retries = 4;
+    dfu_bool rescan;
+
+    TRACE( "%s( %u, %u, %p, %u, %s, %s )\n", __FUNCTION__, vendor, product,
+           devices, max_devices, ((true == initial_abort) ? "true" : "false"),
+           ((true == honor_interfaceclass) ? "true" : "false") );
+
+retry:
+    rescan = false;
+    devicecount = libusb_get_device_list( usbcontext, &list );
+
+    for( i = 0; (i < devicecount) && (found < max_devices); i++ ) {
+        libusb_device *device = list[i];
+        struct libusb_device_descriptor descriptor;
+        uint8_t bus, address;
+
+        if( libusb_get_device_descriptor(device, &descriptor) ) {
+            DEBUG( "Failed in libusb_get_device_descriptor\n" );
+            continue;
+        }
+
+        if( (vendor != descriptor.idVendor) || (product != descriptor.idProduct) ) {
+            continue;
+        }
+
+        bus = libusb_get_bus_number( device );
+        address = libusb_get_device_address( device );
+        if(    (false == dfu_location_match(locations, location_count, bus, address))
+            || (true == dfu_device_claimed(devices, found, bus, address)) )
+        {
+            continue;
+        }
+
+        DEBUG( "found device at USB:%d,%d\n", bus, address );
+
+        memset( &devices[found], 0, sizeof(dfu_device_t) );
+        switch( dfu_device_claim(device, descriptor.bNumConfigurations,
+                                 &devices[found], initial_abort,
+                                 honor_interfaceclass) )
+        {
+            case 0:
+                found++;
+                break;
+            case 1:
+                rescan = true;
+                break;
+        }
+    }
+
+    libusb_free_device_list( list, 1 );
+
+    if( (true == rescan) && (0 < --retries) ) {
+        dfu_device_reenumerate_wait( vendor, product, NULL );
+        goto retry;
+    }
+
+    return found;
+}
+#else
+size_t dfu_device_init_all( const uint32_t vendor,
+                            const uint32_t product,
+                            const dfu_location_t *locations,
+                            const size_t location_count,
+                            dfu_device_t *devices,
+                            const size_t max_devices,
+                            const dfu_bool initial_abort,
+                            const dfu_bool honor_interfaceclass )
+{
+    struct usb_bus *usb_bus;
+    struct usb_device *device;
+    size_t found = 0;
+    int32_t retries = 4;
+    dfu_bool rescan;
+
+    TRACE( "%s( %u, %u, %p, %u, %s, %s )\n", __FUNCTION__, vendor, product,
+           devices, max_devices, ((true == initial_abort) ? "true" : "false"),
+           ((true == honor_interfaceclass) ? "true" : "false") );
+
+retry:
+    rescan = false;
+    usb_find_busses();
+    usb_find_devices();
+
+    /* Walk the tree and claim every matching device. */
+    for( usb_bus = usb_get_busses(); NULL != usb_bus; usb_bus = usb_bus->next ) {
+        for( device = usb_bus->devices; NULL != device; device = device->next) {
+            uint32_t bus = usb_bus->location >> 24;
+
+            if( found == max_devices ) {
+                return found;
+            }
+
+            if(    (vendor  != device->descriptor.idVendor)
+                || (product != device->descriptor.idProduct)
+                || (false == dfu_location_match(locations, location_count, bus, device->devnum))
+                || (true == dfu_device_claimed(devices, found, bus, device->devnum)) )
+            {
+                continue;
+            }
+
+            DEBUG( "found device at USB:%d,%d\n", device->devnum, bus );
+
+            memset( &devices[found], 0, sizeof(dfu_device_t) );
+            switch( dfu_device_claim(device, &devices[found], initial_abort,
+                                     honor_interfaceclass) )
+            {
+                case 0:
+                    found++;
+                    break;
+                case 1:
+                    rescan = true;
+                    break;
+            }
+        }
+    }
+
+    if( (true == rescan) && (0 < --retries) ) {
+        dfu_device_reenumerate_wait( vendor, product, NULL );
+        goto retry;
+    }
+
+    return found;
+}
+#endif
+
+
+/*
+ *  Used to get the current time in ms, for the timeouts in dfu_device_wait.
+ */
+static int64_t dfu_time_ms( void )
+{
+    struct timeval now;
+
+    gettimeofday( &now, NULL );
+
+    return ((int64_t) now.tv_sec) * 1000 + (now.tv_usec / 1000);
+}
+
+/*
+ *  Used to check whether a device matching the vendor, product and
+ *  (optional) bus/address and port is currently attached, by scanning the
+ *  bus once.
+ *
+ *  returns true if such a device is attached, false otherwise
+ */
+#ifdef HAVE_LIBUSB_1_0
+static dfu_bool dfu_device_present( const uint32_t vendor,
+                                    const uint32_t product,
+                                    const uint32_t bus_number,
+                                    const uint32_t device_address,
+                                    const dfu_port_t *port )
+{
+    libusb_device **list;
+    ssize_t i, devicecount;
+    extern libusb_context *usbcontext;
+    dfu_bool present = false;
+
+    devicecount = libusb_get_device_list( usbcontext, &list );
+
+    for( i = 0; (i < devicecount) && (false == present); i++ ) {
+        struct libusb_device_descriptor descriptor;
+
+        if( libusb_get_device_descriptor(list[i], &descriptor) ) {
+            continue;
+        }
+
+        if(    (vendor  == descriptor.idVendor)
+            && (product == descriptor.idProduct)
+            && ((bus_number == 0)
+                || ((libusb_get_bus_number(list[i]) == bus_number) &&
+                    (libusb_get_device_address(list[i]) == device_address)))
+            && (true == dfu_port_match(port, list[i])) )
+        {
+            present = true;
+        }
+    }
+
+    if( 0 <= devicecount ) {
+        libusb_free_device_list( list, 1 );
+    }
+
+    return present;
+}
+#else
+static dfu_bool dfu_device_present( const uint32_t vendor,
+                                    const uint32_t product,
+                                    const uint32_t bus_number,
+                                    const uint32_t device_address,
+                                    const dfu_port_t *port )
+{
+    struct usb_bus *usb_bus;
+    struct usb_device *device;
+
+    usb_find_busses();
+    usb_find_devices();
+
+    for( usb_bus = usb_get_busses(); NULL != usb_bus; usb_bus = usb_bus->next ) {
+        for( device = usb_bus->devices; NULL != device; device = device->next) {
+            if(    (vendor  == device->descriptor.idVendor)
+                && (product == device->descriptor.idProduct)
+                && ((bus_number == 0)
+                    || (device->devnum == device_address
+                        && (usb_bus->location >> 24) == bus_number))
+                && (true == dfu_port_match(port, usb_bus->location >> 24,
+                                           device->devnum)) )
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+#endif
+
+/*
+ *  Used to wait for a device by polling the bus, when the usb library
+ *  cannot tell us about new devices as they arrive.
+ *
+ *  returns 0 once the device is present, or 1 on timeout
+ */
+static int32_t dfu_device_poll( const uint32_t vendor,
+                                const uint32_t product,
+                                const uint32_t bus_number,
+                                const uint32_t device_address,
+                                const dfu_port_t *port,
+                                const int32_t timeout,
+                                const dfu_bool present_ok )
+{
+    int64_t deadline = dfu_time_ms() + timeout;
+
+    /* A device which is already there only counts if the caller says so,
+     * otherwise give it one interval to go away before looking. */
+    if( false == present_ok ) {
+        usleep( DFU_WAIT_POLL_INTERVAL * 1000 );
+    }
+
+    while( false == dfu_device_present(vendor, product, bus_number,
+                                       device_address, port) )
+    {
+        if( (0 < timeout) && (deadline <= dfu_time_ms()) ) {
+            return 1;
+        }
+        usleep( DFU_WAIT_POLL_INTERVAL * 1000 );
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_LIBUSB_1_0
+typedef struct {
+    uint32_t bus_number;
+    uint32_t device_address;
+    const dfu_port_t *port;
+    int arrived;
+} dfu_wait_t;
+
+/*
+ *  Hotplug callback used by dfu_device_wait.  The vendor and product have
+ *  already been filtered on by libusb, so only the location and port are
+ *  left to check.
+ *
+ *  returns 0 to stay registered
+ */
+static int LIBUSB_CALL dfu_device_arrived( libusb_context *context,
+                                           libusb_device *device,
+                                           libusb_hotplug_event event,
+                                           void *user_data )
+{
+    dfu_wait_t *wait = (dfu_wait_t *) user_data;
+
+    if(    (    (wait->bus_number == 0)
+             || (    (libusb_get_bus_number(device) == wait->bus_number)
+                  && (libusb_get_device_address(device) == wait->device_address)))
+        && (true == dfu_port_match(wait->port, device)) )
+    {
+        DEBUG( "device arrived at USB:%d,%d\n", libusb_get_bus_number(device),
+               libusb_get_device_address(device) );
+        wait->arrived = 1;
+    }
+
+    return 0;
+}
+#endif
+
+/*
+ *  dfu_device_wait blocks until a usb device which matches the vendor and
+ *  product parameters passed in is attached.  Where the usb library
+ *  supports hotplug notification this returns as soon as the device
+ *  enumerates; otherwise the bus is scanned periodically.
+ *
+ *  vendor         - the vender number of the device to wait for
+ *  product        - the product number of the device to wait for
+ *  bus_number     - the bus the device must be on, or 0 for any
+ *  device_address - the address the device must have on that bus
+ *  port           - the port the device must be attached to, or NULL
+ *  timeout        - the time in ms to wait, or 0 to wait forever
+ *  present_ok     - true if a device which is already attached will do,
+ *                   false to wait for a new arrival (e.g. after a reset)
+ *
+ *  returns 0 once the device is present, 1 on timeout, or < 0 on error
+ */
+int32_t dfu_device_wait( const uint32_t vendor,
+                         const uint32_t product,
+                         const uint32_t bus_number,
+                         const uint32_t device_address,
+                         const dfu_port_t *port,
+                         const int32_t timeout,
+                         const dfu_bool present_ok )
+{
+#ifdef HAVE_LIBUSB_1_0
+    extern libusb_context *usbcontext;
+    libusb_hotplug_callback_handle callback;
+    dfu_wait_t wait;
+    int64_t deadline;
+    int32_t result;
+#endif
+
+    TRACE( "%s( %u, %u, %u, %u, %d, %s )\n", __FUNCTION__, vendor, product,
+           bus_number, device_address, timeout,
+           ((true == present_ok) ? "true" : "false") );
+
+    if( timeout < 0 ) {
+        DEBUG( "Invalid parameter\n" );
+        return -1;
+    }
+
+#ifdef HAVE_LIBUSB_1_0
+    if( 0 == libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) ) {
+        DEBUG( "hotplug not supported, polling for the device\n" );
+        return dfu_device_poll( vendor, product, bus_number, device_address,
+                                port, timeout, present_ok );
+    }
+
+    wait.bus_number = bus_number;
+    wait.device_address = device_address;
+    wait.port = port;
+    wait.arrived = 0;
+
+    result = libusb_hotplug_register_callback( usbcontext,
+                    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+                    ((true == present_ok) ? LIBUSB_HOTPLUG_ENUMERATE : 0),
+                    vendor, product, LIBUSB_HOTPLUG_MATCH_ANY,
+                    dfu_device_arrived, &wait, &callback );
+    if( LIBUSB_SUCCESS != result ) {
+        DEBUG( "Failed to register the hotplug callback: %d\n", result );
+        return dfu_device_poll( vendor, product, bus_number, device_address,
+                                port, timeout, present_ok );
+    }
+
+    deadline = dfu_time_ms() + timeout;
+    result = 0;
+
+    while( 0 == wait.arrived ) {
+        struct timeval tv = { 0, DFU_WAIT_POLL_INTERVAL * 1000 };
+
+        if( 0 < timeout ) {
+            int64_t remaining = deadline - dfu_time_ms();
+
+            if( remaining <= 0 ) {
+                result = 1;
+                break;
+            }
+            if( remaining < DFU_WAIT_POLL_INTERVAL ) {
+                tv.tv_usec = remaining * 1000;
+            }
+        }
+
+        if( 0 != libusb_handle_events_timeout_completed(usbcontext, &tv,
+                                                         &wait.arrived) )
+        {
+            DEBUG( "Failed while handling usb events\n" );
+            result = -2;
+            break;
+        }
+    }
+
+    libusb_hotplug_deregister_callback( usbcontext, callback );
+
+    return result;
+#else
+    return dfu_device_poll( vendor, product, bus_number, device_address,
+                            port, timeout, present_ok );
+#endif
+}
+
+/*
+ *  Used after a device has been detached or reset while claiming it, to
+ *  let it enumerate again before the bus is scanned.  A reset may well
+ *  have finished re-enumerating the device by the time it returns, so a
+ *  device which is already attached ends the wait straight away; only
+ *  otherwise is there an arrival to wait for.
+ *
+ *  vendor  - the vender number of the device
+ *  product - the product number of the device
+ *  port    - the port the device must be attached to, or NULL
+ */
+static void dfu_device_reenumerate_wait( const uint32_t vendor,
+                                         const uint32_t product,
+                                         const dfu_port_t *port )
+{
+    if( true == dfu_device_present(vendor, product, 0, 0, port) ) {
+        return;
+    }
+
+    /* It may turn up between the scan and the wait, so take one which is
+     * attached by then as well. */
+    dfu_device_wait( vendor, product, 0, 0, port,
+                     DFU_REENUMERATE_TIMEOUT, true );
+}
+
+
 /*
  *  Used to convert the DFU state to a string.
  *
@@ -67,6 +67,9 @@
 #define DFU_STATUS_ERROR_UNKNOWN        0x0e
 #define DFU_STATUS_ERROR_STALLEDPKT     0x0f
 
+/* The most devices dfu_device_init_all will claim at once. */
+#define DFU_MAX_DEVICES                 128
+
 
 /* This is based off of DFU_GETSTATUS
  *
@@ -100,10 +103,28 @@ struct usb_device
                                        const uint32_t product,
                                        const uint32_t bus,
                                        const uint32_t dev_addr,
+                                       const dfu_port_t *port,
                                        dfu_device_t *device,
                                        const dfu_bool initial_abort,
                                        const dfu_bool honor_interfaceclass );
 
+size_t dfu_device_init_all( const uint32_t vendor,
+                            const uint32_t product,
+                            const dfu_location_t *locations,
+                            const size_t location_count,
+                            dfu_device_t *devices,
+                            const size_t max_devices,
+                            const dfu_bool initial_abort,
+                            const dfu_bool honor_interfaceclass );
+
+int32_t dfu_device_wait( const uint32_t vendor,
+                         const uint32_t product,
+                         const uint32_t bus_number,
+                         const uint32_t device_address,
+                         const dfu_port_t *port,
+                         const int32_t timeout,
+                         const dfu_bool present_ok );
+
 char* dfu_status_to_string( const int32_t status );
 char* dfu_state_to_string( const int32_t state );
 #endif
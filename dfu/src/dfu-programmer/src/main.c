@@ -22,6 +22,7 @@
 # include <config.h>
 #endif
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #ifdef HAVE_LIBUSB_1_0
 #include <libusb.h>
@@ -35,6 +36,7 @@
 #include "atmel.h"
 #include "arguments.h"
 #include "commands.h"
+#include "daemon.h"
 
 
 int debug;
@@ -42,9 +44,138 @@ int debug;
 libusb_context *usbcontext;
 #endif
 
+static const char *progname = PACKAGE;
+
+/*
+ *  Releases the DFU interface and closes the handle of a claimed device.
+ *
+ *  returns 0 on success, non-zero if the device could not be released
+ */
+static int32_t release_device( dfu_device_t *dfu_device,
+                               const enum commands_enum command )
+{
+    int32_t retval = 0;
+    int rv;
+
+    if( NULL == dfu_device->handle ) {
+        return 0;
+    }
+
+#ifdef HAVE_LIBUSB_1_0
+    rv = libusb_release_interface( dfu_device->handle, dfu_device->interface );
+#else
+    rv = usb_release_interface( dfu_device->handle, dfu_device->interface );
+#endif
+    /* The RESET command sometimes causes the usb_release_interface command to fail.
+       It is not obvious why this happens but it may be a glitch due to the hardware
+       reset in the attached device. In any event, since reset causes a USB detach
+       this should not matter, so there is no point in raising an alarm.
+    */
+    if( 0 != rv && com_reset != command ) {
+        fprintf( stderr, "%s: failed to release interface %d.\n",
+                         progname, dfu_device->interface );
+        retval = 1;
+    }
+
+#ifdef HAVE_LIBUSB_1_0
+    libusb_close(dfu_device->handle);
+#else
+    if( 0 != usb_close(dfu_device->handle) ) {
+        fprintf( stderr, "%s: failed to close the handle.\n", progname );
+        retval = 1;
+    }
+#endif
+    dfu_device->handle = NULL;
+
+    return retval;
+}
+
+/*
+ *  Runs the command on every matching device (--all) or on every device
+ *  in the list of bus/address pairs given with the target, then prints
+ *  a table with the result for each device.
+ *
+ *  returns 0 if the command succeeded on every device, 1 otherwise
+ */
+static int32_t execute_all( struct programmer_arguments *args )
+{
+    dfu_device_t *devices = NULL;
+    int32_t *results = NULL;
+    size_t max_devices = DFU_MAX_DEVICES;
+    size_t count, i;
+    int32_t failed;
+    int32_t retval = 1;
+
+    if( false == args->all_devices ) {
+        max_devices = args->location_count;
+    }
+
+    devices = (dfu_device_t *) calloc( max_devices, sizeof(dfu_device_t) );
+    results = (int32_t *) calloc( max_devices, sizeof(int32_t) );
+    if( (NULL == devices) || (NULL == results) ) {
+        fprintf( stderr, "%s: out of memory.\n", progname );
+        goto error;
+    }
+
+    count = dfu_device_init_all( args->vendor_id, args->chip_id,
+                                 ((true == args->all_devices) ? NULL : args->locations),
+                                 args->location_count,
+                                 devices, max_devices,
+                                 args->initial_abort,
+                                 args->honor_interfaceclass );
+
+    if( 0 == count ) {
+        fprintf( stderr, "%s: no device present.\n", progname );
+        goto error;
+    }
+
+    if( (false == args->all_devices) && (count != args->location_count) ) {
+        fprintf( stderr, "%s: only %lu of %lu devices present.\n", progname,
+                 (unsigned long) count, (unsigned long) args->location_count );
+    }
+
+    failed = execute_command_all( devices, count, args, results );
+    if( 0 <= failed ) {
+        fprintf( stdout, "%-12s %s\n", "device", "result" );
+        for( i = 0; i < count; i++ ) {
+            char location[16];
+
+            snprintf( location, sizeof(location), "USB:%d,%d",
+                      devices[i].bus_number, devices[i].device_address );
+            if( 0 == results[i] ) {
+                fprintf( stdout, "%-12s %s\n", location, "ok" );
+            } else {
+                fprintf( stdout, "%-12s %s (%d)\n", location, "failed", results[i] );
+            }
+        }
+        fflush( stdout );
+
+        if( (0 == failed)
+            && ((true == args->all_devices) || (count == args->location_count)) )
+        {
+            retval = 0;
+        }
+    }
+
+    for( i = 0; i < count; i++ ) {
+        if( 0 != release_device(&devices[i], args->command) ) {
+            retval = 1;
+        }
+    }
+
+error:
+    if( NULL != devices ) {
+        free( devices );
+    }
+    if( NULL != results ) {
+        free( results );
+    }
+
+    return retval;
+}
+
 int main( int argc, char **argv )
 {
-    static const char *progname = PACKAGE;
     int retval = 0;
     dfu_device_t dfu_device;
     struct programmer_arguments args;
@@ -54,14 +185,6 @@ int main( int argc, char **argv )
     struct usb_device *device = NULL;
 #endif
 
-#ifdef HAVE_LIBUSB_1_0
-    if (libusb_init(&usbcontext)) {
-        fprintf( stderr, "%s: can't init libusb.\n", progname );
-    }
-#else
-    usb_init();
-#endif
-
     memset( &args, 0, sizeof(args) );
     memset( &dfu_device, 0, sizeof(dfu_device) );
     if( 0 != parse_arguments(&args, argc, argv) ) {
@@ -74,6 +197,29 @@ int main( int argc, char **argv )
         return 0;
     }
 
+    /* libusb is only started once the arguments are known to be good,
+     * and then scans the bus when first asked for a device, looking only
+     * at the target's devices.  The daemon serves any target. */
+#ifdef HAVE_LIBUSB_1_0
+#if defined(LIBUSBX_API_VERSION) && (LIBUSBX_API_VERSION >= 0x01000108)
+    if( com_daemon == args.command ) {
+        retval = libusb_init_lazy( &usbcontext, -1, -1 );
+    } else {
+        retval = libusb_init_lazy( &usbcontext, args.vendor_id, args.chip_id );
+    }
+#else
+    retval = libusb_init( &usbcontext );
+#endif
+    if( 0 != retval ) {
+        fprintf( stderr, "%s: can't init libusb.\n", progname );
+        usbcontext = NULL;
+        retval = 1;
+        goto error;
+    }
+#else
+    usb_init();
+#endif
+
     if( debug >= 200 ) {
 #ifdef HAVE_LIBUSB_1_0
         libusb_set_debug(usbcontext, debug );
@@ -82,9 +228,41 @@ int main( int argc, char **argv )
 #endif
     }
 
+    if( com_daemon == args.command ) {
+#ifdef HAVE_LIBUSB_1_0
+        /* The daemon is no use without a usb context to share. */
+        if( NULL == usbcontext ) {
+            retval = 1;
+            goto error;
+        }
+#endif
+        retval = daemon_run( args.daemon_socket );
+        goto error;
+    }
+
+    if( true == args.wait ) {
+        /* With several devices given, wait for the first of them;
+         * with --all any matching device will do. */
+        int32_t result = dfu_device_wait( args.vendor_id, args.chip_id,
+                                          ((true == args.all_devices) ? 0 : args.bus_id),
+                                          args.device_address, &args.port,
+                                          args.wait_timeout * 1000, true );
+        if( 0 != result ) {
+            fprintf( stderr, "%s: %s waiting for the device.\n", progname,
+                     ((1 == result) ? "timed out" : "error") );
+            retval = 1;
+            goto error;
+        }
+    }
+
+    if( (true == args.all_devices) || (1 < args.location_count) ) {
+        retval = execute_all( &args );
+        goto error;
+    }
+
     device = dfu_device_init( args.vendor_id, args.chip_id,
                               args.bus_id, args.device_address,
-                              &dfu_device,
+                              &args.port, &dfu_device,
                               args.initial_abort,
                               args.honor_interfaceclass );
 
@@ -103,39 +281,14 @@ int main( int argc, char **argv )
     retval = 0;
 
 error:
-    if( NULL != dfu_device.handle ) {
-        int rv;
-
-#ifdef HAVE_LIBUSB_1_0
-        rv = libusb_release_interface( dfu_device.handle, dfu_device.interface );
-#else
-        rv = usb_release_interface( dfu_device.handle, dfu_device.interface );
-#endif
-        /* The RESET command sometimes causes the usb_release_interface command to fail.
-           It is not obvious why this happens but it may be a glitch due to the hardware
-           reset in the attached device. In any event, since reset causes a USB detach
-           this should not matter, so there is no point in raising an alarm.
-        */
-        if( 0 != rv && com_reset != args.command ) {
-            fprintf( stderr, "%s: failed to release interface %d.\n",
-                             progname, dfu_device.interface );
-            retval = 1;
-        }
+    if( 0 != release_device(&dfu_device, args.command) ) {
+        retval = 1;
     }
 
-    if( NULL != dfu_device.handle ) {
 #ifdef HAVE_LIBUSB_1_0
-        libusb_close(dfu_device.handle);
-#else
-        if( 0 != usb_close(dfu_device.handle) ) {
-            fprintf( stderr, "%s: failed to close the handle.\n", progname );
-            retval = 1;
-        }
-#endif
+    if( NULL != usbcontext ) {
+        libusb_exit(usbcontext);
     }
-
-#ifdef HAVE_LIBUSB_1_0
-    libusb_exit(usbcontext);
 #endif
 
     return retval;
@@ -58,6 +58,26 @@ enum usbi_log_level {
 
 API_EXPORTED struct usb_bus *usb_busses = NULL;
 
+/* the busses in usb_busses, indexed by bus number */
+static struct usb_bus *bus_table[256];
+
+/* Devices found by usb_find_devices() are kept between calls in a hash
+ * table keyed by their libusb-1.0 device, so that a rescan looks each listed
+ * device up once instead of comparing it with every known device, and only
+ * copies the descriptors of new devices. We hold a reference on each
+ * libusb_device in the table, so its address can't be reused by another
+ * device while it is there. */
+#define DEVICE_TABLE_BUCKETS 256
+
+struct compat_device {
+	struct usb_device dev;	/* must be first, it is what applications see */
+	struct compat_device *hash_next;
+	unsigned int generation;	/* scan in which it was last listed */
+};
+
+static struct compat_device *device_table[DEVICE_TABLE_BUCKETS];
+static unsigned int scan_generation = 0;
+
 #define compat_err(e) -(errno=libusb_to_errno(e))
 
 static int libusb_to_errno(int result)
@@ -178,81 +198,35 @@ API_EXPORTED char *usb_strerror(void)
 	return strerror(errno);
 }
 
-static int find_busses(struct usb_bus **ret)
+/* mark the bus numbers which have devices on them */
+static int find_busses(unsigned char *present)
 {
 	libusb_device **dev_list = NULL;
-	struct usb_bus *busses = NULL;
-	struct usb_bus *bus;
-	int dev_list_len = 0;
+	int dev_list_len;
 	int i;
-	int r;
-
-	r = libusb_get_device_list(ctx, &dev_list);
-	if (r < 0) {
-		usbi_err("get_device_list failed with error %d", r);
-		return compat_err(r);
-	}
 
-	if (r == 0) {
-		libusb_free_device_list(dev_list, 1);
-		/* no buses */
-		return 0;
+	dev_list_len = libusb_get_device_list(ctx, &dev_list);
+	if (dev_list_len < 0) {
+		usbi_err("get_device_list failed with error %d", dev_list_len);
+		return compat_err(dev_list_len);
 	}
 
-	/* iterate over the device list, identifying the individual busses.
-	 * we use the location field of the usb_bus structure to store the
-	 * bus number. */
-
-	dev_list_len = r;
-	for (i = 0; i < dev_list_len; i++) {
-		libusb_device *dev = dev_list[i];
-		uint8_t bus_num = libusb_get_bus_number(dev);
-
-		/* if we already know about it, continue */
-		if (busses) {
-			bus = busses;
-			int found = 0;
-			do {
-				if (bus_num == bus->location) {
-					found = 1;
-					break;
-				}
-			} while ((bus = bus->next) != NULL);
-			if (found)
-				continue;
-		}
-
-		/* add it to the list of busses */
-		bus = malloc(sizeof(*bus));
-		if (!bus)
-			goto err;
-
-		memset(bus, 0, sizeof(*bus));
-		bus->location = bus_num;
-		sprintf(bus->dirname, "%03d", bus_num);
-		LIST_ADD(busses, bus);
-	}
+	for (i = 0; i < dev_list_len; i++)
+		present[libusb_get_bus_number(dev_list[i])] = 1;
 
 	libusb_free_device_list(dev_list, 1);
-	*ret = busses;
 	return 0;
-
-err:
-	bus = busses;
-	while (bus) {
-		struct usb_bus *tbus = bus->next;
-		free(bus);
-		bus = tbus;
-	}
-	return -ENOMEM;
 }
 
+static void remove_device(struct usb_device *dev);
+
 API_EXPORTED int usb_find_busses(void)
 {
-	struct usb_bus *new_busses = NULL;
+	unsigned char present[256];
 	struct usb_bus *bus;
 	int changes = 0;
 	int r;
+	int i;
 
 	/* libusb-1.0 initialization might have failed, but we can't indicate
 	 * this with libusb-0.1, so trap that situation here */
@@ -260,101 +234,53 @@ API_EXPORTED int usb_find_busses(void)
 		return 0;
 	
 	usbi_dbg("");
-	r = find_busses(&new_busses);
+	memset(present, 0, sizeof(present));
+	r = find_busses(present);
 	if (r < 0) {
 		usbi_err("find_busses failed with error %d", r);
 		return r;
 	}
 
-	/* walk through all busses we already know about, removing duplicates
-	 * from the new list. if we do not find it in the new list, the bus
-	 * has been removed. */
-
+	/* a bus we already know about which has no devices listed any more has
+	 * been removed, and its devices with it */
 	bus = usb_busses;
 	while (bus) {
 		struct usb_bus *tbus = bus->next;
-		struct usb_bus *nbus = new_busses;
-		int found = 0;
-		usbi_dbg("in loop");
-
-		while (nbus) {
-			struct usb_bus *tnbus = nbus->next;
-
-			if (bus->location == nbus->location) {
-				LIST_DEL(new_busses, nbus);
-				free(nbus);
-				found = 1;
-				break;
-			}
-			nbus = tnbus;
-		}
 
-		if (!found) {
-			/* bus removed */
+		if (!present[bus->location]) {
 			usbi_dbg("bus %d removed", bus->location);
-			changes++;
+			while (bus->devices)
+				remove_device(bus->devices);
+			bus_table[bus->location] = NULL;
 			LIST_DEL(usb_busses, bus);
 			free(bus);
+			changes++;
 		}
 
 		bus = tbus;
 	}
 
-	/* anything remaining in new_busses is a new bus */
-	bus = new_busses;
-	while (bus) {
-		struct usb_bus *tbus = bus->next;
+	/* any other bus with devices is a new bus */
+	for (i = 0; i < 256; i++) {
+		if (!present[i] || bus_table[i])
+			continue;
+
+		bus = malloc(sizeof(*bus));
+		if (!bus)
+			return -ENOMEM;
+
+		memset(bus, 0, sizeof(*bus));
+		bus->location = i;
+		sprintf(bus->dirname, "%03d", i);
 		usbi_dbg("bus %d added", bus->location);
-		LIST_DEL(new_busses, bus);
 		LIST_ADD(usb_busses, bus);
+		bus_table[i] = bus;
 		changes++;
-		bus = tbus;
 	}
 
 	return changes;
 }
 
-static int find_devices(libusb_device **dev_list, int dev_list_len,
-	struct usb_bus *bus, struct usb_device **ret)
-{
-	struct usb_device *devices = NULL;
-	struct usb_device *dev;
-	int i;
-
-	for (i = 0; i < dev_list_len; i++) {
-		libusb_device *newlib_dev = dev_list[i];
-		uint8_t bus_num = libusb_get_bus_number(newlib_dev);
-
-		if (bus_num != bus->location)
-			continue;
-
-		dev = malloc(sizeof(*dev));
-		if (!dev)
-			goto err;
-
-		/* No need to reference the device now, just take the pointer. We
-		 * increase the reference count later if we keep the device. */
-		dev->dev = newlib_dev;
-
-		dev->bus = bus;
-		dev->devnum = libusb_get_device_address(newlib_dev);
-		sprintf(dev->filename, "%03d", dev->devnum);
-		LIST_ADD(devices, dev);
-	}
-
-	*ret = devices;
-	return 0;
-
-err:
-	dev = devices;
-	while (dev) {
-		struct usb_device *tdev = dev->next;
-		free(dev);
-		dev = tdev;
-	}
-	return -ENOMEM;
-}
-
 static void clear_endpoint_descriptor(struct usb_endpoint_descriptor *ep)
 {
 	if (ep->extra)
@@ -568,16 +494,51 @@ static int initialize_device(struct usb_device *dev)
 static void free_device(struct usb_device *dev)
 {
 	clear_device(dev);
+	free(dev->config);
 	libusb_unref_device(dev->dev);
 	free(dev);
 }
 
+static unsigned int device_hash(libusb_device *newlib_dev)
+{
+	uintptr_t v = (uintptr_t) newlib_dev;
+
+	return (v >> 4 ^ v >> 12) & (DEVICE_TABLE_BUCKETS - 1);
+}
+
+static struct compat_device *device_table_find(libusb_device *newlib_dev)
+{
+	struct compat_device *cdev;
+
+	for (cdev = device_table[device_hash(newlib_dev)]; cdev;
+	     cdev = cdev->hash_next)
+		if (cdev->dev.dev == newlib_dev)
+			return cdev;
+	return NULL;
+}
+
+/* take a device off its bus and out of the device table, and free it */
+static void remove_device(struct usb_device *dev)
+{
+	struct compat_device **link = &device_table[device_hash(dev->dev)];
+
+	while (*link != (struct compat_device *) dev)
+		link = &(*link)->hash_next;
+	*link = (*link)->hash_next;
+
+	LIST_DEL(dev->bus->devices, dev);
+	free_device(dev);
+}
+
 API_EXPORTED int usb_find_devices(void)
 {
 	struct usb_bus *bus;
+	struct usb_device *dev;
+	struct compat_device *cdev;
 	libusb_device **dev_list;
 	int dev_list_len;
 	int r;
+	int i;
 	int changes = 0;
 
 	/* libusb-1.0 initialization might have failed, but we can't indicate
@@ -590,63 +551,70 @@ API_EXPORTED int usb_find_devices(void)
 	if (dev_list_len < 0)
 		return compat_err(dev_list_len);
 
-	for (bus = usb_busses; bus; bus = bus->next) {
-		struct usb_device *new_devices = NULL;
-		struct usb_device *dev;
+	/* mark the devices we already know about as still there, and add the
+	 * new ones. devices on a bus usb_find_busses() has not found yet are
+	 * left for later. */
+	scan_generation++;
+	for (i = 0; i < dev_list_len; i++) {
+		libusb_device *newlib_dev = dev_list[i];
+		unsigned int h;
 
-		r = find_devices(dev_list, dev_list_len, bus, &new_devices);
-		if (r < 0) {
+		bus = bus_table[libusb_get_bus_number(newlib_dev)];
+		if (!bus)
+			continue;
+
+		cdev = device_table_find(newlib_dev);
+		if (cdev) {
+			cdev->generation = scan_generation;
+			continue;
+		}
+
+		cdev = malloc(sizeof(*cdev));
+		if (!cdev) {
+			/* without the full list we can't tell what was removed */
 			libusb_free_device_list(dev_list, 1);
-			return r;
+			return -ENOMEM;
+		}
+		memset(cdev, 0, sizeof(*cdev));
+
+		dev = &cdev->dev;
+		dev->dev = newlib_dev;
+		dev->bus = bus;
+		dev->devnum = libusb_get_device_address(newlib_dev);
+		sprintf(dev->filename, "%03d", dev->devnum);
+
+		r = initialize_device(dev);
+		if (r < 0) {
+			usbi_err("couldn't initialize device %d.%d (error %d)",
+				bus->location, dev->devnum, r);
+			free(cdev);
+			continue;
 		}
 
-		/* walk through the devices we already know about, removing duplicates
-		 * from the new list. if we do not find it in the new list, the device
-		 * has been removed. */
+		usbi_dbg("device %d.%d added", bus->location, dev->devnum);
+		cdev->generation = scan_generation;
+		h = device_hash(newlib_dev);
+		cdev->hash_next = device_table[h];
+		device_table[h] = cdev;
+		LIST_ADD(bus->devices, dev);
+		changes++;
+	}
+
+	/* a device we know about which was not listed has been removed */
+	for (bus = usb_busses; bus; bus = bus->next) {
 		dev = bus->devices;
 		while (dev) {
-			int found = 0;
 			struct usb_device *tdev = dev->next;
-			struct usb_device *ndev = new_devices;
-
-			while (ndev) {
-				if (ndev->devnum == dev->devnum) {
-					LIST_DEL(new_devices, ndev);
-					free(ndev);
-					found = 1;
-					break;
-				}
-				ndev = ndev->next;
-			}
 
-			if (!found) {
+			if (((struct compat_device *) dev)->generation != scan_generation) {
 				usbi_dbg("device %d.%d removed",
 					dev->bus->location, dev->devnum);
-				LIST_DEL(bus->devices, dev);
-				free_device(dev);
+				remove_device(dev);
 				changes++;
 			}
 
 			dev = tdev;
 		}
-
-		/* anything left in new_devices is a new device */
-		dev = new_devices;
-		while (dev) {
-			struct usb_device *tdev = dev->next;
-			r = initialize_device(dev);	
-			if (r < 0) {
-				usbi_err("couldn't initialize device %d.%d (error %d)",
-					dev->bus->location, dev->devnum, r);
-				dev = tdev;
-				continue;
-			}
-			usbi_dbg("device %d.%d added", dev->bus->location, dev->devnum);
-			LIST_DEL(new_devices, dev);
-			LIST_ADD(bus->devices, dev);
-			changes++;
-			dev = tdev;
-		}
 	}
 
 	libusb_free_device_list(dev_list, 1);
@@ -845,6 +813,13 @@ API_EXPORTED int usb_interrupt_write(usb_dev_handle *dev, int ep, const char *by
 	return usb_interrupt_io(dev, ep, (char *)bytes, size, timeout);
 }
 
+/* Requests with at most this much data are built in place in a buffer on
+ * the stack and sent with libusb_control_transfer_inplace(), without any
+ * allocation or taking the handle lock. Longer ones go through
+ * libusb_control_transfer(), which reuses buffers kept on each handle.
+ * Either way the data is copied once, as for a native libusb-1.0 caller. */
+#define CONTROL_STACK_LENGTH 256
+
 API_EXPORTED int usb_control_msg(usb_dev_handle *dev, int bmRequestType,
 	int bRequest, int wValue, int wIndex, char *bytes, int size, int timeout)
 {
@@ -852,6 +827,27 @@ API_EXPORTED int usb_control_msg(usb_dev_handle *dev, int bmRequestType,
 	usbi_dbg("RQT=%x RQ=%x V=%x I=%x len=%d timeout=%d", bmRequestType,
 		bRequest, wValue, wIndex, size, timeout);
 
+#if defined(LIBUSBX_API_VERSION) && (LIBUSBX_API_VERSION >= 0x0100010C)
+	if ((size & 0xffff) <= CONTROL_STACK_LENGTH) {
+		unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + CONTROL_STACK_LENGTH];
+		int in = bmRequestType & LIBUSB_ENDPOINT_IN;
+
+		size &= 0xffff;
+		libusb_fill_control_setup(buffer, bmRequestType & 0xff,
+			bRequest & 0xff, wValue & 0xffff, wIndex & 0xffff, size);
+		if (!in && size)
+			memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, bytes, size);
+
+		r = libusb_control_transfer_inplace(dev->handle, buffer, timeout);
+		if (in && r > 0)
+			memcpy(bytes, buffer + LIBUSB_CONTROL_SETUP_SIZE, r);
+
+		if (r >= 0)
+			return r;
+		return compat_err(r);
+	}
+#endif
+
 	r = libusb_control_transfer(dev->handle, bmRequestType & 0xff,
 		bRequest & 0xff, wValue & 0xffff, wIndex & 0xffff, bytes, size & 0xffff,
 		timeout);
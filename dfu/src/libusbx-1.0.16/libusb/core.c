@@ -33,6 +33,7 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#include <time.h>
 
 #ifdef __ANDROID__
 #include <android/log.h>
@@ -159,6 +160,15 @@ struct list_head active_contexts_list;
  * always logged. libusb_set_debug() and the LIBUSB_DEBUG environment variable
  * have no effects.
  *
+ * \section urbtrace URB tracing
+ *
+ * On Linux, the LIBUSB_TRACE environment variable can be set to the name of
+ * a file to record the URBs submitted to and reaped from usbfs, with a prefix
+ * of their data, in a ring of the most recent events. The ring is written to
+ * the file as a pcap capture with the usbmon link type when the last context
+ * exits or the program exits, or on request with libusb_dump_trace(), so
+ * that a trace can be taken without the privileges usbmon needs.
+ *
  * \section remarks Other remarks
  *
  * libusbx does have imperfections. The \ref caveats "caveats" page attempts
@@ -518,6 +528,7 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	dev->refcnt = 1;
 	dev->session_data = session_id;
 	dev->speed = LIBUSB_SPEED_UNKNOWN;
+	list_init(&dev->handles);
 
 	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		usbi_connect_device (dev);
@@ -526,6 +537,15 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	return dev;
 }
 
+static struct list_head *session_bucket(struct libusb_context *ctx,
+	unsigned long session_id)
+{
+	/* fold the upper bits in, backends put the bus number there */
+	session_id ^= session_id >> 8;
+	session_id ^= session_id >> 16;
+	return &ctx->usb_devs_by_session[session_id & (USBI_SESSION_HASH_SIZE - 1)];
+}
+
 void usbi_connect_device(struct libusb_device *dev)
 {
 	libusb_hotplug_message message;
@@ -538,6 +558,7 @@ void usbi_connect_device(struct libusb_device *dev)
 
 	usbi_mutex_lock(&dev->ctx->usb_devs_lock);
 	list_add(&dev->list, &dev->ctx->usb_devs);
+	list_add(&dev->session_list, session_bucket(dev->ctx, dev->session_data));
 	usbi_mutex_unlock(&dev->ctx->usb_devs_lock);
 
 	/* Signal that an event has occurred for this device if we support hotplug AND
@@ -577,6 +598,7 @@ void usbi_disconnect_device(struct libusb_device *dev)
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_del(&dev->list);
+	list_del(&dev->session_list);
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
 }
 
@@ -603,9 +625,43 @@ int usbi_sanitize_device(struct libusb_device *dev)
 	return 0;
 }
 
-/* Examine libusbx's internal list of known devices, looking for one with
- * a specific session ID. Returns the matching device if it was found, and
- * NULL otherwise. */
+/* Check a sanitized device against the vendor and product ID filter of its
+ * context, see libusb_init_lazy(). Returns 1 if the context wants it.
+ * Devices which do not match are kept in the context, as the parents of
+ * those which do, but are left out of device lists and hotplug events. */
+int usbi_device_filter_match(struct libusb_device *dev)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+
+	if (ctx->filter_vendor_id != -1 &&
+	    ctx->filter_vendor_id != dev->device_descriptor.idVendor)
+		return 0;
+	if (ctx->filter_product_id != -1 &&
+	    ctx->filter_product_id != dev->device_descriptor.idProduct)
+		return 0;
+	return 1;
+}
+
+/* Run the device scan which libusb_init_lazy() deferred, if it has not
+ * been run yet. A failed scan is tried again next time. */
+int usbi_scan_deferred_devices(struct libusb_context *ctx)
+{
+	int r = 0;
+
+	usbi_mutex_lock(&ctx->scan_lock);
+	if (ctx->scan_pending) {
+		usbi_dbg("running deferred device scan");
+		r = usbi_backend->scan_devices(ctx);
+		if (r == 0)
+			ctx->scan_pending = 0;
+	}
+	usbi_mutex_unlock(&ctx->scan_lock);
+
+	return r;
+}
+
+/* Look up a device with a specific session ID in libusbx's index of known
+ * devices. Returns the matching device if it was found, and NULL otherwise. */
 struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	unsigned long session_id)
 {
@@ -613,7 +669,7 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	struct libusb_device *ret = NULL;
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
-	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device)
+	list_for_each_entry(dev, session_bucket(ctx, session_id), session_list, struct libusb_device)
 		if (dev->session_data == session_id) {
 			ret = dev;
 			break;
@@ -656,6 +712,12 @@ ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
 	if (!discdevs)
 		return LIBUSB_ERROR_NO_MEM;
 
+	r = usbi_scan_deferred_devices(ctx);
+	if (r < 0) {
+		len = r;
+		goto out;
+	}
+
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		/* backend provides hotplug support */
 		struct libusb_device *dev;
@@ -683,19 +745,21 @@ ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
 		goto out;
 	}
 
-	/* convert discovered_devs into a list */
-	len = discdevs->len;
-	ret = calloc(len + 1, sizeof(struct libusb_device *));
+	/* convert discovered_devs into a list, leaving out the devices which
+	 * the context does not want */
+	ret = calloc(discdevs->len + 1, sizeof(struct libusb_device *));
 	if (!ret) {
 		len = LIBUSB_ERROR_NO_MEM;
 		goto out;
 	}
 
-	ret[len] = NULL;
-	for (i = 0; i < len; i++) {
+	len = 0;
+	for (i = 0; i < (ssize_t) discdevs->len; i++) {
 		struct libusb_device *dev = discdevs->devices[i];
-		ret[i] = libusb_ref_device(dev);
+		if (usbi_device_filter_match(dev))
+			ret[len++] = libusb_ref_device(dev);
 	}
+	ret[len] = NULL;
 	*list = ret;
 
 out:
@@ -1002,6 +1066,7 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 			usbi_disconnect_device(dev);
 		}
 
+		usbi_device_clear_config_cache(dev);
 		usbi_mutex_destroy(&dev->lock);
 		free(dev);
 	}
@@ -1096,6 +1161,9 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 	_handle->dev = libusb_ref_device(dev);
 	_handle->auto_detach_kernel_driver = 0;
 	_handle->claimed_interfaces = 0;
+	_handle->string_cache = NULL;
+	_handle->num_control_buffers = 0;
+	memset(&_handle->stats, 0, sizeof(_handle->stats));
 	memset(&_handle->os_priv, 0, priv_size);
 
 	r = usbi_backend->open(_handle);
@@ -1109,6 +1177,7 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_add(&_handle->list, &ctx->open_devs);
+	list_add(&_handle->dev_list, &dev->handles);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 	*handle = _handle;
 
@@ -1225,14 +1294,78 @@ static void do_close(struct libusb_context *ctx,
 
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_del(&dev_handle->list);
+	list_del(&dev_handle->dev_list);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 
 	usbi_backend->close(dev_handle);
+	usbi_handle_clear_string_cache(dev_handle);
+	usbi_handle_clear_control_buffers(dev_handle);
 	libusb_unref_device(dev_handle->dev);
 	usbi_mutex_destroy(&dev_handle->lock);
 	free(dev_handle);
 }
 
+/** \ingroup dev
+ * Allocate memory for the data of transfers on a device. Where the operating
+ * system supports it (Linux 4.6 and newer) the memory is mapped from the
+ * kernel's USB device node, and transfers using it do not have their data
+ * copied between user and kernel space. Elsewhere, or if the mapping fails,
+ * ordinary memory is returned, so the result can always be used.
+ *
+ * The memory must be released with libusb_dev_mem_free() before the handle
+ * is closed. Transfers using it are submitted as usual, and a transfer may
+ * use any part of the block. A transfer whose buffer is the start of the
+ * block may instead release it with
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
+ * "LIBUSB_TRANSFER_FREE_BUFFER"; one whose buffer points further into it
+ * must not have that flag set.
+ *
+ * Since \ref LIBUSBX_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle the device the memory will be used with
+ * \param length size of the block in bytes
+ * \returns the block, or NULL if no memory could be allocated
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(
+	libusb_device_handle *dev_handle, size_t length)
+{
+	unsigned char *buffer = NULL;
+
+	if (usbi_backend->dev_mem_alloc)
+		buffer = usbi_backend->dev_mem_alloc(dev_handle, length);
+	if (!buffer)
+		buffer = malloc(length);
+	return buffer;
+}
+
+/** \ingroup dev
+ * Release memory obtained from libusb_dev_mem_alloc().
+ *
+ * Since \ref LIBUSBX_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle the device the memory was allocated for
+ * \param buffer the block
+ * \param length the size it was allocated with
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_dev_mem_free(libusb_device_handle *dev_handle,
+	unsigned char *buffer, size_t length)
+{
+	int r;
+
+	if (!buffer)
+		return 0;
+
+	if (usbi_backend->dev_mem_free) {
+		r = usbi_backend->dev_mem_free(dev_handle, buffer, length);
+		if (r != LIBUSB_ERROR_NOT_FOUND)
+			return r;
+	}
+	free(buffer);
+	return 0;
+}
+
 /** \ingroup dev
  * Close a device handle. Should be called on all open handles before your
  * application exits.
@@ -1607,6 +1740,8 @@ int API_EXPORTED libusb_reset_device(libusb_device_handle *dev)
 	if (!dev->dev->attached)
 		return LIBUSB_ERROR_NO_DEVICE;
 
+	/* the device may come back with different strings */
+	usbi_handle_clear_string_cache(dev);
 	return usbi_backend->reset_device(dev);
 }
 
@@ -1774,26 +1909,16 @@ void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
 		ctx->debug = level;
 }
 
-/** \ingroup lib
- * Initialize libusb. This function must be called before calling any other
- * libusbx function.
- *
- * If you do not provide an output location for a context pointer, a default
- * context will be created. If there was already a default context, it will
- * be reused (and nothing will be initialized/reinitialized).
- *
- * \param context Optional output location for context pointer.
- * Only valid on return code 0.
- * \returns 0 on success, or a LIBUSB_ERROR code on failure
- * \see contexts
- */
-int API_EXPORTED libusb_init(libusb_context **context)
+/* the body of libusb_init() and libusb_init_lazy() */
+static int init_context(libusb_context **context, int lazy, int vendor_id,
+	int product_id)
 {
 	struct libusb_device *dev, *next;
 	char *dbg = getenv("LIBUSB_DEBUG");
 	struct libusb_context *ctx;
 	static int first_init = 1;
 	int r = 0;
+	int i;
 
 	usbi_mutex_static_lock(&default_context_lock);
 
@@ -1837,9 +1962,18 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	usbi_mutex_init(&ctx->usb_devs_lock, NULL);
 	usbi_mutex_init(&ctx->open_devs_lock, NULL);
 	usbi_mutex_init(&ctx->hotplug_cbs_lock, NULL);
+	usbi_mutex_init(&ctx->scan_lock, NULL);
+	ctx->scan_pending = lazy && usbi_backend->scan_devices != NULL;
+	ctx->filter_vendor_id = vendor_id;
+	ctx->filter_product_id = product_id;
 	list_init(&ctx->usb_devs);
+	for (i = 0; i < USBI_SESSION_HASH_SIZE; i++)
+		list_init(&ctx->usb_devs_by_session[i]);
 	list_init(&ctx->open_devs);
 	list_init(&ctx->hotplug_cbs);
+	for (i = 0; i < USBI_HOTPLUG_HASH_SIZE; i++)
+		list_init(&ctx->hotplug_cbs_by_id[i]);
+	list_init(&ctx->hotplug_cbs_wildcard);
 
 	usbi_mutex_static_lock(&active_contexts_lock);
 	if (first_init) {
@@ -1859,6 +1993,7 @@ int API_EXPORTED libusb_init(libusb_context **context)
 	if (r < 0)
 		goto err_backend_exit;
 
+	usbi_transfer_cache_ref();
 	usbi_mutex_static_unlock(&default_context_lock);
 
 	if (context)
@@ -1870,12 +2005,15 @@ err_backend_exit:
 	if (usbi_backend->exit)
 		usbi_backend->exit();
 err_free_ctx:
-	if (ctx == usbi_default_context)
+	if (ctx == usbi_default_context) {
 		usbi_default_context = NULL;
+		default_context_refcnt--;
+	}
 
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 	usbi_mutex_destroy(&ctx->hotplug_cbs_lock);
+	usbi_mutex_destroy(&ctx->scan_lock);
 
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_del (&ctx->list);
@@ -1884,6 +2022,7 @@ err_free_ctx:
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_for_each_entry_safe(dev, next, &ctx->usb_devs, list, struct libusb_device) {
 		list_del(&dev->list);
+		list_del(&dev->session_list);
 		libusb_unref_device(dev);
 	}
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
@@ -1894,6 +2033,57 @@ err_unlock:
 	return r;
 }
 
+/** \ingroup lib
+ * Initialize libusb. This function must be called before calling any other
+ * libusbx function.
+ *
+ * If you do not provide an output location for a context pointer, a default
+ * context will be created. If there was already a default context, it will
+ * be reused (and nothing will be initialized/reinitialized).
+ *
+ * \param context Optional output location for context pointer.
+ * Only valid on return code 0.
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \see contexts
+ * \see libusb_init_lazy()
+ */
+int API_EXPORTED libusb_init(libusb_context **context)
+{
+	return init_context(context, 0, -1, -1);
+}
+
+/** \ingroup lib
+ * Initialize libusb without scanning for devices. This works like
+ * libusb_init(), except that the scan of the devices connected to the system
+ * is deferred until the context is first used to list devices (for example
+ * with libusb_get_device_list() or libusb_open_device_with_vid_pid()) or to
+ * register a hotplug callback. A program which may exit before it gets that
+ * far, e.g. because of bad arguments, then starts almost instantly.
+ *
+ * The context can also be limited to the devices with a given vendor and
+ * product ID, in which case no others are listed or reported to hotplug
+ * callbacks. They are still scanned, so that libusb_get_parent() and
+ * libusb_get_port_numbers() work for the devices which are listed.
+ *
+ * Backends which cannot defer their scan do it during initialization, as
+ * libusb_init() does; the filter still applies.
+ *
+ * Since \ref LIBUSBX_API_VERSION >= 0x01000108
+ *
+ * \param context Optional output location for context pointer. If there was
+ * already a default context, it is reused with its existing settings.
+ * Only valid on return code 0.
+ * \param vendor_id the vendor ID of the devices to list, or -1 for any
+ * \param product_id the product ID of the devices to list, or -1 for any
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ * \see contexts
+ */
+int API_EXPORTED libusb_init_lazy(libusb_context **context, int vendor_id,
+	int product_id)
+{
+	return init_context(context, 1, vendor_id, product_id);
+}
+
 /** \ingroup lib
  * Deinitialize libusb. Should be called after closing all open devices and
  * before your application terminates.
@@ -1905,6 +2095,11 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 
 	usbi_dbg("");
 	USBI_GET_CONTEXT(ctx);
+	if (!ctx) {
+		/* e.g. libusb_init() failed, so there is nothing to undo */
+		usbi_dbg("no default context, not initialized?");
+		return;
+	}
 
 	/* if working with default context, only actually do the deinitialization
 	 * if we're the last user */
@@ -1929,6 +2124,7 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 		usbi_mutex_lock(&ctx->usb_devs_lock);
 		list_for_each_entry_safe(dev, next, &ctx->usb_devs, list, struct libusb_device) {
 			list_del(&dev->list);
+			list_del(&dev->session_list);
 			libusb_unref_device(dev);
 		}
 		usbi_mutex_unlock(&ctx->usb_devs_lock);
@@ -1948,7 +2144,11 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 	usbi_mutex_destroy(&ctx->hotplug_cbs_lock);
+	usbi_mutex_destroy(&ctx->scan_lock);
+	usbi_log_exit(ctx);
 	free(ctx);
+
+	usbi_transfer_cache_unref();
 }
 
 /** \ingroup misc
@@ -2026,24 +2226,306 @@ int usbi_gettimeofday(struct timeval *tp, void *tzp)
 }
 #endif
 
-static void usbi_log_str(struct libusb_context *ctx, const char * str)
+#if defined(ENABLE_LOGGING) && defined(THREADS_POSIX)
+#define USBI_LOG_ASYNC
+#include <sched.h>
+
+/* The log messages of a context with LIBUSB_LOG_SINK_ASYNC set are formatted
+ * straight into a slot of a bounded queue and written out by a background
+ * thread, so that logging costs the caller no I/O and takes no lock.
+ *
+ * Any thread may add to the queue. Each slot carries a sequence number which
+ * says whose turn it is: the slot for position pos is free for a producer
+ * when its seq is pos, holds a message for the writer when it is pos + 1,
+ * and is handed back for the next lap as pos + USBI_LOG_QUEUE_SIZE.
+ * Producers claim positions by moving enqueue_pos on with a compare-and-swap.
+ * A message for which there is no free slot is counted in ctx->log_dropped.
+ *
+ * The writer waits on cond when it finds the queue empty, after setting
+ * sleeping. A producer only takes the lock to signal it if sleeping is set
+ * after its message was published, so a busy writer costs producers
+ * nothing. */
+#define USBI_LOG_QUEUE_SIZE		256	/* must be a power of 2 */
+
+struct usbi_log_record {
+	volatile unsigned int seq;
+	enum libusb_log_level level;
+	char str[USBI_MAX_LOG_LEN];
+};
+
+struct usbi_log_queue {
+	struct usbi_log_record records[USBI_LOG_QUEUE_SIZE];
+	volatile unsigned int enqueue_pos;
+	unsigned int dequeue_pos;	/* only used by the writer */
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	volatile int sleeping;
+	volatile int stop;
+	pthread_t writer;
+};
+#endif
+
+/* Where the log messages of a context go, see libusb_set_log_sink(). A
+ * context without one logs to stderr. The sink is replaced as a whole, and
+ * the old one is only freed once no thread is logging through it. */
+struct usbi_log_sink {
+	struct libusb_context *ctx;
+	libusb_log_sink_cb cb;
+	void *user_data;
+#ifdef USBI_LOG_ASYNC
+	struct usbi_log_queue *queue;
+#endif
+};
+
+static usbi_mutex_static_t log_header_lock = USBI_MUTEX_INITIALIZER;
+
+/* Get the sink of a context for logging one message, which must be followed
+ * by log_sink_put(). ctx->log_users counts the threads in between, so that
+ * libusb_set_log_sink() can wait for them before freeing the old sink. */
+static struct usbi_log_sink *log_sink_get(struct libusb_context *ctx)
+{
+	if (!ctx)
+		return NULL;
+#ifdef USBI_LOG_ASYNC
+	__sync_fetch_and_add(&ctx->log_users, 1);
+#endif
+	return ctx->log_sink;
+}
+
+static void log_sink_put(struct libusb_context *ctx)
 {
+#ifdef USBI_LOG_ASYNC
+	if (ctx)
+		__sync_fetch_and_sub(&ctx->log_users, 1);
+#else
 	UNUSED(ctx);
-	fputs(str, stderr);
+#endif
+}
+
+static void usbi_log_str(struct usbi_log_sink *sink,
+	enum libusb_log_level level, const char * str)
+{
+	if (sink && sink->cb)
+		sink->cb(sink->ctx, level, str, sink->user_data);
+	else
+		fputs(str, stderr);
+}
+
+#ifdef USBI_LOG_ASYNC
+/* claim the next free slot of the queue, or return NULL if it is full. the
+ * slot must then be passed to log_queue_publish() with the position set */
+static struct usbi_log_record *log_queue_claim(struct libusb_context *ctx,
+	struct usbi_log_queue *queue, unsigned int *pos)
+{
+	struct usbi_log_record *record;
+	unsigned int p = queue->enqueue_pos;
+	int diff;
+
+	for (;;) {
+		record = &queue->records[p & (USBI_LOG_QUEUE_SIZE - 1)];
+		diff = (int)(record->seq - p);
+		if (diff == 0) {
+			if (__sync_bool_compare_and_swap(&queue->enqueue_pos, p, p + 1))
+				break;
+		} else if (diff < 0) {
+			/* a whole lap ahead of the writer */
+			__sync_fetch_and_add(&ctx->log_dropped, 1);
+			return NULL;
+		}
+		p = queue->enqueue_pos;
+	}
+
+	*pos = p;
+	return record;
+}
+
+static void log_queue_publish(struct usbi_log_queue *queue,
+	struct usbi_log_record *record, unsigned int pos)
+{
+	__sync_synchronize();
+	record->seq = pos + 1;
+	__sync_synchronize();
+
+	if (queue->sleeping) {
+		usbi_mutex_lock(&queue->lock);
+		usbi_cond_signal(&queue->cond);
+		usbi_mutex_unlock(&queue->lock);
+	}
+}
+
+/* whether the oldest message in the queue has been published */
+static int log_queue_pending(struct usbi_log_queue *queue)
+{
+	unsigned int pos = queue->dequeue_pos;
+
+	return (int)(queue->records[pos & (USBI_LOG_QUEUE_SIZE - 1)].seq -
+		(pos + 1)) >= 0;
+}
+
+/* write out the oldest message in the queue. returns 0 if it was empty */
+static int log_queue_write_one(struct usbi_log_sink *sink)
+{
+	struct usbi_log_queue *queue = sink->queue;
+	unsigned int pos = queue->dequeue_pos;
+	struct usbi_log_record *record =
+		&queue->records[pos & (USBI_LOG_QUEUE_SIZE - 1)];
+
+	if (!log_queue_pending(queue))
+		return 0;
+	__sync_synchronize();
+
+	usbi_log_str(sink, record->level, record->str);
+
+	__sync_synchronize();
+	record->seq = pos + USBI_LOG_QUEUE_SIZE;
+	queue->dequeue_pos = pos + 1;
+	return 1;
+}
+
+static void *log_writer_main(void *arg)
+{
+	struct usbi_log_sink *sink = arg;
+	struct usbi_log_queue *queue = sink->queue;
+	int stop;
+
+	usbi_mutex_lock(&queue->lock);
+	for (;;) {
+		/* messages queued before stop was set are still written */
+		stop = queue->stop;
+		usbi_mutex_unlock(&queue->lock);
+		while (log_queue_write_one(sink))
+			;
+		usbi_mutex_lock(&queue->lock);
+		if (stop)
+			break;
+
+		queue->sleeping = 1;
+		__sync_synchronize();
+		if (!queue->stop && !log_queue_pending(queue))
+			usbi_cond_wait(&queue->cond, &queue->lock);
+		queue->sleeping = 0;
+	}
+	usbi_mutex_unlock(&queue->lock);
+
+	return NULL;
+}
+
+static int log_queue_start(struct usbi_log_sink *sink)
+{
+	struct usbi_log_queue *queue;
+	unsigned int i;
+
+	queue = calloc(1, sizeof(*queue));
+	if (!queue)
+		return LIBUSB_ERROR_NO_MEM;
+	for (i = 0; i < USBI_LOG_QUEUE_SIZE; i++)
+		queue->records[i].seq = i;
+	usbi_mutex_init(&queue->lock, NULL);
+	usbi_cond_init(&queue->cond, NULL);
+
+	sink->queue = queue;
+	if (pthread_create(&queue->writer, NULL, log_writer_main, sink) != 0) {
+		sink->queue = NULL;
+		usbi_cond_destroy(&queue->cond);
+		usbi_mutex_destroy(&queue->lock);
+		free(queue);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+/* stop the background writer once it has written out everything queued */
+static void log_queue_stop(struct usbi_log_queue *queue)
+{
+	usbi_mutex_lock(&queue->lock);
+	queue->stop = 1;
+	usbi_cond_signal(&queue->cond);
+	usbi_mutex_unlock(&queue->lock);
+	pthread_join(queue->writer, NULL);
+
+	usbi_cond_destroy(&queue->cond);
+	usbi_mutex_destroy(&queue->lock);
+	free(queue);
+}
+#endif
+
+/* Replace the sink of a context, and free the old one once no thread is
+ * logging through it. */
+static void log_sink_replace(struct libusb_context *ctx,
+	struct usbi_log_sink *sink)
+{
+	struct usbi_log_sink *old;
+
+#ifdef USBI_LOG_ASYNC
+	old = __sync_lock_test_and_set(&ctx->log_sink, sink);
+	__sync_synchronize();
+	while (ctx->log_users)
+		sched_yield();
+#else
+	old = ctx->log_sink;
+	ctx->log_sink = sink;
+#endif
+
+	if (!old)
+		return;
+#ifdef USBI_LOG_ASYNC
+	if (old->queue)
+		log_queue_stop(old->queue);
+#endif
+	free(old);
+}
+
+/* Drop the log sink of a context which is being destroyed. */
+void usbi_log_exit(struct libusb_context *ctx)
+{
+	log_sink_replace(ctx, NULL);
+}
+
+/* hand a complete line to the sink of the context, through its queue if it
+ * has one */
+static void usbi_log_line(struct libusb_context *ctx,
+	enum libusb_log_level level, const char *str)
+{
+	struct usbi_log_sink *sink = log_sink_get(ctx);
+#ifdef USBI_LOG_ASYNC
+	struct usbi_log_record *record;
+	unsigned int pos;
+
+	if (sink && sink->queue) {
+		record = log_queue_claim(ctx, sink->queue, &pos);
+		if (record) {
+			record->level = level;
+			strncpy(record->str, str, sizeof(record->str) - 1);
+			record->str[sizeof(record->str) - 1] = '\0';
+			log_queue_publish(sink->queue, record, pos);
+		}
+		log_sink_put(ctx);
+		return;
+	}
+#endif
+	usbi_log_str(sink, level, str);
+	log_sink_put(ctx);
 }
 
 void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, va_list args)
 {
 	const char *prefix = "";
-	char buf[USBI_MAX_LOG_LEN];
+	char stack_buf[USBI_MAX_LOG_LEN];
+	char *buf = stack_buf;
 	struct timeval now;
+	struct usbi_log_sink *sink;
 	int global_debug, header_len, text_len;
-	static int has_debug_header_been_displayed = 0;
+	static volatile int has_debug_header_been_displayed = 0;
+#ifdef USBI_LOG_ASYNC
+	struct usbi_log_record *record = NULL;
+	unsigned int pos = 0;
+#endif
 
 #ifdef ENABLE_DEBUG_LOGGING
 	global_debug = 1;
-	UNUSED(ctx);
+	USBI_GET_CONTEXT(ctx);
 #else
 	USBI_GET_CONTEXT(ctx);
 	if (ctx == NULL)
@@ -2083,9 +2565,13 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 #else
 	usbi_gettimeofday(&now, NULL);
 	if ((global_debug) && (!has_debug_header_been_displayed)) {
-		has_debug_header_been_displayed = 1;
-		usbi_log_str(ctx, "[timestamp] [threadID] facility level [function call] <message>\n");
-		usbi_log_str(ctx, "--------------------------------------------------------------------------------\n");
+		usbi_mutex_static_lock(&log_header_lock);
+		if (!has_debug_header_been_displayed) {
+			usbi_log_line(ctx, LIBUSB_LOG_LEVEL_NONE, "[timestamp] [threadID] facility level [function call] <message>\n");
+			usbi_log_line(ctx, LIBUSB_LOG_LEVEL_NONE, "--------------------------------------------------------------------------------\n");
+			has_debug_header_been_displayed = 1;
+		}
+		usbi_mutex_static_unlock(&log_header_lock);
 	}
 	if (now.tv_usec < timestamp_origin.tv_usec) {
 		now.tv_sec--;
@@ -2114,36 +2600,56 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 		break;
 	}
 
+	sink = log_sink_get(ctx);
+#ifdef USBI_LOG_ASYNC
+	/* format straight into the queue */
+	if (sink && sink->queue) {
+		record = log_queue_claim(ctx, sink->queue, &pos);
+		if (!record) {
+			log_sink_put(ctx);
+			return;
+		}
+		record->level = level;
+		buf = record->str;
+	}
+#endif
+
 	if (global_debug) {
-		header_len = snprintf(buf, sizeof(buf),
+		header_len = snprintf(buf, USBI_MAX_LOG_LEN,
 			"[%2d.%06d] [%08x] libusbx: %s [%s] ",
 			(int)now.tv_sec, (int)now.tv_usec, usbi_get_tid(), prefix, function);
 	} else {
-		header_len = snprintf(buf, sizeof(buf),
+		header_len = snprintf(buf, USBI_MAX_LOG_LEN,
 			"libusbx: %s [%s] ", prefix, function);
 	}
 
-	if (header_len < 0 || header_len >= sizeof(buf)) {
+	if (header_len < 0 || header_len >= USBI_MAX_LOG_LEN) {
 		/* Somehow snprintf failed to write to the buffer,
 		 * remove the header so something useful is output. */
 		header_len = 0;
 	}
 	/* Make sure buffer is NUL terminated */
 	buf[header_len] = '\0';
-	text_len = vsnprintf(buf + header_len, sizeof(buf) - header_len,
+	text_len = vsnprintf(buf + header_len, USBI_MAX_LOG_LEN - header_len,
 		format, args);
-	if (text_len < 0 || text_len + header_len >= sizeof(buf)) {
+	if (text_len < 0 || text_len + header_len >= USBI_MAX_LOG_LEN) {
 		/* Truncated log output. On some platforms a -1 return value means
 		 * that the output was truncated. */
-		text_len = sizeof(buf) - header_len;
+		text_len = USBI_MAX_LOG_LEN - header_len;
 	}
-	if (header_len + text_len + sizeof(USBI_LOG_LINE_END) >= sizeof(buf)) {
+	if (header_len + text_len + sizeof(USBI_LOG_LINE_END) >= USBI_MAX_LOG_LEN) {
 		/* Need to truncate the text slightly to fit on the terminator. */
-		text_len -= (header_len + text_len + sizeof(USBI_LOG_LINE_END)) - sizeof(buf);
+		text_len -= (header_len + text_len + sizeof(USBI_LOG_LINE_END)) - USBI_MAX_LOG_LEN;
 	}
 	strcpy(buf + header_len + text_len, USBI_LOG_LINE_END);
 
-	usbi_log_str(ctx, buf);
+#ifdef USBI_LOG_ASYNC
+	if (record)
+		log_queue_publish(sink->queue, record, pos);
+	else
+#endif
+	usbi_log_str(sink, level, buf);
+	log_sink_put(ctx);
 #endif
 }
 
@@ -2157,6 +2663,117 @@ void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 	va_end (args);
 }
 
+/** \ingroup lib
+ * Set where the log messages of a context go. By default they are written to
+ * stderr as they are logged, which takes long enough to change the timing of
+ * USB traffic when debug messages are enabled.
+ *
+ * With LIBUSB_LOG_SINK_ASYNC in flags, messages are instead queued and
+ * handed to the sink by a background thread, so that logging a message costs
+ * little more than formatting it. The sink must then cope with being called
+ * from that thread. A message logged while the queue is full is dropped and
+ * counted, see libusb_get_log_dropped(). The background thread is stopped,
+ * after writing out what is queued, by the next call to this function or by
+ * libusb_exit().
+ *
+ * Debug messages which are not tied to a context are logged through the
+ * default context.
+ *
+ * This function may be called while other threads log through the context,
+ * each of their messages then going to either the old or the new sink. It
+ * waits for those which use the old sink before stopping its background
+ * thread. It must not be called from a sink, or for the same context by two
+ * threads at once. In builds without POSIX threads it must not be called
+ * while other threads may log through the context.
+ *
+ * Since \ref LIBUSBX_API_VERSION >= 0x01000109
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param cb the sink to hand each message to, or NULL for stderr
+ * \param user_data user data to pass to the sink
+ * \param flags bitwise OR of \ref libusb_log_sink_flag values
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if LIBUSB_LOG_SINK_ASYNC was given
+ * but this build of libusbx cannot start a background thread
+ * \returns another LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_set_log_sink(libusb_context *ctx,
+	libusb_log_sink_cb cb, void *user_data, int flags)
+{
+	struct usbi_log_sink *sink = NULL;
+
+	USBI_GET_CONTEXT(ctx);
+
+#ifndef USBI_LOG_ASYNC
+	if (flags & LIBUSB_LOG_SINK_ASYNC)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+
+	if (cb || (flags & LIBUSB_LOG_SINK_ASYNC)) {
+		sink = calloc(1, sizeof(*sink));
+		if (!sink)
+			return LIBUSB_ERROR_NO_MEM;
+		sink->ctx = ctx;
+		sink->cb = cb;
+		sink->user_data = user_data;
+	}
+
+#ifdef USBI_LOG_ASYNC
+	if (flags & LIBUSB_LOG_SINK_ASYNC) {
+		int r = log_queue_start(sink);
+		if (r != LIBUSB_SUCCESS) {
+			free(sink);
+			return r;
+		}
+	}
+#endif
+
+	log_sink_replace(ctx, sink);
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup lib
+ * Get the number of log messages of a context which were dropped because
+ * the queue of its background log writer was full.
+ * See libusb_set_log_sink().
+ *
+ * Since \ref LIBUSBX_API_VERSION >= 0x01000109
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns the number of messages dropped since the context was created
+ */
+unsigned int API_EXPORTED libusb_get_log_dropped(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	return ctx->log_dropped;
+}
+
+/** \ingroup misc
+ * Write out the URB trace which was enabled with the LIBUSB_TRACE
+ * environment variable (see \ref mainpage "the main page"), without waiting
+ * for the last context to exit. The file then holds the events recorded so
+ * far, replacing any capture written before, and tracing carries on. A
+ * program can call this when it detects a failure, so that the trace is
+ * kept even if the program cannot exit cleanly afterwards. The trace is also
+ * written when the program exits without calling libusb_exit().
+ *
+ * Since \ref LIBUSBX_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if no trace is being taken
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the backend cannot trace
+ * \returns LIBUSB_ERROR_IO if the trace could not be written
+ */
+int API_EXPORTED libusb_dump_trace(libusb_context *ctx)
+{
+	UNUSED(ctx);
+
+	if (!usbi_backend->dump_trace)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return usbi_backend->dump_trace();
+}
+
 /** \ingroup misc
  * Returns a constant NULL-terminated string with the ASCII name of a libusbx
  * error or transfer status code. The caller must not free() the returned
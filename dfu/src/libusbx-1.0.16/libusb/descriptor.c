@@ -33,6 +33,41 @@
 #define ENDPOINT_DESC_LENGTH		7
 #define ENDPOINT_AUDIO_DESC_LENGTH	9
 
+/* Parsed configuration descriptors are immutable once built and are shared
+ * between everyone who asks for them. Each one handed out is the desc member
+ * of one of these, and the copy cached in a device holds a reference. */
+struct usbi_config_descriptor {
+	int refcnt;
+	struct libusb_config_descriptor desc;
+};
+
+#define USBI_CONFIG_DESCRIPTOR(config) \
+	container_of(config, struct usbi_config_descriptor, desc)
+
+static usbi_mutex_static_t config_refcnt_lock = USBI_MUTEX_INITIALIZER;
+
+/* A parsed configuration lives in a single allocation: the descriptor above,
+ * then arrays of interfaces, altsettings and endpoints, then the bytes of
+ * any extra descriptors. Each array is handed out in order as the parser
+ * walks the raw descriptor, so the altsettings of one interface and the
+ * endpoints of one altsetting end up contiguous. These are the cursors. */
+struct desc_arena {
+	struct libusb_interface *interface;
+	struct libusb_interface_descriptor *altsetting;
+	struct libusb_endpoint_descriptor *endpoint;
+	unsigned char *extra;
+};
+
+static unsigned char *arena_copy_extra(struct desc_arena *arena,
+	const unsigned char *begin, int len)
+{
+	unsigned char *extra = arena->extra;
+
+	memcpy(extra, begin, len);
+	arena->extra += len;
+	return extra;
+}
+
 /** @defgroup desc USB descriptors
  * This page details how to examine the various standard USB descriptors
  * for detected devices
@@ -90,18 +125,11 @@ int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	return (int) (sp - source);
 }
 
-static void clear_endpoint(struct libusb_endpoint_descriptor *endpoint)
-{
-	if (endpoint->extra)
-		free((unsigned char *) endpoint->extra);
-}
-
 static int parse_endpoint(struct libusb_context *ctx,
-	struct libusb_endpoint_descriptor *endpoint, unsigned char *buffer,
-	int size, int host_endian)
+	struct desc_arena *arena, struct libusb_endpoint_descriptor *endpoint,
+	unsigned char *buffer, int size, int host_endian)
 {
 	struct usb_descriptor_header header;
-	unsigned char *extra;
 	unsigned char *begin;
 	int parsed = 0;
 	int len;
@@ -173,45 +201,13 @@ static int parse_endpoint(struct libusb_context *ctx,
 		return parsed;
 	}
 
-	extra = malloc(len);
-	endpoint->extra = extra;
-	if (!extra) {
-		endpoint->extra_length = 0;
-		return LIBUSB_ERROR_NO_MEM;
-	}
-
-	memcpy(extra, begin, len);
+	endpoint->extra = arena_copy_extra(arena, begin, len);
 	endpoint->extra_length = len;
 
 	return parsed;
 }
 
-static void clear_interface(struct libusb_interface *usb_interface)
-{
-	int i;
-	int j;
-
-	if (usb_interface->altsetting) {
-		for (i = 0; i < usb_interface->num_altsetting; i++) {
-			struct libusb_interface_descriptor *ifp =
-				(struct libusb_interface_descriptor *)
-				usb_interface->altsetting + i;
-			if (ifp->extra)
-				free((void *) ifp->extra);
-			if (ifp->endpoint) {
-				for (j = 0; j < ifp->bNumEndpoints; j++)
-					clear_endpoint((struct libusb_endpoint_descriptor *)
-						ifp->endpoint + j);
-				free((void *) ifp->endpoint);
-			}
-		}
-		free((void *) usb_interface->altsetting);
-		usb_interface->altsetting = NULL;
-	}
-
-}
-
-static int parse_interface(libusb_context *ctx,
+static int parse_interface(libusb_context *ctx, struct desc_arena *arena,
 	struct libusb_interface *usb_interface, unsigned char *buffer, int size,
 	int host_endian)
 {
@@ -220,26 +216,16 @@ static int parse_interface(libusb_context *ctx,
 	int r;
 	int parsed = 0;
 	int interface_number = -1;
-	size_t tmp;
 	struct usb_descriptor_header header;
 	struct libusb_interface_descriptor *ifp;
 	unsigned char *begin;
 
 	usb_interface->num_altsetting = 0;
+	usb_interface->altsetting = arena->altsetting;
 
 	while (size >= INTERFACE_DESC_LENGTH) {
-		struct libusb_interface_descriptor *altsetting =
-			(struct libusb_interface_descriptor *) usb_interface->altsetting;
-		altsetting = usbi_reallocf(altsetting,
-			sizeof(struct libusb_interface_descriptor) *
-			(usb_interface->num_altsetting + 1));
-		if (!altsetting) {
-			r = LIBUSB_ERROR_NO_MEM;
-			goto err;
-		}
-		usb_interface->altsetting = altsetting;
-
-		ifp = altsetting + usb_interface->num_altsetting;
+		/* only taken from the arena once it turns out to be valid */
+		ifp = arena->altsetting;
 		usbi_parse_descriptor(buffer, "bbbbbbbbb", ifp, 0);
 		if (ifp->bDescriptorType != LIBUSB_DT_INTERFACE) {
 			usbi_err(ctx, "unexpected descriptor %x (expected %x)",
@@ -249,8 +235,7 @@ static int parse_interface(libusb_context *ctx,
 		if (ifp->bLength < INTERFACE_DESC_LENGTH) {
 			usbi_err(ctx, "invalid interface bLength (%d)",
 				 ifp->bLength);
-			r = LIBUSB_ERROR_IO;
-			goto err;
+			return LIBUSB_ERROR_IO;
 		}
 		if (ifp->bLength > size) {
 			usbi_warn(ctx, "short intf descriptor read %d/%d",
@@ -259,10 +244,10 @@ static int parse_interface(libusb_context *ctx,
 		}
 		if (ifp->bNumEndpoints > USB_MAXENDPOINTS) {
 			usbi_err(ctx, "too many endpoints (%d)", ifp->bNumEndpoints);
-			r = LIBUSB_ERROR_IO;
-			goto err;
+			return LIBUSB_ERROR_IO;
 		}
 
+		arena->altsetting++;
 		usb_interface->num_altsetting++;
 		ifp->extra = NULL;
 		ifp->extra_length = 0;
@@ -285,8 +270,7 @@ static int parse_interface(libusb_context *ctx,
 				usbi_err(ctx,
 					 "invalid extra intf desc len (%d)",
 					 header.bLength);
-				r = LIBUSB_ERROR_IO;
-				goto err;
+				return LIBUSB_ERROR_IO;
 			} else if (header.bLength > size) {
 				usbi_warn(ctx,
 					  "short extra intf desc read %d/%d",
@@ -310,31 +294,20 @@ static int parse_interface(libusb_context *ctx,
 		/*  drivers to later parse */
 		len = (int)(buffer - begin);
 		if (len) {
-			ifp->extra = malloc(len);
-			if (!ifp->extra) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
-			memcpy((unsigned char *) ifp->extra, begin, len);
+			ifp->extra = arena_copy_extra(arena, begin, len);
 			ifp->extra_length = len;
 		}
 
 		if (ifp->bNumEndpoints > 0) {
-			struct libusb_endpoint_descriptor *endpoint;
-			tmp = ifp->bNumEndpoints * sizeof(struct libusb_endpoint_descriptor);
-			endpoint = malloc(tmp);
+			struct libusb_endpoint_descriptor *endpoint = arena->endpoint;
 			ifp->endpoint = endpoint;
-			if (!endpoint) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
+			arena->endpoint += ifp->bNumEndpoints;
 
-			memset(endpoint, 0, tmp);
 			for (i = 0; i < ifp->bNumEndpoints; i++) {
-				r = parse_endpoint(ctx, endpoint + i, buffer, size,
-					host_endian);
+				r = parse_endpoint(ctx, arena, endpoint + i, buffer,
+					size, host_endian);
 				if (r < 0)
-					goto err;
+					return r;
 				if (r == 0) {
 					ifp->bNumEndpoints = (uint8_t)i;
 					break;;
@@ -355,31 +328,14 @@ static int parse_interface(libusb_context *ctx,
 	}
 
 	return parsed;
-err:
-	clear_interface(usb_interface);
-	return r;
-}
-
-static void clear_configuration(struct libusb_config_descriptor *config)
-{
-	if (config->interface) {
-		int i;
-		for (i = 0; i < config->bNumInterfaces; i++)
-			clear_interface((struct libusb_interface *)
-				config->interface + i);
-		free((void *) config->interface);
-	}
-	if (config->extra)
-		free((void *) config->extra);
 }
 
 static int parse_configuration(struct libusb_context *ctx,
-	struct libusb_config_descriptor *config, unsigned char *buffer,
-	int size, int host_endian)
+	struct desc_arena *arena, struct libusb_config_descriptor *config,
+	unsigned char *buffer, int size, int host_endian)
 {
 	int i;
 	int r;
-	size_t tmp;
 	struct usb_descriptor_header header;
 	struct libusb_interface *usb_interface;
 
@@ -409,13 +365,10 @@ static int parse_configuration(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	tmp = config->bNumInterfaces * sizeof(struct libusb_interface);
-	usb_interface = malloc(tmp);
+	usb_interface = arena->interface;
 	config->interface = usb_interface;
-	if (!config->interface)
-		return LIBUSB_ERROR_NO_MEM;
+	arena->interface += config->bNumInterfaces;
 
-	memset(usb_interface, 0, tmp);
 	buffer += config->bLength;
 	size -= config->bLength;
 
@@ -436,8 +389,7 @@ static int parse_configuration(struct libusb_context *ctx,
 				usbi_err(ctx,
 					 "invalid extra config desc len (%d)",
 					 header.bLength);
-				r = LIBUSB_ERROR_IO;
-				goto err;
+				return LIBUSB_ERROR_IO;
 			} else if (header.bLength > size) {
 				usbi_warn(ctx,
 					  "short extra config desc read %d/%d",
@@ -464,20 +416,15 @@ static int parse_configuration(struct libusb_context *ctx,
 		if (len) {
 			/* FIXME: We should realloc and append here */
 			if (!config->extra_length) {
-				config->extra = malloc(len);
-				if (!config->extra) {
-					r = LIBUSB_ERROR_NO_MEM;
-					goto err;
-				}
-
-				memcpy((unsigned char *) config->extra, begin, len);
+				config->extra = arena_copy_extra(arena, begin, len);
 				config->extra_length = len;
 			}
 		}
 
-		r = parse_interface(ctx, usb_interface + i, buffer, size, host_endian);
+		r = parse_interface(ctx, arena, usb_interface + i, buffer, size,
+			host_endian);
 		if (r < 0)
-			goto err;
+			return r;
 		if (r == 0) {
 			config->bNumInterfaces = (uint8_t)i;
 			break;
@@ -488,23 +435,63 @@ static int parse_configuration(struct libusb_context *ctx,
 	}
 
 	return size;
+}
 
-err:
-	clear_configuration(config);
-	return r;
+/* Sizing pass for the arena. Walk the chain of descriptor headers the same
+ * way the parser does, and count the worst case of what it can take: every
+ * interface descriptor as an altsetting (plus the one it reads before
+ * checking the type) with all of its endpoints, and every byte as extra. */
+static void size_config_arena(unsigned char *buffer, int size,
+	int *num_interfaces, int *num_altsettings, int *num_endpoints)
+{
+	*num_interfaces = 0;
+	*num_altsettings = 1;
+	*num_endpoints = 0;
+
+	if (size >= LIBUSB_DT_CONFIG_SIZE)
+		*num_interfaces = MIN(buffer[4], USB_MAXINTERFACES);
+
+	while (size >= DESC_HEADER_LENGTH) {
+		if (buffer[0] < DESC_HEADER_LENGTH || buffer[0] > size)
+			break;
+		if (buffer[1] == LIBUSB_DT_INTERFACE &&
+		    buffer[0] >= INTERFACE_DESC_LENGTH) {
+			(*num_altsettings)++;
+			*num_endpoints += MIN(buffer[4], USB_MAXENDPOINTS);
+		}
+		size -= buffer[0];
+		buffer += buffer[0];
+	}
 }
 
 static int raw_desc_to_config(struct libusb_context *ctx,
 	unsigned char *buf, int size, int host_endian,
 	struct libusb_config_descriptor **config)
 {
-	struct libusb_config_descriptor *_config = malloc(sizeof(*_config));
+	struct usbi_config_descriptor *_config;
+	struct desc_arena arena;
+	int num_interfaces, num_altsettings, num_endpoints;
 	int r;
-	
+
+	size_config_arena(buf, size, &num_interfaces, &num_altsettings,
+		&num_endpoints);
+	_config = calloc(1, sizeof(*_config) +
+		num_interfaces * sizeof(struct libusb_interface) +
+		num_altsettings * sizeof(struct libusb_interface_descriptor) +
+		num_endpoints * sizeof(struct libusb_endpoint_descriptor) +
+		size);
 	if (!_config)
 		return LIBUSB_ERROR_NO_MEM;
 
-	r = parse_configuration(ctx, _config, buf, size, host_endian);
+	arena.interface = (struct libusb_interface *) (_config + 1);
+	arena.altsetting = (struct libusb_interface_descriptor *)
+		(arena.interface + num_interfaces);
+	arena.endpoint = (struct libusb_endpoint_descriptor *)
+		(arena.altsetting + num_altsettings);
+	arena.extra = (unsigned char *) (arena.endpoint + num_endpoints);
+
+	r = parse_configuration(ctx, &arena, &_config->desc, buf, size,
+		host_endian);
 	if (r < 0) {
 		usbi_err(ctx, "parse_configuration failed with error %d", r);
 		free(_config);
@@ -513,10 +500,103 @@ static int raw_desc_to_config(struct libusb_context *ctx,
 		usbi_warn(ctx, "still %d bytes of descriptor data left", r);
 	}
 	
-	*config = _config;
+	_config->refcnt = 1;
+	*config = &_config->desc;
 	return LIBUSB_SUCCESS;
 }
 
+static struct libusb_config_descriptor *ref_config(
+	struct libusb_config_descriptor *config)
+{
+	usbi_mutex_static_lock(&config_refcnt_lock);
+	USBI_CONFIG_DESCRIPTOR(config)->refcnt++;
+	usbi_mutex_static_unlock(&config_refcnt_lock);
+	return config;
+}
+
+static void unref_config(struct libusb_config_descriptor *config)
+{
+	struct usbi_config_descriptor *_config = USBI_CONFIG_DESCRIPTOR(config);
+	int refcnt;
+
+	usbi_mutex_static_lock(&config_refcnt_lock);
+	refcnt = --_config->refcnt;
+	usbi_mutex_static_unlock(&config_refcnt_lock);
+
+	/* the whole tree is the one block */
+	if (refcnt == 0)
+		free(_config);
+}
+
+/* look up a parsed configuration in the device cache, by index or, with a
+ * negative index, by bConfigurationValue. returns a new reference or NULL */
+static struct libusb_config_descriptor *get_cached_config(libusb_device *dev,
+	int config_index, uint8_t bConfigurationValue)
+{
+	struct libusb_config_descriptor *config = NULL;
+	int i;
+
+	usbi_mutex_lock(&dev->lock);
+	if (dev->config_cache) {
+		if (config_index >= 0) {
+			config = dev->config_cache[config_index];
+		} else {
+			for (i = 0; i < dev->num_configurations; i++) {
+				if (dev->config_cache[i] &&
+				    dev->config_cache[i]->bConfigurationValue == bConfigurationValue) {
+					config = dev->config_cache[i];
+					break;
+				}
+			}
+		}
+		if (config)
+			ref_config(config);
+	}
+	usbi_mutex_unlock(&dev->lock);
+	return config;
+}
+
+/* keep a reference to a freshly parsed configuration in the device cache.
+ * if another thread cached the same index first, the caller's copy is
+ * dropped in favour of that one. */
+static void cache_config(libusb_device *dev, uint8_t config_index,
+	struct libusb_config_descriptor **config)
+{
+	struct libusb_config_descriptor *old = NULL;
+
+	usbi_mutex_lock(&dev->lock);
+	if (!dev->config_cache)
+		dev->config_cache = calloc(dev->num_configurations,
+			sizeof(dev->config_cache[0]));
+	if (dev->config_cache) {
+		if (dev->config_cache[config_index]) {
+			old = *config;
+			*config = dev->config_cache[config_index];
+		} else {
+			dev->config_cache[config_index] = *config;
+		}
+		ref_config(*config);
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	if (old)
+		unref_config(old);
+}
+
+void usbi_device_clear_config_cache(libusb_device *dev)
+{
+	int i;
+
+	if (!dev->config_cache)
+		return;
+
+	for (i = 0; i < dev->num_configurations; i++)
+		if (dev->config_cache[i])
+			unref_config(dev->config_cache[i]);
+	free(dev->config_cache);
+	dev->config_cache = NULL;
+}
+
 int usbi_device_cache_descriptor(libusb_device *dev)
 {
 	int r, host_endian = 0;
@@ -565,7 +645,8 @@ int API_EXPORTED libusb_get_device_descriptor(libusb_device *dev,
  * \param dev a device
  * \param config output location for the USB configuration descriptor. Only
  * valid if 0 was returned. Must be freed with libusb_free_config_descriptor()
- * after use.
+ * after use. The descriptor is shared with other callers and must not be
+ * modified.
  * \returns 0 on success
  * \returns LIBUSB_ERROR_NOT_FOUND if the device is in unconfigured state
  * \returns another LIBUSB_ERROR code on error
@@ -590,7 +671,14 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usbi_parse_descriptor(tmp, "bbw", &_config, host_endian);
+	/* the active configuration is one of the device's configurations, so
+	 * share the cached copy of it where we can */
+	usbi_parse_descriptor(tmp, "bbwbb", &_config, host_endian);
+	r = libusb_get_config_descriptor_by_value(dev,
+		_config.bConfigurationValue, config);
+	if (r != LIBUSB_ERROR_NOT_FOUND)
+		return r;
+
 	buf = malloc(_config.wTotalLength);
 	if (!buf)
 		return LIBUSB_ERROR_NO_MEM;
@@ -613,7 +701,8 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
  * \param config_index the index of the configuration you wish to retrieve
  * \param config output location for the USB configuration descriptor. Only
  * valid if 0 was returned. Must be freed with libusb_free_config_descriptor()
- * after use.
+ * after use. The descriptor is shared with other callers and must not be
+ * modified.
  * \returns 0 on success
  * \returns LIBUSB_ERROR_NOT_FOUND if the configuration does not exist
  * \returns another LIBUSB_ERROR code on error
@@ -633,6 +722,10 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 	if (config_index >= dev->num_configurations)
 		return LIBUSB_ERROR_NOT_FOUND;
 
+	*config = get_cached_config(dev, config_index, 0);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	r = usbi_backend->get_config_descriptor(dev, config_index, tmp,
 		LIBUSB_DT_CONFIG_SIZE, &host_endian);
 	if (r < 0)
@@ -652,6 +745,8 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 		_config.wTotalLength, &host_endian);
 	if (r >= 0)
 		r = raw_desc_to_config(dev->ctx, buf, r, host_endian, config);
+	if (r == 0)
+		cache_config(dev, config_index, config);
 
 	free(buf);
 	return r;
@@ -695,7 +790,8 @@ int usbi_get_config_index_by_value(struct libusb_device *dev,
  * wish to retrieve
  * \param config output location for the USB configuration descriptor. Only
  * valid if 0 was returned. Must be freed with libusb_free_config_descriptor()
- * after use.
+ * after use. The descriptor is shared with other callers and must not be
+ * modified.
  * \returns 0 on success
  * \returns LIBUSB_ERROR_NOT_FOUND if the configuration does not exist
  * \returns another LIBUSB_ERROR code on error
@@ -705,17 +801,13 @@ int usbi_get_config_index_by_value(struct libusb_device *dev,
 int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
 	uint8_t bConfigurationValue, struct libusb_config_descriptor **config)
 {
-	int r, idx, host_endian;
-	unsigned char *buf = NULL;
+	int r, idx;
 
-	if (usbi_backend->get_config_descriptor_by_value) {
-		r = usbi_backend->get_config_descriptor_by_value(dev,
-			bConfigurationValue, &buf, &host_endian);
-		if (r < 0)
-			return r;
-		return raw_desc_to_config(dev->ctx, buf, r, host_endian, config);
-	}
+	*config = get_cached_config(dev, -1, bConfigurationValue);
+	if (*config)
+		return LIBUSB_SUCCESS;
 
+	/* go through the index so that the parsed copy is cached */
 	r = usbi_get_config_index_by_value(dev, bConfigurationValue, &idx);
 	if (r < 0)
 		return r;
@@ -731,6 +823,10 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
  * It is safe to call this function with a NULL config parameter, in which
  * case the function simply returns.
  *
+ * Note since \ref LIBUSBX_API_VERSION >= 0x01000106, parsed descriptors are
+ * cached in the device and shared between callers, so this only drops the
+ * caller's reference.
+ *
  * \param config the configuration descriptor to free
  */
 void API_EXPORTED libusb_free_config_descriptor(
@@ -739,8 +835,7 @@ void API_EXPORTED libusb_free_config_descriptor(
 	if (!config)
 		return;
 
-	clear_configuration(config);
-	free(config);
+	unref_config(config);
 }
 
 /** \ingroup desc
@@ -1131,57 +1226,165 @@ void API_EXPORTED libusb_free_container_id_descriptor(
 	free(container_id);
 }
 
+/* String descriptors in the device's first language, as read from it, so
+ * that asking again for the same string costs no control transfers. Each
+ * entry is a copy of the raw descriptor, which starts with its length. */
+struct usbi_string_cache {
+	int have_langid;
+	uint16_t langid;
+	unsigned char *desc[256];
+};
+
+void usbi_handle_clear_string_cache(struct libusb_device_handle *dev_handle)
+{
+	struct usbi_string_cache *cache;
+	int i;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	cache = dev_handle->string_cache;
+	dev_handle->string_cache = NULL;
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < 256; i++)
+		free(cache->desc[i]);
+	free(cache);
+}
+
+/* look up the language ID, or string descriptor desc_index in that
+ * language, in the cache. desc_index 0 asks for the language ID, which is
+ * returned in *langid. the descriptor is copied to tbuf (255 bytes).
+ * returns its length, or 0 if it is not cached */
+static int get_cached_string(libusb_device_handle *dev, uint8_t desc_index,
+	uint16_t *langid, unsigned char *tbuf)
+{
+	struct usbi_string_cache *cache;
+	int r = 0;
+
+	usbi_mutex_lock(&dev->lock);
+	cache = dev->string_cache;
+	if (cache && desc_index == 0 && cache->have_langid) {
+		*langid = cache->langid;
+		r = 1;
+	} else if (cache && desc_index && cache->desc[desc_index]) {
+		r = cache->desc[desc_index][0];
+		memcpy(tbuf, cache->desc[desc_index], r);
+	}
+	usbi_mutex_unlock(&dev->lock);
+	return r;
+}
+
+/* remember the language ID (desc_index 0) or a string descriptor read from
+ * the device. failing to allocate only means it is read again next time */
+static void cache_string(libusb_device_handle *dev, uint8_t desc_index,
+	uint16_t langid, const unsigned char *tbuf)
+{
+	struct usbi_string_cache *cache;
+	unsigned char *desc = NULL;
+
+	if (desc_index) {
+		desc = malloc(tbuf[0]);
+		if (!desc)
+			return;
+		memcpy(desc, tbuf, tbuf[0]);
+	}
+
+	usbi_mutex_lock(&dev->lock);
+	if (!dev->string_cache)
+		dev->string_cache = calloc(1, sizeof(*dev->string_cache));
+	cache = dev->string_cache;
+	if (cache && desc_index == 0) {
+		cache->langid = langid;
+		cache->have_langid = 1;
+	} else if (cache && !cache->desc[desc_index]) {
+		cache->desc[desc_index] = desc;
+		desc = NULL;
+	}
+	usbi_mutex_unlock(&dev->lock);
+
+	free(desc);
+}
+
+/* read string descriptor desc_index in the device's first language into tbuf
+ * (255 bytes), from the handle's cache where possible. returns the length of
+ * the descriptor or a LIBUSB_ERROR code */
+static int get_string_descriptor_cached(libusb_device_handle *dev,
+	uint8_t desc_index, unsigned char *tbuf)
+{
+	int r;
+	uint16_t langid;
+
+	r = get_cached_string(dev, desc_index, &langid, tbuf);
+	if (r > 0)
+		return r;
+
+	/* Asking for the zero'th index is special - it returns a string
+	 * descriptor that contains all the language IDs supported by the
+	 * device. Typically there aren't many - often only one. Language
+	 * IDs are 16 bit numbers, and they start at the third byte in the
+	 * descriptor. See USB 2.0 specification section 9.6.7 for more
+	 * information.
+	 */
+	if (!get_cached_string(dev, 0, &langid, tbuf)) {
+		r = libusb_get_string_descriptor(dev, 0, 0, tbuf, 255);
+		if (r < 0)
+			return r;
+
+		if (r < 4)
+			return LIBUSB_ERROR_IO;
+
+		langid = tbuf[2] | (tbuf[3] << 8);
+		cache_string(dev, 0, langid, tbuf);
+	}
+
+	r = libusb_get_string_descriptor(dev, desc_index, langid, tbuf, 255);
+	if (r < 0)
+		return r;
+
+	if (r < 2 || tbuf[1] != LIBUSB_DT_STRING)
+		return LIBUSB_ERROR_IO;
+
+	if (tbuf[0] > r)
+		return LIBUSB_ERROR_IO;
+
+	cache_string(dev, desc_index, langid, tbuf);
+	return tbuf[0];
+}
+
 /** \ingroup desc
  * Retrieve a string descriptor in C style ASCII.
  *
  * Wrapper around libusb_get_string_descriptor(). Uses the first language
  * supported by the device.
  *
+ * The language and the strings are remembered in the handle the first time
+ * they are read, so later calls for the same string make no requests to the
+ * device. They are forgotten when the device is reset or disconnected.
+ *
  * \param dev a device handle
  * \param desc_index the index of the descriptor to retrieve
  * \param data output buffer for ASCII string descriptor
  * \param length size of data buffer
  * \returns number of bytes returned in data, or LIBUSB_ERROR code on failure
+ * \see libusb_prefetch_string_descriptors()
  */
 int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	uint8_t desc_index, unsigned char *data, int length)
 {
 	unsigned char tbuf[255]; /* Some devices choke on size > 255 */
 	int r, si, di;
-	uint16_t langid;
-
-	/* Asking for the zero'th index is special - it returns a string
-	 * descriptor that contains all the language IDs supported by the
-	 * device. Typically there aren't many - often only one. Language
-	 * IDs are 16 bit numbers, and they start at the third byte in the
-	 * descriptor. There's also no point in trying to read descriptor 0
-	 * with this function. See USB 2.0 specification section 9.6.7 for
-	 * more information.
-	 */
 
+	/* There's no point in trying to read descriptor 0, the list of
+	 * language IDs, with this function. */
 	if (desc_index == 0)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	r = libusb_get_string_descriptor(dev, 0, 0, tbuf, sizeof(tbuf));
-	if (r < 0)
-		return r;
-
-	if (r < 4)
-		return LIBUSB_ERROR_IO;
-
-	langid = tbuf[2] | (tbuf[3] << 8);
-
-	r = libusb_get_string_descriptor(dev, desc_index, langid, tbuf,
-		sizeof(tbuf));
+	r = get_string_descriptor_cached(dev, desc_index, tbuf);
 	if (r < 0)
 		return r;
 
-	if (tbuf[1] != LIBUSB_DT_STRING)
-		return LIBUSB_ERROR_IO;
-
-	if (tbuf[0] > r)
-		return LIBUSB_ERROR_IO;
-
 	for (di = 0, si = 2; si < tbuf[0]; si += 2) {
 		if (di >= (length - 1))
 			break;
@@ -1195,3 +1398,40 @@ int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	data[di] = 0;
 	return di;
 }
+
+/** \ingroup desc
+ * Read the manufacturer, product and serial number strings named by the
+ * device descriptor into the handle's string cache, so that
+ * libusb_get_string_descriptor_ascii() can return them without further
+ * requests to the device. Strings the device does not have are skipped.
+ *
+ * Since \ref LIBUSBX_API_VERSION >= 0x01000107
+ *
+ * \param dev a device handle
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_prefetch_string_descriptors(libusb_device_handle *dev)
+{
+	struct libusb_device_descriptor *desc = &dev->dev->device_descriptor;
+	uint8_t index[3];
+	unsigned char tbuf[255];
+	int i, r;
+
+	index[0] = desc->iManufacturer;
+	index[1] = desc->iProduct;
+	index[2] = desc->iSerialNumber;
+
+	for (i = 0; i < 3; i++) {
+		if (!index[i])
+			continue;
+		r = get_string_descriptor_cached(dev, index[i], tbuf);
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			return r;
+		if (r < 0)
+			usbi_dbg("string %d: error %d", index[i], r);
+	}
+
+	return 0;
+}
@@ -171,36 +171,83 @@ static int usbi_hotplug_match_cb (struct libusb_context *ctx,
 			       dev, event, hotplug_cb->user_data);
 }
 
-void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
-	libusb_hotplug_event event)
+/* the dispatch list for callbacks on a vendor and product ID. callbacks
+ * which leave either open go on the wildcard list */
+static struct list_head *hotplug_cb_index(struct libusb_context *ctx,
+	int vendor_id, int product_id)
+{
+	unsigned int hash;
+
+	if (LIBUSB_HOTPLUG_MATCH_ANY == vendor_id ||
+	    LIBUSB_HOTPLUG_MATCH_ANY == product_id)
+		return &ctx->hotplug_cbs_wildcard;
+
+	hash = ((unsigned int) vendor_id * 31) ^ (unsigned int) product_id;
+	hash ^= hash >> 5;
+	return &ctx->hotplug_cbs_by_id[hash & (USBI_HOTPLUG_HASH_SIZE - 1)];
+}
+
+static void usbi_hotplug_free_cb (struct libusb_hotplug_callback *hotplug_cb)
+{
+	list_del(&hotplug_cb->list);
+	list_del(&hotplug_cb->index_list);
+	free(hotplug_cb);
+}
+
+/* Callbacks are only freed here and in usbi_hotplug_match, both run by the
+ * event handling thread, so walking a list with the lock dropped around each
+ * callback is safe. Other threads only add callbacks or mark them. */
+static void usbi_hotplug_match_list(struct libusb_context *ctx,
+	struct libusb_device *dev, libusb_hotplug_event event,
+	struct list_head *cbs)
 {
 	struct libusb_hotplug_callback *hotplug_cb, *next;
 	int ret;
 
-	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
-
-	list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list, struct libusb_hotplug_callback) {
+	list_for_each_entry_safe(hotplug_cb, next, cbs, index_list, struct libusb_hotplug_callback) {
 		usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
 		ret = usbi_hotplug_match_cb (ctx, dev, event, hotplug_cb);
 		usbi_mutex_lock(&ctx->hotplug_cbs_lock);
 
 		if (ret) {
-			list_del(&hotplug_cb->list);
-			free(hotplug_cb);
+			usbi_hotplug_free_cb (hotplug_cb);
+		}
+	}
+}
+
+void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
+	libusb_hotplug_event event)
+{
+	struct libusb_hotplug_callback *hotplug_cb, *next;
+
+	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+
+	if (!event) {
+		/* a callback was deregistered, free it wherever it is indexed */
+		list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list, struct libusb_hotplug_callback) {
+			if (hotplug_cb->needs_free) {
+				usbi_hotplug_free_cb (hotplug_cb);
+			}
 		}
+	} else if (usbi_device_filter_match(dev)) {
+		/* only callbacks for this device's IDs, and the wildcards, can
+		 * match */
+		usbi_hotplug_match_list(ctx, dev, event, hotplug_cb_index(ctx,
+			dev->device_descriptor.idVendor,
+			dev->device_descriptor.idProduct));
+		usbi_hotplug_match_list(ctx, dev, event,
+			&ctx->hotplug_cbs_wildcard);
 	}
 
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
 
-	/* loop through and disconnect all open handles for this device */
+	/* disconnect all open handles for this device */
 	if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event) {
 		struct libusb_device_handle *handle;
 
 		usbi_mutex_lock(&ctx->open_devs_lock);
-		list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
-			if (dev == handle->dev) {
-				usbi_handle_disconnect (handle);
-			}
+		list_for_each_entry(handle, &dev->handles, dev_list, struct libusb_device_handle) {
+			usbi_handle_disconnect (handle);
 		}
 		usbi_mutex_unlock(&ctx->open_devs_lock);
 	}
@@ -214,6 +261,7 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 {
 	libusb_hotplug_callback *new_callback;
 	static int handle_id = 1;
+	int r;
 
 	/* check for hotplug support */
 	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
@@ -230,6 +278,13 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 
 	USBI_GET_CONTEXT(ctx);
 
+	/* a deferred scan must not report the devices already connected as
+	 * arriving, so it has to run before the callback is added */
+	r = usbi_scan_deferred_devices(ctx);
+	if (r < 0) {
+		return r;
+	}
+
 	new_callback = (libusb_hotplug_callback *)calloc(1, sizeof (*new_callback));
 	if (!new_callback) {
 		return LIBUSB_ERROR_NO_MEM;
@@ -252,6 +307,8 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 	new_callback->handle = handle_id++;
 
 	list_add(&new_callback->list, &ctx->hotplug_cbs);
+	list_add(&new_callback->index_list,
+		 hotplug_cb_index(ctx, vendor_id, product_id));
 
 	if (flags & LIBUSB_HOTPLUG_ENUMERATE) {
 		struct libusb_device *dev;
@@ -259,7 +316,8 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 		usbi_mutex_lock(&ctx->usb_devs_lock);
 
 		list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device) {
-			(void) usbi_hotplug_match_cb (ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, new_callback);
+			if (usbi_device_filter_match(dev))
+				(void) usbi_hotplug_match_cb (ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, new_callback);
 		}
 
 		usbi_mutex_unlock(&ctx->usb_devs_lock);
@@ -312,8 +370,7 @@ void usbi_hotplug_deregister_all(struct libusb_context *ctx) {
 	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
 	list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list,
 				 struct libusb_hotplug_callback) {
-		list_del(&hotplug_cb->list);
-		free(hotplug_cb);
+		usbi_hotplug_free_cb (hotplug_cb);
 	}
 
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
@@ -64,6 +64,10 @@ struct libusb_hotplug_callback {
 
 	/** List this callback is registered in (ctx->hotplug_cbs) */
 	struct list_head list;
+
+	/** List this callback is dispatched from (a bucket of
+	 * ctx->hotplug_cbs_by_id, or ctx->hotplug_cbs_wildcard) */
+	struct list_head index_list;
 };
 
 typedef struct libusb_hotplug_callback libusb_hotplug_callback;
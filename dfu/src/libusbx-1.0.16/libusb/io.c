@@ -34,6 +34,12 @@
 #ifdef USBI_TIMERFD_AVAILABLE
 #include <sys/timerfd.h>
 #endif
+#ifdef USBI_EPOLL_AVAILABLE
+#include <sys/epoll.h>
+
+/* most events taken from the epoll instance by one pass of handle_events() */
+#define USBI_EPOLL_MAX_EVENTS	64
+#endif
 
 #include "libusbi.h"
 #include "hotplug.h"
@@ -1108,6 +1114,7 @@ int usbi_io_init(struct libusb_context *ctx)
 {
 	int r;
 
+	usbi_mutex_init(&ctx->stats_lock, NULL);
 	usbi_mutex_init(&ctx->flying_transfers_lock, NULL);
 	usbi_mutex_init(&ctx->pollfds_lock, NULL);
 	usbi_mutex_init(&ctx->pollfd_modify_lock, NULL);
@@ -1117,6 +1124,19 @@ int usbi_io_init(struct libusb_context *ctx)
 	list_init(&ctx->flying_transfers);
 	list_init(&ctx->pollfds);
 
+#ifdef USBI_EPOLL_AVAILABLE
+	/* this has to exist before the first fd is added */
+	ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->epoll_fd >= 0) {
+		usbi_dbg("using epoll for event handling");
+		ctx->epoll_pollfd.fd = ctx->epoll_fd;
+		ctx->epoll_pollfd.events = POLLIN;
+	} else {
+		usbi_dbg("epoll not available (error %d)", errno);
+		ctx->epoll_fd = -1;
+	}
+#endif
+
 	/* FIXME should use an eventfd on kernels that support it */
 	r = usbi_pipe(ctx->ctrl_pipe);
 	if (r < 0) {
@@ -1165,6 +1185,11 @@ err_close_pipe:
 	usbi_close(ctx->ctrl_pipe[0]);
 	usbi_close(ctx->ctrl_pipe[1]);
 err:
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		close(ctx->epoll_fd);
+#endif
+	usbi_mutex_destroy(&ctx->stats_lock);
 	usbi_mutex_destroy(&ctx->flying_transfers_lock);
 	usbi_mutex_destroy(&ctx->pollfds_lock);
 	usbi_mutex_destroy(&ctx->pollfd_modify_lock);
@@ -1188,6 +1213,13 @@ void usbi_io_exit(struct libusb_context *ctx)
 		close(ctx->timerfd);
 	}
 #endif
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		close(ctx->epoll_fd);
+#endif
+	free(ctx->pollfds_array);
+	free(ctx->timeout_heap);
+	usbi_mutex_destroy(&ctx->stats_lock);
 	usbi_mutex_destroy(&ctx->flying_transfers_lock);
 	usbi_mutex_destroy(&ctx->pollfds_lock);
 	usbi_mutex_destroy(&ctx->pollfd_modify_lock);
@@ -1196,21 +1228,17 @@ void usbi_io_exit(struct libusb_context *ctx)
 	usbi_cond_destroy(&ctx->event_waiters_cond);
 }
 
-static int calculate_timeout(struct usbi_transfer *transfer)
+/* set the absolute timeout of a transfer, counting from now */
+static void set_transfer_timeout(struct usbi_transfer *transfer,
+	const struct timespec *now)
 {
-	int r;
-	struct timespec current_time;
+	struct timespec current_time = *now;
 	unsigned int timeout =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout;
 
-	if (!timeout)
-		return 0;
-
-	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &current_time);
-	if (r < 0) {
-		usbi_err(ITRANSFER_CTX(transfer),
-			"failed to read monotonic clock, errno=%d", errno);
-		return r;
+	if (!timeout) {
+		timerclear(&transfer->timeout);
+		return;
 	}
 
 	current_time.tv_sec += timeout / 1000;
@@ -1222,74 +1250,535 @@ static int calculate_timeout(struct usbi_transfer *transfer)
 	}
 
 	TIMESPEC_TO_TIMEVAL(&transfer->timeout, &current_time);
+}
+
+/* note the submission time of a transfer, and set its timeout from it */
+static int calculate_timeout(struct usbi_transfer *transfer)
+{
+	int r;
+	struct timespec current_time;
+
+	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &current_time);
+	if (r < 0) {
+		usbi_err(ITRANSFER_CTX(transfer),
+			"failed to read monotonic clock, errno=%d", errno);
+		return r;
+	}
+
+	transfer->submitted = current_time;
+	set_transfer_timeout(transfer, &current_time);
 	return 0;
 }
 
-/* add a transfer to the (timeout-sorted) active transfers list.
- * Callers of this function must hold the flying_transfers_lock.
- * This function *always* adds the transfer to the flying_transfers list,
- * it will return non 0 if it fails to update the timer, but even then the
- * transfer is added to the flying_transfers list. */
-static int add_to_flying_list(struct usbi_transfer *transfer)
+/* Transfer statistics, see libusb_get_stats(). Every transfer is counted
+ * in its context and in its device handle, under the stats_lock of the
+ * context. */
+static void stats_count_submitted(struct libusb_context *ctx,
+	struct libusb_transfer **transfers, int count)
 {
-	struct usbi_transfer *cur;
-	struct timeval *timeout = &transfer->timeout;
-	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
-	int r = 0;
-	int first = 1;
+	struct libusb_transfer *transfer;
+	int i;
 
-	/* if we have no other flying transfers, start the list with this one */
-	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&transfer->list, &ctx->flying_transfers);
-		goto out;
+	usbi_mutex_lock(&ctx->stats_lock);
+	for (i = 0; i < count; i++) {
+		transfer = transfers[i];
+		if (transfer->type > LIBUSB_TRANSFER_TYPE_INTERRUPT)
+			continue;
+		ctx->stats.types[transfer->type].submitted++;
+		transfer->dev_handle->stats.types[transfer->type].submitted++;
 	}
+	usbi_mutex_unlock(&ctx->stats_lock);
+}
 
-	/* if we have infinite timeout, append to end of list */
-	if (!timerisset(timeout)) {
-		list_add_tail(&transfer->list, &ctx->flying_transfers);
-		/* first is irrelevant in this case */
-		goto out;
+static void stats_add_finished(struct libusb_transfer_stats *stats,
+	enum libusb_transfer_status status, int in, size_t bytes, int bucket)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		stats->completed++;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		stats->timed_out++;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		stats->cancelled++;
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		stats->stalled++;
+		break;
+	default:
+		stats->failed++;
+		break;
 	}
 
-	/* otherwise, find appropriate place in list */
-	list_for_each_entry(cur, &ctx->flying_transfers, list, struct usbi_transfer) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timeval *cur_tv = &cur->timeout;
+	if (in)
+		stats->bytes_in += bytes;
+	else
+		stats->bytes_out += bytes;
+	stats->latency[bucket]++;
+}
 
-		if (!timerisset(cur_tv) || (cur_tv->tv_sec > timeout->tv_sec) ||
-				(cur_tv->tv_sec == timeout->tv_sec &&
-					cur_tv->tv_usec > timeout->tv_usec)) {
-			list_add_tail(&transfer->list, &cur->list);
-			goto out;
-		}
-		first = 0;
+static void stats_count_finished(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	struct timespec now;
+	int64_t elapsed;
+	uint64_t usecs = 0;
+	size_t bytes = 0;
+	int bucket, in, i;
+
+	if (transfer->type > LIBUSB_TRANSFER_TYPE_INTERRUPT)
+		return;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now) == 0) {
+		elapsed = (int64_t)(now.tv_sec - itransfer->submitted.tv_sec) * 1000000
+			+ (now.tv_nsec - itransfer->submitted.tv_nsec) / 1000;
+		if (elapsed > 0)
+			usecs = elapsed;
+	}
+	for (bucket = 0; usecs && bucket < LIBUSB_STATS_LATENCY_BUCKETS - 1;
+	     bucket++)
+		usecs >>= 1;
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		in = transfer->buffer[0] & LIBUSB_ENDPOINT_IN;
+	else
+		in = transfer->endpoint & LIBUSB_ENDPOINT_IN;
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		for (i = 0; i < transfer->num_iso_packets; i++)
+			bytes += transfer->iso_packet_desc[i].actual_length;
+	} else if (itransfer->transferred > 0) {
+		bytes = itransfer->transferred;
 	}
-	/* first is 0 at this stage (list not empty) */
 
-	/* otherwise we need to be inserted at the end */
+	usbi_mutex_lock(&ctx->stats_lock);
+	stats_add_finished(&ctx->stats.types[transfer->type], status, in,
+		bytes, bucket);
+	stats_add_finished(&transfer->dev_handle->stats.types[transfer->type],
+		status, in, bytes, bucket);
+	usbi_mutex_unlock(&ctx->stats_lock);
+}
+
+/** \ingroup asyncio
+ * Get a snapshot of the transfer statistics of a context or of one device
+ * handle. For each transfer type, libusbx counts the transfers submitted
+ * and how they finished, the bytes moved in each direction, and a histogram
+ * of the time between submission and completion. Bucket 0 of
+ * \ref libusb_transfer_stats::latency "latency" counts transfers which took
+ * less than 1 microsecond, bucket i those which took from 2^(i-1) up to 2^i
+ * microseconds, and the last bucket everything longer.
+ *
+ * The counters start at zero when the context is initialized or the device
+ * is opened, and can be cleared with libusb_reset_stats().
+ *
+ * Since \ref LIBUSBX_API_VERSION >= 0x0100010A
+ *
+ * \param ctx the context to operate on, or NULL for the default context.
+ * Ignored if dev_handle is given.
+ * \param dev_handle a device handle to get the statistics of, or NULL for
+ * the statistics of the whole context
+ * \param stats output location for the statistics, indexed by
+ * \ref libusb_transfer_type
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ */
+int API_EXPORTED libusb_get_stats(libusb_context *ctx,
+	libusb_device_handle *dev_handle, struct libusb_stats *stats)
+{
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (dev_handle)
+		ctx = HANDLE_CTX(dev_handle);
+	USBI_GET_CONTEXT(ctx);
+
+	usbi_mutex_lock(&ctx->stats_lock);
+	*stats = dev_handle ? dev_handle->stats : ctx->stats;
+	usbi_mutex_unlock(&ctx->stats_lock);
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Clear the transfer statistics of a context or of one device handle.
+ * Clearing the statistics of a device handle does not change those of its
+ * context, and the other way round.
+ *
+ * Since \ref LIBUSBX_API_VERSION >= 0x0100010A
+ *
+ * \param ctx the context to operate on, or NULL for the default context.
+ * Ignored if dev_handle is given.
+ * \param dev_handle a device handle to clear the statistics of, or NULL to
+ * clear the statistics of the whole context
+ */
+void API_EXPORTED libusb_reset_stats(libusb_context *ctx,
+	libusb_device_handle *dev_handle)
+{
+	if (dev_handle)
+		ctx = HANDLE_CTX(dev_handle);
+	USBI_GET_CONTEXT(ctx);
+
+	usbi_mutex_lock(&ctx->stats_lock);
+	if (dev_handle)
+		memset(&dev_handle->stats, 0, sizeof(dev_handle->stats));
+	else
+		memset(&ctx->stats, 0, sizeof(ctx->stats));
+	usbi_mutex_unlock(&ctx->stats_lock);
+}
+
+/* Binary min-heap of the flying transfers which have a timeout, so that
+ * submission and completion do not have to walk all transfers in flight.
+ * All of these must be called with the flying_transfers_lock held. */
+static void timeout_heap_set(struct libusb_context *ctx, unsigned int pos,
+	struct usbi_transfer *transfer)
+{
+	ctx->timeout_heap[pos] = transfer;
+	transfer->timeout_index = pos + 1;
+}
+
+static void timeout_heap_up(struct libusb_context *ctx, unsigned int pos)
+{
+	struct usbi_transfer *transfer = ctx->timeout_heap[pos];
+
+	while (pos > 0) {
+		unsigned int parent = (pos - 1) / 2;
+		if (!timercmp(&transfer->timeout,
+				&ctx->timeout_heap[parent]->timeout, <))
+			break;
+		timeout_heap_set(ctx, pos, ctx->timeout_heap[parent]);
+		pos = parent;
+	}
+	timeout_heap_set(ctx, pos, transfer);
+}
+
+static void timeout_heap_down(struct libusb_context *ctx, unsigned int pos)
+{
+	struct usbi_transfer *transfer = ctx->timeout_heap[pos];
+	unsigned int len = ctx->timeout_heap_len;
+
+	while (2 * pos + 1 < len) {
+		unsigned int child = 2 * pos + 1;
+		if (child + 1 < len &&
+		    timercmp(&ctx->timeout_heap[child + 1]->timeout,
+				&ctx->timeout_heap[child]->timeout, <))
+			child++;
+		if (!timercmp(&ctx->timeout_heap[child]->timeout,
+				&transfer->timeout, <))
+			break;
+		timeout_heap_set(ctx, pos, ctx->timeout_heap[child]);
+		pos = child;
+	}
+	timeout_heap_set(ctx, pos, transfer);
+}
+
+static int timeout_heap_insert(struct libusb_context *ctx,
+	struct usbi_transfer *transfer)
+{
+	if (ctx->timeout_heap_len == ctx->timeout_heap_size) {
+		unsigned int size = ctx->timeout_heap_size ?
+			ctx->timeout_heap_size * 2 : 32;
+		struct usbi_transfer **heap = realloc(ctx->timeout_heap,
+			size * sizeof(*heap));
+		if (!heap)
+			return LIBUSB_ERROR_NO_MEM;
+		ctx->timeout_heap = heap;
+		ctx->timeout_heap_size = size;
+	}
+	ctx->timeout_heap[ctx->timeout_heap_len++] = transfer;
+	timeout_heap_up(ctx, ctx->timeout_heap_len - 1);
+	return 0;
+}
+
+static void timeout_heap_remove(struct libusb_context *ctx,
+	struct usbi_transfer *transfer)
+{
+	unsigned int pos;
+	struct usbi_transfer *last;
+
+	if (!transfer->timeout_index)
+		return;
+
+	pos = transfer->timeout_index - 1;
+	transfer->timeout_index = 0;
+	last = ctx->timeout_heap[--ctx->timeout_heap_len];
+	if (pos == ctx->timeout_heap_len)
+		return;
+
+	timeout_heap_set(ctx, pos, last);
+	timeout_heap_up(ctx, pos);
+	timeout_heap_down(ctx, last->timeout_index - 1);
+}
+
+/* returns the flying transfer with the soonest timeout that still has to be
+ * handled by libusbx, or NULL if there is none. transfers which have already
+ * timed out or whose timeout is handled by the OS are dropped from the heap
+ * on the way. */
+static struct usbi_transfer *timeout_heap_next(struct libusb_context *ctx)
+{
+	while (ctx->timeout_heap_len) {
+		struct usbi_transfer *transfer = ctx->timeout_heap[0];
+		if (!(transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT)))
+			return transfer;
+		timeout_heap_remove(ctx, transfer);
+	}
+	return NULL;
+}
+
+#ifdef USBI_TIMERFD_AVAILABLE
+static int arm_timerfd(struct libusb_context *ctx, const struct timeval *tv)
+{
+	const struct itimerspec it = { {0, 0},
+		{ tv->tv_sec, tv->tv_usec * 1000 } };
+
+	if (timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL) < 0) {
+		timerclear(&ctx->timerfd_armed);
+		return LIBUSB_ERROR_OTHER;
+	}
+	ctx->timerfd_armed = *tv;
+	return 0;
+}
+#endif
+
+/* add a transfer to the active transfers list, and to the timeout heap if it
+ * has a timeout.
+ * Callers of this function must hold the flying_transfers_lock.
+ * This function *always* adds the transfer to the flying_transfers list,
+ * it will return non 0 if it fails to track its timeout, but even then the
+ * transfer is added to the flying_transfers list.
+ *
+ * The timerfd is only re-armed when the new timeout is sooner than the one
+ * it is armed for. It is left alone when transfers complete, at worst it
+ * then fires early once and handle_timerfd_trigger() arms it for the next
+ * timeout. */
+static int add_to_flying_list(struct usbi_transfer *transfer)
+{
+	struct timeval *timeout = &transfer->timeout;
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	int r;
+
 	list_add_tail(&transfer->list, &ctx->flying_transfers);
-out:
+	transfer->timeout_index = 0;
+
+	/* transfers with infinite timeout are not tracked in the heap */
+	if (!timerisset(timeout))
+		return 0;
+
+	r = timeout_heap_insert(ctx, transfer);
+	if (r < 0)
+		return r;
+
 #ifdef USBI_TIMERFD_AVAILABLE
-	if (first && usbi_using_timerfd(ctx) && timerisset(timeout)) {
-		/* if this transfer has the lowest timeout of all active transfers,
-		 * rearm the timerfd with this transfer's timeout */
-		const struct itimerspec it = { {0, 0},
-			{ timeout->tv_sec, timeout->tv_usec * 1000 } };
+	if (usbi_using_timerfd(ctx) && transfer->timeout_index == 1 &&
+	    (!timerisset(&ctx->timerfd_armed) ||
+	     timercmp(timeout, &ctx->timerfd_armed, <))) {
 		usbi_dbg("arm timerfd for timeout in %dms (first in line)",
 			USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-		r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-		if (r < 0) {
+		r = arm_timerfd(ctx, timeout);
+		if (r < 0)
 			usbi_warn(ctx, "failed to arm first timerfd (errno %d)", errno);
-			r = LIBUSB_ERROR_OTHER;
-		}
 	}
-#else
-	UNUSED(first);
 #endif
 
 	return r;
 }
 
+/* remove a transfer from the active transfers list and the timeout heap.
+ * Callers of this function must hold the flying_transfers_lock. */
+static void remove_from_flying_list(struct usbi_transfer *transfer)
+{
+	list_del(&transfer->list);
+	timeout_heap_remove(ITRANSFER_CTX(transfer), transfer);
+}
+
+/* Freed transfers are kept for reuse by libusb_alloc_transfer(), bucketed
+ * by their number of iso packet descriptors, which fixes the size of the
+ * allocation. This saves the calloc/free and the lock setup for programs
+ * which allocate a transfer per request, as the synchronous API does. The
+ * cache is shared by all contexts, as transfers are allocated without one.
+ * It is only used while a context exists, and is emptied when the last one
+ * exits, so that nothing is kept for transfers freed after that. */
+#define TRANSFER_CACHE_MAX_ISO		64
+#define TRANSFER_CACHE_DEPTH		32
+
+static struct list_head transfer_cache[TRANSFER_CACHE_MAX_ISO + 1];
+static int transfer_cache_len[TRANSFER_CACHE_MAX_ISO + 1];
+static int transfer_cache_initialized = 0;
+static int transfer_cache_contexts = 0;
+static uint64_t transfer_cache_hits = 0;
+static uint64_t transfer_cache_misses = 0;
+static usbi_mutex_static_t transfer_cache_lock = USBI_MUTEX_INITIALIZER;
+
+static size_t transfer_alloc_size(int iso_packets)
+{
+	size_t os_alloc_size = usbi_backend->transfer_priv_size
+		+ (usbi_backend->add_iso_packet_size * iso_packets);
+	return sizeof(struct usbi_transfer)
+		+ sizeof(struct libusb_transfer)
+		+ (sizeof(struct libusb_iso_packet_descriptor) * iso_packets)
+		+ os_alloc_size;
+}
+
+/* must be called with the transfer_cache_lock held */
+static void transfer_cache_init(void)
+{
+	int i;
+
+	if (transfer_cache_initialized)
+		return;
+	for (i = 0; i <= TRANSFER_CACHE_MAX_ISO; i++)
+		list_init(&transfer_cache[i]);
+	transfer_cache_initialized = 1;
+}
+
+/* returns a cached transfer with the given number of iso packets, or NULL */
+static struct usbi_transfer *transfer_cache_get(int iso_packets)
+{
+	struct usbi_transfer *itransfer = NULL;
+
+	usbi_mutex_static_lock(&transfer_cache_lock);
+	if (iso_packets >= 0 && iso_packets <= TRANSFER_CACHE_MAX_ISO &&
+	    transfer_cache_len[iso_packets]) {
+		itransfer = list_entry(transfer_cache[iso_packets].next,
+			struct usbi_transfer, list);
+		list_del(&itransfer->list);
+		transfer_cache_len[iso_packets]--;
+		transfer_cache_hits++;
+	} else {
+		transfer_cache_misses++;
+	}
+	usbi_mutex_static_unlock(&transfer_cache_lock);
+	return itransfer;
+}
+
+/* keeps a transfer for reuse. returns 0 if the cache has no room for it */
+static int transfer_cache_put(struct usbi_transfer *itransfer)
+{
+	int iso_packets = itransfer->num_iso_packets;
+	int r = 0;
+
+	if (iso_packets < 0 || iso_packets > TRANSFER_CACHE_MAX_ISO)
+		return 0;
+
+	usbi_mutex_static_lock(&transfer_cache_lock);
+	if (transfer_cache_contexts &&
+	    transfer_cache_len[iso_packets] < TRANSFER_CACHE_DEPTH) {
+		list_add(&itransfer->list, &transfer_cache[iso_packets]);
+		transfer_cache_len[iso_packets]++;
+		r = 1;
+	}
+	usbi_mutex_static_unlock(&transfer_cache_lock);
+	return r;
+}
+
+/* called for each context created */
+void usbi_transfer_cache_ref(void)
+{
+	usbi_mutex_static_lock(&transfer_cache_lock);
+	transfer_cache_init();
+	transfer_cache_contexts++;
+	usbi_mutex_static_unlock(&transfer_cache_lock);
+}
+
+/* called for each context destroyed. frees every cached transfer once the
+ * last one is gone */
+void usbi_transfer_cache_unref(void)
+{
+	struct usbi_transfer *itransfer, *tmp;
+	int i;
+
+	usbi_mutex_static_lock(&transfer_cache_lock);
+	if (--transfer_cache_contexts == 0) {
+		usbi_dbg("transfer cache: %lu hits, %lu misses",
+			(unsigned long)transfer_cache_hits,
+			(unsigned long)transfer_cache_misses);
+		for (i = 0; i <= TRANSFER_CACHE_MAX_ISO; i++) {
+			list_for_each_entry_safe(itransfer, tmp, &transfer_cache[i], list, struct usbi_transfer) {
+				list_del(&itransfer->list);
+				usbi_mutex_destroy(&itransfer->lock);
+				free(itransfer);
+			}
+			transfer_cache_len[i] = 0;
+		}
+	}
+	usbi_mutex_static_unlock(&transfer_cache_lock);
+}
+
+/** \ingroup asyncio
+ * Fill libusbx's cache of freed transfers, so that the next count calls to
+ * libusb_alloc_transfer() with the same iso_packets do not need to allocate
+ * memory. This is optional, the cache also fills up as transfers are freed.
+ * The cache is only kept while a context exists, and is emptied when the
+ * last context exits.
+ *
+ * Since \ref LIBUSBX_API_VERSION >= 0x01000104
+ *
+ * \param iso_packets number of isochronous packet descriptors, as would be
+ * passed to libusb_alloc_transfer()
+ * \param count number of transfers to make available
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if iso_packets is larger than the cache
+ * handles, or count is larger than it keeps
+ * \returns LIBUSB_ERROR_NOT_FOUND if there is no context
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_prealloc_transfers(int iso_packets, int count)
+{
+	size_t alloc_size = transfer_alloc_size(iso_packets);
+	int contexts, cached;
+
+	if (iso_packets < 0 || iso_packets > TRANSFER_CACHE_MAX_ISO ||
+	    count < 0 || count > TRANSFER_CACHE_DEPTH)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_static_lock(&transfer_cache_lock);
+	contexts = transfer_cache_contexts;
+	cached = transfer_cache_len[iso_packets];
+	usbi_mutex_static_unlock(&transfer_cache_lock);
+	if (!contexts)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	for (; cached < count; cached++) {
+		struct usbi_transfer *itransfer = calloc(1, alloc_size);
+		if (!itransfer)
+			return LIBUSB_ERROR_NO_MEM;
+
+		itransfer->num_iso_packets = iso_packets;
+		usbi_mutex_init(&itransfer->lock, NULL);
+		if (!transfer_cache_put(itransfer)) {
+			usbi_mutex_destroy(&itransfer->lock);
+			free(itransfer);
+			break;
+		}
+	}
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Get the number of libusb_alloc_transfer() calls which were served from the
+ * cache of freed transfers, and the number which had to allocate memory. The
+ * counters are shared by all contexts and are never reset, so callers
+ * interested in a sequence of allocations should compare the values from
+ * before and after it.
+ *
+ * Since \ref LIBUSBX_API_VERSION >= 0x0100010D
+ *
+ * \param hits output location for the number of cache hits, or NULL
+ * \param misses output location for the number of cache misses, or NULL
+ */
+void API_EXPORTED libusb_get_transfer_cache_stats(uint64_t *hits,
+	uint64_t *misses)
+{
+	usbi_mutex_static_lock(&transfer_cache_lock);
+	if (hits)
+		*hits = transfer_cache_hits;
+	if (misses)
+		*misses = transfer_cache_misses;
+	usbi_mutex_static_unlock(&transfer_cache_lock);
+}
+
 /** \ingroup asyncio
  * Allocate a libusbx transfer with a specified number of isochronous packet
  * descriptors. The returned transfer is pre-initialized for you. When the new
@@ -1317,13 +1806,21 @@ DEFAULT_VISIBILITY
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 	int iso_packets)
 {
-	size_t os_alloc_size = usbi_backend->transfer_priv_size
-		+ (usbi_backend->add_iso_packet_size * iso_packets);
-	size_t alloc_size = sizeof(struct usbi_transfer)
-		+ sizeof(struct libusb_transfer)
-		+ (sizeof(struct libusb_iso_packet_descriptor) * iso_packets)
-		+ os_alloc_size;
-	struct usbi_transfer *itransfer = calloc(1, alloc_size);
+	size_t alloc_size = transfer_alloc_size(iso_packets);
+	struct usbi_transfer *itransfer = transfer_cache_get(iso_packets);
+
+	if (itransfer) {
+		/* keep the lock, which was initialized when first allocated */
+		itransfer->transferred = 0;
+		itransfer->flags = 0;
+		itransfer->timeout_index = 0;
+		timerclear(&itransfer->timeout);
+		memset(USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer), 0,
+			alloc_size - sizeof(struct usbi_transfer));
+		return USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	}
+
+	itransfer = calloc(1, alloc_size);
 	if (!itransfer)
 		return NULL;
 
@@ -1347,6 +1844,12 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
  * It is not legal to free an active transfer (one which has been submitted
  * and has not yet completed).
  *
+ * A buffer freed through \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
+ * "LIBUSB_TRANSFER_FREE_BUFFER" may have been allocated with
+ * libusb_dev_mem_alloc(), in which case it is released as by
+ * libusb_dev_mem_free(). The transfer must then still have the handle the
+ * memory was allocated for, and be freed before that handle is closed.
+ *
  * \param transfer the transfer to free
  */
 void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
@@ -1355,10 +1858,18 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 	if (!transfer)
 		return;
 
-	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER && transfer->buffer)
-		free(transfer->buffer);
+	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER && transfer->buffer) {
+		/* the buffer may have come from libusb_dev_mem_alloc(), whose size
+		 * the transfer does not record */
+		if (!transfer->dev_handle || !usbi_backend->dev_mem_free ||
+		    usbi_backend->dev_mem_free(transfer->dev_handle,
+				transfer->buffer, 0) == LIBUSB_ERROR_NOT_FOUND)
+			free(transfer->buffer);
+	}
 
 	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (transfer_cache_put(itransfer))
+		return;
 	usbi_mutex_destroy(&itransfer->lock);
 	free(itransfer);
 }
@@ -1370,6 +1881,7 @@ static int disarm_timerfd(struct libusb_context *ctx)
 	int r;
 
 	usbi_dbg("");
+	timerclear(&ctx->timerfd_armed);
 	r = timerfd_settime(ctx->timerfd, 0, &disarm_timer, NULL);
 	if (r < 0)
 		return LIBUSB_ERROR_OTHER;
@@ -1377,45 +1889,24 @@ static int disarm_timerfd(struct libusb_context *ctx)
 		return 0;
 }
 
-/* iterates through the flying transfers, and rearms the timerfd based on the
- * next upcoming timeout.
+/* rearms the timerfd based on the next upcoming timeout.
  * must be called with flying_list locked.
  * returns 0 if there was no timeout to arm, 1 if the next timeout was armed,
  * or a LIBUSB_ERROR code on failure.
  */
 static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
 {
-	struct usbi_transfer *transfer;
+	struct usbi_transfer *transfer = timeout_heap_next(ctx);
+	int r;
 
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!timerisset(cur_tv))
-			goto disarm;
-
-		/* act on first transfer that is not already cancelled */
-		if (!(transfer->flags & USBI_TRANSFER_TIMED_OUT)) {
-			int r;
-			const struct itimerspec it = { {0, 0},
-				{ cur_tv->tv_sec, cur_tv->tv_usec * 1000 } };
-			usbi_dbg("next timeout originally %dms", USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-			r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-			if (r < 0)
-				return LIBUSB_ERROR_OTHER;
-			return 1;
-		}
-	}
+	if (!transfer)
+		return disarm_timerfd(ctx);
 
-disarm:
-	return disarm_timerfd(ctx);
-}
-#else
-static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
-{
-	(void)ctx;
-	return 0;
+	usbi_dbg("next timeout originally %dms", USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
+	r = arm_timerfd(ctx, &transfer->timeout);
+	if (r < 0)
+		return r;
+	return 1;
 }
 #endif
 
@@ -1453,11 +1944,11 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	if (r == LIBUSB_SUCCESS) {
 		r = usbi_backend->submit_transfer(itransfer);
 	}
-	if (r != LIBUSB_SUCCESS) {
-		list_del(&itransfer->list);
-		arm_timerfd_for_next_timeout(ctx);
-	}
+	if (r != LIBUSB_SUCCESS)
+		remove_from_flying_list(itransfer);
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	if (r == LIBUSB_SUCCESS)
+		stats_count_submitted(ctx, &transfer, 1);
 
 out:
 	updated_fds = (itransfer->flags & USBI_TRANSFER_UPDATED_FDS);
@@ -1467,6 +1958,123 @@ out:
 	return r;
 }
 
+/* qsort() comparison putting transfers in address order */
+static int compare_transfers(const void *a, const void *b)
+{
+	uintptr_t ta = (uintptr_t) *(struct libusb_transfer * const *) a;
+	uintptr_t tb = (uintptr_t) *(struct libusb_transfer * const *) b;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+/** \ingroup asyncio
+ * Submit several transfers at once. This behaves like calling
+ * libusb_submit_transfer() on each of them in turn, but the batch shares one
+ * clock reading for the timeouts and one pass over libusbx's list of
+ * transfers in flight, and the transfers are handed to the operating system
+ * back to back.
+ *
+ * All transfers must belong to devices of the same context, and each may
+ * appear only once. If a transfer cannot be submitted, the ones before it
+ * stay submitted and it and the ones after it are not submitted.
+ *
+ * Since \ref LIBUSBX_API_VERSION >= 0x01000103
+ *
+ * \param transfers the transfers to submit
+ * \param count the number of transfers
+ * \returns the number of transfers which were submitted, which is count
+ * unless one of them failed
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the batch is not valid, in which
+ * case nothing is submitted
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns the error libusb_submit_transfer() would have returned, if the
+ * first transfer could not be submitted
+ */
+int API_EXPORTED libusb_submit_transfers(struct libusb_transfer **transfers,
+	int count)
+{
+	struct libusb_context *ctx;
+	struct libusb_transfer **sorted;
+	struct timespec now;
+	int updated_fds = 0;
+	int submitted;
+	int i, r;
+
+	if (!transfers || count <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	for (i = 0; i < count; i++) {
+		if (!transfers[i] || !transfers[i]->dev_handle)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		if (TRANSFER_CTX(transfers[i]) != TRANSFER_CTX(transfers[0]))
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	ctx = TRANSFER_CTX(transfers[0]);
+
+	/* The transfer locks are taken in address order, so that threads
+	 * submitting batches which share transfers cannot deadlock. Sorting
+	 * also brings any transfer listed twice next to itself. */
+	sorted = malloc(count * sizeof(*sorted));
+	if (!sorted)
+		return LIBUSB_ERROR_NO_MEM;
+	memcpy(sorted, transfers, count * sizeof(*sorted));
+	qsort(sorted, count, sizeof(*sorted), compare_transfers);
+	for (i = 1; i < count; i++) {
+		if (sorted[i] == sorted[i - 1]) {
+			free(sorted);
+			return LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+
+	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now);
+	if (r < 0) {
+		usbi_err(ctx, "failed to read monotonic clock, errno=%d", errno);
+		free(sorted);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	/* same lock order as libusb_submit_transfer(): every transfer lock,
+	 * then the flying transfers lock */
+	for (i = 0; i < count; i++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(sorted[i]);
+		usbi_mutex_lock(&itransfer->lock);
+		itransfer->transferred = 0;
+		itransfer->flags = 0;
+		itransfer->submitted = now;
+		set_transfer_timeout(itransfer, &now);
+	}
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	for (submitted = 0; submitted < count; submitted++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[submitted]);
+		r = add_to_flying_list(itransfer);
+		if (r == LIBUSB_SUCCESS)
+			r = usbi_backend->submit_transfer(itransfer);
+		if (r != LIBUSB_SUCCESS) {
+			remove_from_flying_list(itransfer);
+			break;
+		}
+	}
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	stats_count_submitted(ctx, transfers, submitted);
+
+	for (i = 0; i < count; i++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(sorted[i]);
+		if (itransfer->flags & USBI_TRANSFER_UPDATED_FDS)
+			updated_fds = 1;
+		usbi_mutex_unlock(&itransfer->lock);
+	}
+	free(sorted);
+	if (updated_fds)
+		usbi_fd_notification(ctx);
+
+	if (submitted < count)
+		usbi_dbg("transfer %d of %d failed with error %d", submitted, count, r);
+	return submitted ? submitted : r;
+}
+
 /** \ingroup asyncio
  * Asynchronously cancel a previously submitted transfer.
  * This function returns immediately, but this does not indicate cancellation
@@ -1523,20 +2131,11 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct libusb_context *ctx = TRANSFER_CTX(transfer);
 	uint8_t flags;
-	int r = 0;
-
-	/* FIXME: could be more intelligent with the timerfd here. we don't need
-	 * to disarm the timerfd if there was no timer running, and we only need
-	 * to rearm the timerfd if the transfer that expired was the one with
-	 * the shortest timeout. */
 
+	/* the timerfd is left armed, see add_to_flying_list() */
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	list_del(&itransfer->list);
-	if (usbi_using_timerfd(ctx))
-		r = arm_timerfd_for_next_timeout(ctx);
+	remove_from_flying_list(itransfer);
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-	if (usbi_using_timerfd(ctx) && (r < 0))
-		return r;
 
 	if (status == LIBUSB_TRANSFER_COMPLETED
 			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
@@ -1549,6 +2148,8 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 		}
 	}
 
+	stats_count_finished(itransfer, status);
+
 	flags = transfer->flags;
 	transfer->status = status;
 	transfer->actual_length = itransfer->transferred;
@@ -1850,7 +2451,8 @@ static int handle_timeouts_locked(struct libusb_context *ctx)
 	struct timeval systime;
 	struct usbi_transfer *transfer;
 
-	if (list_empty(&ctx->flying_transfers))
+	transfer = timeout_heap_next(ctx);
+	if (!transfer)
 		return 0;
 
 	/* get current time */
@@ -1860,26 +2462,15 @@ static int handle_timeouts_locked(struct libusb_context *ctx)
 
 	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
 
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!timerisset(cur_tv))
-			return 0;
-
-		/* ignore timeouts we've already handled */
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
+	/* take transfers off the timeout heap for as long as the soonest one has
+	 * expired */
+	for (; transfer; transfer = timeout_heap_next(ctx)) {
 		/* if transfer has non-expired timeout, nothing more to do */
-		if ((cur_tv->tv_sec > systime.tv_sec) ||
-				(cur_tv->tv_sec == systime.tv_sec &&
-					cur_tv->tv_usec > systime.tv_usec))
+		if (timercmp(&transfer->timeout, &systime, >))
 			return 0;
 
 		/* otherwise, we've got an expired timeout to handle */
+		timeout_heap_remove(ctx, transfer);
 		handle_timeout(transfer);
 	}
 	return 0;
@@ -1916,38 +2507,132 @@ out:
 }
 #endif
 
-/* do the actual event handling. assumes that no other thread is concurrently
- * doing the same thing. */
-static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+/* the most hotplug messages taken from the pipe in one read */
+#define USBI_HOTPLUG_BATCH	16
+
+/* read the messages waiting in the hotplug pipe and dispatch each to the
+ * matching hotplug callbacks. writes of a message are atomic, so a single
+ * read drains up to a batch of whole messages, and a burst of hotplug
+ * events costs one wakeup per batch rather than one per device */
+static int handle_hotplug_pipe(struct libusb_context *ctx)
 {
-	int r;
-	struct usbi_pollfd *ipollfd;
+	libusb_hotplug_message messages[USBI_HOTPLUG_BATCH];
+	ssize_t ret;
+	int i, count;
+
+	usbi_dbg("caught a fish on the hotplug pipe");
+
+	/* read the messages from the hotplug thread */
+	ret = usbi_read(ctx->hotplug_pipe[0], messages, sizeof (messages));
+	if (ret < (ssize_t) sizeof(messages[0]) ||
+	    ret % sizeof(messages[0])) {
+		usbi_err(ctx, "hotplug pipe read error %d", ret);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	count = (int) (ret / sizeof(messages[0]));
+	if (count > 1)
+		usbi_dbg("%d hotplug messages", count);
+
+	for (i = 0; i < count; i++) {
+		usbi_hotplug_match(ctx, messages[i].device, messages[i].event);
+
+		/* the device left. dereference the device */
+		if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == messages[i].event)
+			libusb_unref_device(messages[i].device);
+	}
+
+	return 0;
+}
+
+#ifdef USBI_EPOLL_AVAILABLE
+/* the epoll flavour of handle_events(). only the fds which are ready are
+ * returned by the kernel, so the internal fds are recognised by number and
+ * the backend is passed an array holding just the ready device fds. each
+ * epoll event carries its fd rather than a pointer, the backend finds the
+ * device handle from it and nothing can be left pointing at a handle which
+ * was closed while its events were pending. */
+static int handle_epoll_events(struct libusb_context *ctx, int timeout_ms)
+{
+	struct epoll_event events[USBI_EPOLL_MAX_EVENTS];
+	struct pollfd fds[USBI_EPOLL_MAX_EVENTS];
 	POLL_NFDS_TYPE nfds = 0;
-	struct pollfd *fds = NULL;
-	int i = -1;
-	int timeout_ms;
+	int hotplug_ready = 0;
+	int timer_ready = 0;
+	int i, r;
 
-	usbi_mutex_lock(&ctx->pollfds_lock);
-	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
-		nfds++;
+	usbi_dbg("epoll_wait() with timeout in %dms", timeout_ms);
+	r = epoll_wait(ctx->epoll_fd, events, USBI_EPOLL_MAX_EVENTS, timeout_ms);
+	usbi_dbg("epoll_wait() returned %d", r);
+	if (r == 0) {
+		return handle_timeouts(ctx);
+	} else if (r == -1 && errno == EINTR) {
+		return LIBUSB_ERROR_INTERRUPTED;
+	} else if (r < 0) {
+		usbi_err(ctx, "epoll_wait failed %d err=%d\n", r, errno);
+		return LIBUSB_ERROR_IO;
+	}
 
-	/* TODO: malloc when number of fd's changes, not on every poll */
-	if (nfds != 0)
-		fds = malloc(sizeof(*fds) * nfds);
-	if (!fds) {
-		usbi_mutex_unlock(&ctx->pollfds_lock);
-		return LIBUSB_ERROR_NO_MEM;
+	for (i = 0; i < r; i++) {
+		int fd = events[i].data.fd;
+
+		if (fd == ctx->ctrl_pipe[0]) {
+			/* another thread wanted to interrupt event handling, and it
+			 * succeeded! handle any other events that cropped up at the
+			 * same time, and simply return */
+			usbi_dbg("caught a fish on the control pipe");
+		} else if (fd == ctx->hotplug_pipe[0]) {
+			hotplug_ready = 1;
+#ifdef USBI_TIMERFD_AVAILABLE
+		} else if (usbi_using_timerfd(ctx) && fd == ctx->timerfd) {
+			timer_ready = 1;
+#endif
+		} else {
+			/* the EPOLL* flags have the values of their POLL* counterparts */
+			fds[nfds].fd = fd;
+			fds[nfds].events = 0;
+			fds[nfds].revents = (short)events[i].events;
+			nfds++;
+		}
 	}
 
-	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd) {
-		struct libusb_pollfd *pollfd = &ipollfd->pollfd;
-		int fd = pollfd->fd;
-		i++;
-		fds[i].fd = fd;
-		fds[i].events = pollfd->events;
-		fds[i].revents = 0;
+	if (hotplug_ready && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		r = handle_hotplug_pipe(ctx);
+		if (r < 0)
+			return r;
 	}
-	usbi_mutex_unlock(&ctx->pollfds_lock);
+
+#ifdef USBI_TIMERFD_AVAILABLE
+	if (timer_ready) {
+		/* timerfd indicates that a timeout has expired */
+		usbi_dbg("timerfd triggered");
+		r = handle_timerfd_trigger(ctx);
+		if (r < 0)
+			return r;
+	}
+#else
+	UNUSED(timer_ready);
+#endif
+
+	if (!nfds)
+		return 0;
+
+	r = usbi_backend->handle_events(ctx, fds, nfds, nfds);
+	if (r)
+		usbi_err(ctx, "backend handle_events failed with error %d", r);
+	return r;
+}
+#endif
+
+/* do the actual event handling. assumes that no other thread is concurrently
+ * doing the same thing. */
+static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+{
+	int r;
+	struct usbi_pollfd *ipollfd;
+	POLL_NFDS_TYPE nfds;
+	struct pollfd *fds;
+	int timeout_ms;
 
 	timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
 
@@ -1955,17 +2640,52 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	if (tv->tv_usec % 1000)
 		timeout_ms++;
 
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx))
+		return handle_epoll_events(ctx, timeout_ms);
+#endif
+
+	usbi_mutex_lock(&ctx->pollfds_lock);
+	if (!ctx->pollfds_array ||
+	    ctx->pollfds_array_generation != ctx->pollfds_generation) {
+		nfds = 0;
+		list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
+			nfds++;
+
+		if (nfds > ctx->pollfds_array_size) {
+			fds = realloc(ctx->pollfds_array, sizeof(*fds) * nfds);
+			if (!fds) {
+				usbi_mutex_unlock(&ctx->pollfds_lock);
+				return LIBUSB_ERROR_NO_MEM;
+			}
+			ctx->pollfds_array = fds;
+			ctx->pollfds_array_size = nfds;
+		}
+
+		fds = ctx->pollfds_array;
+		nfds = 0;
+		list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd) {
+			struct libusb_pollfd *pollfd = &ipollfd->pollfd;
+			fds[nfds].fd = pollfd->fd;
+			fds[nfds].events = pollfd->events;
+			fds[nfds].revents = 0;
+			nfds++;
+		}
+		ctx->pollfds_array_nfds = nfds;
+		ctx->pollfds_array_generation = ctx->pollfds_generation;
+	}
+	fds = ctx->pollfds_array;
+	nfds = ctx->pollfds_array_nfds;
+	usbi_mutex_unlock(&ctx->pollfds_lock);
+
 	usbi_dbg("poll() %d fds with timeout in %dms", nfds, timeout_ms);
 	r = usbi_poll(fds, nfds, timeout_ms);
 	usbi_dbg("poll() returned %d", r);
 	if (r == 0) {
-		free(fds);
 		return handle_timeouts(ctx);
 	} else if (r == -1 && errno == EINTR) {
-		free(fds);
 		return LIBUSB_ERROR_INTERRUPTED;
 	} else if (r < 0) {
-		free(fds);
 		usbi_err(ctx, "poll failed %d err=%d\n", r, errno);
 		return LIBUSB_ERROR_IO;
 	}
@@ -1989,26 +2709,12 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 
 	/* fd[1] is always the hotplug pipe */
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) && fds[1].revents) {
-		libusb_hotplug_message message;
-		ssize_t ret;
-
-		usbi_dbg("caught a fish on the hotplug pipe");
-
-		/* read the message from the hotplug thread */
-		ret = usbi_read(ctx->hotplug_pipe[0], &message, sizeof (message));
-		if (ret < sizeof(message)) {
-			usbi_err(ctx, "hotplug pipe read error %d < %d",
-				 ret, sizeof(message));
-			r = LIBUSB_ERROR_OTHER;
+		int ret = handle_hotplug_pipe(ctx);
+		if (ret < 0) {
+			r = ret;
 			goto handled;
 		}
 
-		usbi_hotplug_match(ctx, message.device, message.event);
-
-		/* the device left. dereference the device */
-		if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == message.event)
-			libusb_unref_device(message.device);
-
 		fds[1].revents = 0;
 		if (1 == r--)
 			goto handled;
@@ -2044,7 +2750,6 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 		usbi_err(ctx, "backend handle_events failed with error %d", r);
 
 handled:
-	free(fds);
 	return r;
 }
 
@@ -2327,9 +3032,8 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	struct usbi_transfer *transfer;
 	struct timespec cur_ts;
 	struct timeval cur_tv;
-	struct timeval *next_timeout;
+	struct timeval next_timeout;
 	int r;
-	int found = 0;
 
 	USBI_GET_CONTEXT(ctx);
 	if (usbi_using_timerfd(ctx))
@@ -2343,26 +3047,16 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	}
 
 	/* find next transfer which hasn't already been processed as timed out */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* no timeout for this transfer? */
-		if (!timerisset(&transfer->timeout))
-			continue;
-
-		found = 1;
-		break;
-	}
+	transfer = timeout_heap_next(ctx);
+	if (transfer)
+		next_timeout = transfer->timeout;
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
-	if (!found) {
+	if (!transfer) {
 		usbi_dbg("no URB with timeout or all handled by OS; no timeout!");
 		return 0;
 	}
 
-	next_timeout = &transfer->timeout;
-
 	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &cur_ts);
 	if (r < 0) {
 		usbi_err(ctx, "failed to read monotonic clock, errno=%d", errno);
@@ -2370,11 +3064,11 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	}
 	TIMESPEC_TO_TIMEVAL(&cur_tv, &cur_ts);
 
-	if (!timercmp(&cur_tv, next_timeout, <)) {
+	if (!timercmp(&cur_tv, &next_timeout, <)) {
 		usbi_dbg("first timeout already expired");
 		timerclear(tv);
 	} else {
-		timersub(next_timeout, &cur_tv, tv);
+		timersub(&next_timeout, &cur_tv, tv);
 		usbi_dbg("next timeout in %d.%06ds", tv->tv_sec, tv->tv_usec);
 	}
 
@@ -2396,6 +3090,9 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
  * and added to the poll set at libusb_init() time). If you don't want this,
  * remove the notifiers immediately before calling libusb_exit().
  *
+ * When libusbx uses epoll (see libusb_get_pollfds()), the notifiers are
+ * never invoked, as the one file descriptor exposed never changes.
+ *
  * \param ctx the context to operate on, or NULL for the default context
  * \param added_cb pointer to function for addition notifications
  * \param removed_cb pointer to function for removal notifications
@@ -2424,11 +3121,29 @@ int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
 	usbi_dbg("add fd %d events %d", fd, events);
 	ipollfd->pollfd.fd = fd;
 	ipollfd->pollfd.events = events;
+
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		struct epoll_event event;
+
+		memset(&event, 0, sizeof(event));
+		event.events = events;
+		event.data.fd = fd;
+		if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			usbi_err(ctx, "failed to add fd %d to epoll (errno %d)", fd, errno);
+			free(ipollfd);
+			return LIBUSB_ERROR_OTHER;
+		}
+	}
+#endif
+
 	usbi_mutex_lock(&ctx->pollfds_lock);
 	list_add_tail(&ipollfd->list, &ctx->pollfds);
+	ctx->pollfds_generation++;
 	usbi_mutex_unlock(&ctx->pollfds_lock);
 
-	if (ctx->fd_added_cb)
+	/* with epoll the application only ever sees the epoll fd */
+	if (ctx->fd_added_cb && !usbi_using_epoll(ctx))
 		ctx->fd_added_cb(fd, events, ctx->fd_cb_user_data);
 	return 0;
 }
@@ -2454,8 +3169,21 @@ void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 	}
 
 	list_del(&ipollfd->list);
+	ctx->pollfds_generation++;
 	usbi_mutex_unlock(&ctx->pollfds_lock);
 	free(ipollfd);
+
+#ifdef USBI_EPOLL_AVAILABLE
+	if (usbi_using_epoll(ctx)) {
+		/* the event argument is ignored, but pre-2.6.9 kernels want one */
+		struct epoll_event event;
+
+		if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, fd, &event) < 0)
+			usbi_dbg("failed to remove fd %d from epoll (errno %d)", fd, errno);
+		return;
+	}
+#endif
+
 	if (ctx->fd_removed_cb)
 		ctx->fd_removed_cb(fd, ctx->fd_cb_user_data);
 }
@@ -2467,6 +3195,11 @@ void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
  * The returned list is NULL-terminated and should be freed with free() when
  * done. The actual list contents must not be touched.
  *
+ * When libusbx was built with --enable-epoll on Linux, the list holds a
+ * single epoll file descriptor which becomes readable whenever any of the
+ * internal ones needs attention, and it does not change while the context
+ * exists.
+ *
  * As file descriptors are a Unix-specific concept, this function is not
  * available on Windows and will always return NULL.
  *
@@ -2486,6 +3219,16 @@ const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
 	size_t cnt = 0;
 	USBI_GET_CONTEXT(ctx);
 
+#ifdef USBI_EPOLL_AVAILABLE
+	/* the epoll fd stands in for all of the others */
+	if (usbi_using_epoll(ctx)) {
+		ret = calloc(2, sizeof(struct libusb_pollfd *));
+		if (ret)
+			ret[0] = &ctx->epoll_pollfd;
+		return (const struct libusb_pollfd **) ret;
+	}
+#endif
+
 	usbi_mutex_lock(&ctx->pollfds_lock);
 	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
 		cnt++;
@@ -2520,6 +3263,8 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle)
 	usbi_dbg("device %d.%d",
 		handle->dev->bus_number, handle->dev->device_address);
 
+	usbi_handle_clear_string_cache(handle);
+
 	/* terminate all pending transfers with the LIBUSB_TRANSFER_NO_DEVICE
 	 * status code.
 	 *
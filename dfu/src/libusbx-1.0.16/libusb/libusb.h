@@ -144,7 +144,7 @@ typedef unsigned __int32  uint32_t;
  * Internally, LIBUSBX_API_VERSION is defined as follows:
  * (libusbx major << 24) | (libusbx minor << 16) | (16 bit incremental)
  */
-#define LIBUSBX_API_VERSION 0x01000102
+#define LIBUSBX_API_VERSION 0x0100010D
 
 #ifdef __cplusplus
 extern "C" {
@@ -1134,7 +1134,10 @@ enum libusb_transfer_flags {
 	/** Report short frames as errors */
 	LIBUSB_TRANSFER_SHORT_NOT_OK = 1<<0,
 
-	/** Automatically free() transfer buffer during libusb_free_transfer() */
+	/** Automatically free() transfer buffer during libusb_free_transfer().
+	 * A buffer from libusb_dev_mem_alloc() is released with
+	 * libusb_dev_mem_free() instead, which requires the transfer to be freed
+	 * before its device handle is closed. */
 	LIBUSB_TRANSFER_FREE_BUFFER = 1<<1,
 
 	/** Automatically call libusb_free_transfer() after callback returns.
@@ -1259,6 +1262,56 @@ struct libusb_transfer {
 	;
 };
 
+/** \ingroup asyncio
+ * Number of buckets in the latency histogram of \ref libusb_transfer_stats.
+ * Bucket 0 counts the transfers which finished less than a microsecond after
+ * they were submitted, bucket i those which took from 2^(i-1) up to 2^i
+ * microseconds, and the last bucket all those which took longer.
+ */
+#define LIBUSB_STATS_LATENCY_BUCKETS	24
+
+/** \ingroup asyncio
+ * Counters for the transfers of one type, see libusb_get_stats().
+ */
+struct libusb_transfer_stats {
+	/** Transfers submitted successfully */
+	uint64_t submitted;
+
+	/** Transfers which finished with LIBUSB_TRANSFER_COMPLETED */
+	uint64_t completed;
+
+	/** Transfers which finished with LIBUSB_TRANSFER_TIMED_OUT */
+	uint64_t timed_out;
+
+	/** Transfers which finished with LIBUSB_TRANSFER_CANCELLED */
+	uint64_t cancelled;
+
+	/** Transfers which finished with LIBUSB_TRANSFER_STALL */
+	uint64_t stalled;
+
+	/** Transfers which finished with another error status */
+	uint64_t failed;
+
+	/** Bytes received, whatever the status of the transfer */
+	uint64_t bytes_in;
+
+	/** Bytes sent, not counting control setup packets */
+	uint64_t bytes_out;
+
+	/** Histogram of the time from submission to completion, see
+	 * \ref LIBUSB_STATS_LATENCY_BUCKETS */
+	uint64_t latency[LIBUSB_STATS_LATENCY_BUCKETS];
+};
+
+/** \ingroup asyncio
+ * Transfer statistics of a context or a device handle, see
+ * libusb_get_stats().
+ */
+struct libusb_stats {
+	/** Counters for each \ref libusb_transfer_type, indexed by type */
+	struct libusb_transfer_stats types[4];
+};
+
 /** \ingroup misc
  * Capabilities supported by an instance of libusb on the current running
  * platform. Test if the loaded library supports a given capability by calling
@@ -1297,9 +1350,34 @@ enum libusb_log_level {
 	LIBUSB_LOG_LEVEL_DEBUG,
 };
 
+/** \ingroup lib
+ * Log sink callback, see libusb_set_log_sink().
+ * \param ctx the context the message was logged on
+ * \param level the level of the message, or LIBUSB_LOG_LEVEL_NONE for the
+ * header printed before the first debug message
+ * \param str the message as a complete line, with its line ending
+ * \param user_data user data given to libusb_set_log_sink()
+ */
+typedef void (LIBUSB_CALL *libusb_log_sink_cb)(libusb_context *ctx,
+	enum libusb_log_level level, const char *str, void *user_data);
+
+/** \ingroup lib
+ * Flags for libusb_set_log_sink().
+ */
+enum libusb_log_sink_flag {
+	/** Hand messages to the sink from a background thread. */
+	LIBUSB_LOG_SINK_ASYNC = 1 << 0,
+};
+
 int LIBUSB_CALL libusb_init(libusb_context **ctx);
+int LIBUSB_CALL libusb_init_lazy(libusb_context **ctx, int vendor_id,
+	int product_id);
 void LIBUSB_CALL libusb_exit(libusb_context *ctx);
 void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level);
+int LIBUSB_CALL libusb_set_log_sink(libusb_context *ctx,
+	libusb_log_sink_cb cb, void *user_data, int flags);
+unsigned int LIBUSB_CALL libusb_get_log_dropped(libusb_context *ctx);
+int LIBUSB_CALL libusb_dump_trace(libusb_context *ctx);
 const struct libusb_version * LIBUSB_CALL libusb_get_version(void);
 int LIBUSB_CALL libusb_has_capability(uint32_t capability);
 const char * LIBUSB_CALL libusb_error_name(int errcode);
@@ -1366,6 +1444,10 @@ int LIBUSB_CALL libusb_get_max_iso_packet_size(libusb_device *dev,
 
 int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **handle);
 void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle);
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev_handle,
+	size_t length);
+int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev_handle,
+	unsigned char *buffer, size_t length);
 libusb_device * LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle);
 
 int LIBUSB_CALL libusb_set_configuration(libusb_device_handle *dev,
@@ -1467,8 +1549,17 @@ static inline void libusb_fill_control_setup(unsigned char *buffer,
 
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfers(struct libusb_transfer **transfers,
+	int count);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_prealloc_transfers(int iso_packets, int count);
+void LIBUSB_CALL libusb_get_transfer_cache_stats(uint64_t *hits,
+	uint64_t *misses);
+int LIBUSB_CALL libusb_get_stats(libusb_context *ctx,
+	libusb_device_handle *dev_handle, struct libusb_stats *stats);
+void LIBUSB_CALL libusb_reset_stats(libusb_context *ctx,
+	libusb_device_handle *dev_handle);
 
 /** \ingroup asyncio
  * Helper function to populate the required \ref libusb_transfer fields
@@ -1698,6 +1789,9 @@ static inline unsigned char *libusb_get_iso_packet_buffer_simple(
 int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout);
+int LIBUSB_CALL libusb_control_transfer_inplace(
+	libusb_device_handle *dev_handle, unsigned char *buffer,
+	unsigned int timeout);
 
 int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
@@ -1751,6 +1845,7 @@ static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
 
 int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
 	uint8_t desc_index, unsigned char *data, int length);
+int LIBUSB_CALL libusb_prefetch_string_descriptors(libusb_device_handle *dev);
 
 /* polling and timeouts */
 
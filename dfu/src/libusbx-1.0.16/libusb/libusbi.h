@@ -153,6 +153,8 @@ void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, va_list args);
 
+void usbi_log_exit(struct libusb_context *ctx);
+
 #if !defined(_MSC_VER) || _MSC_VER >= 1400
 
 #ifdef ENABLE_LOGGING
@@ -217,10 +219,25 @@ static inline void usbi_dbg(const char *format, ...)
 
 extern struct libusb_context *usbi_default_context;
 
+/* Number of buckets in the per-context session ID index. Must be a power of
+ * two. */
+#define USBI_SESSION_HASH_SIZE	64
+
+/* Number of buckets in the per-context index of hotplug callbacks by vendor
+ * and product ID. Must be a power of two. */
+#define USBI_HOTPLUG_HASH_SIZE	32
+
 struct libusb_context {
 	int debug;
 	int debug_fixed;
 
+	/* where log messages go, see libusb_set_log_sink(). log_users counts
+	 * the threads logging through log_sink, and log_dropped the messages
+	 * lost because the queue of its background writer was full. */
+	struct usbi_log_sink * volatile log_sink;
+	volatile int log_users;
+	volatile unsigned int log_dropped;
+
 	/* internal control pipe, used for interrupting event handling when
 	 * something needs to modify poll fds. */
 	int ctrl_pipe[2];
@@ -228,6 +245,17 @@ struct libusb_context {
 	struct list_head usb_devs;
 	usbi_mutex_t usb_devs_lock;
 
+	/* set by libusb_init_lazy() until the backend has scanned for devices,
+	 * and the vendor and product ID the devices of the context must have,
+	 * or -1 to match any. scan_pending is protected by scan_lock. */
+	int scan_pending;
+	usbi_mutex_t scan_lock;
+	int filter_vendor_id;
+	int filter_product_id;
+
+	/* usb_devs indexed by session ID, protected by usb_devs_lock. */
+	struct list_head usb_devs_by_session[USBI_SESSION_HASH_SIZE];
+
 	/* A list of open handles. Backends are free to traverse this if required.
 	 */
 	struct list_head open_devs;
@@ -236,18 +264,41 @@ struct libusb_context {
 	/* A list of registered hotplug callbacks */
 	struct list_head hotplug_cbs;
 	usbi_mutex_t hotplug_cbs_lock;
+
+	/* hotplug_cbs indexed for dispatch, protected by hotplug_cbs_lock.
+	 * callbacks for one vendor and product ID are hashed by the pair, the
+	 * others are in hotplug_cbs_wildcard. */
+	struct list_head hotplug_cbs_by_id[USBI_HOTPLUG_HASH_SIZE];
+	struct list_head hotplug_cbs_wildcard;
 	int hotplug_pipe[2];
 
-	/* this is a list of in-flight transfer handles, sorted by timeout
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
+	/* transfer statistics of the context, see libusb_get_stats(). the lock
+	 * also protects the statistics of each device handle. */
+	struct libusb_stats stats;
+	usbi_mutex_t stats_lock;
+
+	/* this is a list of in-flight transfer handles, in submission order. */
 	struct list_head flying_transfers;
 	usbi_mutex_t flying_transfers_lock;
 
-	/* list of poll fds */
+	/* the in-flight transfers which have a timeout, as a binary min-heap
+	 * ordered by timeout expiration. protected by flying_transfers_lock. */
+	struct usbi_transfer **timeout_heap;
+	unsigned int timeout_heap_len;
+	unsigned int timeout_heap_size;
+
+	/* list of poll fds, and a counter bumped (under pollfds_lock) whenever
+	 * it changes */
 	struct list_head pollfds;
 	usbi_mutex_t pollfds_lock;
+	unsigned int pollfds_generation;
+
+	/* the poll fds as an array for poll(), owned by the thread handling
+	 * events and rebuilt when pollfds_generation moves on */
+	struct pollfd *pollfds_array;
+	POLL_NFDS_TYPE pollfds_array_nfds;
+	POLL_NFDS_TYPE pollfds_array_size;
+	unsigned int pollfds_array_generation;
 
 	/* a counter that is set when we want to interrupt event handling, in order
 	 * to modify the poll fd set. and a lock to protect it. */
@@ -272,8 +323,19 @@ struct libusb_context {
 
 #ifdef USBI_TIMERFD_AVAILABLE
 	/* used for timeout handling, if supported by OS.
-	 * this timerfd is maintained to trigger on the next pending timeout */
+	 * this timerfd is maintained to trigger no later than the next pending
+	 * timeout. timerfd_armed is the expiration it is armed for, cleared when
+	 * disarmed; protected by flying_transfers_lock. */
 	int timerfd;
+	struct timeval timerfd_armed;
+#endif
+
+#ifdef USBI_EPOLL_AVAILABLE
+	/* if epoll is in use, every poll fd is registered with this epoll
+	 * instance, which is what handle_events() waits on and the only fd
+	 * exposed through libusb_get_pollfds() */
+	int epoll_fd;
+	struct libusb_pollfd epoll_pollfd;
 #endif
 
 	struct list_head list;
@@ -285,9 +347,15 @@ struct libusb_context {
 #define usbi_using_timerfd(ctx) (0)
 #endif
 
+#ifdef USBI_EPOLL_AVAILABLE
+#define usbi_using_epoll(ctx) ((ctx)->epoll_fd >= 0)
+#else
+#define usbi_using_epoll(ctx) (0)
+#endif
+
 struct libusb_device {
-	/* lock protects refcnt, everything else is finalized at initialization
-	 * time */
+	/* lock protects refcnt and config_cache, everything else is finalized
+	 * at initialization time */
 	usbi_mutex_t lock;
 	int refcnt;
 
@@ -301,11 +369,18 @@ struct libusb_device {
 	enum libusb_speed speed;
 
 	struct list_head list;
+	struct list_head session_list;
 	unsigned long session_data;
 
+	/* open handles for this device, protected by ctx->open_devs_lock */
+	struct list_head handles;
+
 	struct libusb_device_descriptor device_descriptor;
 	int attached;
 
+	/* parsed configuration descriptors by index, allocated on first use */
+	struct libusb_config_descriptor **config_cache;
+
 	unsigned char os_priv
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
 	[] /* valid C99 code */
@@ -315,14 +390,29 @@ struct libusb_device {
 	;
 };
 
+#define USBI_CONTROL_BUFFERS	4
+
 struct libusb_device_handle {
-	/* lock protects claimed_interfaces */
+	/* lock protects claimed_interfaces, string_cache and the control
+	 * buffers */
 	usbi_mutex_t lock;
 	unsigned long claimed_interfaces;
 
+	/* string descriptors read so far, allocated on first use */
+	struct usbi_string_cache *string_cache;
+
+	/* setup + data buffers kept for reuse by libusb_control_transfer() */
+	unsigned char *control_buffers[USBI_CONTROL_BUFFERS];
+	int control_buffer_sizes[USBI_CONTROL_BUFFERS];
+	int num_control_buffers;
+
 	struct list_head list;
+	struct list_head dev_list; /* in dev->handles */
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
+
+	/* transfer statistics, protected by the stats_lock of the context */
+	struct libusb_stats stats;
 	unsigned char os_priv
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
 	[] /* valid C99 code */
@@ -354,6 +444,10 @@ struct usbi_transfer {
 	int num_iso_packets;
 	struct list_head list;
 	struct timeval timeout;
+	/* when the transfer was submitted, for the latency statistics */
+	struct timespec submitted;
+	/* position in the context's timeout heap plus one, 0 if not in it */
+	unsigned int timeout_index;
 	int transferred;
 	uint8_t flags;
 
@@ -411,12 +505,16 @@ struct usb_descriptor_header {
 
 int usbi_io_init(struct libusb_context *ctx);
 void usbi_io_exit(struct libusb_context *ctx);
+void usbi_transfer_cache_ref(void);
+void usbi_transfer_cache_unref(void);
 
 struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	unsigned long session_id);
 struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	unsigned long session_id);
 int usbi_sanitize_device(struct libusb_device *dev);
+int usbi_device_filter_match(struct libusb_device *dev);
+int usbi_scan_deferred_devices(struct libusb_context *ctx);
 void usbi_handle_disconnect(struct libusb_device_handle *handle);
 
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
@@ -426,6 +524,9 @@ int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer);
 int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	void *dest, int host_endian);
 int usbi_device_cache_descriptor(libusb_device *dev);
+void usbi_device_clear_config_cache(libusb_device *dev);
+void usbi_handle_clear_string_cache(struct libusb_device_handle *dev_handle);
+void usbi_handle_clear_control_buffers(struct libusb_device_handle *dev_handle);
 int usbi_get_config_index_by_value(struct libusb_device *dev,
 	uint8_t bConfigurationValue, int *idx);
 
@@ -988,6 +1089,57 @@ struct usbi_os_backend {
 	/* FIXME: linux can't use this any more. if other OS's cannot either,
 	 * then remove this */
 	size_t add_iso_packet_size;
+
+	/* Allocate persistent memory for transfers on this device which the
+	 * OS can use without copying it, such as a mapping of the device node.
+	 *
+	 * Optional, and backends which list their members positionally may leave
+	 * it out. Return NULL if no such memory is available, in which case
+	 * libusbx falls back to ordinary memory.
+	 */
+	unsigned char *(*dev_mem_alloc)(struct libusb_device_handle *handle,
+		size_t len);
+
+	/* Release memory obtained from dev_mem_alloc(). len is 0 when the
+	 * caller does not know the size, as for a transfer freed with
+	 * LIBUSB_TRANSFER_FREE_BUFFER.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_FOUND if the buffer was not allocated by
+	 *   dev_mem_alloc(), libusbx then frees it as ordinary memory
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*dev_mem_free)(struct libusb_device_handle *handle,
+		unsigned char *buffer, size_t len);
+
+	/* Scan for the devices connected to the system, adding them to the
+	 * context as init() does, for a context created by libusb_init_lazy().
+	 * init() must not scan if ctx->scan_pending is set; libusbx then calls
+	 * this the first time devices are listed or a hotplug callback is
+	 * registered. Devices which do not match the vendor and product ID
+	 * filter of the context must still be added, as they may be the
+	 * parents of ones which do; libusbx leaves them out of device lists
+	 * and hotplug events (see usbi_device_filter_match()).
+	 *
+	 * Optional, and backends which list their members positionally may leave
+	 * it out, in which case libusb_init_lazy() scans like libusb_init().
+	 *
+	 * Return 0 on success, or a LIBUSB_ERROR code on failure.
+	 */
+	int (*scan_devices)(struct libusb_context *ctx);
+
+	/* Write out the trace the backend keeps of the transfers it handles,
+	 * see libusb_dump_trace().
+	 *
+	 * Optional, for backends which can trace transfers.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_FOUND if no trace is being taken
+	 * - another LIBUSB_ERROR code on failure
+	 */
+	int (*dump_trace)(void);
 };
 
 extern const struct usbi_os_backend * const usbi_backend;
@@ -98,127 +98,231 @@ int linux_netlink_stop_event_monitor(void)
 	return LIBUSB_SUCCESS;
 }
 
-static const char *netlink_message_parse (const char *buffer, size_t len, const char *key)
+/* the most uevents taken from the socket at once */
+#define NETLINK_BATCH		32
+#define NETLINK_BUFFER_SIZE	2048
+
+/* a usb device uevent, with sys_name pointing into the message buffer */
+struct netlink_event {
+	int dropped;
+	int detached;
+	uint8_t busnum;
+	uint8_t devaddr;
+	const char *sys_name;
+};
+
+/* message buffers, only used with linux_hotplug_lock held */
+static char netlink_buffers[NETLINK_BATCH][NETLINK_BUFFER_SIZE];
+
+/* value of a KEY=VALUE entry, if the entry at buffer has the key */
+static const char *netlink_message_value (const char *entry, const char *key, size_t keylen)
 {
-	size_t keylen = strlen(key);
-	size_t offset;
-
-	for (offset = 0 ; offset < len && '\0' != buffer[offset] ; offset += strlen(buffer + offset) + 1) {
-		if (0 == strncmp(buffer + offset, key, keylen) &&
-		    '=' == buffer[offset + keylen]) {
-			return buffer + offset + keylen + 1;
-		}
-	}
+	if (0 == strncmp(entry, key, keylen) && '=' == entry[keylen])
+		return entry + keylen + 1;
 
 	return NULL;
 }
 
-/* parse parts of netlink message common to both libudev and the kernel */
+/* parse parts of netlink message common to both libudev and the kernel.
+ * the message is a series of NUL terminated KEY=VALUE entries, which are
+ * walked once, leaving the values in place in the buffer */
 static int linux_netlink_parse(char *buffer, size_t len, int *detached, const char **sys_name,
 			       uint8_t *busnum, uint8_t *devaddr) {
+	const char *action = NULL, *subsystem = NULL, *bus = NULL, *dev = NULL;
+	const char *devpath = NULL;
+	const char *entry, *end = buffer + len;
 	const char *tmp;
-	int i;
-
-	errno = 0;
+	char *endptr;
+	unsigned long value;
 
 	*sys_name = NULL;
 	*detached = 0;
 	*busnum   = 0;
 	*devaddr  = 0;
 
-	tmp = netlink_message_parse((const char *) buffer, len, "ACTION");
-	if (tmp == NULL)
+	for (entry = buffer ; entry < end && '\0' != *entry ; entry += strlen(entry) + 1) {
+		switch (*entry) {
+		case 'A':
+			if (!action)
+				action = netlink_message_value(entry, "ACTION", 6);
+			break;
+		case 'S':
+			if (!subsystem)
+				subsystem = netlink_message_value(entry, "SUBSYSTEM", 9);
+			break;
+		case 'B':
+			if (!bus)
+				bus = netlink_message_value(entry, "BUSNUM", 6);
+			break;
+		case 'D':
+			if (!dev)
+				dev = netlink_message_value(entry, "DEVNUM", 6);
+			if (!devpath)
+				devpath = netlink_message_value(entry, "DEVPATH", 7);
+			break;
+		}
+	}
+
+	if (action == NULL)
 		return -1;
-	if (0 == strcmp(tmp, "remove")) {
+	if (0 == strcmp(action, "remove")) {
 		*detached = 1;
-	} else if (0 != strcmp(tmp, "add")) {
-		usbi_dbg("unknown device action %s", tmp);
+	} else if (0 != strcmp(action, "add")) {
+		usbi_dbg("unknown device action %s", action);
 		return -1;
 	}
 
 	/* check that this is a usb message */
-	tmp = netlink_message_parse(buffer, len, "SUBSYSTEM");
-	if (NULL == tmp || 0 != strcmp(tmp, "usb")) {
+	if (NULL == subsystem || 0 != strcmp(subsystem, "usb")) {
 		/* not usb. ignore */
 		return -1;
 	}
 
-	tmp = netlink_message_parse(buffer, len, "BUSNUM");
-	if (NULL == tmp) {
+	if (NULL == bus) {
 		/* no bus number (likely a usb interface). ignore*/
 		return -1;
 	}
 
-	*busnum = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
-	if (errno) {
-		errno = 0;
+	value = strtoul(bus, &endptr, 10);
+	if (endptr == bus)
 		return -1;
-	}
+	*busnum = (uint8_t)(value & 0xff);
 
-	tmp = netlink_message_parse(buffer, len, "DEVNUM");
-	if (NULL == tmp) {
+	if (NULL == dev) {
 		return -1;
 	}
 
-	*devaddr = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
-	if (errno) {
-		errno = 0;
+	value = strtoul(dev, &endptr, 10);
+	if (endptr == dev)
 		return -1;
-	}
+	*devaddr = (uint8_t)(value & 0xff);
 
-	tmp = netlink_message_parse(buffer, len, "DEVPATH");
-	if (NULL == tmp) {
+	if (NULL == devpath) {
 		return -1;
 	}
 
-	for (i = strlen(tmp) - 1 ; i ; --i) {
-		if ('/' ==tmp[i]) {
-			*sys_name = tmp + i + 1;
-			break;
-		}
-	}
+	tmp = strrchr(devpath, '/');
+	if (tmp && tmp != devpath)
+		*sys_name = tmp + 1;
 
 	/* found a usb device */
 	return 0;
 }
 
-static int linux_netlink_read_message(void)
+/* drop pairs of events in which a device was added and then removed again
+ * within the same batch, there is nothing to tell anyone about. a removal
+ * followed by an addition is kept, as the old device has to go before the
+ * new one at that address arrives. so is a pair for a device which a context
+ * already has, e.g. from a scan which ran after the device was added, as its
+ * removal must still be reported */
+static void linux_netlink_coalesce(struct netlink_event *events, int count)
 {
-	unsigned char buffer[1024];
-	struct iovec iov = {.iov_base = buffer, .iov_len = sizeof(buffer)};
-	struct msghdr meh = { .msg_iov=&iov, .msg_iovlen=1,
-			     .msg_name=&snl, .msg_namelen=sizeof(snl) };
-	const char *sys_name = NULL;
-	uint8_t busnum, devaddr;
-	int detached, r;
-	size_t len;
-
-	/* read netlink message */
-	memset(buffer, 0, sizeof(buffer));
-	len = recvmsg(linux_netlink_socket, &meh, 0);
-	if (len < 32) {
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		if (events[i].detached || events[i].dropped)
+			continue;
+		for (j = i + 1; j < count; j++) {
+			if (events[j].dropped ||
+			    events[j].busnum != events[i].busnum ||
+			    events[j].devaddr != events[i].devaddr)
+				continue;
+			if (events[j].detached &&
+			    !linux_hotplug_known(events[i].busnum, events[i].devaddr)) {
+				usbi_dbg("device %hhu.%hhu came and went",
+					 events[i].busnum, events[i].devaddr);
+				events[i].dropped = 1;
+				events[j].dropped = 1;
+			}
+			break;
+		}
+	}
+}
+
+/* read a batch of waiting netlink messages and report the usb devices they
+ * add or remove. returns the number of messages read, or -1 if there were
+ * none */
+static int linux_netlink_read_messages(void)
+{
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[NETLINK_BATCH];
+#else
+	struct {
+		struct msghdr msg_hdr;
+		unsigned int msg_len;
+	} msgs[NETLINK_BATCH];
+	ssize_t len;
+#endif
+	struct iovec iovs[NETLINK_BATCH];
+	struct netlink_event events[NETLINK_BATCH];
+	int count, num_events = 0;
+	int i, r;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < NETLINK_BATCH; i++) {
+		iovs[i].iov_base = netlink_buffers[i];
+		iovs[i].iov_len = sizeof(netlink_buffers[i]) - 1;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	/* read netlink messages */
+#ifdef HAVE_RECVMMSG
+	count = recvmmsg(linux_netlink_socket, msgs, NETLINK_BATCH, 0, NULL);
+#else
+	/* one at a time, until there are no more (the socket does not block) */
+	for (count = 0; count < NETLINK_BATCH; count++) {
+		len = recvmsg(linux_netlink_socket, &msgs[count].msg_hdr, 0);
+		if (len < 0)
+			break;
+		msgs[count].msg_len = len;
+	}
+#endif
+	if (count < 1) {
 		if (errno != EAGAIN)
 			usbi_dbg("error recieving message from netlink");
 		return -1;
 	}
 
-	/* TODO -- authenticate this message is from the kernel or udevd */
+	for (i = 0; i < count; i++) {
+		size_t len = msgs[i].msg_len;
+		struct netlink_event *event = &events[num_events];
+
+		if (len < 32)
+			continue;
+
+		/* TODO -- authenticate this message is from the kernel or udevd */
 
-	r = linux_netlink_parse(buffer, len, &detached, &sys_name,
-				&busnum, &devaddr);
-	if (r)
-		return r;
+		/* make sure the last entry is terminated */
+		netlink_buffers[i][len] = '\0';
+		r = linux_netlink_parse(netlink_buffers[i], len, &event->detached,
+					&event->sys_name, &event->busnum,
+					&event->devaddr);
+		if (r)
+			continue;
+		event->dropped = 0;
 
-	usbi_dbg("netlink hotplug found device busnum: %hhu, devaddr: %hhu, sys_name: %s, removed: %s",
-		 busnum, devaddr, sys_name, detached ? "yes" : "no");
+		usbi_dbg("netlink hotplug found device busnum: %hhu, devaddr: %hhu, sys_name: %s, removed: %s",
+			 event->busnum, event->devaddr, event->sys_name,
+			 event->detached ? "yes" : "no");
+		num_events++;
+	}
+
+	linux_netlink_coalesce(events, num_events);
 
 	/* signal device is available (or not) to all contexts */
-	if (detached)
-		linux_hotplug_disconnected(busnum, devaddr, sys_name);
-	else
-		linux_hotplug_enumerate(busnum, devaddr, sys_name);
+	for (i = 0; i < num_events; i++) {
+		if (events[i].dropped)
+			continue;
+		if (events[i].detached)
+			linux_hotplug_disconnected(events[i].busnum,
+				events[i].devaddr, events[i].sys_name);
+		else
+			linux_hotplug_enumerate(events[i].busnum,
+				events[i].devaddr, events[i].sys_name);
+	}
 
-	return 0;
+	return count;
 }
 
 static void *linux_netlink_event_thread_main(void *arg)
@@ -235,7 +339,7 @@ static void *linux_netlink_event_thread_main(void *arg)
 		}
 
 		usbi_mutex_static_lock(&linux_hotplug_lock);
-		linux_netlink_read_message();
+		linux_netlink_read_messages();
 		usbi_mutex_static_unlock(&linux_hotplug_lock);
 	}
 
@@ -248,7 +352,7 @@ void linux_netlink_hotplug_poll(void)
 
 	usbi_mutex_static_lock(&linux_hotplug_lock);
 	do {
-		r = linux_netlink_read_message();
-	} while (r == 0);
+		r = linux_netlink_read_messages();
+	} while (r > 0);
 	usbi_mutex_static_unlock(&linux_hotplug_lock);
 }
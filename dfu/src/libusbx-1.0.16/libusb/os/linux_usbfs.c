@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
@@ -77,6 +78,85 @@
 
 static const char *usbfs_path = NULL;
 
+/* sysfs device directory.  In a build configured with --enable-tests-build,
+ * both it and the usbfs path may be moved under the directory named by
+ * LIBUSB_SYSROOT, which lets enumeration be run against a simulated device
+ * tree (see tests/stress.c).  Other builds never look at the variable. */
+static char sysfs_device_path_buf[PATH_MAX];
+static const char *sysfs_device_path = SYSFS_DEVICE_PATH;
+
+/* sysfs_device_path, opened at init so that device directories and their
+ * attributes are looked up relative to it with the *at() calls, instead of
+ * resolving the whole path from / every time */
+static int sysfs_devices_fd = -1;
+
+/* Devices seen in sysfs are cached across scans, keyed by their sysfs
+ * directory name, so that rescanning a device which has not changed does
+ * not reread its attributes and descriptors.  An entry is only trusted
+ * while the inode and mtime of the sysfs directory are unchanged; the
+ * kernel creates a new directory each time a device enumerates. inode
+ * numbers are recycled, so the mtime is compared to the nanosecond. */
+#define SYSFS_CACHE_BUCKETS 64
+
+struct sysfs_cache_entry {
+	struct list_head list;
+	char *sysfs_dir;
+	ino_t ino;
+	struct timespec mtime;
+	unsigned int generation;	/* scan in which the entry was last seen */
+	int has_address;
+	uint8_t busnum;
+	uint8_t devaddr;
+	int speed;
+	unsigned char *descriptors;	/* NULL until read */
+	int descriptors_len;
+};
+
+static struct list_head sysfs_cache[SYSFS_CACHE_BUCKETS];
+static int sysfs_cache_initialized = 0;
+static unsigned int sysfs_cache_generation = 0;
+static usbi_mutex_static_t sysfs_cache_lock = USBI_MUTEX_INITIALIZER;
+
+/* Open device handles indexed by their usbfs file descriptor, so that
+ * op_handle_events() does not have to search open_devs for every ready fd.
+ * fd_handles_lock only guards the table. A handle looked up in it stays
+ * valid while op_handle_events() uses it: both op_handle_events() and
+ * op_close() run with the context's events lock held, so only a transfer
+ * callback called from op_handle_events() itself can close the handle.
+ * The generation of an entry changes each time it is set or cleared,
+ * which is how op_handle_events() notices that. */
+struct fd_handle {
+	struct libusb_device_handle *handle;
+	unsigned int generation;
+};
+
+static struct fd_handle *fd_handles = NULL;
+static int fd_handles_size = 0;
+static usbi_mutex_static_t fd_handles_lock = USBI_MUTEX_INITIALIZER;
+
+/* URB trace, enabled by naming a file in the LIBUSB_TRACE environment
+ * variable. Each URB submitted and reaped is recorded, with the first
+ * TRACE_DATA_LEN bytes of its data, in a ring which keeps the last
+ * TRACE_RING_SIZE events. The file is created when the first context is
+ * initialized. The ring is written to it as a pcap capture with the usbmon
+ * link type when the last context exits, when the program exits without
+ * that, and whenever libusb_dump_trace() is called, each time replacing the
+ * previous capture. Wireshark reads it like a capture from the kernel's
+ * usbmon, which needs root. */
+#define TRACE_RING_SIZE		4096
+#define TRACE_DATA_LEN		64
+#define PCAP_LINKTYPE_USB_LINUX_MMAPPED	220
+
+struct trace_record {
+	struct usbmon_packet hdr;
+	unsigned char data[TRACE_DATA_LEN];
+};
+
+static FILE *trace_file = NULL;
+static struct trace_record *trace_ring = NULL;
+static unsigned int trace_count = 0;	/* events recorded so far */
+static usbi_mutex_static_t trace_lock = USBI_MUTEX_INITIALIZER;
+
 /* use usbdev*.* device names in /dev instead of the usbfs bus directories */
 static int usbdev_names = 0;
 
@@ -143,6 +223,13 @@ struct linux_device_priv {
 struct linux_device_handle_priv {
 	int fd;
 	uint32_t caps;
+	struct list_head dev_mem; /* mappings from op_dev_mem_alloc */
+};
+
+struct linux_dev_mem {
+	struct list_head list;
+	unsigned char *buffer;
+	size_t len;
 };
 
 enum reap_action {
@@ -259,15 +346,16 @@ static int check_usb_vfs(const char *dirname)
 	return found;
 }
 
-static const char *find_usbfs_path(void)
+static const char *find_usbfs_path(const char *sysroot)
 {
-	const char *path = "/dev/bus/usb";
+	static char path[PATH_MAX];
 	const char *ret = NULL;
 
+	snprintf(path, PATH_MAX, "%s/dev/bus/usb", sysroot);
 	if (check_usb_vfs(path)) {
 		ret = path;
 	} else {
-		path = "/proc/bus/usb";
+		snprintf(path, PATH_MAX, "%s/proc/bus/usb", sysroot);
 		if (check_usb_vfs(path))
 			ret = path;
 	}
@@ -277,7 +365,7 @@ static const char *find_usbfs_path(void)
 		struct dirent *entry;
 		DIR *dir;
 
-		path = "/dev";
+		snprintf(path, PATH_MAX, "%s/dev", sysroot);
 		dir = opendir(path);
 		if (dir != NULL) {
 			while ((entry = readdir(dir)) != NULL) {
@@ -348,15 +436,221 @@ static int kernel_version_ge(int major, int minor, int sublevel)
 	return ksublevel >= sublevel;
 }
 
+static void trace_atexit(void);
+
+/* open the trace file and allocate the ring if LIBUSB_TRACE is set. called
+ * under linux_hotplug_lock, before any device can be opened */
+static void trace_start(struct libusb_context *ctx)
+{
+	static int atexit_registered = 0;
+	const char *path = getenv("LIBUSB_TRACE");
+
+	if (!path || !*path || trace_ring)
+		return;
+
+	trace_file = fopen(path, "wbe");
+	if (!trace_file) {
+		usbi_warn(ctx, "could not open the URB trace %s: %s", path,
+			strerror(errno));
+		return;
+	}
+	trace_ring = malloc(TRACE_RING_SIZE * sizeof(*trace_ring));
+	if (!trace_ring) {
+		usbi_warn(ctx, "no memory for the URB trace");
+		fclose(trace_file);
+		trace_file = NULL;
+		return;
+	}
+	trace_count = 0;
+	if (!atexit_registered && atexit(trace_atexit) == 0)
+		atexit_registered = 1;
+	usbi_dbg("tracing URBs to %s", path);
+}
+
+/* record a URB event: 'S' before it is submitted, 'E' if the submission
+ * failed and 'C' once it is reaped */
+static void trace_urb(struct libusb_device_handle *handle,
+	struct usbfs_urb *urb, char event, int status)
+{
+	struct trace_record *rec;
+	struct timespec now;
+	unsigned char *data = urb->buffer;
+	int length = event == 'C' ? urb->actual_length : urb->buffer_length;
+	int saved_errno, has_data;
+
+	if (!trace_ring)
+		return;
+
+	/* the submit paths still look at errno after a failure */
+	saved_errno = errno;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	usbi_mutex_static_lock(&trace_lock);
+	if (!trace_ring) {
+		usbi_mutex_static_unlock(&trace_lock);
+		errno = saved_errno;
+		return;
+	}
+	rec = &trace_ring[trace_count++ % TRACE_RING_SIZE];
+	memset(&rec->hdr, 0, sizeof(rec->hdr));
+	rec->hdr.id = (uintptr_t)urb;
+	rec->hdr.type = event;
+	rec->hdr.xfer_type = urb->type;
+	rec->hdr.epnum = urb->endpoint;
+	rec->hdr.devnum = handle->dev->device_address;
+	rec->hdr.busnum = handle->dev->bus_number;
+	rec->hdr.flag_setup = '-';
+	rec->hdr.ts_sec = now.tv_sec;
+	rec->hdr.ts_usec = now.tv_nsec / 1000;
+	rec->hdr.status = status;
+	rec->hdr.start_frame = urb->start_frame;
+	rec->hdr.xfer_flags = urb->flags;
+
+	if (urb->type == USBFS_URB_TYPE_CONTROL) {
+		/* the direction of a control URB is in its setup packet, which
+		 * the kernel does not count in the lengths it returns */
+		rec->hdr.epnum |= data[0] & LIBUSB_ENDPOINT_IN;
+		if (event == 'S') {
+			memcpy(rec->hdr.s.setup, data, LIBUSB_CONTROL_SETUP_SIZE);
+			rec->hdr.flag_setup = 0;
+		}
+		data += LIBUSB_CONTROL_SETUP_SIZE;
+		if (event != 'C')
+			length -= LIBUSB_CONTROL_SETUP_SIZE;
+	} else if (urb->type == USBFS_URB_TYPE_ISO) {
+		rec->hdr.s.iso.error_count = urb->error_count;
+		rec->hdr.s.iso.numdesc = urb->number_of_packets;
+	}
+	if (length < 0)
+		length = 0;
+	rec->hdr.length = length;
+
+	/* like usbmon, data goes out on submission and comes in on completion */
+	if (rec->hdr.epnum & LIBUSB_ENDPOINT_IN)
+		has_data = event == 'C';
+	else
+		has_data = event == 'S';
+	if (has_data) {
+		rec->hdr.len_cap = MIN(length, TRACE_DATA_LEN);
+		memcpy(rec->data, data, rec->hdr.len_cap);
+	} else {
+		rec->hdr.flag_data = rec->hdr.epnum & LIBUSB_ENDPOINT_IN ? '<' : '>';
+	}
+	usbi_mutex_static_unlock(&trace_lock);
+	errno = saved_errno;
+}
+
+/* write the events in the ring to the trace file as a pcap capture,
+ * replacing what was written before. called under trace_lock with the trace
+ * running */
+static int trace_write(void)
+{
+	struct {
+		uint32_t magic;
+		uint16_t version_major;
+		uint16_t version_minor;
+		int32_t thiszone;
+		uint32_t sigfigs;
+		uint32_t snaplen;
+		uint32_t linktype;
+	} file_hdr = { 0xa1b2c3d4, 2, 4, 0, 0,
+		sizeof(struct trace_record), PCAP_LINKTYPE_USB_LINUX_MMAPPED };
+	struct {
+		uint32_t ts_sec;
+		uint32_t ts_usec;
+		uint32_t incl_len;
+		uint32_t orig_len;
+	} rec_hdr;
+	struct trace_record *rec;
+	unsigned int i;
+	FILE *f = trace_file;
+
+	rewind(f);
+	fwrite(&file_hdr, sizeof(file_hdr), 1, f);
+	for (i = trace_count > TRACE_RING_SIZE ? trace_count - TRACE_RING_SIZE : 0;
+	     i < trace_count; i++) {
+		rec = &trace_ring[i % TRACE_RING_SIZE];
+		rec_hdr.ts_sec = rec->hdr.ts_sec;
+		rec_hdr.ts_usec = rec->hdr.ts_usec;
+		rec_hdr.incl_len = sizeof(rec->hdr) + rec->hdr.len_cap;
+		rec_hdr.orig_len = sizeof(rec->hdr) +
+			(rec->hdr.flag_data ? 0 : rec->hdr.length);
+		fwrite(&rec_hdr, sizeof(rec_hdr), 1, f);
+		fwrite(rec, rec_hdr.incl_len, 1, f);
+	}
+	if (fflush(f) != 0 || ftruncate(fileno(f), ftell(f)) != 0) {
+		usbi_warn(NULL, "could not write the URB trace: %s",
+			strerror(errno));
+		return LIBUSB_ERROR_IO;
+	}
+
+	usbi_dbg("%u URB events traced, %u kept", trace_count,
+		MIN(trace_count, TRACE_RING_SIZE));
+	return LIBUSB_SUCCESS;
+}
+
+/* write the trace ring to the trace file and free it. called under
+ * linux_hotplug_lock when the last context exits */
+static void trace_stop(void)
+{
+	usbi_mutex_static_lock(&trace_lock);
+	if (trace_ring) {
+		trace_write();
+		fclose(trace_file);
+		free(trace_ring);
+		trace_file = NULL;
+		trace_ring = NULL;
+	}
+	usbi_mutex_static_unlock(&trace_lock);
+}
+
+static int op_dump_trace(void)
+{
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_static_lock(&trace_lock);
+	if (trace_ring)
+		r = trace_write();
+	usbi_mutex_static_unlock(&trace_lock);
+
+	return r;
+}
+
+/* write the trace of a program which exits without libusb_exit() */
+static void trace_atexit(void)
+{
+	op_dump_trace();
+}
+
 static int op_init(struct libusb_context *ctx)
 {
 	struct stat statbuf;
 	int r;
 
-	usbfs_path = find_usbfs_path();
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	if (init_count == 0) {
+		const char *sysroot = NULL;
+
+#ifdef ENABLE_TESTS_BUILD
+		sysroot = getenv("LIBUSB_SYSROOT");
+#endif
+		if (!sysroot)
+			sysroot = "";
+		snprintf(sysfs_device_path_buf, PATH_MAX, "%s%s", sysroot,
+			SYSFS_DEVICE_PATH);
+		sysfs_device_path = sysfs_device_path_buf;
+		if (sysfs_devices_fd >= 0)
+			close(sysfs_devices_fd);
+		sysfs_devices_fd = open(sysfs_device_path,
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		usbfs_path = find_usbfs_path(sysroot);
+	}
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+
 	if (!usbfs_path) {
 		usbi_err(ctx, "could not find usbfs");
-		return LIBUSB_ERROR_OTHER;
+		r = LIBUSB_ERROR_OTHER;
+		goto err;
 	}
 
 	if (monotonic_clkid == -1)
@@ -367,7 +661,8 @@ static int op_init(struct libusb_context *ctx)
 		supports_flag_bulk_continuation = kernel_version_ge(2,6,32);
 		if (supports_flag_bulk_continuation == -1) {
 			usbi_err(ctx, "error checking for bulk continuation support");
-			return LIBUSB_ERROR_OTHER;
+			r = LIBUSB_ERROR_OTHER;
+			goto err;
 		}
 	}
 
@@ -379,7 +674,8 @@ static int op_init(struct libusb_context *ctx)
 		supports_flag_zero_packet = kernel_version_ge(2,6,31);
 		if (-1 == supports_flag_zero_packet) {
 			usbi_err(ctx, "error checking for zero length packet support");
-			return LIBUSB_ERROR_OTHER;
+			r = LIBUSB_ERROR_OTHER;
+			goto err;
 		}
 	}
 
@@ -391,7 +687,8 @@ static int op_init(struct libusb_context *ctx)
 		sysfs_has_descriptors = kernel_version_ge(2,6,26);
 		if (-1 == sysfs_has_descriptors) {
 			usbi_err(ctx, "error checking for sysfs descriptors");
-			return LIBUSB_ERROR_OTHER;
+			r = LIBUSB_ERROR_OTHER;
+			goto err;
 		}
 	}
 
@@ -400,12 +697,13 @@ static int op_init(struct libusb_context *ctx)
 		sysfs_can_relate_devices = kernel_version_ge(2,6,22);
 		if (-1 == sysfs_can_relate_devices) {
 			usbi_err(ctx, "error checking for sysfs busnum");
-			return LIBUSB_ERROR_OTHER;
+			r = LIBUSB_ERROR_OTHER;
+			goto err;
 		}
 	}
 
 	if (sysfs_can_relate_devices || sysfs_has_descriptors) {
-		r = stat(SYSFS_DEVICE_PATH, &statbuf);
+		r = stat(sysfs_device_path, &statbuf);
 		if (r != 0 || !S_ISDIR(statbuf.st_mode)) {
 			usbi_warn(ctx, "sysfs not mounted");
 			sysfs_can_relate_devices = 0;
@@ -426,15 +724,34 @@ static int op_init(struct libusb_context *ctx)
 		r = linux_start_event_monitor();
 	}
 	if (r == LIBUSB_SUCCESS) {
-		r = linux_scan_devices(ctx);
-		if (r == LIBUSB_SUCCESS)
+		/* a lazy context is scanned by op_scan_devices() when it is
+		 * first used. the event monitor still runs meanwhile. */
+		if (!ctx->scan_pending)
+			r = linux_scan_devices(ctx);
+		if (r == LIBUSB_SUCCESS) {
+			/* nothing can fail after this, so the trace is only
+			 * started once init is sure to succeed */
+			if (init_count == 0)
+				trace_start(ctx);
 			init_count++;
-		else if (init_count == 0)
+		} else if (init_count == 0)
 			linux_stop_event_monitor();
 	} else
 		usbi_err(ctx, "error starting hotplug event monitor");
 	usbi_mutex_static_unlock(&linux_hotplug_lock);
 
+	if (r == LIBUSB_SUCCESS)
+		return r;
+
+err:
+	/* undo the first init's setup, which the next one does again */
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	if (init_count == 0 && sysfs_devices_fd >= 0) {
+		close(sysfs_devices_fd);
+		sysfs_devices_fd = -1;
+	}
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+
 	return r;
 }
 
@@ -445,6 +762,19 @@ static void op_exit(void)
 	if (!--init_count) {
 		/* tear down event handler */
 		(void)linux_stop_event_monitor();
+
+		if (sysfs_devices_fd >= 0) {
+			close(sysfs_devices_fd);
+			sysfs_devices_fd = -1;
+		}
+
+		trace_stop();
+
+		usbi_mutex_static_lock(&fd_handles_lock);
+		free(fd_handles);
+		fd_handles = NULL;
+		fd_handles_size = 0;
+		usbi_mutex_static_unlock(&fd_handles_lock);
 	}
 	usbi_mutex_static_unlock(&linux_hotplug_lock);
 }
@@ -476,6 +806,17 @@ static int linux_scan_devices(struct libusb_context *ctx)
 #endif
 }
 
+static int op_scan_devices(struct libusb_context *ctx)
+{
+	int r;
+
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	r = linux_scan_devices(ctx);
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+
+	return r;
+}
+
 static void op_hotplug_poll(void)
 {
 #if defined(USE_UDEV)
@@ -491,51 +832,142 @@ static int _open_sysfs_attr(struct libusb_device *dev, const char *attr)
 	char filename[PATH_MAX];
 	int fd;
 
-	snprintf(filename, PATH_MAX, "%s/%s/%s",
-		SYSFS_DEVICE_PATH, priv->sysfs_dir, attr);
-	fd = open(filename, O_RDONLY);
+	snprintf(filename, PATH_MAX, "%s/%s", priv->sysfs_dir, attr);
+	fd = openat(sysfs_devices_fd, filename, O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
 		usbi_err(DEVICE_CTX(dev),
-			"open %s failed ret=%d errno=%d", filename, fd, errno);
+			"open %s/%s failed ret=%d errno=%d", sysfs_device_path,
+			filename, fd, errno);
 		return LIBUSB_ERROR_IO;
 	}
 
 	return fd;
 }
 
+/* open the sysfs directory of a device, for reading its attributes */
+static int sysfs_open_device_dir(struct libusb_context *ctx,
+	const char *devname)
+{
+	int dirfd;
+
+	dirfd = openat(sysfs_devices_fd, devname,
+		O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		if (errno == ENOENT) {
+			/* Directory doesn't exist. Assume the device has been
+			   disconnected (see trac ticket #70). */
+			return LIBUSB_ERROR_NO_DEVICE;
+		}
+		usbi_err(ctx, "open %s/%s failed errno=%d", sysfs_device_path,
+			 devname, errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	return dirfd;
+}
+
 /* Note only suitable for attributes which always read >= 0, < 0 is error */
-static int __read_sysfs_attr(struct libusb_context *ctx,
-	const char *devname, const char *attr)
+static int sysfs_read_attr_at(struct libusb_context *ctx, int dirfd,
+	const char *attr)
 {
-	char filename[PATH_MAX];
-	FILE *f;
-	int r, value;
+	char buf[20], *endptr;
+	long value;
+	ssize_t r;
+	int fd;
 
-	snprintf(filename, PATH_MAX, "%s/%s/%s", SYSFS_DEVICE_PATH,
-		 devname, attr);
-	f = fopen(filename, "r");
-	if (f == NULL) {
+	fd = openat(dirfd, attr, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		if (errno == ENOENT) {
 			/* File doesn't exist. Assume the device has been
 			   disconnected (see trac ticket #70). */
 			return LIBUSB_ERROR_NO_DEVICE;
 		}
-		usbi_err(ctx, "open %s failed errno=%d", filename, errno);
+		usbi_err(ctx, "open %s failed errno=%d", attr, errno);
 		return LIBUSB_ERROR_IO;
 	}
 
-	r = fscanf(f, "%d", &value);
-	fclose(f);
-	if (r != 1) {
-		usbi_err(ctx, "fscanf %s returned %d, errno=%d", attr, r, errno);
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r < 0) {
+		usbi_err(ctx, "read %s failed errno=%d", attr, errno);
+		return LIBUSB_ERROR_NO_DEVICE; /* For unplug race (trac #70) */
+	}
+	buf[r] = '\0';
+
+	value = strtol(buf, &endptr, 10);
+	if (endptr == buf) {
+		usbi_err(ctx, "error converting %s '%s' to integer", attr, buf);
 		return LIBUSB_ERROR_NO_DEVICE; /* For unplug race (trac #70) */
 	}
 	if (value < 0) {
-		usbi_err(ctx, "%s contains a negative value", filename);
+		usbi_err(ctx, "%s contains a negative value", attr);
 		return LIBUSB_ERROR_IO;
 	}
 
-	return value;
+	return (int) value;
+}
+
+/* Note only suitable for attributes which always read >= 0, < 0 is error */
+static int __read_sysfs_attr(struct libusb_context *ctx,
+	const char *devname, const char *attr)
+{
+	int dirfd, r;
+
+	dirfd = sysfs_open_device_dir(ctx, devname);
+	if (dirfd < 0)
+		return dirfd;
+
+	r = sysfs_read_attr_at(ctx, dirfd, attr);
+	close(dirfd);
+	return r;
+}
+
+/* read the whole descriptors file open as fd into a new buffer. usbfs has
+ * holes in the file, which are returned as zeroes */
+static int read_descriptors(struct libusb_context *ctx, int fd,
+	unsigned char **descriptors, int *descriptors_len)
+{
+	int descriptors_size = 512; /* Begin with a 1024 byte alloc */
+	ssize_t r;
+
+	*descriptors = NULL;
+	*descriptors_len = 0;
+	do {
+		descriptors_size *= 2;
+		*descriptors = usbi_reallocf(*descriptors, descriptors_size);
+		if (!*descriptors) {
+			*descriptors_len = 0;
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		/* usbfs has holes in the file */
+		if (!sysfs_has_descriptors) {
+			memset(*descriptors + *descriptors_len,
+			       0, descriptors_size - *descriptors_len);
+		}
+		r = read(fd, *descriptors + *descriptors_len,
+			 descriptors_size - *descriptors_len);
+		if (r < 0) {
+			usbi_err(ctx, "read descriptor failed ret=%d errno=%d",
+				 fd, errno);
+			return LIBUSB_ERROR_IO;
+		}
+		*descriptors_len += r;
+	} while (*descriptors_len == descriptors_size);
+
+	return LIBUSB_SUCCESS;
+}
+
+static enum libusb_speed sysfs_speed(struct libusb_context *ctx, int speed)
+{
+	switch (speed) {
+	case     1: return LIBUSB_SPEED_LOW;
+	case    12: return LIBUSB_SPEED_FULL;
+	case   480: return LIBUSB_SPEED_HIGH;
+	case  5000: return LIBUSB_SPEED_SUPER;
+	default:
+		usbi_warn(ctx, "Unknown device speed: %d Mbps", speed);
+		return LIBUSB_SPEED_UNKNOWN;
+	}
 }
 
 static int op_get_device_descriptor(struct libusb_device *dev,
@@ -596,6 +1028,8 @@ int linux_get_device_address (struct libusb_context *ctx, int detached,
 	uint8_t *busnum, uint8_t *devaddr,const char *dev_node,
 	const char *sys_name)
 {
+	int dirfd, bus, dev;
+
 	usbi_dbg("getting address for device: %s detached: %d", sys_name, detached);
 	/* can't use sysfs to read the bus and device number if the
 	 * device has been detached */
@@ -616,18 +1050,24 @@ int linux_get_device_address (struct libusb_context *ctx, int detached,
 
 	usbi_dbg("scan %s", sys_name);
 
-	*busnum = __read_sysfs_attr(ctx, sys_name, "busnum");
-	if (0 > *busnum)
-		return *busnum;
+	dirfd = sysfs_open_device_dir(ctx, sys_name);
+	if (dirfd < 0)
+		return dirfd;
 
-	*devaddr = __read_sysfs_attr(ctx, sys_name, "devnum");
-	if (0 > *devaddr)
-		return *devaddr;
+	bus = sysfs_read_attr_at(ctx, dirfd, "busnum");
+	dev = bus < 0 ? bus : sysfs_read_attr_at(ctx, dirfd, "devnum");
+	close(dirfd);
+	if (bus < 0)
+		return bus;
+	if (dev < 0)
+		return dev;
 
-	usbi_dbg("bus=%d dev=%d", *busnum, *devaddr);
-	if (*busnum > 255 || *devaddr > 255)
+	usbi_dbg("bus=%d dev=%d", bus, dev);
+	if (bus > 255 || dev > 255)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
+	*busnum = (uint8_t) bus;
+	*devaddr = (uint8_t) dev;
 	return LIBUSB_SUCCESS;
 }
 
@@ -831,14 +1271,215 @@ static int usbfs_get_active_config(struct libusb_device *dev, int fd)
 	return active_config;
 }
 
+static unsigned int sysfs_cache_hash(const char *sysfs_dir)
+{
+	unsigned int hash = 5381;
+
+	while (*sysfs_dir)
+		hash = hash * 33 + (unsigned char) *sysfs_dir++;
+
+	return hash % SYSFS_CACHE_BUCKETS;
+}
+
+static void sysfs_cache_free_entry(struct sysfs_cache_entry *entry)
+{
+	list_del(&entry->list);
+	free(entry->descriptors);
+	free(entry->sysfs_dir);
+	free(entry);
+}
+
+/* find the cache entry for a sysfs device, creating it if need be. an entry
+ * whose directory has been replaced since it was filled in is emptied.
+ * returns NULL if the device has gone. sysfs_cache_lock must be held. */
+static struct sysfs_cache_entry *sysfs_cache_get(const char *sysfs_dir)
+{
+	struct sysfs_cache_entry *entry, *found = NULL;
+	struct list_head *bucket;
+	struct stat statbuf;
+	int i;
+
+	if (!sysfs_cache_initialized) {
+		for (i = 0; i < SYSFS_CACHE_BUCKETS; i++)
+			list_init(&sysfs_cache[i]);
+		sysfs_cache_initialized = 1;
+	}
+
+	bucket = &sysfs_cache[sysfs_cache_hash(sysfs_dir)];
+	list_for_each_entry(entry, bucket, list, struct sysfs_cache_entry) {
+		if (0 == strcmp(entry->sysfs_dir, sysfs_dir)) {
+			found = entry;
+			break;
+		}
+	}
+
+	if (fstatat(sysfs_devices_fd, sysfs_dir, &statbuf, 0) != 0) {
+		if (found)
+			sysfs_cache_free_entry(found);
+		return NULL;
+	}
+
+	if (found && (found->ino != statbuf.st_ino ||
+			found->mtime.tv_sec != statbuf.st_mtim.tv_sec ||
+			found->mtime.tv_nsec != statbuf.st_mtim.tv_nsec)) {
+		usbi_dbg("%s changed, dropping cached attributes", sysfs_dir);
+		free(found->descriptors);
+		found->descriptors = NULL;
+		found->descriptors_len = 0;
+		found->has_address = 0;
+	} else if (!found) {
+		found = calloc(1, sizeof(*found));
+		if (!found)
+			return NULL;
+		found->sysfs_dir = strdup(sysfs_dir);
+		if (!found->sysfs_dir) {
+			free(found);
+			return NULL;
+		}
+		list_add(&found->list, bucket);
+	}
+
+	found->ino = statbuf.st_ino;
+	found->mtime = statbuf.st_mtim;
+	found->generation = sysfs_cache_generation;
+
+	return found;
+}
+
+/* drop a device from the cache, e.g. when it is unplugged */
+static void sysfs_cache_remove(const char *sysfs_dir)
+{
+	struct sysfs_cache_entry *entry;
+
+	usbi_mutex_static_lock(&sysfs_cache_lock);
+	if (sysfs_cache_initialized) {
+		list_for_each_entry(entry, &sysfs_cache[sysfs_cache_hash(sysfs_dir)],
+				list, struct sysfs_cache_entry) {
+			if (0 == strcmp(entry->sysfs_dir, sysfs_dir)) {
+				sysfs_cache_free_entry(entry);
+				break;
+			}
+		}
+	}
+	usbi_mutex_static_unlock(&sysfs_cache_lock);
+}
+
+#if !defined(USE_UDEV)
+/* drop every device which was not seen by the scan that just finished */
+static void sysfs_cache_prune(void)
+{
+	struct sysfs_cache_entry *entry, *next;
+	int i;
+
+	usbi_mutex_static_lock(&sysfs_cache_lock);
+	for (i = 0; sysfs_cache_initialized && i < SYSFS_CACHE_BUCKETS; i++) {
+		list_for_each_entry_safe(entry, next, &sysfs_cache[i], list,
+				struct sysfs_cache_entry) {
+			if (entry->generation != sysfs_cache_generation)
+				sysfs_cache_free_entry(entry);
+		}
+	}
+	usbi_mutex_static_unlock(&sysfs_cache_lock);
+}
+#endif
+
+/* read everything enumeration needs from the sysfs directory of a device
+ * into its cache entry, opening the directory once. sysfs_cache_lock must be
+ * held. */
+static int sysfs_cache_prefetch(struct libusb_context *ctx,
+	struct sysfs_cache_entry *entry)
+{
+	int dirfd, fd, bus, dev, speed, r = LIBUSB_SUCCESS;
+
+	if (entry->has_address &&
+			(entry->descriptors || !sysfs_has_descriptors))
+		return LIBUSB_SUCCESS;
+
+	dirfd = sysfs_open_device_dir(ctx, entry->sysfs_dir);
+	if (dirfd < 0)
+		return dirfd;
+
+	if (!entry->has_address) {
+		bus = sysfs_read_attr_at(ctx, dirfd, "busnum");
+		dev = bus < 0 ? bus : sysfs_read_attr_at(ctx, dirfd, "devnum");
+		if (bus < 0 || dev < 0) {
+			r = bus < 0 ? bus : dev;
+			goto out;
+		}
+		if (bus > 255 || dev > 255) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+			goto out;
+		}
+		entry->busnum = (uint8_t) bus;
+		entry->devaddr = (uint8_t) dev;
+		entry->has_address = 1;
+	}
+
+	if (sysfs_has_descriptors && !entry->descriptors) {
+		/* Note speed can contain 1.5, in this case sysfs_read_attr_at
+		   will stop parsing at the '.' and return 1 */
+		speed = sysfs_read_attr_at(ctx, dirfd, "speed");
+		entry->speed = speed >= 0 ? sysfs_speed(ctx, speed)
+					  : LIBUSB_SPEED_UNKNOWN;
+
+		fd = openat(dirfd, "descriptors", O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			usbi_err(ctx, "open %s/descriptors failed errno=%d",
+				 entry->sysfs_dir, errno);
+			r = LIBUSB_ERROR_IO;
+			goto out;
+		}
+		r = read_descriptors(ctx, fd, &entry->descriptors,
+				     &entry->descriptors_len);
+		close(fd);
+		if (r < 0) {
+			free(entry->descriptors);
+			entry->descriptors = NULL;
+			entry->descriptors_len = 0;
+		}
+	}
+
+out:
+	close(dirfd);
+	return r;
+}
+
+/* copy the speed and descriptors of a sysfs device out of the cache, reading
+ * them first if need be. returns 1 if they were copied, 0 if they have to be
+ * read without the cache, <0 on error */
+static int sysfs_cache_load(struct libusb_device *dev, const char *sysfs_dir)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	struct sysfs_cache_entry *entry;
+	int r = 0;
+
+	usbi_mutex_static_lock(&sysfs_cache_lock);
+	entry = sysfs_cache_get(sysfs_dir);
+	if (entry)
+		r = sysfs_cache_prefetch(DEVICE_CTX(dev), entry);
+	if (entry && r == 0 && entry->descriptors) {
+		priv->descriptors = malloc(entry->descriptors_len);
+		if (priv->descriptors) {
+			memcpy(priv->descriptors, entry->descriptors,
+				entry->descriptors_len);
+			priv->descriptors_len = entry->descriptors_len;
+			dev->speed = entry->speed;
+			r = 1;
+		} else {
+			r = LIBUSB_ERROR_NO_MEM;
+		}
+	}
+	usbi_mutex_static_unlock(&sysfs_cache_lock);
+
+	return r;
+}
+
 static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 	uint8_t devaddr, const char *sysfs_dir)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
 	struct libusb_context *ctx = DEVICE_CTX(dev);
-	int descriptors_size = 512; /* Begin with a 1024 byte alloc */
-	int fd, speed;
-	ssize_t r;
+	int fd, speed, r;
 
 	dev->bus_number = busnum;
 	dev->device_address = devaddr;
@@ -849,19 +1490,17 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 			return LIBUSB_ERROR_NO_MEM;
 		strcpy(priv->sysfs_dir, sysfs_dir);
 
+		if (sysfs_has_descriptors && sysfs_can_relate_devices) {
+			r = sysfs_cache_load(dev, sysfs_dir);
+			if (r != 0)
+				return r < 0 ? r : LIBUSB_SUCCESS;
+		}
+
 		/* Note speed can contain 1.5, in this case __read_sysfs_attr
 		   will stop parsing at the '.' and return 1 */
 		speed = __read_sysfs_attr(DEVICE_CTX(dev), sysfs_dir, "speed");
-		if (speed >= 0) {
-			switch (speed) {
-			case     1: dev->speed = LIBUSB_SPEED_LOW; break;
-			case    12: dev->speed = LIBUSB_SPEED_FULL; break;
-			case   480: dev->speed = LIBUSB_SPEED_HIGH; break;
-			case  5000: dev->speed = LIBUSB_SPEED_SUPER; break;
-			default:
-				usbi_warn(DEVICE_CTX(dev), "Unknown device speed: %d Mbps", speed);
-			}
-		}
+		if (speed >= 0)
+			dev->speed = sysfs_speed(DEVICE_CTX(dev), speed);
 	}
 
 	/* cache descriptors in memory */
@@ -872,31 +1511,11 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 	if (fd < 0)
 		return fd;
 
-	do {
-		descriptors_size *= 2;
-		priv->descriptors = usbi_reallocf(priv->descriptors,
-						  descriptors_size);
-		if (!priv->descriptors) {
-			close(fd);
-			return LIBUSB_ERROR_NO_MEM;
-		}
-		/* usbfs has holes in the file */
-		if (!sysfs_has_descriptors) {
-			memset(priv->descriptors + priv->descriptors_len,
-			       0, descriptors_size - priv->descriptors_len);
-		}
-		r = read(fd, priv->descriptors + priv->descriptors_len,
-			 descriptors_size - priv->descriptors_len);
-		if (r < 0) {
-			usbi_err(ctx, "read descriptor failed ret=%d errno=%d",
-				 fd, errno);
-			close(fd);
-			return LIBUSB_ERROR_IO;
-		}
-		priv->descriptors_len += r;
-	} while (priv->descriptors_len == descriptors_size);
-	
+	r = read_descriptors(ctx, fd, &priv->descriptors,
+			     &priv->descriptors_len);
 	close(fd);
+	if (r < 0)
+		return r;
 
 	if (priv->descriptors_len < DEVICE_DESC_LENGTH) {
 		usbi_err(ctx, "short descriptor read (%d)",
@@ -1078,6 +1697,9 @@ void linux_hotplug_disconnected(uint8_t busnum, uint8_t devaddr, const char *sys
 	struct libusb_device *dev;
 	unsigned long session_id = busnum << 8 | devaddr;
 
+	if (sys_name)
+		sysfs_cache_remove(sys_name);
+
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
 		dev = usbi_get_device_by_session_id (ctx, session_id);
@@ -1090,6 +1712,26 @@ void linux_hotplug_disconnected(uint8_t busnum, uint8_t devaddr, const char *sys
 	usbi_mutex_static_unlock(&active_contexts_lock);
 }
 
+/* whether any context has the device at the given address. called with
+ * linux_hotplug_lock held */
+int linux_hotplug_known(uint8_t busnum, uint8_t devaddr)
+{
+	struct libusb_context *ctx;
+	unsigned long session_id = busnum << 8 | devaddr;
+	int known = 0;
+
+	usbi_mutex_static_lock(&active_contexts_lock);
+	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+		if (usbi_get_device_by_session_id(ctx, session_id)) {
+			known = 1;
+			break;
+		}
+	}
+	usbi_mutex_static_unlock(&active_contexts_lock);
+
+	return known;
+}
+
 #if !defined(USE_UDEV)
 /* open a bus directory and adds all discovered devices to the context */
 static int usbfs_scan_busdir(struct libusb_context *ctx, uint8_t busnum)
@@ -1181,12 +1823,29 @@ static int usbfs_get_device_list(struct libusb_context *ctx)
 
 static int sysfs_scan_device(struct libusb_context *ctx, const char *devname)
 {
+	struct sysfs_cache_entry *entry;
 	uint8_t busnum, devaddr;
-	int ret;
+	int ret, cached = 0;
+
+	/* a new device has everything enumeration needs read in one pass
+	 * here, so that initialize_device() finds it all in the cache */
+	usbi_mutex_static_lock(&sysfs_cache_lock);
+	entry = sysfs_cache_get(devname);
+	if (entry) {
+		ret = sysfs_cache_prefetch(ctx, entry);
+		if (ret == LIBUSB_SUCCESS) {
+			busnum = entry->busnum;
+			devaddr = entry->devaddr;
+			cached = 1;
+		}
+	}
+	usbi_mutex_static_unlock(&sysfs_cache_lock);
 
-	ret = linux_get_device_address (ctx, 0, &busnum, &devaddr, NULL, devname);
-	if (LIBUSB_SUCCESS != ret) {
-		return ret;
+	if (!cached) {
+		ret = linux_get_device_address (ctx, 0, &busnum, &devaddr, NULL, devname);
+		if (LIBUSB_SUCCESS != ret) {
+			return ret;
+		}
 	}
 
 	return linux_enumerate_device(ctx, busnum & 0xff, devaddr & 0xff,
@@ -1196,7 +1855,7 @@ static int sysfs_scan_device(struct libusb_context *ctx, const char *devname)
 #if !defined(USE_UDEV)
 static int sysfs_get_device_list(struct libusb_context *ctx)
 {
-	DIR *devices = opendir(SYSFS_DEVICE_PATH);
+	DIR *devices = opendir(sysfs_device_path);
 	struct dirent *entry;
 	int r = LIBUSB_ERROR_IO;
 
@@ -1205,6 +1864,10 @@ static int sysfs_get_device_list(struct libusb_context *ctx)
 		return r;
 	}
 
+	usbi_mutex_static_lock(&sysfs_cache_lock);
+	sysfs_cache_generation++;
+	usbi_mutex_static_unlock(&sysfs_cache_lock);
+
 	while ((entry = readdir(devices))) {
 		if ((!isdigit(entry->d_name[0]) && strncmp(entry->d_name, "usb", 3))
 				|| strchr(entry->d_name, ':'))
@@ -1219,6 +1882,7 @@ static int sysfs_get_device_list(struct libusb_context *ctx)
 	}
 
 	closedir(devices);
+	sysfs_cache_prune();
 	return r;
 }
 
@@ -1241,11 +1905,63 @@ static int linux_default_scan_devices (struct libusb_context *ctx)
 }
 #endif
 
+static int fd_handles_add(struct libusb_device_handle *handle, int fd)
+{
+	usbi_mutex_static_lock(&fd_handles_lock);
+	if (fd >= fd_handles_size) {
+		struct fd_handle *table;
+		int size = fd_handles_size ? fd_handles_size : 64;
+
+		while (size <= fd)
+			size *= 2;
+		table = realloc(fd_handles, size * sizeof(*table));
+		if (!table) {
+			usbi_mutex_static_unlock(&fd_handles_lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		memset(table + fd_handles_size, 0,
+			(size - fd_handles_size) * sizeof(*table));
+		fd_handles = table;
+		fd_handles_size = size;
+	}
+	fd_handles[fd].handle = handle;
+	fd_handles[fd].generation++;
+	usbi_mutex_static_unlock(&fd_handles_lock);
+	return 0;
+}
+
+static void fd_handles_remove(int fd)
+{
+	usbi_mutex_static_lock(&fd_handles_lock);
+	if (fd < fd_handles_size) {
+		fd_handles[fd].handle = NULL;
+		fd_handles[fd].generation++;
+	}
+	usbi_mutex_static_unlock(&fd_handles_lock);
+}
+
+/* Returns the handle open on fd, if any, and the generation of its entry. */
+static struct libusb_device_handle *fd_handles_get(int fd,
+	unsigned int *generation)
+{
+	struct libusb_device_handle *handle = NULL;
+
+	*generation = 0;
+	usbi_mutex_static_lock(&fd_handles_lock);
+	if (fd < fd_handles_size) {
+		handle = fd_handles[fd].handle;
+		*generation = fd_handles[fd].generation;
+	}
+	usbi_mutex_static_unlock(&fd_handles_lock);
+	return handle;
+}
+
 static int op_open(struct libusb_device_handle *handle)
 {
 	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
 	int r;
 
+	list_init(&hpriv->dev_mem);
 	hpriv->fd = _get_usbfs_fd(handle->dev, O_RDWR, 0);
 	if (hpriv->fd < 0)
 		return hpriv->fd;
@@ -1263,16 +1979,97 @@ static int op_open(struct libusb_device_handle *handle)
 			hpriv->caps |= USBFS_CAP_BULK_CONTINUATION;
 	}
 
-	return usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	r = fd_handles_add(handle, hpriv->fd);
+	if (r == 0) {
+		r = usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+		if (r < 0)
+			fd_handles_remove(hpriv->fd);
+	}
+	if (r < 0)
+		close(hpriv->fd);
+
+	return r;
 }
 
 static void op_close(struct libusb_device_handle *dev_handle)
 {
-	int fd = _device_handle_priv(dev_handle)->fd;
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(dev_handle);
+	struct linux_dev_mem *mem, *tmp;
+	int fd = hpriv->fd;
+
+	/* the mappings hold the device open, so drop any the user forgot */
+	list_for_each_entry_safe(mem, tmp, &hpriv->dev_mem, list, struct linux_dev_mem) {
+		usbi_warn(HANDLE_CTX(dev_handle),
+			"device memory %p still allocated at close", mem->buffer);
+		munmap(mem->buffer, mem->len);
+		list_del(&mem->list);
+		free(mem);
+	}
+
 	usbi_remove_pollfd(HANDLE_CTX(dev_handle), fd);
+	fd_handles_remove(fd);
 	close(fd);
 }
 
+static unsigned char *op_dev_mem_alloc(struct libusb_device_handle *handle,
+	size_t len)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct linux_dev_mem *mem;
+	void *buffer;
+
+	mem = malloc(sizeof(*mem));
+	if (!mem)
+		return NULL;
+
+	/* usbfs hands out memory which URBs can use in place from kernel 4.6 */
+	buffer = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		hpriv->fd, 0);
+	if (buffer == MAP_FAILED) {
+		usbi_dbg("mmap of %lu bytes failed errno=%d",
+			(unsigned long) len, errno);
+		free(mem);
+		return NULL;
+	}
+
+	mem->buffer = buffer;
+	mem->len = len;
+	usbi_mutex_lock(&handle->lock);
+	list_add(&mem->list, &hpriv->dev_mem);
+	usbi_mutex_unlock(&handle->lock);
+	return buffer;
+}
+
+static int op_dev_mem_free(struct libusb_device_handle *handle,
+	unsigned char *buffer, size_t len)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct linux_dev_mem *mem;
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&handle->lock);
+	list_for_each_entry(mem, &hpriv->dev_mem, list, struct linux_dev_mem) {
+		if (mem->buffer == buffer) {
+			list_del(&mem->list);
+			r = 0;
+			break;
+		}
+	}
+	usbi_mutex_unlock(&handle->lock);
+	if (r < 0)
+		return r;
+
+	if (len && mem->len != len)
+		usbi_warn(HANDLE_CTX(handle), "freeing %lu bytes of %lu byte mapping",
+			(unsigned long) len, (unsigned long) mem->len);
+	if (munmap(mem->buffer, mem->len) < 0) {
+		usbi_err(HANDLE_CTX(handle), "munmap failed errno=%d", errno);
+		r = LIBUSB_ERROR_IO;
+	}
+	free(mem);
+	return r;
+}
+
 static int op_get_configuration(struct libusb_device_handle *handle,
 	int *config)
 {
@@ -1766,8 +2563,10 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 		    transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)
 			urb->flags |= USBFS_URB_ZERO_PACKET;
 
+		trace_urb(transfer->dev_handle, urb, 'S', -EINPROGRESS);
 		r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 		if (r < 0) {
+			trace_urb(transfer->dev_handle, urb, 'E', -errno);
 			if (errno == ENODEV) {
 				r = LIBUSB_ERROR_NO_DEVICE;
 			} else {
@@ -1929,8 +2728,12 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
-		int r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
+		int r;
+
+		trace_urb(transfer->dev_handle, urbs[i], 'S', -EINPROGRESS);
+		r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
 		if (r < 0) {
+			trace_urb(transfer->dev_handle, urbs[i], 'E', -errno);
 			if (errno == ENODEV) {
 				r = LIBUSB_ERROR_NO_DEVICE;
 			} else {
@@ -2005,8 +2808,10 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	urb->buffer = transfer->buffer;
 	urb->buffer_length = transfer->length;
 
+	trace_urb(transfer->dev_handle, urb, 'S', -EINPROGRESS);
 	r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 	if (r < 0) {
+		trace_urb(transfer->dev_handle, urb, 'E', -errno);
 		free(urb);
 		tpriv->urbs = NULL;
 		if (errno == ENODEV)
@@ -2441,6 +3246,7 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 
 	usbi_dbg("urb type=%d status=%d transferred=%d", urb->type, urb->status,
 		urb->actual_length);
+	trace_urb(handle, urb, 'C', urb->status);
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
@@ -2463,21 +3269,23 @@ static int op_handle_events(struct libusb_context *ctx,
 	int r;
 	unsigned int i = 0;
 
-	usbi_mutex_lock(&ctx->open_devs_lock);
+	UNUSED(ctx);
 	for (i = 0; i < nfds && num_ready > 0; i++) {
 		struct pollfd *pollfd = &fds[i];
 		struct libusb_device_handle *handle;
-		struct linux_device_handle_priv *hpriv = NULL;
+		struct linux_device_handle_priv *hpriv;
+		unsigned int generation, current;
 
 		if (!pollfd->revents)
 			continue;
 
 		num_ready--;
-		list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
-			hpriv = _device_handle_priv(handle);
-			if (hpriv->fd == pollfd->fd)
-				break;
+		handle = fd_handles_get(pollfd->fd, &generation);
+		if (!handle) {
+			usbi_dbg("no open handle for fd %d", pollfd->fd);
+			continue;
 		}
+		hpriv = _device_handle_priv(handle);
 
 		if (pollfd->revents & POLLERR) {
 			usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->fd);
@@ -2485,19 +3293,18 @@ static int op_handle_events(struct libusb_context *ctx,
 			continue;
 		}
 
+		/* stop once a transfer callback has closed the handle */
 		do {
 			r = reap_for_handle(handle);
-		} while (r == 0);
-		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
+			fd_handles_get(pollfd->fd, &current);
+		} while (r == 0 && current == generation);
+		if (r == 0 || r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
 			continue;
 		else if (r < 0)
-			goto out;
+			return r;
 	}
 
-	r = 0;
-out:
-	usbi_mutex_unlock(&ctx->open_devs_lock);
-	return r;
+	return 0;
 }
 
 static int op_clock_gettime(int clk_id, struct timespec *tp)
@@ -2565,4 +3372,10 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.device_handle_priv_size = sizeof(struct linux_device_handle_priv),
 	.transfer_priv_size = sizeof(struct linux_transfer_priv),
 	.add_iso_packet_size = 0,
+
+	.dev_mem_alloc = op_dev_mem_alloc,
+	.dev_mem_free = op_dev_mem_free,
+
+	.scan_devices = op_scan_devices,
+	.dump_trace = op_dump_trace,
 };
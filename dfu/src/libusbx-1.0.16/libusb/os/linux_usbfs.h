@@ -132,6 +132,35 @@ struct usbfs_disconnect_claim {
 	char driver[USBFS_MAXDRIVERNAME + 1];
 };
 
+/* the event header of the binary usbmon interface, as in pcap captures with
+ * the LINKTYPE_USB_LINUX_MMAPPED link type. fields are host endian. */
+struct usbmon_packet {
+	uint64_t id;		/* URB address */
+	unsigned char type;	/* 'S' submit, 'C' complete, 'E' submit error */
+	unsigned char xfer_type;	/* same as usbfs_urb.type */
+	unsigned char epnum;	/* endpoint, with the direction bit */
+	unsigned char devnum;
+	uint16_t busnum;
+	char flag_setup;	/* 0 if setup is valid */
+	char flag_data;		/* 0 if data follows the header */
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;	/* URB length */
+	uint32_t len_cap;	/* length of the data following the header */
+	union {
+		unsigned char setup[8];
+		struct {
+			int32_t error_count;
+			int32_t numdesc;
+		} iso;
+	} s;
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+};
+
 #define IOCTL_USBFS_CONTROL	_IOWR('U', 0, struct usbfs_ctrltransfer)
 #define IOCTL_USBFS_BULK		_IOWR('U', 2, struct usbfs_bulktransfer)
 #define IOCTL_USBFS_RESETEP	_IOR('U', 3, unsigned int)
@@ -171,6 +200,7 @@ void linux_netlink_hotplug_poll(void);
 
 void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name);
 void linux_hotplug_disconnected(uint8_t busnum, uint8_t devaddr, const char *sys_name);
+int linux_hotplug_known(uint8_t busnum, uint8_t devaddr);
 
 int linux_get_device_address (struct libusb_context *ctx, int detached,
 	uint8_t *busnum, uint8_t *devaddr, const char *dev_node,
@@ -59,60 +59,70 @@ static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 	}
 }
 
-/** \ingroup syncio
- * Perform a USB control transfer.
- *
- * The direction of the transfer is inferred from the bmRequestType field of
- * the setup packet.
- *
- * The wValue, wIndex and wLength fields values should be given in host-endian
- * byte order.
- *
- * \param dev_handle a handle for the device to communicate with
- * \param bmRequestType the request type field for the setup packet
- * \param bRequest the request field for the setup packet
- * \param wValue the value field for the setup packet
- * \param wIndex the index field for the setup packet
- * \param data a suitably-sized data buffer for either input or output
- * (depending on direction bits within bmRequestType)
- * \param wLength the length field for the setup packet. The data buffer should
- * be at least this size.
- * \param timeout timeout (in millseconds) that this function should wait
- * before giving up due to no response being received. For an unlimited
- * timeout, use value 0.
- * \returns on success, the number of bytes actually transferred
- * \returns LIBUSB_ERROR_TIMEOUT if the transfer timed out
- * \returns LIBUSB_ERROR_PIPE if the control request was not supported by the
- * device
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns another LIBUSB_ERROR code on other failures
- */
-int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
-	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
-	unsigned char *data, uint16_t wLength, unsigned int timeout)
+/* Buffers for libusb_control_transfer() are kept in a small pool on each
+ * device handle, so that a stream of requests does not allocate and free
+ * one per request. A pooled buffer only ever grows. */
+static unsigned char *control_buffer_get(libusb_device_handle *dev_handle,
+	int length, int *size)
+{
+	unsigned char *buffer = NULL;
+	int i;
+
+	*size = 0;
+	usbi_mutex_lock(&dev_handle->lock);
+	if (dev_handle->num_control_buffers > 0) {
+		i = --dev_handle->num_control_buffers;
+		buffer = dev_handle->control_buffers[i];
+		*size = dev_handle->control_buffer_sizes[i];
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	if (*size < length) {
+		buffer = usbi_reallocf(buffer, length);
+		*size = length;
+	}
+	return buffer;
+}
+
+static void control_buffer_put(libusb_device_handle *dev_handle,
+	unsigned char *buffer, int size)
+{
+	usbi_mutex_lock(&dev_handle->lock);
+	if (dev_handle->num_control_buffers < USBI_CONTROL_BUFFERS) {
+		dev_handle->control_buffers[dev_handle->num_control_buffers] = buffer;
+		dev_handle->control_buffer_sizes[dev_handle->num_control_buffers++] =
+			size;
+		buffer = NULL;
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+	free(buffer);
+}
+
+/* free the pooled control buffers. called when the handle is closed */
+void usbi_handle_clear_control_buffers(struct libusb_device_handle *dev_handle)
+{
+	int i;
+
+	for (i = 0; i < dev_handle->num_control_buffers; i++)
+		free(dev_handle->control_buffers[i]);
+	dev_handle->num_control_buffers = 0;
+}
+
+/* run a control transfer whose setup packet is at the start of buffer, and
+ * whose data stage is read or written in place after it */
+static int do_sync_control_transfer(libusb_device_handle *dev_handle,
+	unsigned char *buffer, unsigned int timeout, int *transferred)
 {
 	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-	unsigned char *buffer;
 	int completed = 0;
 	int r;
 
+	*transferred = 0;
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
 
-	buffer = (unsigned char*) malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
-	if (!buffer) {
-		libusb_free_transfer(transfer);
-		return LIBUSB_ERROR_NO_MEM;
-	}
-
-	libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue, wIndex,
-		wLength);
-	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
-		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
-
 	libusb_fill_control_transfer(transfer, dev_handle, buffer,
 		sync_transfer_cb, &completed, timeout);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
@@ -121,10 +131,7 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 
 	sync_transfer_wait_for_completion(transfer);
 
-	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
-		memcpy(data, libusb_control_transfer_get_data(transfer),
-			transfer->actual_length);
-
+	*transferred = transfer->actual_length;
 	switch (transfer->status) {
 	case LIBUSB_TRANSFER_COMPLETED:
 		r = transfer->actual_length;
@@ -155,6 +162,97 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	return r;
 }
 
+/** \ingroup syncio
+ * Perform a USB control transfer.
+ *
+ * The direction of the transfer is inferred from the bmRequestType field of
+ * the setup packet.
+ *
+ * The wValue, wIndex and wLength fields values should be given in host-endian
+ * byte order.
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param bmRequestType the request type field for the setup packet
+ * \param bRequest the request field for the setup packet
+ * \param wValue the value field for the setup packet
+ * \param wIndex the index field for the setup packet
+ * \param data a suitably-sized data buffer for either input or output
+ * (depending on direction bits within bmRequestType)
+ * \param wLength the length field for the setup packet. The data buffer should
+ * be at least this size.
+ * \param timeout timeout (in millseconds) that this function should wait
+ * before giving up due to no response being received. For an unlimited
+ * timeout, use value 0.
+ * \returns on success, the number of bytes actually transferred
+ * \returns LIBUSB_ERROR_TIMEOUT if the transfer timed out
+ * \returns LIBUSB_ERROR_PIPE if the control request was not supported by the
+ * device
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failures
+ */
+int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+	unsigned char *buffer;
+	int size, transferred;
+	int r;
+
+	buffer = control_buffer_get(dev_handle,
+		LIBUSB_CONTROL_SETUP_SIZE + wLength, &size);
+	if (!buffer)
+		return LIBUSB_ERROR_NO_MEM;
+
+	libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue, wIndex,
+		wLength);
+	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
+		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+
+	r = do_sync_control_transfer(dev_handle, buffer, timeout, &transferred);
+
+	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+		memcpy(data, buffer + LIBUSB_CONTROL_SETUP_SIZE, transferred);
+
+	control_buffer_put(dev_handle, buffer, size);
+	return r;
+}
+
+/** \ingroup syncio
+ * Perform a USB control transfer on a buffer laid out like the buffer of an
+ * asynchronous control transfer: the setup packet, for example filled in with
+ * libusb_fill_control_setup(), followed by room for wLength bytes of data.
+ * Data is sent from, or received into, the buffer right after the setup
+ * packet. Unlike libusb_control_transfer(), this neither allocates a buffer
+ * nor copies the data, which suits callers that build requests in place.
+ *
+ * Since \ref LIBUSBX_API_VERSION >= 0x0100010C
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param buffer the setup packet, in bus-endian byte order, followed by the
+ * data stage
+ * \param timeout timeout (in millseconds) that this function should wait
+ * before giving up due to no response being received. For an unlimited
+ * timeout, use value 0.
+ * \returns on success, the number of bytes of data actually transferred
+ * \returns LIBUSB_ERROR_TIMEOUT if the transfer timed out
+ * \returns LIBUSB_ERROR_PIPE if the control request was not supported by the
+ * device
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failures
+ */
+int API_EXPORTED libusb_control_transfer_inplace(
+	libusb_device_handle *dev_handle, unsigned char *buffer,
+	unsigned int timeout)
+{
+	int transferred;
+
+	if (!buffer)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	return do_sync_control_transfer(dev_handle, buffer, timeout,
+		&transferred);
+}
+
 static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *buffer, int length,
 	int *transferred, unsigned int timeout, unsigned char type)
@@ -17,8 +17,35 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <memory.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/netlink.h>
+#include <linux/usbdevice_fs.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 #include "libusb.h"
 #include "libusbx_testlib.h"
@@ -144,12 +171,2473 @@ static libusbx_testlib_result test_default_context_change(libusbx_testlib_ctx *
 	return TEST_STATUS_SUCCESS;
 }
 
+#ifdef __linux__
+/* Size of the simulated sysfs tree: a root hub plus this many devices on
+ * each bus. */
+#define SIM_BUSES		4
+#define SIM_DEVICES_PER_BUS	120
+#define SIM_SCANS		50
+
+/* mkdtemp() template for the root of a simulated tree */
+#define SIM_ROOT		"/tmp/libusbx-sysfs-XXXXXX"
+
+/* the file system the simulated trees are made on, see ioctl() below */
+static dev_t sim_dev;
+
+static double elapsed_ms(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000.0 +
+		(now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+static int sim_write_attr(const char *dir, const char *attr,
+	const void *data, size_t len)
+{
+	char path[512];
+	FILE *f;
+	size_t r;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	r = fwrite(data, 1, len, f);
+	fclose(f);
+	return r == len ? 0 : -1;
+}
+
+/* The configuration of every simulated device, bus endian: a class
+ * specific descriptor after the config descriptor, a DFU interface with two
+ * altsettings, the first followed by a DFU functional descriptor, and a
+ * vendor interface with a bulk IN endpoint, which has a SuperSpeed
+ * companion descriptor, and a bulk OUT endpoint. */
+static const unsigned char sim_config[] = {
+	LIBUSB_DT_CONFIG_SIZE, LIBUSB_DT_CONFIG, 69, 0, 2, 1, 0, 0x80, 50,
+	4, 0x24, 0x01, 0x00,
+	LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE, 0, 0, 0, 0xfe, 1, 2, 0,
+	9, 0x21, 0x0b, 0xff, 0x00, 0x00, 0x10, 0x10, 0x01,
+	LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE, 0, 1, 0, 0xfe, 1, 2, 0,
+	LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE, 1, 0, 2, 0xff, 0, 0, 0,
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, 0x81, 2, 64, 0, 0,
+	LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE, LIBUSB_DT_SS_ENDPOINT_COMPANION,
+	0, 0, 0, 0,
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, 0x02, 2, 64, 0, 0,
+};
+
+/* Creates (or removes) one device in a simulated sysfs tree, with the
+ * attributes the Linux backend reads while enumerating. Root hubs are
+ * 1d6b:0002 with the hub class, other devices 03eb:2ffb. */
+static int sim_device(const char *devices, const char *name, int busnum,
+	int devnum, int create)
+{
+	static const char *attrs[] = { "busnum", "devnum", "speed",
+		"bConfigurationValue", "descriptors" };
+	/* device descriptor followed by the config descriptor, bus endian */
+	unsigned char desc[LIBUSB_DT_DEVICE_SIZE + sizeof(sim_config)] = {
+		LIBUSB_DT_DEVICE_SIZE, LIBUSB_DT_DEVICE, 0x00, 0x02, 0, 0, 0, 64,
+		0xeb, 0x03, 0xfb, 0x2f, 0x00, 0x00, 1, 2, 3, 1 };
+	char dir[512], value[16];
+	unsigned int i;
+
+	snprintf(dir, sizeof(dir), "%s/%s", devices, name);
+	if (!create) {
+		for (i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+			char path[sizeof(dir) + 32];
+			snprintf(path, sizeof(path), "%s/%s", dir, attrs[i]);
+			unlink(path);
+		}
+		return rmdir(dir);
+	}
+
+	if (mkdir(dir, 0755) != 0)
+		return -1;
+	memcpy(desc + LIBUSB_DT_DEVICE_SIZE, sim_config, sizeof(sim_config));
+	if (devnum == 1) {
+		desc[4] = LIBUSB_CLASS_HUB;
+		desc[8] = 0x6b;
+		desc[9] = 0x1d;
+		desc[10] = 0x02;
+		desc[11] = 0x00;
+	}
+	snprintf(value, sizeof(value), "%d\n", busnum);
+	if (sim_write_attr(dir, "busnum", value, strlen(value)))
+		return -1;
+	snprintf(value, sizeof(value), "%d\n", devnum);
+	if (sim_write_attr(dir, "devnum", value, strlen(value)))
+		return -1;
+	if (sim_write_attr(dir, "speed", "12\n", 3) ||
+	    sim_write_attr(dir, "bConfigurationValue", "1\n", 2) ||
+	    sim_write_attr(dir, "descriptors", desc, sizeof(desc)))
+		return -1;
+	return 0;
+}
+
+/* Creates (or removes) a simulated sysfs and usbfs tree under root. */
+static int sim_tree(const char *root, int create)
+{
+	static const char *dirs[] = { "sys", "sys/bus", "sys/bus/usb",
+		"sys/bus/usb/devices", "dev", "dev/bus", "dev/bus/usb",
+		"dev/bus/usb/001" };
+	const int ndirs = sizeof(dirs) / sizeof(dirs[0]);
+	char path[512], devices[512], name[32];
+	int bus, port, i;
+
+	snprintf(devices, sizeof(devices), "%s/sys/bus/usb/devices", root);
+	for (i = 0; create && i < ndirs; i++) {
+		snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+		if (mkdir(path, 0755) != 0)
+			return -1;
+	}
+
+	for (bus = 1; bus <= SIM_BUSES; bus++) {
+		snprintf(name, sizeof(name), "usb%d", bus);
+		if (sim_device(devices, name, bus, 1, create) && create)
+			return -1;
+		for (port = 1; port <= SIM_DEVICES_PER_BUS; port++) {
+			snprintf(name, sizeof(name), "%d-%d", bus, port);
+			if (sim_device(devices, name, bus, port + 1, create) && create)
+				return -1;
+		}
+	}
+
+	/* usbfs nodes for the devices on bus 1, see ioctl() below */
+	snprintf(path, sizeof(path), "%s/dev/bus/usb/001", root);
+	for (i = 1; i <= SIM_DEVICES_PER_BUS + 1; i++) {
+		char node[sizeof(path) + sizeof(name)];
+
+		snprintf(node, sizeof(node), "%s/%03d", path, i);
+		if (!create)
+			unlink(node);
+		else if (mkfifo(node, 0644) != 0)
+			return -1;
+	}
+
+	for (i = ndirs - 1; !create && i >= 0; i--) {
+		snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+		rmdir(path);
+	}
+	return 0;
+}
+
+/* Creates a simulated tree in a new temporary directory, named from the
+ * SIM_ROOT template in root, and points the backend at it. */
+static int sim_setup(libusbx_testlib_ctx * tctx, char * root)
+{
+	struct stat st;
+
+	if (!mkdtemp(root) || stat(root, &st) != 0) {
+		libusbx_testlib_logf(tctx, "Failed to create a temporary directory");
+		return -1;
+	}
+	sim_dev = st.st_dev;
+	if (sim_tree(root, 1)) {
+		libusbx_testlib_logf(tctx, "Failed to create the simulated tree");
+		sim_tree(root, 0);
+		rmdir(root);
+		return -1;
+	}
+	setenv("LIBUSB_SYSROOT", root, 1);
+	return 0;
+}
+
+/* Removes the tree made by sim_setup(). Anything else a test created under
+ * root must be gone first. */
+static void sim_teardown(const char * root)
+{
+	unsetenv("LIBUSB_SYSROOT");
+	sim_tree(root, 0);
+	rmdir(root);
+}
+
+/* A fake usbfs for the simulated tree. Its device nodes are named pipes,
+ * which poll() and epoll both report as always writable, like a usbfs node
+ * with URBs to reap. usbfs ioctls on them are answered by the ioctl()
+ * below, which the library calls instead of the one in libc; it tells them
+ * from the library's own pipes by their file system. URBs complete as soon
+ * as they are submitted, and are reaped in order. Control requests get a
+ * status, a string descriptor or a stall, except for the vendor request
+ * SIM_REQUEST_HOLD, which is never answered: it stays in flight until it is
+ * discarded. Other URBs transfer their whole buffer. Device memory mapped from the nodes is anonymous shared memory,
+ * and the last mapping is tracked until it is unmapped. Only one thread may
+ * use it at a time. */
+#define SIM_URBS	1024
+#define SIM_REQUEST_HOLD	0x5a
+
+static struct {
+	struct {
+		int fd;
+		int held;
+		struct usbdevfs_urb *urb;
+	} urbs[SIM_URBS];
+	int pending;
+	int submitted;
+	int string_requests;
+	int resets;
+	int mappings;
+	void *mapping;
+} sim_usbfs;
+
+static void sim_complete_control(struct usbdevfs_urb *urb)
+{
+	unsigned char *setup = urb->buffer;
+	unsigned char desc[32];
+	int wlength = setup[6] | (setup[7] << 8);
+	int len = -1;
+
+	if (setup[1] == LIBUSB_REQUEST_GET_STATUS) {
+		desc[0] = 1;
+		desc[1] = 0;
+		len = 2;
+	} else if (setup[1] == LIBUSB_REQUEST_GET_DESCRIPTOR &&
+		   setup[3] == LIBUSB_DT_STRING) {
+		char str[12];
+		int i;
+
+		sim_usbfs.string_requests++;
+		if (setup[2] == 0) {
+			/* the LANGID table: US English only */
+			desc[2] = 0x09;
+			desc[3] = 0x04;
+			len = 4;
+		} else {
+			snprintf(str, sizeof(str), "String %d", setup[2]);
+			for (i = 0; str[i]; i++) {
+				desc[2 + 2 * i] = str[i];
+				desc[3 + 2 * i] = 0;
+			}
+			len = 2 + 2 * i;
+		}
+		desc[0] = len;
+		desc[1] = LIBUSB_DT_STRING;
+	}
+
+	if (len < 0) {
+		urb->status = -EPIPE;
+		urb->actual_length = 0;
+		return;
+	}
+	if (len > wlength)
+		len = wlength;
+	memcpy(setup + LIBUSB_CONTROL_SETUP_SIZE, desc, len);
+	urb->status = 0;
+	urb->actual_length = len;
+}
+
+/* whether the URB is a SIM_REQUEST_HOLD request */
+static int sim_holds(struct usbdevfs_urb *urb)
+{
+	unsigned char *setup = urb->buffer;
+
+	return urb->type == USBDEVFS_URB_TYPE_CONTROL &&
+		(setup[0] & (0x03 << 5)) == LIBUSB_REQUEST_TYPE_VENDOR &&
+		setup[1] == SIM_REQUEST_HOLD;
+}
+
+/* the tests are built with -fvisibility=hidden too */
+__attribute__((visibility("default")))
+int ioctl(int fd, unsigned long request, ...)
+{
+	struct usbdevfs_urb *urb;
+	struct stat st;
+	va_list ap;
+	void *arg;
+	int i;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode) || st.st_dev != sim_dev)
+		return syscall(SYS_ioctl, fd, request, arg);
+
+	switch (request) {
+	case USBDEVFS_SUBMITURB:
+		urb = arg;
+		if (sim_usbfs.pending == SIM_URBS) {
+			errno = ENOMEM;
+			return -1;
+		}
+		sim_usbfs.urbs[sim_usbfs.pending].held = 0;
+		if (sim_holds(urb)) {
+			sim_usbfs.urbs[sim_usbfs.pending].held = 1;
+		} else if (urb->type == USBDEVFS_URB_TYPE_CONTROL) {
+			sim_complete_control(urb);
+		} else {
+			urb->status = 0;
+			urb->actual_length = urb->buffer_length;
+		}
+		sim_usbfs.urbs[sim_usbfs.pending].fd = fd;
+		sim_usbfs.urbs[sim_usbfs.pending].urb = urb;
+		sim_usbfs.pending++;
+		sim_usbfs.submitted++;
+		return 0;
+	case USBDEVFS_REAPURBNDELAY:
+		for (i = 0; i < sim_usbfs.pending; i++) {
+			if (sim_usbfs.urbs[i].fd != fd || sim_usbfs.urbs[i].held)
+				continue;
+			*(struct usbdevfs_urb **) arg = sim_usbfs.urbs[i].urb;
+			sim_usbfs.pending--;
+			memmove(&sim_usbfs.urbs[i], &sim_usbfs.urbs[i + 1],
+				(sim_usbfs.pending - i) * sizeof(sim_usbfs.urbs[0]));
+			return 0;
+		}
+		errno = EAGAIN;
+		return -1;
+	case USBDEVFS_DISCARDURB:
+		/* only held URBs are still in flight */
+		for (i = 0; i < sim_usbfs.pending; i++) {
+			if (sim_usbfs.urbs[i].fd != fd || sim_usbfs.urbs[i].urb != arg ||
+			    !sim_usbfs.urbs[i].held)
+				continue;
+			urb = arg;
+			urb->status = -ENOENT;
+			urb->actual_length = 0;
+			sim_usbfs.urbs[i].held = 0;
+			return 0;
+		}
+		errno = EINVAL;
+		return -1;
+	case USBDEVFS_RESET:
+		sim_usbfs.resets++;
+		return 0;
+	case USBDEVFS_SETCONFIGURATION:
+	case USBDEVFS_SETINTERFACE:
+	case USBDEVFS_CLAIMINTERFACE:
+	case USBDEVFS_RELEASEINTERFACE:
+	case USBDEVFS_CLEAR_HALT:
+	case USBDEVFS_RESETEP:
+		return 0;
+	}
+	return syscall(SYS_ioctl, fd, request, arg);
+}
+
+/* 32 bit systems map through SYS_mmap2, which takes the offset in pages */
+#if defined(SYS_mmap) && !defined(SYS_mmap2)
+__attribute__((visibility("default")))
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset)
+{
+	struct stat st;
+	void *mapping;
+
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode) ||
+	    st.st_dev != sim_dev)
+		return (void *) syscall(SYS_mmap, addr, len, prot, flags, fd, offset);
+
+	mapping = (void *) syscall(SYS_mmap, addr, len, prot,
+		flags | MAP_ANONYMOUS, -1, 0);
+	if (mapping != MAP_FAILED) {
+		sim_usbfs.mappings++;
+		sim_usbfs.mapping = mapping;
+	}
+	return mapping;
+}
+
+__attribute__((visibility("default")))
+int munmap(void *addr, size_t len)
+{
+	if (addr == sim_usbfs.mapping)
+		sim_usbfs.mapping = NULL;
+	return syscall(SYS_munmap, addr, len);
+}
+#endif
+
+/* Returns a reference to the simulated device on bus 1 with the given
+ * address, or NULL. */
+static libusb_device *sim_find(libusb_context * ctx, int address)
+{
+	libusb_device ** list;
+	libusb_device * dev = NULL;
+	ssize_t cnt, i;
+
+	cnt = libusb_get_device_list(ctx, &list);
+	for (i = 0; i < cnt && !dev; i++) {
+		if (libusb_get_bus_number(list[i]) == 1 &&
+		    libusb_get_device_address(list[i]) == address)
+			dev = libusb_ref_device(list[i]);
+	}
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
+	return dev;
+}
+
+/* Enumerates the simulated tree once, checking the device count and
+ * whether a device with the given address is on bus 1. */
+static int sim_scan(libusbx_testlib_ctx * tctx, int expect_address)
+{
+	libusb_context * ctx = NULL;
+	libusb_device ** list;
+	ssize_t cnt, i;
+	int found = 0;
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return -1;
+	}
+	cnt = libusb_get_device_list(ctx, &list);
+	for (i = 0; i < cnt; i++) {
+		if (libusb_get_bus_number(list[i]) == 1 &&
+		    libusb_get_device_address(list[i]) == expect_address)
+			found = 1;
+	}
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
+	libusb_exit(ctx);
+
+	if (cnt != SIM_BUSES * (SIM_DEVICES_PER_BUS + 1) || !found) {
+		libusbx_testlib_logf(tctx, "Found %d devices (expected %d), "
+			"address %d %s", (int) cnt,
+			SIM_BUSES * (SIM_DEVICES_PER_BUS + 1), expect_address,
+			found ? "present" : "missing");
+		return -1;
+	}
+	return 0;
+}
+
+/** Benchmarks enumeration of a simulated sysfs tree with several hundred
+ * devices. The first scan reads every device; later scans should only
+ * stat the devices, which the backend keeps cached between contexts.
+ * A device which re-enumerates must still be picked up. */
+static libusbx_testlib_result test_enumerate_simulated_sysfs(libusbx_testlib_ctx * tctx)
+{
+	char root[] = SIM_ROOT;
+	char devices[512];
+	struct timeval start;
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	double cold, warm = 0;
+	int i;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+
+	gettimeofday(&start, NULL);
+	if (sim_scan(tctx, 2))
+		goto out;
+	cold = elapsed_ms(&start);
+
+	for (i = 0; i < SIM_SCANS; i++) {
+		gettimeofday(&start, NULL);
+		if (sim_scan(tctx, 2))
+			goto out;
+		warm += elapsed_ms(&start);
+	}
+	warm /= SIM_SCANS;
+
+	libusbx_testlib_logf(tctx, "%d devices: first scan %.2f ms, "
+		"later scans %.2f ms", SIM_BUSES * (SIM_DEVICES_PER_BUS + 1),
+		cold, warm);
+
+	/* Re-enumerate 1-1 at a new address; the cached one must not be used. */
+	snprintf(devices, sizeof(devices), "%s/sys/bus/usb/devices", root);
+	if (sim_device(devices, "1-1", 1, 2, 0) ||
+	    sim_device(devices, "1-1", 1, 200, 1))
+		goto out;
+	if (sim_scan(tctx, 200))
+		goto out;
+
+	result = TEST_STATUS_SUCCESS;
+out:
+	sim_teardown(root);
+	return result;
+}
+
+/** Counts the system calls made by a first and a later scan of a simulated
+ * sysfs tree, in a child process traced with ptrace(). The child stops
+ * itself before, between and after the two scans. Threads started by the
+ * backend are not traced. */
+static libusbx_testlib_result test_enumerate_syscalls(libusbx_testlib_ctx * tctx)
+{
+	char root[] = SIM_ROOT;
+	const int ndevices = SIM_BUSES * (SIM_DEVICES_PER_BUS + 1);
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	long stops[2] = { 0, 0 };
+	int phase = -1, status, sig;
+	pid_t pid;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+	if (pid == 0) {
+		int r;
+
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+			_exit(2);
+		raise(SIGSTOP);
+		r = sim_scan(tctx, 2);
+		raise(SIGSTOP);
+		r |= sim_scan(tctx, 2);
+		raise(SIGSTOP);
+		_exit(r ? 1 : 0);
+	}
+
+	/* Every system call stops the child twice, on entry and on exit. */
+	while (waitpid(pid, &status, 0) == pid && WIFSTOPPED(status)) {
+		sig = WSTOPSIG(status);
+		if (sig == SIGSTOP) {
+			if (phase < 0)
+				ptrace(PTRACE_SETOPTIONS, pid, NULL,
+					(void *) PTRACE_O_TRACESYSGOOD);
+			phase++;
+			sig = 0;
+		} else if (sig == (SIGTRAP | 0x80)) {
+			if (phase >= 0 && phase < 2)
+				stops[phase]++;
+			sig = 0;
+		}
+		ptrace(PTRACE_SYSCALL, pid, NULL, (void *) (long) sig);
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) == 2) {
+		libusbx_testlib_logf(tctx, "Could not trace the scans");
+		result = TEST_STATUS_SKIP;
+		goto out;
+	}
+	if (WEXITSTATUS(status) != 0)
+		goto out;
+
+	libusbx_testlib_logf(tctx, "%d devices: first scan %ld syscalls "
+		"(%.1f per device), later scan %ld syscalls (%.1f per device)",
+		ndevices, stops[0] / 2, stops[0] / 2.0 / ndevices,
+		stops[1] / 2, stops[1] / 2.0 / ndevices);
+	result = TEST_STATUS_SUCCESS;
+out:
+	sim_teardown(root);
+	return result;
+}
+
+/** Benchmarks libusb_init_lazy() against libusb_init() on a simulated
+ * sysfs tree, and checks that the deferred scan finds every device, or
+ * only those matching the vendor and product ID filter. */
+static libusbx_testlib_result test_lazy_init(libusbx_testlib_ctx * tctx)
+{
+	char root[] = SIM_ROOT;
+	const int ndevices = SIM_BUSES * (SIM_DEVICES_PER_BUS + 1);
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_context * ctx;
+	libusb_device ** list;
+	struct timeval start;
+	double eager = 0, lazy = 0;
+	ssize_t cnt;
+	int i, r;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+
+	for (i = 0; i < SIM_SCANS; i++) {
+		gettimeofday(&start, NULL);
+		r = libusb_init(&ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+			goto out;
+		}
+		libusb_exit(ctx);
+		eager += elapsed_ms(&start);
+
+		gettimeofday(&start, NULL);
+		r = libusb_init_lazy(&ctx, -1, -1);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Failed to init libusb lazily: %d", r);
+			goto out;
+		}
+		libusb_exit(ctx);
+		lazy += elapsed_ms(&start);
+	}
+	libusbx_testlib_logf(tctx, "%d devices: init and exit %.3f ms, "
+		"lazily %.3f ms", ndevices, eager / SIM_SCANS, lazy / SIM_SCANS);
+
+	/* The deferred scan runs on the first listing. */
+	if (libusb_init_lazy(&ctx, -1, -1) != LIBUSB_SUCCESS)
+		goto out;
+	cnt = libusb_get_device_list(ctx, &list);
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
+	libusb_exit(ctx);
+	if (cnt != ndevices) {
+		libusbx_testlib_logf(tctx, "Found %d devices (expected %d)",
+			(int) cnt, ndevices);
+		goto out;
+	}
+
+	/* Every simulated device but the root hubs is 03eb:2ffb. The hubs
+	 * are left out of the list, but must still be there as parents. */
+	if (libusb_init_lazy(&ctx, 0x03eb, 0x2ffb) != LIBUSB_SUCCESS)
+		goto out;
+	cnt = libusb_get_device_list(ctx, &list);
+	for (i = 0; i < cnt; i++) {
+		libusb_device *parent = libusb_get_parent(list[i]);
+		uint8_t ports[8];
+
+		if (!parent || libusb_get_device_address(parent) != 1 ||
+		    libusb_get_bus_number(parent) !=
+		    libusb_get_bus_number(list[i]) ||
+		    libusb_get_port_numbers(list[i], ports, sizeof(ports)) != 1 ||
+		    ports[0] != libusb_get_device_address(list[i]) - 1) {
+			libusbx_testlib_logf(tctx, "Device %d-%d has no root hub "
+				"or the wrong port", libusb_get_bus_number(list[i]),
+				libusb_get_device_address(list[i]));
+			break;
+		}
+	}
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
+	libusb_exit(ctx);
+	if (i < cnt)
+		goto out;
+	if (cnt != SIM_BUSES * SIM_DEVICES_PER_BUS) {
+		libusbx_testlib_logf(tctx, "Found %d matching devices (expected %d)",
+			(int) cnt, SIM_BUSES * SIM_DEVICES_PER_BUS);
+		goto out;
+	}
+
+	if (libusb_init_lazy(&ctx, 0x03eb, 0x2ff0) != LIBUSB_SUCCESS)
+		goto out;
+	cnt = libusb_get_device_list(ctx, &list);
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
+	libusb_exit(ctx);
+	if (cnt != 0) {
+		libusbx_testlib_logf(tctx, "Found %d devices with a filter "
+			"matching none", (int) cnt);
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+out:
+	sim_teardown(root);
+	return result;
+}
+
+/** Benchmarks the event loop: how many times per second a context (on a
+ * simulated tree, so that it can be created without USB hardware) can go
+ * through libusb_handle_events_timeout() when nothing is pending. */
+static libusbx_testlib_result test_handle_events_rate(libusbx_testlib_ctx * tctx)
+{
+#define EVENT_LOOPS	200000
+	char root[] = SIM_ROOT;
+	libusb_context * ctx = NULL;
+	libusbx_testlib_result result = TEST_STATUS_ERROR;
+	struct timeval start, zero = { 0, 0 };
+	double ms;
+	int i, r;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		goto out;
+	}
+
+	result = TEST_STATUS_FAILURE;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < EVENT_LOOPS; i++) {
+		r = libusb_handle_events_timeout(ctx, &zero);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Handling events failed: %d", r);
+			break;
+		}
+	}
+	ms = elapsed_ms(&start);
+	libusb_exit(ctx);
+
+	if (i == EVENT_LOOPS) {
+		libusbx_testlib_logf(tctx, "%d event loops in %.2f ms, %.0f per second",
+			EVENT_LOOPS, ms, EVENT_LOOPS * 1000.0 / ms);
+		result = TEST_STATUS_SUCCESS;
+	}
+out:
+	sim_teardown(root);
+	return result;
+#undef EVENT_LOOPS
+}
+
+struct reopen_state {
+	libusb_device *dev;
+	libusb_device_handle *handle;
+	int done;
+};
+
+static void LIBUSB_CALL reopen_callback(struct libusb_transfer * transfer)
+{
+	struct reopen_state *state = transfer->user_data;
+
+	libusb_close(transfer->dev_handle);
+	if (libusb_open(state->dev, &state->handle) != LIBUSB_SUCCESS)
+		state->handle = NULL;
+	state->done = 1;
+}
+
+/** Tests that a transfer callback can close its device handle and open the
+ * device again while its completion is being handled, and that the new
+ * handle, which gets the same file descriptor, works. */
+static libusbx_testlib_result test_callback_reopen(libusbx_testlib_ctx * tctx)
+{
+	char root[] = SIM_ROOT;
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle = NULL;
+	struct libusb_transfer * transfer = NULL;
+	struct reopen_state state = { NULL, NULL, 0 };
+	unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + 2];
+	libusbx_testlib_result result = TEST_STATUS_ERROR;
+	int r;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		goto out;
+	}
+	state.dev = sim_find(ctx, 2);
+	transfer = libusb_alloc_transfer(0);
+	if (!state.dev || !transfer ||
+	    libusb_open(state.dev, &handle) != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open the simulated device");
+		goto out;
+	}
+
+	result = TEST_STATUS_FAILURE;
+	libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_STATUS, 0, 0, 2);
+	libusb_fill_control_transfer(transfer, handle, buffer, reopen_callback,
+		&state, 1000);
+	r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Submit failed: %d", r);
+		goto out;
+	}
+	handle = NULL;
+	while (!state.done)
+		if (libusb_handle_events(ctx) != LIBUSB_SUCCESS)
+			break;
+
+	if (!state.done || transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+	    !state.handle) {
+		libusbx_testlib_logf(tctx, "Transfer status %d, %s",
+			transfer->status, state.handle ? "reopened" : "not reopened");
+		goto out;
+	}
+	r = libusb_control_transfer(state.handle, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_STATUS, 0, 0, buffer, 2, 1000);
+	if (r != 2) {
+		libusbx_testlib_logf(tctx, "GET_STATUS on the new handle "
+			"returned %d", r);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	if (handle)
+		libusb_close(handle);
+	if (state.handle)
+		libusb_close(state.handle);
+	libusb_free_transfer(transfer);
+	if (state.dev)
+		libusb_unref_device(state.dev);
+	if (ctx)
+		libusb_exit(ctx);
+	sim_teardown(root);
+	return result;
+}
+
+/* Finds the port ID of the socket on which libusbx's netlink monitor gets
+ * uevents, the one bound to a multicast group. Returns 0 if there is none. */
+static uint32_t netlink_monitor_portid(void)
+{
+	struct sockaddr_nl addr;
+	socklen_t len;
+	int fd, protocol;
+
+	for (fd = 0; fd < 1024; fd++) {
+		len = sizeof(addr);
+		if (getsockname(fd, (struct sockaddr *)&addr, &len) != 0 ||
+		    addr.nl_family != AF_NETLINK || !addr.nl_groups)
+			continue;
+		len = sizeof(protocol);
+		if (getsockopt(fd, SOL_SOCKET, SO_PROTOCOL, &protocol, &len) == 0 &&
+		    protocol == NETLINK_KOBJECT_UEVENT)
+			return addr.nl_pid;
+	}
+	return 0;
+}
+
+/* Sends a uevent like the kernel's for a device on the simulated tree to
+ * the netlink monitor only. */
+static int netlink_send_uevent(int sock, uint32_t portid, const char *action,
+	const char *name, int busnum, int devnum)
+{
+	struct sockaddr_nl addr;
+	char msg[256];
+	int len;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = portid;
+	len = snprintf(msg, sizeof(msg), "%s@/devices/sim/usb%d/%s%c"
+		"ACTION=%s%cDEVPATH=/devices/sim/usb%d/%s%cSUBSYSTEM=usb%c"
+		"BUSNUM=%03d%cDEVNUM=%03d", action, busnum, name, 0, action, 0,
+		busnum, name, 0, 0, busnum, 0, devnum);
+	return sendto(sock, msg, len + 1, 0, (struct sockaddr *)&addr,
+		sizeof(addr)) == len + 1 ? 0 : -1;
+}
+
+/* Moves the other threads of the process, such as the netlink monitor, onto
+ * the CPU which this one runs on, at idle priority, so that they only run
+ * once this one blocks. This thread stays on that CPU until the affinity
+ * saved in cpus is restored. */
+static int sim_idle_other_threads(cpu_set_t *cpus)
+{
+	struct sched_param param = { 0 };
+	struct dirent *entry;
+	cpu_set_t one;
+	pid_t tid, self = syscall(SYS_gettid);
+	DIR *dir;
+	int r = 0;
+
+	CPU_ZERO(&one);
+	CPU_SET(sched_getcpu(), &one);
+	if (sched_getaffinity(0, sizeof(*cpus), cpus) ||
+	    sched_setaffinity(0, sizeof(one), &one))
+		return -1;
+	dir = opendir("/proc/self/task");
+	if (!dir)
+		return -1;
+	while (r == 0 && (entry = readdir(dir)) != NULL) {
+		tid = atoi(entry->d_name);
+		if (tid <= 0 || tid == self)
+			continue;
+		if (sched_setaffinity(tid, sizeof(one), &one) ||
+		    sched_setscheduler(tid, SCHED_IDLE, &param))
+			r = -1;
+	}
+	closedir(dir);
+	return r;
+}
+
+static int LIBUSB_CALL coalesce_callback(libusb_context *ctx,
+	libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	int *left = user_data;
+
+	(void)ctx;
+	(void)event;
+	if (libusb_get_device_address(dev) == 5)
+		(*left)++;
+	return 0;
+}
+
+/** Tests that the netlink monitor still reports the removal of a device
+ * which a context has, when an addition of it comes in the same batch, as
+ * happens when a device is plugged in while a context scans and then pulled
+ * out again. Only a device which no context knows about may come and go
+ * without notice. */
+static libusbx_testlib_result test_netlink_coalesce(libusbx_testlib_ctx * tctx)
+{
+	char root[] = SIM_ROOT;
+	libusb_context * ctx = NULL;
+	libusb_device * dev;
+	libusbx_testlib_result result = TEST_STATUS_ERROR;
+	struct timeval tv = { 0, 10000 };
+	cpu_set_t cpus;
+	uint32_t portid;
+	int i, sock = -1, left = 0, pinned = 0;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+	if (libusb_init(&ctx) != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb");
+		goto out;
+	}
+	portid = netlink_monitor_portid();
+	if (portid)
+		sock = socket(PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+	if (!portid || sock < 0) {
+		libusbx_testlib_logf(tctx, "No netlink monitor to send to");
+		result = TEST_STATUS_SKIP;
+		goto out;
+	}
+	if (libusb_hotplug_register_callback(ctx,
+	    LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0, LIBUSB_HOTPLUG_MATCH_ANY,
+	    LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+	    coalesce_callback, &left, NULL) != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to register a callback");
+		goto out;
+	}
+
+	/* 1-4 at address 5 was found by the scan at init. Both uevents
+	 * must be read in one batch for the monitor to consider coalescing
+	 * them. */
+	if (sim_idle_other_threads(&cpus)) {
+		libusbx_testlib_logf(tctx, "Failed to hold back the netlink "
+			"monitor: %s", strerror(errno));
+		goto out;
+	}
+	pinned = 1;
+	if (netlink_send_uevent(sock, portid, "add", "1-4", 1, 5) ||
+	    netlink_send_uevent(sock, portid, "remove", "1-4", 1, 5)) {
+		libusbx_testlib_logf(tctx, "Failed to send uevents: %s",
+			strerror(errno));
+		result = errno == EPERM ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+		goto out;
+	}
+
+	result = TEST_STATUS_FAILURE;
+	for (i = 0; i < 200 && !left; i++)
+		libusb_handle_events_timeout(ctx, &tv);
+	dev = sim_find(ctx, 5);
+	if (left != 1 || dev) {
+		libusbx_testlib_logf(tctx, "Removal reported %d times, device "
+			"%s listed", left, dev ? "still" : "not");
+		if (dev)
+			libusb_unref_device(dev);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	if (sock >= 0)
+		close(sock);
+	if (ctx)
+		libusb_exit(ctx);
+	if (pinned)
+		sched_setaffinity(0, sizeof(cpus), &cpus);
+	sim_teardown(root);
+	return result;
+}
+
+/* What a test_hotplug_dispatch() callback has seen, and the callback it
+ * deregisters the first time it is called, if any. */
+struct dispatch_count {
+	int arrived;
+	int left;
+	libusb_hotplug_callback_handle drop;
+};
+
+static int LIBUSB_CALL dispatch_callback(libusb_context *ctx,
+	libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	struct dispatch_count *count = user_data;
+
+	(void)dev;
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		count->arrived++;
+	else
+		count->left++;
+	if (count->drop) {
+		libusb_hotplug_deregister_callback(ctx, count->drop);
+		count->drop = 0;
+	}
+	return 0;
+}
+
+/** Tests hotplug dispatch through the vendor and product ID index: on the
+ * arrival of a root hub and the removal of a 03eb:2ffb device, sent as
+ * uevents to the netlink monitor, each callback is called for the events
+ * and devices it matches, whether it is indexed by ID or a wildcard, and
+ * not after it was deregistered by another callback, or by itself, during
+ * the dispatch of an earlier event. */
+static libusbx_testlib_result test_hotplug_dispatch(libusbx_testlib_ctx * tctx)
+{
+	/* IDs and expected calls: arrivals of 1d6b:0002, removals of
+	 * 03eb:2ffb. The full wildcards come last, so that the one
+	 * registered later is dispatched first, and deregisters the one
+	 * before it during the arrival. The last deregisters itself. */
+	static const struct {
+		int vendor_id, product_id, arrived, left;
+	} cbs[] = {
+		{ 0x03eb, 0x2ffb, 0, 1 },
+		{ 0x1d6b, 0x0002, 1, 0 },
+		{ 0x03eb, 0x0001, 0, 0 },
+		{ 0x03eb, LIBUSB_HOTPLUG_MATCH_ANY, 0, 1 },
+		{ LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, 0, 0 },
+		{ LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, 1, 1 },
+		{ LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, 1, 0 },
+	};
+#define DISPATCH_CBS	(int) (sizeof(cbs) / sizeof(cbs[0]))
+	char root[] = SIM_ROOT;
+	char devices[sizeof(root) + 32];
+	libusb_context * ctx = NULL;
+	libusbx_testlib_result result = TEST_STATUS_ERROR;
+	struct dispatch_count count[DISPATCH_CBS];
+	libusb_hotplug_callback_handle handle[DISPATCH_CBS];
+	struct timeval tv = { 0, 10000 };
+	uint32_t portid;
+	int i, sock = -1, added = 0;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+	if (libusb_init(&ctx) != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb");
+		goto out;
+	}
+	portid = netlink_monitor_portid();
+	if (portid)
+		sock = socket(PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+	if (!portid || sock < 0) {
+		libusbx_testlib_logf(tctx, "No netlink monitor to send to");
+		result = TEST_STATUS_SKIP;
+		goto out;
+	}
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < DISPATCH_CBS; i++) {
+		if (libusb_hotplug_register_callback(ctx,
+		    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+		    LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0, cbs[i].vendor_id,
+		    cbs[i].product_id, LIBUSB_HOTPLUG_MATCH_ANY,
+		    dispatch_callback, &count[i], &handle[i]) != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Failed to register callback %d", i);
+			goto out;
+		}
+	}
+	count[DISPATCH_CBS - 2].drop = handle[DISPATCH_CBS - 3];
+	count[DISPATCH_CBS - 1].drop = handle[DISPATCH_CBS - 1];
+
+	/* a fifth bus comes, then 1-4 at address 5 goes */
+	snprintf(devices, sizeof(devices), "%s/sys/bus/usb/devices", root);
+	if (sim_device(devices, "usb5", 5, 1, 1)) {
+		libusbx_testlib_logf(tctx, "Failed to add a simulated root hub");
+		goto out;
+	}
+	added = 1;
+	if (netlink_send_uevent(sock, portid, "add", "usb5", 5, 1) ||
+	    netlink_send_uevent(sock, portid, "remove", "1-4", 1, 5)) {
+		libusbx_testlib_logf(tctx, "Failed to send uevents: %s",
+			strerror(errno));
+		result = errno == EPERM ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+		goto out;
+	}
+
+	result = TEST_STATUS_FAILURE;
+	for (i = 0; i < 200 && !count[DISPATCH_CBS - 2].left; i++)
+		libusb_handle_events_timeout(ctx, &tv);
+	for (i = 0; i < DISPATCH_CBS; i++) {
+		if (count[i].arrived != cbs[i].arrived ||
+		    count[i].left != cbs[i].left) {
+			libusbx_testlib_logf(tctx, "Callback %d for %04x:%04x saw %d "
+				"arrivals and %d removals (expected %d and %d)", i,
+				cbs[i].vendor_id & 0xffff, cbs[i].product_id & 0xffff,
+				count[i].arrived, count[i].left, cbs[i].arrived,
+				cbs[i].left);
+			goto out;
+		}
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	if (sock >= 0)
+		close(sock);
+	if (ctx)
+		libusb_exit(ctx);
+	if (added)
+		sim_device(devices, "usb5", 5, 1, 0);
+	sim_teardown(root);
+	return result;
+#undef DISPATCH_CBS
+}
+
+/* Checks that a trace file is a pcap capture with the usbmon link type, and
+ * counts its records. The first must be the submission of a control URB.
+ * Returns -1 if the file is bad. */
+static int trace_records(libusbx_testlib_ctx * tctx, const char * path)
+{
+	struct {
+		uint32_t ts_sec;
+		uint32_t ts_usec;
+		uint32_t incl_len;
+		uint32_t orig_len;
+	} rec_hdr;
+	unsigned char packet[256];
+	uint32_t hdr[6];
+	int count = -1;
+	FILE * f;
+
+	f = fopen(path, "rb");
+	if (!f || fread(hdr, sizeof(hdr), 1, f) != 1) {
+		libusbx_testlib_logf(tctx, "Trace file has no pcap header");
+		goto out;
+	}
+	if (hdr[0] != 0xa1b2c3d4 || hdr[5] != 220) {
+		libusbx_testlib_logf(tctx, "Bad pcap magic %08x or link type %u",
+			hdr[0], hdr[5]);
+		goto out;
+	}
+	for (count = 0; fread(&rec_hdr, sizeof(rec_hdr), 1, f) == 1; count++) {
+		/* 64 bytes of usbmon header, then at most 64 of data */
+		if (rec_hdr.incl_len < 64 || rec_hdr.incl_len > sizeof(packet) ||
+		    fread(packet, rec_hdr.incl_len, 1, f) != 1 ||
+		    (count == 0 && (packet[8] != 'S' || packet[9] != 2))) {
+			libusbx_testlib_logf(tctx, "Bad trace record %d", count);
+			count = -1;
+			break;
+		}
+	}
+out:
+	if (f)
+		fclose(f);
+	return count;
+}
+
+/** Tests the URB trace of LIBUSB_TRACE: control transfers to a simulated
+ * device are each recorded as a submission and a completion, dumped on
+ * request with libusb_dump_trace(), and written again when the last
+ * context exits, but not when another one does. */
+static libusbx_testlib_result test_urb_trace(libusbx_testlib_ctx * tctx)
+{
+#define TRACE_TRANSFERS	100
+	char root[] = SIM_ROOT;
+	char trace[sizeof(root) + 16];
+	libusb_context * ctx[2] = { NULL, NULL };
+	libusb_device_handle * handle = NULL;
+	libusb_device * dev;
+	libusbx_testlib_result result = TEST_STATUS_ERROR;
+	unsigned char status[2];
+	struct stat st;
+	off_t dumped;
+	pid_t pid;
+	int i, r;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+	snprintf(trace, sizeof(trace), "%s/trace.pcap", root);
+	setenv("LIBUSB_TRACE", trace, 1);
+
+	for (i = 0; i < 2; i++) {
+		r = libusb_init(&ctx[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+			goto out;
+		}
+	}
+	dev = sim_find(ctx[1], 2);
+	r = dev ? libusb_open(dev, &handle) : LIBUSB_ERROR_NOT_FOUND;
+	if (dev)
+		libusb_unref_device(dev);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open device: %d", r);
+		goto out;
+	}
+
+	result = TEST_STATUS_FAILURE;
+	if (stat(trace, &st) != 0 || st.st_size != 0) {
+		libusbx_testlib_logf(tctx, "Trace file missing or written early");
+		goto out;
+	}
+	for (i = 0; i < TRACE_TRANSFERS; i++) {
+		r = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_STATUS, 0, 0, status, sizeof(status), 1000);
+		if (r != sizeof(status)) {
+			libusbx_testlib_logf(tctx, "GET_STATUS returned %d", r);
+			goto out;
+		}
+	}
+
+	r = libusb_dump_trace(ctx[1]);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to dump the trace: %d", r);
+		goto out;
+	}
+	r = trace_records(tctx, trace);
+	if (r != 2 * TRACE_TRANSFERS) {
+		libusbx_testlib_logf(tctx, "Dumped %d records (expected %d)",
+			r, 2 * TRACE_TRANSFERS);
+		goto out;
+	}
+	stat(trace, &st);
+	dumped = st.st_size;
+
+	libusb_close(handle);
+	handle = NULL;
+	libusb_exit(ctx[0]);
+	ctx[0] = NULL;
+	if (stat(trace, &st) != 0 || st.st_size != dumped) {
+		libusbx_testlib_logf(tctx, "Trace rewritten before the last exit");
+		goto out;
+	}
+	libusb_exit(ctx[1]);
+	ctx[1] = NULL;
+
+	r = trace_records(tctx, trace);
+	if (r != 2 * TRACE_TRANSFERS) {
+		libusbx_testlib_logf(tctx, "Wrote %d records (expected %d)",
+			r, 2 * TRACE_TRANSFERS);
+		goto out;
+	}
+	if (libusb_dump_trace(NULL) != LIBUSB_ERROR_NOT_FOUND) {
+		libusbx_testlib_logf(tctx, "Dumped a trace after it was written");
+		goto out;
+	}
+
+	/* A program which exits without libusb_exit() still writes it. */
+	unlink(trace);
+	pid = fork();
+	if (pid == 0) {
+		if (libusb_init(&ctx[0]) != LIBUSB_SUCCESS ||
+		    !(dev = sim_find(ctx[0], 2)) ||
+		    libusb_open(dev, &handle) != LIBUSB_SUCCESS)
+			_exit(1);
+		for (i = 0; i < TRACE_TRANSFERS; i++)
+			libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN,
+				LIBUSB_REQUEST_GET_STATUS, 0, 0, status,
+				sizeof(status), 1000);
+		exit(0);
+	}
+	if (pid < 0 || waitpid(pid, &r, 0) != pid || !WIFEXITED(r) ||
+	    WEXITSTATUS(r) != 0) {
+		libusbx_testlib_logf(tctx, "Traced child failed");
+		goto out;
+	}
+	r = trace_records(tctx, trace);
+	if (r != 2 * TRACE_TRANSFERS) {
+		libusbx_testlib_logf(tctx, "Wrote %d records at exit "
+			"(expected %d)", r, 2 * TRACE_TRANSFERS);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	if (handle)
+		libusb_close(handle);
+	for (i = 0; i < 2; i++)
+		if (ctx[i])
+			libusb_exit(ctx[i]);
+	unsetenv("LIBUSB_TRACE");
+	unlink(trace);
+	sim_teardown(root);
+	return result;
+#undef TRACE_TRANSFERS
+}
+
+struct log_sink_stats {
+	int fd;
+	int lines;
+};
+
+static void LIBUSB_CALL log_sink_count(libusb_context *ctx,
+	enum libusb_log_level level, const char *str, void *user_data)
+{
+	struct log_sink_stats *stats = user_data;
+	ssize_t r;
+
+	(void)ctx;
+	/* sinks may be called from the writers of two queues at once while
+	 * one replaces the other */
+	if (level != LIBUSB_LOG_LEVEL_NONE)
+		__sync_fetch_and_add(&stats->lines, 1);
+	/* cost about what writing to stderr would */
+	r = write(stats->fd, str, strlen(str));
+	(void)r;
+}
+
+struct log_sink_producer_args {
+	int loops;
+	volatile int done;
+};
+
+/* runs the event loop with debug messages on from a second thread */
+static void *log_sink_producer(void *arg)
+{
+	struct log_sink_producer_args *args = arg;
+	struct timeval zero = { 0, 0 };
+	int i;
+
+	for (i = 0; i < args->loops; i++)
+		libusb_handle_events_timeout(NULL, &zero);
+	args->done = 1;
+	return NULL;
+}
+
+/** Benchmarks the event loop with debug messages on, written to /dev/null
+ * synchronously and then by the background writer, and checks that every
+ * message was either written or counted as dropped. Then does the same while
+ * the sink is replaced over and over from another thread, which must not
+ * lose, repeat or crash on any message. */
+static libusbx_testlib_result test_log_sink(libusbx_testlib_ctx * tctx)
+{
+#define LOG_LOOPS	20000
+#define LOG_SWAPS	2000
+	char root[] = SIM_ROOT;
+	libusbx_testlib_result result = TEST_STATUS_ERROR;
+	struct log_sink_stats sync_stats, async_stats, swap_stats[2];
+	struct timeval start, zero = { 0, 0 };
+	double sync_ms, async_ms;
+	unsigned int dropped, swap_dropped;
+	struct log_sink_producer_args producer_args;
+	pthread_t producer;
+	int i, r, swaps;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+
+	/* Debug messages not tied to a context go to the default one. */
+	r = libusb_init(NULL);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		goto out;
+	}
+	sync_stats.fd = async_stats.fd = open("/dev/null", O_WRONLY);
+	sync_stats.lines = async_stats.lines = 0;
+	libusb_set_debug(NULL, LIBUSB_LOG_LEVEL_DEBUG);
+
+	libusb_set_log_sink(NULL, log_sink_count, &sync_stats, 0);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < LOG_LOOPS; i++)
+		libusb_handle_events_timeout(NULL, &zero);
+	sync_ms = elapsed_ms(&start);
+
+	r = libusb_set_log_sink(NULL, log_sink_count, &async_stats,
+		LIBUSB_LOG_SINK_ASYNC);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to start the log writer: %d", r);
+		result = r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP
+			: TEST_STATUS_FAILURE;
+		libusb_set_log_sink(NULL, NULL, NULL, 0);
+		libusb_exit(NULL);
+		close(sync_stats.fd);
+		goto out;
+	}
+	gettimeofday(&start, NULL);
+	for (i = 0; i < LOG_LOOPS; i++)
+		libusb_handle_events_timeout(NULL, &zero);
+	async_ms = elapsed_ms(&start);
+	/* waits for the writer to finish */
+	libusb_set_log_sink(NULL, NULL, NULL, 0);
+	dropped = libusb_get_log_dropped(NULL);
+
+	libusbx_testlib_logf(tctx, "%d event loops, %d messages: %.2f ms "
+		"synchronously, %.2f ms with the background writer "
+		"(%d written, %u dropped)", LOG_LOOPS, sync_stats.lines, sync_ms,
+		async_ms, async_stats.lines, dropped);
+	result = TEST_STATUS_SUCCESS;
+	if (async_stats.lines + dropped != (unsigned int) sync_stats.lines) {
+		libusbx_testlib_logf(tctx, "Messages were lost or repeated");
+		result = TEST_STATUS_FAILURE;
+	}
+
+	/* Alternate between a synchronous and a queued sink while the
+	 * messages are logged by another thread. */
+	swap_stats[0].fd = swap_stats[1].fd = sync_stats.fd;
+	swap_stats[0].lines = swap_stats[1].lines = 0;
+	libusb_set_log_sink(NULL, log_sink_count, &swap_stats[0], 0);
+	producer_args.loops = LOG_LOOPS;
+	producer_args.done = 0;
+	if (pthread_create(&producer, NULL, log_sink_producer,
+	    &producer_args) != 0) {
+		libusbx_testlib_logf(tctx, "Failed to start a thread");
+		result = TEST_STATUS_ERROR;
+	} else {
+		for (swaps = 0; !producer_args.done && swaps < LOG_SWAPS; swaps++)
+			libusb_set_log_sink(NULL, log_sink_count,
+				&swap_stats[swaps & 1],
+				swaps & 1 ? 0 : LIBUSB_LOG_SINK_ASYNC);
+		pthread_join(producer, NULL);
+		libusb_set_log_sink(NULL, NULL, NULL, 0);
+		swap_dropped = libusb_get_log_dropped(NULL) - dropped;
+
+		libusbx_testlib_logf(tctx, "%d sink swaps: %d written, "
+			"%u dropped", swaps, swap_stats[0].lines +
+			swap_stats[1].lines, swap_dropped);
+		if (swap_stats[0].lines + swap_stats[1].lines + swap_dropped !=
+		    (unsigned int) sync_stats.lines) {
+			libusbx_testlib_logf(tctx, "Messages were lost or "
+				"repeated while swapping sinks");
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+	libusb_set_debug(NULL, LIBUSB_LOG_LEVEL_NONE);
+	libusb_exit(NULL);
+	close(sync_stats.fd);
+out:
+	sim_teardown(root);
+	return result;
+#undef LOG_SWAPS
+#undef LOG_LOOPS
+}
+
+/** Tests that the config descriptors of a device are parsed once and
+ * shared: every lookup returns the same copy, which stays valid until its
+ * last reference is freed, even after the device and its context are gone.
+ * Also times a lookup from the cache. */
+static libusbx_testlib_result test_config_cache(libusbx_testlib_ctx * tctx)
+{
+#define CONFIG_LOOPS	100000
+	char root[] = SIM_ROOT;
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_context * ctx;
+	libusb_device * dev;
+	struct libusb_config_descriptor *config[4] = { NULL, NULL, NULL, NULL };
+	struct libusb_config_descriptor *again;
+	struct timeval start;
+	double ms;
+	int i, r;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		sim_teardown(root);
+		return TEST_STATUS_ERROR;
+	}
+	dev = sim_find(ctx, 2);
+	if (!dev) {
+		libusbx_testlib_logf(tctx, "Simulated device 1-2 not found");
+		goto out;
+	}
+
+	if (libusb_get_config_descriptor(dev, 0, &config[0]) ||
+	    libusb_get_config_descriptor(dev, 0, &config[1]) ||
+	    libusb_get_active_config_descriptor(dev, &config[2]) ||
+	    libusb_get_config_descriptor_by_value(dev, 1, &config[3])) {
+		libusbx_testlib_logf(tctx, "Failed to get the config descriptor");
+		goto out;
+	}
+	for (i = 1; i < 4; i++) {
+		if (config[i] != config[0]) {
+			libusbx_testlib_logf(tctx, "Lookup %d returned another copy", i);
+			goto out;
+		}
+	}
+	r = libusb_get_config_descriptor(dev, 1, &again);
+	if (r != LIBUSB_ERROR_NOT_FOUND) {
+		libusbx_testlib_logf(tctx, "Config index 1 returned %d", r);
+		if (r == LIBUSB_SUCCESS)
+			libusb_free_config_descriptor(again);
+		goto out;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < CONFIG_LOOPS; i++) {
+		if (libusb_get_config_descriptor(dev, 0, &again) != LIBUSB_SUCCESS ||
+		    again != config[0]) {
+			libusbx_testlib_logf(tctx, "Cached lookup %d failed", i);
+			goto out;
+		}
+		libusb_free_config_descriptor(again);
+	}
+	ms = elapsed_ms(&start);
+
+	/* Drop all but the last reference, then the device and the context:
+	 * the descriptor must survive them (ASan catches a use after free)
+	 * and go with the last free (LeakSanitizer catches a leak). */
+	for (i = 0; i < 3; i++) {
+		libusb_free_config_descriptor(config[i]);
+		config[i] = NULL;
+	}
+	libusb_unref_device(dev);
+	dev = NULL;
+	libusb_exit(ctx);
+	ctx = NULL;
+	if (config[3]->bConfigurationValue != 1 ||
+	    config[3]->bNumInterfaces != 2 ||
+	    config[3]->interface[1].altsetting[0].bNumEndpoints != 2 ||
+	    config[3]->interface[1].altsetting[0].endpoint[1].bEndpointAddress != 0x02) {
+		libusbx_testlib_logf(tctx, "Descriptor changed after its device "
+			"was destroyed");
+		goto out;
+	}
+
+	libusbx_testlib_logf(tctx, "%d cached config descriptor lookups, "
+		"%.1f ns each", CONFIG_LOOPS, ms * 1000000.0 / CONFIG_LOOPS);
+	result = TEST_STATUS_SUCCESS;
+out:
+	for (i = 0; i < 4; i++)
+		if (config[i])
+			libusb_free_config_descriptor(config[i]);
+	if (dev)
+		libusb_unref_device(dev);
+	if (ctx)
+		libusb_exit(ctx);
+	sim_teardown(root);
+	return result;
+#undef CONFIG_LOOPS
+}
+
+/* Checks one field of a parsed descriptor, see test_config_parse(). */
+#define CHECK_FIELD(desc, field, value) do { \
+	if ((desc)->field != (value)) { \
+		libusbx_testlib_logf(tctx, "%s is %d (expected %d)", \
+			#desc "->" #field, (int) (desc)->field, (int) (value)); \
+		goto out; \
+	} \
+} while (0)
+
+/* Checks the extra bytes of a parsed descriptor against sim_config[]. */
+#define CHECK_EXTRA(desc, offset, len) do { \
+	if ((desc)->extra_length != (len) || ((len) && \
+	    memcmp((desc)->extra, sim_config + (offset), (len)))) { \
+		libusbx_testlib_logf(tctx, "%s has the wrong extra bytes", #desc); \
+		goto out; \
+	} \
+} while (0)
+
+/** Tests the parse of the simulated configuration field by field, with
+ * its extra descriptors, against the bytes in sim_config[]. These are the
+ * values the per-array parser used to produce. */
+static libusbx_testlib_result test_config_parse(libusbx_testlib_ctx * tctx)
+{
+	char root[] = SIM_ROOT;
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_context * ctx;
+	libusb_device * dev;
+	struct libusb_config_descriptor *config = NULL;
+	struct libusb_ss_endpoint_companion_descriptor *comp = NULL;
+	const struct libusb_interface_descriptor *alt;
+	const struct libusb_endpoint_descriptor *ep;
+	int r;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		sim_teardown(root);
+		return TEST_STATUS_ERROR;
+	}
+	dev = sim_find(ctx, 2);
+	if (!dev || libusb_get_config_descriptor(dev, 0, &config)) {
+		libusbx_testlib_logf(tctx, "Failed to get the config descriptor");
+		goto out;
+	}
+
+	CHECK_FIELD(config, bLength, LIBUSB_DT_CONFIG_SIZE);
+	CHECK_FIELD(config, bDescriptorType, LIBUSB_DT_CONFIG);
+	CHECK_FIELD(config, wTotalLength, sizeof(sim_config));
+	CHECK_FIELD(config, bNumInterfaces, 2);
+	CHECK_FIELD(config, bConfigurationValue, 1);
+	CHECK_FIELD(config, iConfiguration, 0);
+	CHECK_FIELD(config, bmAttributes, 0x80);
+	CHECK_FIELD(config, MaxPower, 50);
+	CHECK_EXTRA(config, 9, 4);
+
+	/* interface 0: DFU, two altsettings, the first with a functional
+	 * descriptor */
+	CHECK_FIELD(&config->interface[0], num_altsetting, 2);
+	alt = &config->interface[0].altsetting[0];
+	CHECK_FIELD(alt, bLength, LIBUSB_DT_INTERFACE_SIZE);
+	CHECK_FIELD(alt, bDescriptorType, LIBUSB_DT_INTERFACE);
+	CHECK_FIELD(alt, bInterfaceNumber, 0);
+	CHECK_FIELD(alt, bAlternateSetting, 0);
+	CHECK_FIELD(alt, bNumEndpoints, 0);
+	CHECK_FIELD(alt, bInterfaceClass, LIBUSB_CLASS_APPLICATION);
+	CHECK_FIELD(alt, bInterfaceSubClass, 1);
+	CHECK_FIELD(alt, bInterfaceProtocol, 2);
+	CHECK_FIELD(alt, iInterface, 0);
+	CHECK_EXTRA(alt, 22, 9);
+	alt = &config->interface[0].altsetting[1];
+	CHECK_FIELD(alt, bInterfaceNumber, 0);
+	CHECK_FIELD(alt, bAlternateSetting, 1);
+	CHECK_FIELD(alt, bNumEndpoints, 0);
+	CHECK_FIELD(alt, bInterfaceClass, LIBUSB_CLASS_APPLICATION);
+	CHECK_EXTRA(alt, 0, 0);
+
+	/* interface 1: vendor specific, a bulk endpoint each way */
+	CHECK_FIELD(&config->interface[1], num_altsetting, 1);
+	alt = &config->interface[1].altsetting[0];
+	CHECK_FIELD(alt, bInterfaceNumber, 1);
+	CHECK_FIELD(alt, bAlternateSetting, 0);
+	CHECK_FIELD(alt, bNumEndpoints, 2);
+	CHECK_FIELD(alt, bInterfaceClass, LIBUSB_CLASS_VENDOR_SPEC);
+	CHECK_FIELD(alt, bInterfaceSubClass, 0);
+	CHECK_FIELD(alt, bInterfaceProtocol, 0);
+	CHECK_EXTRA(alt, 0, 0);
+	ep = &alt->endpoint[0];
+	CHECK_FIELD(ep, bLength, LIBUSB_DT_ENDPOINT_SIZE);
+	CHECK_FIELD(ep, bDescriptorType, LIBUSB_DT_ENDPOINT);
+	CHECK_FIELD(ep, bEndpointAddress, 0x81);
+	CHECK_FIELD(ep, bmAttributes, LIBUSB_TRANSFER_TYPE_BULK);
+	CHECK_FIELD(ep, wMaxPacketSize, 64);
+	CHECK_FIELD(ep, bInterval, 0);
+	CHECK_FIELD(ep, bRefresh, 0);
+	CHECK_FIELD(ep, bSynchAddress, 0);
+	CHECK_EXTRA(ep, 56, LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE);
+	ep = &alt->endpoint[1];
+	CHECK_FIELD(ep, bEndpointAddress, 0x02);
+	CHECK_FIELD(ep, bmAttributes, LIBUSB_TRANSFER_TYPE_BULK);
+	CHECK_FIELD(ep, wMaxPacketSize, 64);
+	CHECK_EXTRA(ep, 0, 0);
+
+	/* the companion descriptor is parsed from the endpoint's extra bytes */
+	r = libusb_get_ss_endpoint_companion_descriptor(ctx, &alt->endpoint[0],
+		&comp);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "No endpoint companion descriptor: %d", r);
+		goto out;
+	}
+	CHECK_FIELD(comp, bLength, LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE);
+	CHECK_FIELD(comp, bDescriptorType, LIBUSB_DT_SS_ENDPOINT_COMPANION);
+	CHECK_FIELD(comp, bMaxBurst, 0);
+	CHECK_FIELD(comp, bmAttributes, 0);
+	CHECK_FIELD(comp, wBytesPerInterval, 0);
+
+	result = TEST_STATUS_SUCCESS;
+out:
+	if (comp)
+		libusb_free_ss_endpoint_companion_descriptor(comp);
+	if (config)
+		libusb_free_config_descriptor(config);
+	if (dev)
+		libusb_unref_device(dev);
+	libusb_exit(ctx);
+	sim_teardown(root);
+	return result;
+}
+
+#undef CHECK_EXTRA
+#undef CHECK_FIELD
+
+/* Reads string desc_index of handle, and checks its text and how many
+ * string requests the fake usbfs saw. */
+static int sim_check_string(libusbx_testlib_ctx * tctx,
+	libusb_device_handle * handle, uint8_t desc_index, int requests)
+{
+	unsigned char data[32];
+	char expect[16];
+	int r;
+
+	sim_usbfs.string_requests = 0;
+	r = libusb_get_string_descriptor_ascii(handle, desc_index, data,
+		sizeof(data));
+	snprintf(expect, sizeof(expect), "String %d", desc_index);
+	if (r != (int) strlen(expect) || memcmp(data, expect, r)) {
+		libusbx_testlib_logf(tctx, "String %d read returned %d", desc_index, r);
+		return -1;
+	}
+	if (sim_usbfs.string_requests != requests) {
+		libusbx_testlib_logf(tctx, "String %d took %d requests (expected %d)",
+			desc_index, sim_usbfs.string_requests, requests);
+		return -1;
+	}
+	return 0;
+}
+
+/** Tests the string descriptor cache of a device handle on the fake usbfs:
+ * a string is read once, with the LANGID, and a repeat lookup makes no
+ * request until the device is reset or the handle is closed. Also times a
+ * cached lookup. */
+static libusbx_testlib_result test_string_cache(libusbx_testlib_ctx * tctx)
+{
+#define STRING_LOOPS	100000
+	char root[] = SIM_ROOT;
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_context * ctx;
+	libusb_device * dev;
+	libusb_device_handle * handle = NULL;
+	unsigned char data[32];
+	struct timeval start;
+	double ms;
+	int i, r;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		sim_teardown(root);
+		return TEST_STATUS_ERROR;
+	}
+	dev = sim_find(ctx, 2);
+	if (!dev || libusb_open(dev, &handle) != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open simulated device 1-2");
+		goto out;
+	}
+
+	/* the first read also fetches the LANGID, later ones nothing */
+	if (sim_check_string(tctx, handle, 2, 2) ||
+	    sim_check_string(tctx, handle, 2, 0) ||
+	    sim_check_string(tctx, handle, 1, 1))
+		goto out;
+
+	/* of the three strings the device descriptor names, only the serial
+	 * number is left to fetch */
+	sim_usbfs.string_requests = 0;
+	r = libusb_prefetch_string_descriptors(handle);
+	if (r != LIBUSB_SUCCESS || sim_usbfs.string_requests != 1) {
+		libusbx_testlib_logf(tctx, "Prefetch returned %d after %d requests",
+			r, sim_usbfs.string_requests);
+		goto out;
+	}
+	if (sim_check_string(tctx, handle, 3, 0))
+		goto out;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < STRING_LOOPS; i++) {
+		if (libusb_get_string_descriptor_ascii(handle, 2, data,
+		    sizeof(data)) != 8) {
+			libusbx_testlib_logf(tctx, "Cached lookup %d failed", i);
+			goto out;
+		}
+	}
+	ms = elapsed_ms(&start);
+
+	/* a reset may have changed the device, so everything is read again */
+	sim_usbfs.resets = 0;
+	r = libusb_reset_device(handle);
+	if (r != LIBUSB_SUCCESS || sim_usbfs.resets != 1) {
+		libusbx_testlib_logf(tctx, "Reset returned %d", r);
+		goto out;
+	}
+	if (sim_check_string(tctx, handle, 2, 2) ||
+	    sim_check_string(tctx, handle, 2, 0))
+		goto out;
+
+	/* and the cache goes with the handle */
+	libusb_close(handle);
+	handle = NULL;
+	if (libusb_open(dev, &handle) != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to reopen simulated device 1-2");
+		goto out;
+	}
+	if (sim_check_string(tctx, handle, 2, 2))
+		goto out;
+
+	libusbx_testlib_logf(tctx, "%d cached string lookups, %.1f ns each",
+		STRING_LOOPS, ms * 1000000.0 / STRING_LOOPS);
+	result = TEST_STATUS_SUCCESS;
+out:
+	if (handle)
+		libusb_close(handle);
+	if (dev)
+		libusb_unref_device(dev);
+	libusb_exit(ctx);
+	sim_teardown(root);
+	return result;
+#undef STRING_LOOPS
+}
+
+/* The start of libusb-0.1's struct usb_bus and struct usb_device, which
+ * that library's ABI fixes, as far as test_compat_rescan() needs them. */
+struct compat_device;
+
+struct compat_bus {
+	struct compat_bus *next, *prev;
+	char dirname[PATH_MAX + 1];
+	struct compat_device *devices;
+	uint32_t location;
+};
+
+struct compat_device {
+	struct compat_device *next, *prev;
+	char filename[PATH_MAX + 1];
+};
+
+/* Lists bus 1 of libusb-0.1 by device address into devs, and returns its
+ * device count, or -1 if there is no bus 1. */
+static int compat_bus1(struct compat_bus *(*get_busses)(void),
+	struct compat_device **devs, int ndevs)
+{
+	struct compat_bus *bus;
+	struct compat_device *dev;
+	int count = 0, address;
+
+	for (bus = get_busses(); bus && bus->location != 1; bus = bus->next)
+		;
+	if (!bus)
+		return -1;
+	memset(devs, 0, ndevs * sizeof(*devs));
+	for (dev = bus->devices; dev; dev = dev->next) {
+		address = atoi(dev->filename);
+		if (address > 0 && address < ndevs)
+			devs[address] = dev;
+		count++;
+	}
+	return count;
+}
+
+/** Tests libusb-0.1 (libusb-compat) on a simulated tree: a rescan keeps
+ * every usb_device it already had, a device replugged at the same address
+ * through the netlink monitor is replaced, and one unplugged is dropped,
+ * without touching the others. usb_control_msg() must work on both of its
+ * paths. Also times a rescan which finds nothing new. The library is loaded at run time from the usual search path,
+ * LD_LIBRARY_PATH included, and the test is skipped without it. Its
+ * context lives until the process exits, so this has to be the last test. */
+static libusbx_testlib_result test_compat_rescan(libusbx_testlib_ctx * tctx)
+{
+#define RESCAN_LOOPS	100
+	const int ndevices = SIM_BUSES * (SIM_DEVICES_PER_BUS + 1);
+	char root[] = SIM_ROOT;
+	libusbx_testlib_result result = TEST_STATUS_ERROR;
+	struct compat_device *before[SIM_DEVICES_PER_BUS + 2];
+	struct compat_device *after[SIM_DEVICES_PER_BUS + 2];
+	void (*usb_init)(void);
+	int (*usb_find_busses)(void);
+	int (*usb_find_devices)(void);
+	struct compat_bus *(*usb_get_busses)(void);
+	void *(*usb_open)(struct compat_device *dev);
+	int (*usb_close)(void *dev);
+	int (*usb_control_msg)(void *dev, int requesttype, int request,
+		int value, int index, char *bytes, int size, int timeout);
+	char bytes[512];
+	int status, string, stall;
+	void *handle;
+	struct timeval start;
+	cpu_set_t cpus;
+	uint32_t portid;
+	double ms;
+	void *lib;
+	int i, r, sock = -1, pinned = 0;
+
+	lib = dlopen("libusb-0.1.so.4", RTLD_NOW | RTLD_LOCAL);
+	if (!lib) {
+		libusbx_testlib_logf(tctx, "No libusb-0.1: %s", dlerror());
+		return TEST_STATUS_SKIP;
+	}
+	usb_init = (void (*)(void)) dlsym(lib, "usb_init");
+	usb_find_busses = (int (*)(void)) dlsym(lib, "usb_find_busses");
+	usb_find_devices = (int (*)(void)) dlsym(lib, "usb_find_devices");
+	usb_get_busses = (struct compat_bus *(*)(void)) dlsym(lib,
+		"usb_get_busses");
+	usb_open = (void *(*)(struct compat_device *)) dlsym(lib, "usb_open");
+	usb_close = (int (*)(void *)) dlsym(lib, "usb_close");
+	usb_control_msg = (int (*)(void *, int, int, int, int, char *, int,
+		int)) dlsym(lib, "usb_control_msg");
+	if (!usb_init || !usb_find_busses || !usb_find_devices ||
+	    !usb_get_busses || !usb_open || !usb_close || !usb_control_msg) {
+		libusbx_testlib_logf(tctx, "libusb-0.1 lacks the functions tested");
+		return TEST_STATUS_ERROR;
+	}
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+	usb_init();
+	r = usb_find_busses();
+	if (r != SIM_BUSES) {
+		libusbx_testlib_logf(tctx, "Found %d busses (expected %d)", r,
+			SIM_BUSES);
+		goto out;
+	}
+	r = usb_find_devices();
+	if (r != ndevices) {
+		libusbx_testlib_logf(tctx, "Found %d devices (expected %d)", r,
+			ndevices);
+		goto out;
+	}
+	compat_bus1(usb_get_busses, before, SIM_DEVICES_PER_BUS + 2);
+
+	result = TEST_STATUS_FAILURE;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < RESCAN_LOOPS; i++) {
+		r = usb_find_busses() + usb_find_devices();
+		if (r != 0) {
+			libusbx_testlib_logf(tctx, "Rescan %d made %d changes", i, r);
+			goto out;
+		}
+	}
+	ms = elapsed_ms(&start);
+	if (compat_bus1(usb_get_busses, after, SIM_DEVICES_PER_BUS + 2) !=
+	    SIM_DEVICES_PER_BUS + 1 || memcmp(before, after, sizeof(before))) {
+		libusbx_testlib_logf(tctx, "Rescans changed the devices of bus 1");
+		goto out;
+	}
+
+	/* usb_control_msg() builds short requests in place, and hands longer
+	 * ones to libusb_control_transfer(). Both must return the data, and
+	 * a stall as -EPIPE. */
+	handle = before[2] ? usb_open(before[2]) : NULL;
+	if (!handle) {
+		libusbx_testlib_logf(tctx, "Failed to open 1-1 with libusb-0.1");
+		goto out;
+	}
+	status = usb_control_msg(handle, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_STATUS, 0, 0, bytes, 2, 1000);
+	if (status == 2 && (bytes[0] != 1 || bytes[1] != 0))
+		status = -1;
+	string = usb_control_msg(handle, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_STRING << 8) | 1, 0x0409,
+		bytes, sizeof(bytes), 1000);
+	if (string == 18 && (bytes[1] != LIBUSB_DT_STRING || bytes[2] != 'S'))
+		string = -1;
+	stall = usb_control_msg(handle, LIBUSB_ENDPOINT_OUT |
+		LIBUSB_REQUEST_TYPE_VENDOR, 1, 0, 0, bytes, 4, 1000);
+	usb_close(handle);
+	if (status != 2 || string != 18 || stall != -EPIPE) {
+		libusbx_testlib_logf(tctx, "usb_control_msg() returned %d for the "
+			"status, %d for a string and %d for a stall", status, string,
+			stall);
+		goto out;
+	}
+
+	portid = netlink_monitor_portid();
+	if (portid)
+		sock = socket(PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+	if (!portid || sock < 0) {
+		libusbx_testlib_logf(tctx, "No netlink monitor to send to");
+		result = TEST_STATUS_SKIP;
+		goto out;
+	}
+
+	/* 1-4 at address 5 is replugged: it comes back at the same address,
+	 * but as another device. Both uevents are handled before the next
+	 * rescan, as the monitor only runs while this thread sleeps. */
+	if (sim_idle_other_threads(&cpus)) {
+		libusbx_testlib_logf(tctx, "Failed to hold back the netlink "
+			"monitor: %s", strerror(errno));
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+	pinned = 1;
+	if (netlink_send_uevent(sock, portid, "remove", "1-4", 1, 5) ||
+	    netlink_send_uevent(sock, portid, "add", "1-4", 1, 5)) {
+		libusbx_testlib_logf(tctx, "Failed to send uevents: %s",
+			strerror(errno));
+		result = errno == EPERM ? TEST_STATUS_SKIP : TEST_STATUS_ERROR;
+		goto out;
+	}
+	for (i = 0, r = 0; i < 200 && !r; i++) {
+		usleep(10000);
+		r = usb_find_devices();
+	}
+	if (r != 2 ||
+	    compat_bus1(usb_get_busses, after, SIM_DEVICES_PER_BUS + 2) !=
+	    SIM_DEVICES_PER_BUS + 1 || !after[5] || after[5] == before[5]) {
+		libusbx_testlib_logf(tctx, "Replugging 1-4 made %d changes, "
+			"and %s its usb_device", r, after[5] && after[5] !=
+			before[5] ? "replaced" : "did not replace");
+		goto out;
+	}
+	before[5] = after[5];
+
+	/* then 1-5 at address 6 goes */
+	if (netlink_send_uevent(sock, portid, "remove", "1-5", 1, 6)) {
+		libusbx_testlib_logf(tctx, "Failed to send a uevent: %s",
+			strerror(errno));
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+	for (i = 0, r = 0; i < 200 && !r; i++) {
+		usleep(10000);
+		r = usb_find_devices();
+	}
+	before[6] = NULL;
+	if (r != 1 ||
+	    compat_bus1(usb_get_busses, after, SIM_DEVICES_PER_BUS + 2) !=
+	    SIM_DEVICES_PER_BUS || memcmp(before, after, sizeof(before))) {
+		libusbx_testlib_logf(tctx, "Removal of 1-5 made %d changes, or "
+			"changed other devices", r);
+		goto out;
+	}
+
+	libusbx_testlib_logf(tctx, "%d devices: libusb-0.1 rescan %.3f ms",
+		ndevices, ms / RESCAN_LOOPS);
+	result = TEST_STATUS_SUCCESS;
+out:
+	if (sock >= 0)
+		close(sock);
+	if (pinned)
+		sched_setaffinity(0, sizeof(cpus), &cpus);
+	sim_teardown(root);
+	return result;
+#undef RESCAN_LOOPS
+}
+
+/** Benchmarks allocating and freeing transfers the way the synchronous API
+ * does, one at a time, after warming up libusbx's transfer cache. The cache
+ * is only kept while a context exists, which is made on a simulated tree. */
+static libusbx_testlib_result test_alloc_free_transfers(libusbx_testlib_ctx * tctx)
+{
+#define ALLOC_LOOPS	1000000
+	char root[] = SIM_ROOT;
+	libusb_context * ctx = NULL;
+	struct libusb_transfer * transfers[8];
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	uint64_t hits, misses, end_hits, end_misses;
+	struct timeval start;
+	double ms;
+	int i, j, r;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+	if (libusb_prealloc_transfers(0, 8) != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to preallocate transfers");
+		goto out;
+	}
+
+	libusb_get_transfer_cache_stats(&hits, &misses);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < ALLOC_LOOPS; i += 8) {
+		for (j = 0; j < 8; j++) {
+			transfers[j] = libusb_alloc_transfer(0);
+			if (!transfers[j] || transfers[j]->length || transfers[j]->buffer) {
+				libusbx_testlib_logf(tctx, "Bad transfer from the cache");
+				goto out;
+			}
+			transfers[j]->length = 64;
+		}
+		for (j = 0; j < 8; j++)
+			libusb_free_transfer(transfers[j]);
+	}
+	ms = elapsed_ms(&start);
+
+	/* with 8 transfers preallocated, every allocation should be a hit */
+	libusb_get_transfer_cache_stats(&end_hits, &end_misses);
+	end_hits -= hits;
+	end_misses -= misses;
+	if (end_hits != ALLOC_LOOPS || end_misses) {
+		libusbx_testlib_logf(tctx, "%lu cache hits and %lu misses for %d "
+			"allocations", (unsigned long)end_hits,
+			(unsigned long)end_misses, ALLOC_LOOPS);
+		goto out;
+	}
+
+	libusb_exit(ctx);
+	ctx = NULL;
+	r = libusb_prealloc_transfers(0, 8);
+	if (r != LIBUSB_ERROR_NOT_FOUND) {
+		libusbx_testlib_logf(tctx, "Preallocating without a context "
+			"returned %d", r);
+		goto out;
+	}
+
+	libusbx_testlib_logf(tctx, "%d transfers allocated and freed, %.1f ns "
+		"each, %.1f%% cache hits", ALLOC_LOOPS, ms * 1000000.0 / ALLOC_LOOPS,
+		100.0 * end_hits / (end_hits + end_misses));
+	result = TEST_STATUS_SUCCESS;
+out:
+	if (ctx)
+		libusb_exit(ctx);
+	sim_teardown(root);
+	return result;
+#undef ALLOC_LOOPS
+}
+
+static void LIBUSB_CALL dev_mem_callback(struct libusb_transfer * transfer)
+{
+	int * done = transfer->user_data;
+	*done = 1;
+}
+
+/** Tests that a transfer buffer from libusb_dev_mem_alloc() is unmapped,
+ * rather than passed to free(), when the transfer is freed with
+ * LIBUSB_TRANSFER_FREE_BUFFER. */
+static libusbx_testlib_result test_dev_mem_free_buffer(libusbx_testlib_ctx * tctx)
+{
+	char root[] = SIM_ROOT;
+	libusb_context * ctx = NULL;
+	libusb_device * dev;
+	libusb_device_handle * handle = NULL;
+	struct libusb_transfer * transfer = NULL;
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	unsigned char * buffer;
+	int mappings;
+	int done = 0;
+	int r;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+	dev = sim_find(ctx, 2);
+	if (!dev || libusb_open(dev, &handle) != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open the simulated device");
+		libusb_unref_device(dev);
+		handle = NULL;
+		goto out;
+	}
+	libusb_unref_device(dev);
+
+	mappings = sim_usbfs.mappings;
+	buffer = libusb_dev_mem_alloc(handle, 4096);
+	if (!buffer)
+		goto out;
+	if (sim_usbfs.mappings != mappings + 1) {
+		free(buffer);
+		libusbx_testlib_logf(tctx, "Device memory was not mapped");
+		result = TEST_STATUS_SKIP;
+		goto out;
+	}
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer) {
+		libusb_dev_mem_free(handle, buffer, 4096);
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+	libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_STATUS, 0, 0, 2);
+	libusb_fill_control_transfer(transfer, handle, buffer, dev_mem_callback,
+		&done, 1000);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	r = libusb_submit_transfer(transfer);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Submit failed: %d", r);
+		goto out;
+	}
+	while (!done)
+		if (libusb_handle_events_completed(ctx, &done) != LIBUSB_SUCCESS)
+			goto out;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+	    transfer->actual_length != 2 ||
+	    libusb_control_transfer_get_data(transfer)[0] != 1) {
+		libusbx_testlib_logf(tctx, "Transfer ended with status %d, %d bytes",
+			transfer->status, transfer->actual_length);
+		goto out;
+	}
+
+	libusb_free_transfer(transfer);
+	transfer = NULL;
+	if (sim_usbfs.mapping == buffer) {
+		libusbx_testlib_logf(tctx, "The buffer was not unmapped");
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+out:
+	/* frees the buffer too */
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+	if (ctx)
+		libusb_exit(ctx);
+	sim_teardown(root);
+	return result;
+}
+
+/** Benchmarks synchronous GET_STATUS requests on a simulated device,
+ * through libusb_control_transfer() and through
+ * libusb_control_transfer_inplace(), which must return the same status.
+ * A request the device stalls must fail the same way through both. */
+static libusbx_testlib_result test_control_transfers(libusbx_testlib_ctx * tctx)
+{
+#define CONTROL_LOOPS	1000
+	char root[] = SIM_ROOT;
+	libusb_context * ctx = NULL;
+	libusb_device * dev;
+	libusb_device_handle * handle = NULL;
+	unsigned char status[2], buffer[LIBUSB_CONTROL_SETUP_SIZE + 2];
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	struct timeval start;
+	double ms[2];
+	int i, r;
+
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+	dev = sim_find(ctx, 2);
+	if (!dev || libusb_open(dev, &handle) != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open the simulated device");
+		libusb_unref_device(dev);
+		handle = NULL;
+		goto out;
+	}
+	libusb_unref_device(dev);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < CONTROL_LOOPS; i++) {
+		r = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_STATUS, 0, 0, status, 2, 1000);
+		if (r != 2 || status[0] != 1 || status[1] != 0) {
+			libusbx_testlib_logf(tctx, "GET_STATUS returned %d", r);
+			goto out;
+		}
+	}
+	ms[0] = elapsed_ms(&start);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < CONTROL_LOOPS; i++) {
+		libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_STATUS, 0, 0, 2);
+		r = libusb_control_transfer_inplace(handle, buffer, 1000);
+		if (r != 2 || memcmp(buffer + LIBUSB_CONTROL_SETUP_SIZE, status, 2)) {
+			libusbx_testlib_logf(tctx, "In place GET_STATUS returned %d", r);
+			goto out;
+		}
+	}
+	ms[1] = elapsed_ms(&start);
+
+	r = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_SYNCH_FRAME, 0, 0, status, 2, 1000);
+	libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_SYNCH_FRAME, 0, 0, 2);
+	i = libusb_control_transfer_inplace(handle, buffer, 1000);
+	if (r != LIBUSB_ERROR_PIPE || i != LIBUSB_ERROR_PIPE) {
+		libusbx_testlib_logf(tctx, "Stalled request returned %d, %d in "
+			"place", r, i);
+		goto out;
+	}
+
+	libusbx_testlib_logf(tctx, "%d requests: %.1f us each, %.1f us in place",
+		CONTROL_LOOPS, ms[0] * 1000.0 / CONTROL_LOOPS,
+		ms[1] * 1000.0 / CONTROL_LOOPS);
+	result = TEST_STATUS_SUCCESS;
+out:
+	libusb_close(handle);
+	if (ctx)
+		libusb_exit(ctx);
+	sim_teardown(root);
+	return result;
+#undef CONTROL_LOOPS
+}
+
+#define TIMED_TRANSFERS		256
+#define TIMED_ROUNDS		20
+/* a timeout handled later than this was stuck behind a later one */
+#define TIMED_LATE_MS		20
+
+static void LIBUSB_CALL count_completion(struct libusb_transfer * transfer)
+{
+	int * pending = transfer->user_data;
+	(*pending)--;
+}
+
+struct timed_expiry {
+	int * pending;
+	const struct timeval * start;
+	double ms;
+};
+
+static void LIBUSB_CALL record_expiry(struct libusb_transfer * transfer)
+{
+	struct timed_expiry * expiry = transfer->user_data;
+
+	expiry->ms = elapsed_ms(expiry->start);
+	(*expiry->pending)--;
+}
+
+/** Benchmarks submission and completion of many timed transfers in flight
+ * at once: TIMED_TRANSFERS GET_STATUS requests, each with its own timeout,
+ * are submitted to a simulated device, and then reaped. Every other round
+ * submits them in one libusb_submit_transfers() call. The transfer
+ * statistics of the handle must account for all of them. A last round
+ * replaces every other request with one the device never answers, which
+ * must time out, no earlier than asked and not much later, while the
+ * others complete. */
+static libusbx_testlib_result test_timed_transfers(libusbx_testlib_ctx * tctx)
+{
+	char root[] = SIM_ROOT;
+	libusb_context * ctx = NULL;
+	libusb_device * dev;
+	libusb_device_handle * handle = NULL;
+	struct libusb_transfer * transfers[TIMED_TRANSFERS];
+	unsigned char buffers[TIMED_TRANSFERS][LIBUSB_CONTROL_SETUP_SIZE + 2];
+	struct timed_expiry expiries[TIMED_TRANSFERS];
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	struct timeval start, round_start;
+	struct libusb_stats stats;
+	struct libusb_transfer_stats * control;
+	double submit_ms[2] = { 0, 0 }, total_ms, late_ms = 0;
+	uint64_t reaped = 0, median = 0;
+	ssize_t i;
+	int pending = 0;
+	int round, r;
+
+	memset(transfers, 0, sizeof(transfers));
+	if (sim_setup(tctx, root))
+		return TEST_STATUS_ERROR;
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+	dev = sim_find(ctx, 2);
+	if (!dev || libusb_open(dev, &handle) != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to open the simulated device");
+		libusb_unref_device(dev);
+		handle = NULL;
+		goto out;
+	}
+	libusb_unref_device(dev);
+
+	for (i = 0; i < TIMED_TRANSFERS; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i]) {
+			result = TEST_STATUS_ERROR;
+			goto out;
+		}
+		libusb_fill_control_setup(buffers[i], LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_STATUS, 0, 0, 2);
+		/* spread the timeouts, so that they are not submitted in order */
+		libusb_fill_control_transfer(transfers[i], handle, buffers[i],
+			count_completion, &pending, 2000 + (i * 37) % 1000);
+	}
+
+	gettimeofday(&start, NULL);
+	for (round = 0; round < TIMED_ROUNDS; round++) {
+		gettimeofday(&round_start, NULL);
+		if (round % 2) {
+			r = libusb_submit_transfers(transfers, TIMED_TRANSFERS);
+			if (r > 0)
+				pending += r;
+			if (r != TIMED_TRANSFERS) {
+				libusbx_testlib_logf(tctx, "Batch submit returned %d", r);
+				goto drain;
+			}
+		} else {
+			for (i = 0; i < TIMED_TRANSFERS; i++) {
+				r = libusb_submit_transfer(transfers[i]);
+				if (r != LIBUSB_SUCCESS) {
+					libusbx_testlib_logf(tctx, "Submit failed: %d", r);
+					goto drain;
+				}
+				pending++;
+			}
+		}
+		submit_ms[round % 2] += elapsed_ms(&round_start);
+
+		while (pending > 0)
+			if (libusb_handle_events(ctx) != LIBUSB_SUCCESS)
+				break;
+		for (i = 0; i < TIMED_TRANSFERS; i++)
+			if (transfers[i]->status != LIBUSB_TRANSFER_COMPLETED) {
+				libusbx_testlib_logf(tctx, "Transfer %d ended with status %d",
+					(int) i, transfers[i]->status);
+				goto drain;
+			}
+	}
+	total_ms = elapsed_ms(&start);
+
+	libusb_get_stats(NULL, handle, &stats);
+	control = &stats.types[LIBUSB_TRANSFER_TYPE_CONTROL];
+	for (i = 0; i < LIBUSB_STATS_LATENCY_BUCKETS; i++)
+		reaped += control->latency[i];
+	if (control->submitted != TIMED_TRANSFERS * TIMED_ROUNDS ||
+	    control->completed != control->submitted ||
+	    reaped != control->submitted) {
+		libusbx_testlib_logf(tctx, "Statistics count %d submitted, %d "
+			"completed, %d stalled, %d reaped",
+			(int) control->submitted, (int) control->completed,
+			(int) control->stalled, (int) reaped);
+		goto drain;
+	}
+	for (i = 0, reaped = 0; reaped * 2 < control->submitted; i++)
+		reaped += control->latency[i];
+	median = i > 1 ? 1ULL << (i - 2) : 0;
+
+	libusbx_testlib_logf(tctx, "%d transfers: %.2f us per submit, %.2f us "
+		"per batched submit with up to %d in flight, %.0f transfers per "
+		"second", TIMED_TRANSFERS * TIMED_ROUNDS,
+		submit_ms[0] * 2000.0 / (TIMED_TRANSFERS * TIMED_ROUNDS),
+		submit_ms[1] * 2000.0 / (TIMED_TRANSFERS * TIMED_ROUNDS),
+		TIMED_TRANSFERS,
+		TIMED_TRANSFERS * TIMED_ROUNDS * 1000.0 / total_ms);
+	libusbx_testlib_logf(tctx, "Median latency at least %d us, %d bytes in",
+		(int) median, (int) control->bytes_in);
+
+	/* the unanswered requests get timeouts from 20 to 83 ms, so that they
+	 * expire from all over the timeout heap, and the answered ones leave it
+	 * from all over it too */
+	for (i = 1; i < TIMED_TRANSFERS; i += 2) {
+		expiries[i].pending = &pending;
+		expiries[i].start = &start;
+		expiries[i].ms = 0;
+		libusb_fill_control_setup(buffers[i],
+			LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+			SIM_REQUEST_HOLD, 0, 0, 2);
+		libusb_fill_control_transfer(transfers[i], handle, buffers[i],
+			record_expiry, &expiries[i], 20 + (i * 37) % 64);
+	}
+	gettimeofday(&start, NULL);
+	r = libusb_submit_transfers(transfers, TIMED_TRANSFERS);
+	if (r > 0)
+		pending += r;
+	if (r != TIMED_TRANSFERS) {
+		libusbx_testlib_logf(tctx, "Batch submit returned %d", r);
+		goto drain;
+	}
+	while (pending > 0)
+		if (libusb_handle_events(ctx) != LIBUSB_SUCCESS)
+			break;
+	for (i = 0; i < TIMED_TRANSFERS; i++) {
+		if (i % 2 == 0) {
+			if (transfers[i]->status == LIBUSB_TRANSFER_COMPLETED)
+				continue;
+		} else if (transfers[i]->status == LIBUSB_TRANSFER_TIMED_OUT &&
+			   expiries[i].ms >= transfers[i]->timeout &&
+			   expiries[i].ms < transfers[i]->timeout + TIMED_LATE_MS) {
+			if (expiries[i].ms - transfers[i]->timeout > late_ms)
+				late_ms = expiries[i].ms - transfers[i]->timeout;
+			continue;
+		}
+		libusbx_testlib_logf(tctx, "Transfer %d ended with status %d after "
+			"%.1f of %u ms", (int) i, transfers[i]->status,
+			i % 2 ? expiries[i].ms : 0.0, transfers[i]->timeout);
+		goto drain;
+	}
+	libusb_get_stats(NULL, handle, &stats);
+	if (control->timed_out != TIMED_TRANSFERS / 2) {
+		libusbx_testlib_logf(tctx, "Statistics count %d timed out",
+			(int) control->timed_out);
+		goto drain;
+	}
+
+	libusbx_testlib_logf(tctx, "%d timeouts, up to %.1f ms late",
+		TIMED_TRANSFERS / 2, late_ms);
+	result = TEST_STATUS_SUCCESS;
+
+drain:
+	for (i = 0; i < TIMED_TRANSFERS; i++)
+		libusb_cancel_transfer(transfers[i]);
+	while (pending > 0)
+		if (libusb_handle_events(ctx) != LIBUSB_SUCCESS)
+			break;
+out:
+	for (i = 0; i < TIMED_TRANSFERS; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_close(handle);
+	if (ctx)
+		libusb_exit(ctx);
+	sim_teardown(root);
+	return result;
+}
+#undef TIMED_TRANSFERS
+#undef TIMED_ROUNDS
+#undef TIMED_LATE_MS
+#endif
+
 /* Fill in the list of tests. */
 static const libusbx_testlib_test tests[] = {
 	{"init_and_exit", &test_init_and_exit},
 	{"get_device_list", &test_get_device_list},
 	{"many_device_lists", &test_many_device_lists},
 	{"default_context_change", &test_default_context_change},
+#ifdef __linux__
+	{"enumerate_simulated_sysfs", &test_enumerate_simulated_sysfs},
+	{"enumerate_syscalls", &test_enumerate_syscalls},
+	{"lazy_init", &test_lazy_init},
+	{"handle_events_rate", &test_handle_events_rate},
+	{"callback_reopen", &test_callback_reopen},
+	{"netlink_coalesce", &test_netlink_coalesce},
+	{"hotplug_dispatch", &test_hotplug_dispatch},
+	{"urb_trace", &test_urb_trace},
+	{"log_sink", &test_log_sink},
+	{"config_cache", &test_config_cache},
+	{"config_parse", &test_config_parse},
+	{"string_cache", &test_string_cache},
+	{"control_transfers", &test_control_transfers},
+	{"timed_transfers", &test_timed_transfers},
+	{"alloc_free_transfers", &test_alloc_free_transfers},
+	{"dev_mem_free_buffer", &test_dev_mem_free_buffer},
+	/* keeps a context until exit */
+	{"compat_rescan", &test_compat_rescan},
+#endif
 	LIBUSBX_NULL_TEST
 };
 